@@ -1,27 +1,187 @@
 #ifndef __AVLTREE_H__
 #define __AVLTREE_H__
 
-template<typename Key, typename Value>
-class AVLTree : public Tree<Key, Value>
+/**
+ * AVL balance rule: the heights of sibling subtrees differ by at most one,
+ * which keeps the height below 1.44 log2(n + 2)
+ */
+struct HeightBalance
 {
+  /**
+   * Checks whether subtree a is too tall to be the sibling of subtree b
+   */
+  template <typename Node>
+  static bool Heavy(const Node *a, const Node *b)
+  {
+    return Node::Height(a) > Node::Height(b) + 1;
+  }
+
+  /**
+   * Checks whether a single rotation balances a node whose heavy child has
+   * the subtrees inner & outer, light being the other child of the node.
+   * Otherwise the inner subtree is rotated up twice
+   */
+  template <typename Node>
+  static bool Single(const Node *, const Node *inner, const Node *outer)
+  {
+    return Node::Height(outer) >= Node::Height(inner);
+  }
+
+  /**
+   * Checks whether a node stays balanced after an update below it left the
+   * heights of its children unchanged. It always does under this rule, so
+   * updates stop rebalancing there
+   */
+  static bool Stays(size_t, size_t)
+  {
+    return true;
+  }
+};
+
+/**
+ * BB[alpha] balance rule, after Nievergelt & Reingold: counting n + 1 for
+ * a subtree of n nodes, each child weighs at least alpha = 2/7 of its
+ * parent, so the height stays below 2.06 log2(n + 1) whatever the order of
+ * the updates. For alpha under 1 - 1/sqrt(2), a single or double rotation
+ * balances a node again after an insert, a delete or a join (Blelloch,
+ * Ferizovic & Sun)
+ */
+struct WeightBalance
+{
+  /**
+   * Checks whether subtree a is too large to be the sibling of subtree b
+   */
+  template <typename Node>
+  static bool Heavy(const Node *a, const Node *b)
+  {
+    return Exceeds(Node::Count(a) + 1, Node::Count(b) + 1);
+  }
+
+  /**
+   * Checks whether a single rotation balances a node whose heavy child has
+   * the subtrees inner & outer, light being the other child of the node:
+   * light & inner become siblings, under a sibling of outer
+   */
+  template <typename Node>
+  static bool Single(const Node *light, const Node *inner, const Node *outer)
+  {
+    size_t l = Node::Count(light) + 1;
+    size_t i = Node::Count(inner) + 1;
+    size_t o = Node::Count(outer) + 1;
+    return Fits(l, i) && Fits(l + i, o);
+  }
+
+  /**
+   * Checks whether a node stays balanced after an update below it left the
+   * heights of its children unchanged, from its size n & the size m of the
+   * child on the path of the update, without reading the other child
+   */
+  static bool Stays(size_t n, size_t m)
+  {
+    return Fits(m + 1, n - m);
+  }
+
+private:
+  /**
+   * Checks whether weight a is more than (1 - alpha) / alpha times weight b
+   */
+  static bool Exceeds(size_t a, size_t b)
+  {
+    return 2 * a > 5 * b;
+  }
+
+  /**
+   * Checks whether sibling subtrees of weights a & b are balanced
+   */
+  static bool Fits(size_t a, size_t b)
+  {
+    return !Exceeds(a, b) && !Exceeds(b, a);
+  }
+};
+
+/**
+ * Self-balancing binary search tree storing the size & height of every
+ * subtree. By default it is an AVL tree, balancing heights; WeightBalance
+ * makes it a BB[alpha] tree, balancing sizes, which keeps a worse but
+ * still logarithmic height & rotates less often under random updates
+ *
+ * @tparam Key     Key types, must support total ordering
+ * @tparam Value   Value types
+ * @tparam Compare Comparator ordering the keys
+ * @tparam Layout  Node layout, WideNodes, CompactNodes or PersistentNodes
+ * @tparam Rule    Balance rule, HeightBalance or WeightBalance
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Layout = WideNodes, typename Rule = HeightBalance>
+class AVLTree : public TreeBase<AVLTree<Key, Value, Compare, Layout, Rule>, Key, Value>
+{
+  class Node;
+
+  /**
+   * Split, join & set operations, built on Join(left, node, right)
+   */
+  typedef Joins<AVLTree, Node, Key, Value> Ops;
+  friend class Joins<AVLTree, Node, Key, Value>;
+
 public:
+  /**
+   * Bidirectional iterator over the items, in key order. Values are
+   * read-only if the nodes may be shared with snapshots
+   */
+  typedef TreeIterator<Node, Key, typename std::conditional<
+      Layout::kPersistent, const Value, Value>::type> Iterator;
+
+  /**
+   * Immutable view of the tree, taken by GetSnapshot
+   */
+  typedef TreeSnapshot<Node, TreeIterator<Node, Key, const Value>> Snapshot;
+
+  /**
+   * Type the keys of type K are looked up as
+   */
+  template <typename K>
+  using Lookup = typename LookupKey<Compare, Key, K>::Type;
+
   /**
    * Creates an empty Red-Black tree
    */
-  AVLTree()
-    : root(NULL)
+  explicit AVLTree(const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
     , size(0)
+    , depths(0)
+    , stale(false)
   {
   }
 
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  AVLTree(It begin, It end, const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
+    , size(0)
+    , depths(0)
+    , stale(false)
+  {
+    BulkLoad(begin, end);
+  }
+
   /**
    * Destroys the Red-Black tree
    */
   ~AVLTree()
   {
-    if (root)
+    if (versions.Live())
     {
-      delete root;
+      Abandon();
+    }
+    else if (!std::is_trivially_destructible<Node>::value)
+    {
+      Destroy(root);
+      versions.Drain([] (Node *node) { node->~Node(); });
     }
   }
 
@@ -30,157 +190,625 @@ public:
    */
   void Insert(const Key& key, const Value& value)
   {
-    Node *node = new Node();
-    node->key = key;
-    node->value = value;
-    root = Insert(root, node);
+    Emplace(key, value);
+  }
+
+  /**
+   * Inserts a new item into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Emplace(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    size_t before = size;
+    root = Insert(root, true, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return size != before;
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    size_t before = size;
+    root = Insert(root, false, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return size != before;
   }
 
   /**
-   * Retrieves an item from the tree
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. The tree is built perfectly balanced in O(n)
    */
-  Value& Find(const Key& key)
+  template <typename It>
+  void BulkLoad(It begin, It end)
   {
+    if (root)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+
+    size = this->CountSorted(begin, end, compare);
+    root = Build(begin, size);
+  }
+
+  /**
+   * Retrieves an item from the tree. With a transparent comparator, key can be
+   * of any type comparable with Key
+   */
+  template <typename K>
+  Value& Find(const K& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Retrieves an item from the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *TryFind(const K& arg)
+  {
+    const Lookup<K>& key = arg;
     Node *node = root;
+    counters.Add(&Counters::finds);
+    while (node)
+    {
+      counters.Add(&Counters::visits);
+      if (compare(key, node->key))
+      {
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        node = node->right;
+      }
+      else
+      {
+        // Values shared with snapshots are copied before they are handed out
+        return versions.Frozen(node) ? Thaw(key) : &node->value;
+      }
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Retrieves an item for reading only, without copying the nodes it shares
+   * with snapshots
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  const Value *TryFind(const K& arg) const
+  {
+    const Lookup<K>& key = arg;
+    const Node *node = root;
+    counters.Add(&Counters::finds);
     while (node)
     {
-      if (node->key > key)
+      counters.Add(&Counters::visits);
+      if (compare(key, node->key))
       {
         node = node->left;
       }
-      else if (node->key < key)
+      else if (compare(node->key, key))
       {
         node = node->right;
       }
       else
       {
-        return node->value;
+        return &node->value;
       }
     }
 
-    throw std::runtime_error("Key not found");
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  template <typename K>
+  bool Contains(const K& key)
+  {
+    const AVLTree& tree = *this;
+    return tree.TryFind(key) != NULL;
+  }
+
+  /**
+   * Looks up n keys with their cache misses overlapped. Stores a pointer
+   * to the value of each key in out, or NULL if the key is missing
+   */
+  size_t FindBatch(const Key *keys, size_t n, Value **out)
+  {
+    counters.Add(&Counters::finds, n);
+    size_t found = Batch<Node, Key, Value, Comparator<Compare>>::Find(root, keys, n, out, compare);
+    if (versions.Live())
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        out[i] = out[i] ? TryFind(keys[i]) : NULL;
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Inserts n items, updating the keys already present in groups. Values
+   * are updated in place, so while snapshots are live the items are
+   * inserted one at a time instead
+   */
+  void InsertBatch(const Key *keys, const Value *values, size_t n)
+  {
+    if (versions.Live())
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        Insert(keys[i], values[i]);
+      }
+      return;
+    }
+    Batch<Node, Key, Value, Comparator<Compare>>::Insert(this, &root, keys, values, n, compare);
+  }
+
+  /**
+   * Deletes an item from the tree
+   */
+  template <typename K>
+  void Delete(const K& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an item from the tree if the key is present
+   * @return True if an item was removed
+   */
+  template <typename K>
+  bool Erase(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    size_t before = size;
+    root = Delete(root, key);
+    Collect();
+    return size != before;
+  }
+
+  /**
+   * Removes all items. The nodes are not visited unless they need their
+   * destructors run; their memory goes back in whole chunks
+   */
+  void Clear()
+  {
+    if (versions.Live())
+    {
+      counters.Add(&Counters::frees, size + versions.GetRetired());
+      Abandon();
+    }
+    else
+    {
+      versions.Drain([this] (Node *node) { Free(node); });
+      if (!std::is_trivially_destructible<Node>::value)
+      {
+        Destroy(root);
+      }
+      counters.Add(&Counters::frees, size);
+    }
+    pool.Release();
+    root = NULL;
+    size = 0;
+    depths = 0;
+    stale = false;
+  }
+
+  /**
+   * Moves the items with keys not less than key into another tree, which
+   * must be empty, in O(log n). The trees share their node memory from
+   * then on, which is freed once both let go of it
+   */
+  template <typename K>
+  void Split(const K& arg, AVLTree& right)
+  {
+    const Lookup<K>& key = arg;
+    if (&right == this || right.root)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+    versions.Check();
+
+    right.pool.Share(pool);
+    Node *left, *rest;
+    Node *found = Ops::Split(this, root, key, left, rest);
+    root = left;
+    right.root = found ? Join(NULL, found, rest) : rest;
+    size = Node::Count(root);
+    right.size = Node::Count(right.root);
+
+    // The depths of the items are only known for both trees together
+    stale = right.stale = true;
+  }
+
+  /**
+   * Moves all items of another tree, whose keys must all be greater than
+   * those of this one, into this tree in O(log n)
+   */
+  void Join(AVLTree& right)
+  {
+    if (&right == this)
+    {
+      throw std::runtime_error("Cannot join a tree with itself");
+    }
+    versions.Check();
+    if (root && right.root && !compare(Last(root)->key, First(right.root)->key))
+    {
+      throw std::runtime_error("Trees overlap");
+    }
+    root = Ops::Join(this, root, Adopt(right));
+  }
+
+  /**
+   * Moves all items of another tree into this one, keeping the values of
+   * this tree for keys in both. Takes O(m log(n / m + 1)) for trees of
+   * sizes m <= n; the other tree is left empty
+   */
+  void Union(AVLTree& other)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      root = Ops::Union(this, root, Adopt(other));
+    }
+  }
+
+  /**
+   * Keeps the items whose keys are also in another tree, which is left
+   * empty, in O(m log(n / m + 1))
+   */
+  void Intersect(AVLTree& other)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      root = Ops::Intersect(this, root, Adopt(other));
+    }
+  }
+
+  /**
+   * Removes the items whose keys are in another tree, which is left empty,
+   * in O(m log(n / m + 1))
+   */
+  void Difference(AVLTree& other)
+  {
+    if (&other == this)
+    {
+      Clear();
+      return;
+    }
+    versions.Check();
+    root = Ops::Difference(this, root, Adopt(other));
+  }
+
+  /**
+   * Inserts n items with strictly increasing keys, overwriting the values
+   * of keys already present, in O(m log(n / m + 1)). Large batches are cut
+   * in disjoint key ranges, the tree is split along them & the pieces are
+   * updated by the threads of a pool, then joined back
+   */
+  void ParallelInsertBatch(const Key *keys, const Value *values, size_t n, TaskPool& tasks)
+  {
+    versions.Check();
+    Ops::ParallelInsert(*this, keys, values, n, tasks);
+  }
+
+  /**
+   * Removes the items with any of n strictly increasing keys, ignoring
+   * missing ones, in O(m log(n / m + 1)) on the threads of a pool
+   */
+  void ParallelDeleteBatch(const Key *keys, size_t n, TaskPool& tasks)
+  {
+    versions.Check();
+    Ops::ParallelErase(*this, keys, n, tasks);
+  }
+
+  /**
+   * Moves all items of another tree into this one as Union does, on the
+   * threads of a pool. Both trees are split around the median key of the
+   * larger one until the pieces are small
+   */
+  void ParallelUnion(AVLTree& other, TaskPool& tasks)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      Ops::ParallelUnion(*this, other, tasks);
+    }
+  }
+
+  /**
+   * Returns an immutable view of the items in O(1), which can be read from
+   * any thread without locks while this tree goes on changing: from then
+   * on, updates copy the nodes on their path instead of modifying them,
+   * until the snapshot is released. Needs PersistentNodes & must be taken
+   * by the thread updating the tree. Split, Join & the set operations
+   * throw while snapshots are live; clearing or destroying the tree leaves
+   * them readable
+   */
+  Snapshot GetSnapshot()
+  {
+    static_assert(Layout::kPersistent, "Snapshots need PersistentNodes");
+    Collect();
+    uint32_t version = versions.Freeze();
+    return Snapshot(root, size, version, versions.GetRegistry());
+  }
+
+  /**
+   * Returns an iterator to the smallest item
+   */
+  Iterator Begin()
+  {
+    return Iterator::Begin(&root);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator::End(&root);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   */
+  template <typename K>
+  Iterator LowerBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Iterator::template Bound<false>(&root, key, compare);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key
+   */
+  template <typename K>
+  Iterator UpperBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Iterator::template Bound<true>(&root, key, compare);
+  }
+
+  /**
+   * Returns an iterator to the k-th smallest item, counting from zero, or
+   * the past-the-end iterator if k is out of range, in O(log n)
+   */
+  Iterator Select(size_t k)
+  {
+    return Iterator::Select(&root, k);
+  }
+
+  /**
+   * Returns the number of keys less than key, in O(log n)
+   */
+  template <typename K>
+  size_t Rank(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    size_t rank = 0;
+    for (Node *node = root; node; )
+    {
+      if (compare(node->key, key))
+      {
+        rank += Node::Count(node->left) + 1;
+        node = node->right;
+      }
+      else
+      {
+        node = node->left;
+      }
+    }
+    return rank;
+  }
+
+  /**
+   * Returns the number of keys in [lo, hi), in O(log n)
+   */
+  template <typename L, typename H>
+  size_t CountRange(const L& lo, const H& hi)
+  {
+    // Lookup keys are only ever compared with keys of the tree
+    size_t l = Rank(lo), h = Rank(hi);
+    return l < h ? h - l : 0;
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order.
+   * Callbacks taking the value by const reference read it in place
+   */
+  template <typename L, typename H, typename Fn>
+  void Range(const L& lo, const H& hi, Fn fn)
+  {
+    typedef typename std::conditional<
+        Reads<Fn, Key, Value>::value, const Value, Value>::type V;
+    typedef TreeIterator<Node, Key, V> Cursor;
+    const Lookup<L>& l = lo;
+    const Lookup<H>& h = hi;
+    if (!std::is_const<V>::value && versions.Live())
+    {
+      // Handing a value out copies the path to it, which iterators do not
+      // follow, so every item is found again from the root
+      for (Iterator it = LowerBound(l); it != End() && compare(it.GetKey(), h); it = UpperBound(it.GetKey()))
+      {
+        fn(it.GetKey(), *Thaw(it.GetKey()));
+      }
+      return;
+    }
+
+    for (Cursor it = Cursor::template Bound<false>(&root, l, compare), end = Cursor::End(&root); it != end; ++it)
+    {
+      if (!compare(it.GetKey(), h))
+      {
+        break;
+      }
+      fn(it.GetKey(), it.GetValue());
+    }
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<Key, Key, const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
+  }
+
+  /**
+   * Returns the number of items in the tree
+   */
+  size_t GetSize()
+  {
+    return size;
+  }
+
+  /**
+   * Returns the height of the tree, in O(1)
+   */
+  size_t GetHeight()
+  {
+    return root ? root->height : 0;
   }
 
   /**
-   * Deletes an item from the tree
+   * Returns the structural statistics of the tree, in O(1) except for the
+   * first call after a Split, which sums the depths of the items again.
+   * The bytes of the pool include the nodes retired for live snapshots
    */
-  void Delete(const Key& key)
+  Stats GetStats()
   {
-    root = Delete(root, key);
+    if (stale)
+    {
+      depths = Depths(root);
+      stale = false;
+    }
+
+    Stats stats;
+    stats.nodes = size;
+    stats.fill = size ? 1.0 : 0.0;
+    stats.depth = size ? static_cast<double>(depths) / size : 0.0;
+    stats.bytes = pool.GetBytes();
+    return stats;
   }
 
   /**
-   * Returns the number of items in the tree
+   * Returns a snapshot of the operation counters
    */
-  size_t GetSize()
+  Counters GetCounters()
   {
-    return size;
+    return counters.Get(compare);
   }
 
   /**
-   * Returns the height of the tree
+   * Zeroes the operation counters
    */
-  size_t GetHeight()
+  void ResetCounters()
   {
-    return root ? root->GetHeight() : 0;
+    counters.Reset(compare);
   }
 
 private:
   /**
    * Internal node in the tree
    */
-  class Node
+  class Node : public Stamped<Layout::kPersistent>
   {
   public:
     /**
-     * Allocates an empty node
+     * Reference to another node, a pointer or an index
+     */
+    typedef typename Layout::template Link<Node> Link;
+
+    /**
+     * Allocates a leaf, constructing the key & value from the arguments
      */
-    Node()
+    template <typename K, typename... Args>
+    Node(K&& key, Args&&... args)
       : weight(1)
+      , height(1)
+      , key(std::forward<K>(key))
+      , value(std::forward<Args>(args)...)
       , left(NULL)
       , right(NULL)
     {
     }
 
     /**
-     * Frees the node & its children
+     * Returns the number of nodes in a subtree
      */
-    ~Node()
+    static size_t Count(const Node *node)
     {
-      if (left)
-      {
-        delete left;
-      }
-
-      if (right)
-      {
-        delete right;
-      }
+      return node ? node->weight : 0;
     }
 
     /**
-     * Computes the height of a node
+     * Returns the height of a subtree
      */
-    void ComputeWeight()
+    static uint32_t Height(const Node *node)
     {
-      weight = 1;
-
-      if (left)
-      {
-        weight += left->weight;
-      }
-
-      if (right)
-      {
-        weight += right->weight;
-      }
+      return node ? node->height : 0;
     }
 
     /**
-     * Retrieves the balance factor
+     * Computes the size & height of the subtree rooted at the node
      */
-    int GetBalance()
+    void ComputeWeight()
     {
-      int diff = 0;
+      weight = 1;
+      height = 0;
 
       if (left)
       {
-        diff += left->weight;
+        weight += left->weight;
+        height = left->height;
       }
 
       if (right)
       {
-        diff -= right->weight;
+        weight += right->weight;
+        height = std::max(height, right->height);
       }
 
-      return diff;
+      ++height;
     }
 
+  public:
     /**
-     * Retrieves the height of the tree
+     * Size of the tree
      */
-    int GetHeight()
-    {
-      int height = 0;
-
-      if (left)
-      {
-        height = std::max(height, left->GetHeight());
-      }
-
-      if (right)
-      {
-        height = std::max(height, right->GetHeight());
-      }
-
-      return height + 1;
-    }
+    typename Layout::Count weight;
 
-  public:
     /**
-     * Size of the tree
+     * Height of the subtree
      */
-    size_t weight;
+    uint32_t height;
 
     /**
      * Key of the node
@@ -195,26 +823,39 @@ private:
     /**
      * Left child
      */
-    Node *left;
+    Link left;
 
     /**
      * Right child
      */
-    Node *right;
+    Link right;
   };
 
+  /**
+   * Recomputes the size & height of a node from its children, keeping the
+   * total depth of the items up to date
+   */
+  void Update(Node *node)
+  {
+    depths -= node->weight;
+    node->ComputeWeight();
+    depths += node->weight;
+  }
+
   /**
    * Rotates a node left
    */
   Node *RotateLeft(Node *x)
   {
-    Node *y = x->right;
+    counters.Add(&Counters::rotations);
+    x = Mutable(x);
+    Node *y = Mutable(x->right);
 
     x->right = y->left;
-    x->ComputeWeight();
+    Update(x);
 
     y->left = x;
-    y->ComputeWeight();
+    Update(y);
 
     return y;
   }
@@ -224,57 +865,68 @@ private:
    */
   Node *RotateRight(Node *y)
   {
-    Node *x = y->left;
+    counters.Add(&Counters::rotations);
+    y = Mutable(y);
+    Node *x = Mutable(y->left);
 
     y->left = x->right;
-    y->ComputeWeight();
+    Update(y);
 
     x->right = y;
-    x->ComputeWeight();
+    Update(x);
 
     return x;
   }
 
   /**
-   * Returns the successor of a node (the smallest node larger
-   * than this one)
+   * Builds a perfectly balanced tree out of the next n sorted items
    */
-  Node *Successor(Node *node)
+  template <typename It>
+  Node *Build(It& it, size_t n)
   {
-    node = node->right;
-    if (node)
+    if (n == 0)
     {
-      while (node->left)
-      {
-        node = node->left;
-      }
+      return NULL;
     }
 
+    Node *left = Build(it, (n - 1) / 2);
+
+    counters.Add(&Counters::allocs);
+    Node *node = pool.Alloc(it->first, it->second);
+    versions.Stamp(node);
+    ++depths;
+    ++it;
+
+    node->left = left;
+    node->right = Build(it, n - 1 - (n - 1) / 2);
+    Update(node);
     return node;
   }
 
   /**
-   * Balances a node
+   * Balances a node, which must be modifiable, with a single or a double
+   * rotation if one child is too heavy for the other
    */
   Node *Balance(Node *node)
   {
-    node->ComputeWeight();
-    int balance = node->GetBalance();
+    counters.Add(&Counters::fixups);
+    Update(node);
+    Node *left = node->left, *right = node->right;
 
-    if (balance > 1)
+    if (Rule::Heavy(left, right))
     {
-      if (node->left->GetBalance() < 0)
+      if (!Rule::template Single<Node>(right, left->right, left->left))
       {
-        node->left = RotateLeft(node->left);
+        node->left = RotateLeft(left);
       }
       return RotateRight(node);
     }
 
-    if (balance < -1)
+    if (Rule::Heavy(right, left))
     {
-      if (node->right->GetBalance() > 0)
+      if (!Rule::template Single<Node>(left, right->left, right->right))
       {
-        node->right = RotateRight(node->right);
+        node->right = RotateRight(right);
       }
       return RotateLeft(node);
     }
@@ -283,93 +935,444 @@ private:
   }
 
   /**
-   * Inserts a node & restores balance
+   * Inserts an item into the tree rooted at root. The path down is kept on
+   * a stack & walked back up by Retrace, so the node is only constructed
+   * once its position is known, from the forwarded arguments
+   * @param replace Whether to overwrite the value of a duplicate
+   * @return The new root
    */
-  Node *Insert(Node *node, Node *what)
+  template <typename K, typename... Args>
+  Node *Insert(Node *root, bool replace, K&& key, Args&&... args)
   {
-    if (node == NULL)
+    Stack<Node *> path;
+    bool left = false;
+    for (Node *node = root; node; )
     {
-      ++size;
-      return what;
+      path.Push(node);
+      if (compare(key, node->key))
+      {
+        node = node->left;
+        left = true;
+      }
+      else if (compare(node->key, key))
+      {
+        node = node->right;
+        left = false;
+      }
+      else
+      {
+        if (!replace)
+        {
+          return root;
+        }
+        path.Pop();
+        Node *copy = Mutable(node);
+        this->Assign(copy->value, std::forward<Args>(args)...);
+        return Relink(path, node, copy, root);
+      }
     }
 
-    if (what->key < node->key)
+    ++size;
+    ++depths;
+    counters.Add(&Counters::allocs);
+    Node *node = pool.Alloc(std::forward<K>(key), std::forward<Args>(args)...);
+    versions.Stamp(node);
+    return Retrace(path, node, left, 1, false);
+  }
+
+  /**
+   * Removes the item with a key from the tree rooted at root. A node with
+   * two children is replaced by its successor, whose own path is retraced
+   * first. Nothing is modified if the key is missing
+   * @return The new root
+   */
+  template <typename K>
+  Node *Delete(Node *root, const K& key)
+  {
+    Stack<Node *> path;
+    Node *node = root;
+    for (;;)
     {
-      node->left = Insert(node->left, what);
-      return Balance(node);
+      if (!node)
+      {
+        return root;
+      }
+
+      if (compare(key, node->key))
+      {
+        path.Push(node);
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        path.Push(node);
+        node = node->right;
+      }
+      else
+      {
+        break;
+      }
     }
 
-    if (what->key > node->key)
+    --size;
+    bool left = !path.Empty() && path.Top()->left == node;
+    uint32_t height = node->height;
+    Node *child;
+    if (!node->left || !node->right)
     {
-      node->right = Insert(node->right, what);
-      return Balance(node);
+      child = node->left ? node->left : node->right;
     }
+    else
+    {
+      Stack<Node *> below;
+      Node *next = node->right;
+      for (; next->left; next = next->left)
+      {
+        below.Push(next);
+      }
+      Node *right = Retrace(below, next->right, true, -1, false);
 
-    node->value = what->value;
-    return node;
+      child = Mutable(next);
+      child->left = node->left;
+      child->right = right;
+      child = Balance(child);
+    }
+    Drop(node);
+
+    return Retrace(path, child, left, -1, child && child->height == height);
   }
 
   /**
-   * Removes a node from the tree & restores balance
+   * Walks the path of an insert or a delete back up from the new subtree
+   * below it, linking each node to the subtree rebuilt below & adding
+   * delta to its size. Nodes are rebalanced until one keeps its height;
+   * from there on only the sizes change, unless the balance rule finds
+   * them too uneven
+   * @param left    Whether the subtree goes left of the last node of the
+   *                path; higher up, the side of the node replaced tells
+   * @param settled Whether the subtree below kept its height
+   * @return The new root of the path
    */
-  Node *Delete(Node *node, const Key& key)
+  Node *Retrace(Stack<Node *>& path, Node *child, bool left, int delta, bool settled)
   {
-    if (!node)
+    while (!path.Empty())
     {
-      throw std::runtime_error("Key not found");
+      Node *node = Mutable(path.Top());
+      if (left)
+      {
+        node->left = child;
+      }
+      else
+      {
+        node->right = child;
+      }
+
+      if (settled && Rule::Stays(node->weight + delta, Node::Count(child)))
+      {
+        node->weight += delta;
+        depths += delta;
+      }
+      else
+      {
+        uint32_t height = node->height;
+        node = Balance(node);
+        settled = node->height == height;
+      }
+      child = node;
+
+      Node *old = path.Top();
+      path.Pop();
+      left = !path.Empty() && path.Top()->left == old;
+    }
+    return child;
+  }
+
+  /**
+   * Links the copy of a node taken for an update in place of the node,
+   * copying its ancestors in turn as long as snapshots hold them
+   * @return The new root
+   */
+  Node *Relink(Stack<Node *>& path, Node *node, Node *copy, Node *root)
+  {
+    for (; !path.Empty(); path.Pop())
+    {
+      if (copy == node)
+      {
+        return root;
+      }
+
+      Node *up = Mutable(path.Top());
+      if (up->left == node)
+      {
+        up->left = copy;
+      }
+      else
+      {
+        up->right = copy;
+      }
+      node = path.Top();
+      copy = up;
     }
+    return copy;
+  }
 
-    if (key < node->key)
+  /**
+   * Makes the value of a key modifiable, copying the node holding it & the
+   * ancestors of the node as long as snapshots hold them
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *Thaw(const K& key)
+  {
+    Stack<Node *> path;
+    for (Node *node = root; node; )
     {
-      node->left = Delete(node->left, key);
-      return Balance(node);
+      if (compare(key, node->key))
+      {
+        path.Push(node);
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        path.Push(node);
+        node = node->right;
+      }
+      else
+      {
+        Node *copy = Mutable(node);
+        root = Relink(path, node, copy, root);
+        return &copy->value;
+      }
     }
+    return NULL;
+  }
+
+  /**
+   * Leaves the nodes & the chunks holding them to the live snapshots, which
+   * destroy them along with the retired ones once the last is released
+   */
+  void Abandon()
+  {
+    typedef typename Layout::template Allocator<Node> Allocator;
+    std::shared_ptr<Allocator> chunks = std::make_shared<Allocator>();
+    chunks->Share(pool);
+    Node *node = root;
+    versions.Orphan([] (Node *node) { node->~Node(); }, [chunks, node] ()
+    {
+      if (!std::is_trivially_destructible<Node>::value)
+      {
+        Destroy(node);
+      }
+    });
+  }
 
-    if (key > node->key)
+  /**
+   * Runs the destructors of all nodes in a subtree in O(1) space. Left
+   * children are rotated up until the top node has none, which is then
+   * destroyed & replaced by its right child, so the tree is flattened as
+   * it is torn down instead of being walked with a stack
+   */
+  static void Destroy(Node *node)
+  {
+    while (node)
     {
-      node->right = Delete(node->right, key);
-      return Balance(node);
+      if (Node *left = node->left)
+      {
+        node->left = left->right;
+        left->right = node;
+        node = left;
+      }
+      else
+      {
+        Node *right = node->right;
+        node->~Node();
+        node = right;
+      }
     }
+  }
 
-    Node *tmp;
+  /**
+   * Links two subtrees & a node whose key lies between theirs. The node
+   * goes down the inner spine of the heavier subtree until it can take the
+   * other one as its sibling, then the path is rebalanced on the way back
+   * up, with at most one single or double rotation per node
+   */
+  Node *Join(Node *left, Node *node, Node *right)
+  {
+    if (Rule::Heavy(left, right))
+    {
+      left->right = Join(left->right, node, right);
+      return Balance(left);
+    }
 
-    --size;
-    if (!node->left)
+    if (Rule::Heavy(right, left))
     {
-      tmp = node->right;
-      node->right = NULL;
-      delete node;
-      return tmp;
+      right->left = Join(left, node, right->left);
+      return Balance(right);
     }
 
-    if (!node->right)
+    node->left = left;
+    node->right = right;
+    return Balance(node);
+  }
+
+  /**
+   * Returns a node which can be modified: the node itself, or a copy of
+   * it if a snapshot may reach it, in which case the original is retired
+   */
+  Node *Mutable(Node *node)
+  {
+    return versions.Frozen(node) ? Copy(node, std::integral_constant<bool, Layout::kPersistent>()) : node;
+  }
+
+  Node *Copy(Node *node, std::true_type)
+  {
+    counters.Add(&Counters::allocs);
+    Node *copy = pool.Alloc(static_cast<const Node&>(*node));
+    versions.Stamp(copy);
+    versions.Retire(node);
+    return copy;
+  }
+
+  Node *Copy(Node *node, std::false_type)
+  {
+    return node;
+  }
+
+  /**
+   * Frees a node removed from the tree, or retires it if a snapshot may
+   * still reach it
+   */
+  void Drop(Node *node)
+  {
+    depths -= Node::Count(node);
+    if (versions.Frozen(node))
+    {
+      versions.Retire(node);
+    }
+    else
     {
-      tmp = node->left;
-      node->left = NULL;
-      delete node;
-      return tmp;
+      Free(node);
     }
+  }
+
+  /**
+   * Returns a node to the pool
+   */
+  void Free(Node *node)
+  {
+    counters.Add(&Counters::frees);
+    pool.Free(node);
+  }
+
+  /**
+   * Frees the retired nodes which no snapshot can reach anymore
+   */
+  void Collect()
+  {
+    versions.Collect([this] (Node *node) { Free(node); });
+  }
+
+  /**
+   * Takes the nodes of another tree over, leaving it empty
+   * @return The root of the other tree
+   */
+  Node *Adopt(AVLTree& other)
+  {
+    pool.Absorb(other.pool);
+    size += other.size;
+    depths += other.depths;
+    stale = stale || other.stale;
+
+    Node *node = other.root;
+    other.root = NULL;
+    other.size = 0;
+    other.depths = 0;
+    other.stale = false;
+    return node;
+  }
+
+  /**
+   * Allocates a node for a join-based operation
+   */
+  Node *Create(const Key& key, const Value& value)
+  {
+    ++size;
+    ++depths;
+    counters.Add(&Counters::allocs);
+    return pool.Alloc(key, value);
+  }
 
-    tmp = Successor(node);
-    tmp->right = DeleteMin(node->right);
-    tmp->left = node->left;
+  /**
+   * Frees a node dropped by a join-based operation
+   */
+  void Remove(Node *node)
+  {
+    depths -= Node::Count(node);
+    --size;
+    counters.Add(&Counters::frees);
+    pool.Free(node);
+  }
 
-    return Balance(tmp);
+  /**
+   * Returns the node with the smallest key in a subtree
+   */
+  static Node *First(Node *node)
+  {
+    while (node->left)
+    {
+      node = node->left;
+    }
+    return node;
   }
 
   /**
-   * Removes the successor of a node
+   * Returns the node with the largest key in a subtree
    */
-  Node *DeleteMin(Node *node)
+  static Node *Last(Node *node)
   {
-    if (!node->left)
+    while (node->right)
     {
-      return node->right;
+      node = node->right;
     }
+    return node;
+  }
+
+  /**
+   * Sums the sizes of all subtrees, which is the total depth of the items
+   */
+  static size_t Depths(Node *root)
+  {
+    size_t total = 0;
+    Stack<Node *> stack;
+    for (Node *node = root; node || !stack.Empty(); )
+    {
+      if (!node)
+      {
+        node = stack.Top();
+        stack.Pop();
+      }
 
-    return Balance(DeleteMin(node->left));
+      total += Node::Count(node);
+      if (node->right)
+      {
+        stack.Push(node->right);
+      }
+      node = node->left;
+    }
+    return total;
   }
 
+  /**
+   * Comparator ordering the keys
+   */
+  Comparator<Compare> compare;
+
+  /**
+   * Allocator for the nodes
+   */
+  typename Layout::template Allocator<Node> pool;
+
   /**
    * Root node of the tree
    */
@@ -379,6 +1382,27 @@ private:
    * Number of items stored in the tree
    */
   size_t size;
+
+  /**
+   * Sum of the depths of all items, the root being at depth 1, which is
+   * also the sum of the sizes of all subtrees
+   */
+  size_t depths;
+
+  /**
+   * Set once a Split leaves depths unknown, until GetStats sums them again
+   */
+  bool stale;
+
+  /**
+   * Snapshot versions & the nodes retired while snapshots are live
+   */
+  Versions<Node, Layout::kPersistent> versions;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  mutable CounterSet<> counters;
 };
 
 #endif /*__AVLTREE_H__*/
@@ -0,0 +1,1076 @@
+#ifndef __BPLUSTREE_H__
+#define __BPLUSTREE_H__
+
+/**
+ * B+-tree implementation. Internal nodes only store separator keys and
+ * child pointers, while values are stored in the leaves, which are chained
+ * together to allow ordered scans without revisiting internal nodes.
+ *
+ * Node capacities are derived from the node size, which should be a
+ * multiple of the cache line (or the page size for very large trees)
+ *
+ * @tparam Key    Key types, must support total ordering
+ * @tparam Value  Value types
+ * @tparam Bytes  Size of a node, in bytes
+ * @tparam Search Intra-node search strategy
+ */
+template <
+    typename Key,
+    typename Value,
+    size_t Bytes = 256,
+    typename Search = NodeSearch<Key>>
+class BPlusTree : public TreeBase<BPlusTree<Key, Value, Bytes, Search>, Key, Value>
+{
+  struct Leaf;
+
+public:
+  /**
+   * Bidirectional iterator over the items, in key order. Steps follow the
+   * leaf chain. Iterators are invalidated by modifications of the tree
+   */
+  class Iterator
+  {
+  public:
+    const Key& GetKey() const
+    {
+      return leaf->key[i];
+    }
+
+    Value& GetValue() const
+    {
+      return leaf->value[i];
+    }
+
+    Iterator& operator ++ ()
+    {
+      if (++i >= leaf->n)
+      {
+        leaf = leaf->next;
+        i = 0;
+      }
+      return *this;
+    }
+
+    Iterator& operator -- ()
+    {
+      if (!leaf)
+      {
+        Node *node = tree->root;
+        while (!node->leaf)
+        {
+          Inner *inner = static_cast<Inner *>(node);
+          node = inner->child[inner->n];
+        }
+        leaf = node->n > 0 ? static_cast<Leaf *>(node) : NULL;
+        i = node->n - 1;
+      }
+      else if (i > 0)
+      {
+        --i;
+      }
+      else
+      {
+        leaf = leaf->prev;
+        i = leaf ? leaf->n - 1 : 0;
+      }
+      return *this;
+    }
+
+    Iterator operator ++ (int)
+    {
+      Iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    Iterator operator -- (int)
+    {
+      Iterator it(*this);
+      --*this;
+      return it;
+    }
+
+    bool operator == (const Iterator& that) const
+    {
+      return leaf == that.leaf && (!leaf || i == that.i);
+    }
+
+    bool operator != (const Iterator& that) const
+    {
+      return !(*this == that);
+    }
+
+  private:
+    friend class BPlusTree;
+
+    Iterator(Leaf *leaf, int i, BPlusTree *tree)
+      : leaf(leaf)
+      , i(i)
+      , tree(tree)
+    {
+      if (leaf && i >= leaf->n)
+      {
+        this->leaf = leaf->next;
+        this->i = 0;
+      }
+    }
+
+    /**
+     * Current leaf, NULL past the end
+     */
+    Leaf *leaf;
+
+    /**
+     * Index of the current item in the leaf
+     */
+    int i;
+
+    /**
+     * Tree being iterated, used to step back from the end
+     */
+    BPlusTree *tree;
+  };
+
+  /**
+   * Creates a new B+-tree
+   */
+  BPlusTree()
+    : root(NULL)
+    , size(0)
+    , height(1)
+    , leafCount(1)
+    , innerCount(0)
+  {
+    counters.Add(&Counters::allocs);
+    root = leaves.Alloc();
+  }
+
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  BPlusTree(It begin, It end, double fill = 1.0)
+    : root(NULL)
+    , size(0)
+    , height(1)
+    , leafCount(1)
+    , innerCount(0)
+  {
+    counters.Add(&Counters::allocs);
+    root = leaves.Alloc();
+    BulkLoad(begin, end, fill);
+  }
+
+  /**
+   * Destroys the tree
+   */
+  ~BPlusTree()
+  {
+    if (!std::is_trivially_destructible<Leaf>::value ||
+        !std::is_trivially_destructible<Inner>::value)
+    {
+      Destroy(root);
+    }
+  }
+
+  /**
+   * Inserts a value into the tree
+   */
+  void Insert(const Key& key, const Value& value)
+  {
+    Emplace(key, value);
+  }
+
+  /**
+   * Inserts a value into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Emplace(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    return InsertItem(true, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    return InsertItem(false, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. Leaves are packed & chained left to right, then
+   * the internal levels are built bottom-up, in O(n). Each node receives
+   * about fill times its capacity, but never less than half of it
+   */
+  template <typename It>
+  void BulkLoad(It begin, It end, double fill = 1.0)
+  {
+    if (size != 0)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+
+    size_t n = this->CountSorted(begin, end);
+    if (n == 0)
+    {
+      return;
+    }
+
+    // Build the leaves, reusing the empty root as the first one
+    int lo = kLeaf / 2, hi = kLeaf;
+    int target = std::max(lo, std::min(hi, static_cast<int>(fill * hi)));
+
+    size_t count = (n + target - 1) / target;
+    count = std::min(count, n / lo);
+    count = std::max(count, static_cast<size_t>(1));
+
+    std::vector<Key> seps;
+    std::vector<Node *> nodes;
+    size_t base = n / count, extra = n % count;
+    for (size_t g = 0; g < count; ++g)
+    {
+      Leaf *leaf = g == 0 ? static_cast<Leaf *>(root) : leaves.Alloc();
+      counters.Add(&Counters::allocs, g > 0);
+      leaf->n = static_cast<int>(base + (g < extra));
+      for (int i = 0; i < leaf->n; ++i, ++begin)
+      {
+        leaf->key[i] = begin->first;
+        leaf->value[i] = begin->second;
+      }
+
+      if (g > 0)
+      {
+        Leaf *prev = static_cast<Leaf *>(nodes.back());
+        prev->next = leaf;
+        leaf->prev = prev;
+        seps.push_back(leaf->key[0]);
+      }
+      nodes.push_back(leaf);
+    }
+    leafCount = count;
+
+    // Build the internal levels out of the separators
+    lo = kInner / 2;
+    hi = kInner;
+    target = std::max(lo, std::min(hi, static_cast<int>(fill * hi)));
+    while (nodes.size() > 1)
+    {
+      std::vector<Key> upSeps;
+      std::vector<Node *> up;
+      size_t m = seps.size(), s = 0, c = 0;
+      count = Groups(m, target, lo);
+      base = (m - count + 1) / count;
+      extra = (m - count + 1) % count;
+      for (size_t g = 0; g < count; ++g)
+      {
+        counters.Add(&Counters::allocs);
+        Inner *node = inners.Alloc();
+        node->n = static_cast<int>(base + (g < extra));
+        for (int i = 0; i < node->n; ++i)
+        {
+          node->key[i] = std::move(seps[s++]);
+          node->child[i] = nodes[c++];
+        }
+        node->child[node->n] = nodes[c++];
+        up.push_back(node);
+
+        if (g + 1 < count)
+        {
+          upSeps.push_back(seps[s++]);
+        }
+      }
+
+      innerCount += up.size();
+      nodes.swap(up);
+      seps.swap(upSeps);
+      ++height;
+    }
+
+    root = nodes[0];
+    size = n;
+  }
+
+  /**
+   * Deletes an entry from the tree
+   */
+  void Delete(const Key& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an entry from the tree if the key is present
+   * @return True if an entry was removed
+   */
+  bool Erase(const Key& key)
+  {
+    if (!Delete(root, key))
+    {
+      return false;
+    }
+
+    if (!root->leaf && root->n == 0)
+    {
+      Inner *node = static_cast<Inner *>(root);
+      root = node->child[0];
+      counters.Add(&Counters::frees);
+      inners.Free(node);
+      --innerCount;
+      --height;
+    }
+    return true;
+  }
+
+  /**
+   * Finds a value in the tree
+   */
+  Value& Find(const Key& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Finds a value in the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  Value *TryFind(const Key& key)
+  {
+    // All leaves are on the same level, so lookups visit height nodes
+    counters.Add(&Counters::finds);
+    counters.Add(&Counters::visits, height);
+    Leaf *leaf = FindLeaf(key);
+    int i = LowerBound(leaf, key);
+    if (i < leaf->n && leaf->key[i] == key)
+    {
+      return &leaf->value[i];
+    }
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  bool Contains(const Key& key)
+  {
+    return TryFind(key) != NULL;
+  }
+
+  /**
+   * Removes all items, leaving an empty root leaf. The nodes are not visited
+   * unless they need their destructors run; their memory goes back in whole
+   * chunks
+   */
+  void Clear()
+  {
+    if (!std::is_trivially_destructible<Leaf>::value ||
+        !std::is_trivially_destructible<Inner>::value)
+    {
+      Destroy(root);
+    }
+    counters.Add(&Counters::frees, leafCount + innerCount);
+    inners.Release();
+    leaves.Release();
+    counters.Add(&Counters::allocs);
+    root = leaves.Alloc();
+    size = 0;
+    height = 1;
+    leafCount = 1;
+    innerCount = 0;
+  }
+
+  /**
+   * Returns an iterator to the smallest item
+   */
+  Iterator Begin()
+  {
+    Node *node = root;
+    while (!node->leaf)
+    {
+      node = static_cast<Inner *>(node)->child[0];
+    }
+    return Iterator(static_cast<Leaf *>(node), 0, this);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator(NULL, 0, this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   */
+  Iterator LowerBound(const Key& key)
+  {
+    Leaf *leaf = FindLeaf(key);
+    return Iterator(leaf, LowerBound(leaf, key), this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key
+   */
+  Iterator UpperBound(const Key& key)
+  {
+    Leaf *leaf = FindLeaf(key);
+    return Iterator(leaf, Search::UpperBound(leaf->key, leaf->n, key), this);
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  template <typename Fn>
+  void Range(const Key& lo, const Key& hi, Fn fn)
+  {
+    Leaf *leaf = FindLeaf(lo);
+    for (int i = LowerBound(leaf, lo); leaf; leaf = leaf->next, i = 0)
+    {
+      for (; i < leaf->n; ++i)
+      {
+        if (!(leaf->key[i] < hi))
+        {
+          return;
+        }
+
+        fn(leaf->key[i], leaf->value[i]);
+      }
+    }
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
+  }
+
+  /**
+   * Returns the number of items in the tree
+   */
+  size_t GetSize()
+  {
+    return size;
+  }
+
+  /**
+   * Returns the height of the tree. All leaves are on the same level,
+   * so it only changes when the root is split or collapsed
+   */
+  size_t GetHeight()
+  {
+    return height;
+  }
+
+  /**
+   * Returns the structural statistics of the tree, in O(1). Items are all
+   * in leaves, so they all lie at the depth of the leaves
+   */
+  Stats GetStats()
+  {
+    Stats stats;
+    stats.nodes = leafCount + innerCount;
+    stats.fill = static_cast<double>(size) / (leafCount * kLeaf);
+    stats.depth = size ? static_cast<double>(height) : 0.0;
+    stats.bytes = leaves.GetBytes() + inners.GetBytes();
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return counters.Get();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset();
+  }
+
+private:
+  /**
+   * Common header of nodes
+   */
+  struct Node
+  {
+    Node(bool leaf)
+      : leaf(leaf)
+      , n(0)
+    {
+    }
+
+    bool leaf;
+    int  n;
+  };
+
+  /**
+   * Number of separator keys in an internal node
+   */
+  static const int kInner = static_cast<int>(
+      (Bytes - sizeof(Node) - sizeof(Node *)) / (sizeof(Key) + sizeof(Node *))
+      < 3 ? 3 :
+      (Bytes - sizeof(Node) - sizeof(Node *)) / (sizeof(Key) + sizeof(Node *)));
+
+  /**
+   * Number of items in a leaf
+   */
+  static const int kLeaf = static_cast<int>(
+      (Bytes - sizeof(Node) - 2 * sizeof(Node *)) / (sizeof(Key) + sizeof(Value))
+      < 3 ? 3 :
+      (Bytes - sizeof(Node) - 2 * sizeof(Node *)) / (sizeof(Key) + sizeof(Value)));
+
+  /**
+   * Internal node: n separators, n + 1 children. All keys in child[i + 1]
+   * are greater than or equal to key[i]
+   */
+  struct Inner : public Node
+  {
+    Inner()
+      : Node(false)
+    {
+    }
+
+    Key   key[kInner];
+    Node *child[kInner + 1];
+  };
+
+  /**
+   * Leaf node: keys & values in separate arrays, linked to siblings
+   */
+  struct Leaf : public Node
+  {
+    Leaf()
+      : Node(true)
+      , prev(NULL)
+      , next(NULL)
+    {
+    }
+
+    Leaf  *prev;
+    Leaf  *next;
+    Key    key[kLeaf];
+    Value  value[kLeaf];
+  };
+
+  /**
+   * Returns the index of the first key in a leaf not less than key
+   */
+  int LowerBound(Leaf *leaf, const Key& key)
+  {
+    counters.Add(&Counters::searches);
+    return Search::LowerBound(leaf->key, leaf->n, key);
+  }
+
+  /**
+   * Returns the index of the child of an internal node containing key
+   */
+  int ChildIndex(Inner *node, const Key& key)
+  {
+    counters.Add(&Counters::searches);
+    return Search::UpperBound(node->key, node->n, key);
+  }
+
+  /**
+   * Descends to the leaf which might contain a key
+   */
+  Leaf *FindLeaf(const Key& key)
+  {
+    Node *node = root;
+    while (!node->leaf)
+    {
+      Inner *inner = static_cast<Inner *>(node);
+      node = inner->child[ChildIndex(inner, key)];
+    }
+    return static_cast<Leaf *>(node);
+  }
+
+  /**
+   * Returns the number of nodes a level of m items is split into, when
+   * adjacent nodes are separated by an item moved up to the next level.
+   * Nodes get close to target items each, but never fewer than lo
+   */
+  static size_t Groups(size_t m, size_t target, size_t lo)
+  {
+    size_t count = (m + target + 1) / (target + 1);
+    count = std::min(count, (m + 1) / (lo + 1));
+    return std::max(count, static_cast<size_t>(1));
+  }
+
+  /**
+   * Inserts an item, growing the tree if the root was split
+   * @param replace Whether to overwrite the value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool InsertItem(bool replace, K&& key, Args&&... args)
+  {
+    Key sep;
+    Node *split;
+    size_t before = size;
+
+    if (Insert(root, replace, &sep, &split, std::forward<K>(key), std::forward<Args>(args)...))
+    {
+      counters.Add(&Counters::allocs);
+      Inner *node = inners.Alloc();
+      ++innerCount;
+      node->n = 1;
+      node->key[0] = std::move(sep);
+      node->child[0] = root;
+      node->child[1] = split;
+      root = node;
+      ++height;
+    }
+
+    return size != before;
+  }
+
+  /**
+   * Inserts an item into a subtree. If the node had to be split, the
+   * separator and the new right node are returned through sep & split
+   */
+  template <typename K, typename... Args>
+  bool Insert(Node *node, bool replace, Key *sep, Node **split, K&& key, Args&&... args)
+  {
+    if (node->leaf)
+    {
+      Leaf *leaf = static_cast<Leaf *>(node);
+      int i = LowerBound(leaf, key);
+      if (i < leaf->n && leaf->key[i] == key)
+      {
+        if (replace)
+        {
+          this->Assign(leaf->value[i], std::forward<Args>(args)...);
+        }
+        return false;
+      }
+
+      if (leaf->n < kLeaf)
+      {
+        InsertLeaf(leaf, i, std::forward<K>(key), std::forward<Args>(args)...);
+        return false;
+      }
+
+      // Split the leaf in two halves & link the new leaf in
+      counters.Add(&Counters::splits);
+      counters.Add(&Counters::allocs);
+      Leaf *right = leaves.Alloc();
+      ++leafCount;
+      int mid = kLeaf / 2;
+      for (int j = mid; j < kLeaf; ++j)
+      {
+        right->key[j - mid] = std::move(leaf->key[j]);
+        right->value[j - mid] = std::move(leaf->value[j]);
+      }
+      right->n = kLeaf - mid;
+      leaf->n = mid;
+
+      right->next = leaf->next;
+      right->prev = leaf;
+      if (leaf->next)
+      {
+        leaf->next->prev = right;
+      }
+      leaf->next = right;
+
+      if (i <= mid)
+      {
+        InsertLeaf(leaf, i, std::forward<K>(key), std::forward<Args>(args)...);
+      }
+      else
+      {
+        InsertLeaf(right, i - mid, std::forward<K>(key), std::forward<Args>(args)...);
+      }
+
+      *sep = right->key[0];
+      *split = right;
+      return true;
+    }
+
+    Inner *inner = static_cast<Inner *>(node);
+    int i = ChildIndex(inner, key);
+
+    Key childSep;
+    Node *childSplit;
+    if (!Insert(inner->child[i], replace, &childSep, &childSplit,
+                std::forward<K>(key), std::forward<Args>(args)...))
+    {
+      return false;
+    }
+
+    if (inner->n < kInner)
+    {
+      InsertInner(inner, i, std::move(childSep), childSplit);
+      return false;
+    }
+
+    // Split the internal node, moving the median key up
+    counters.Add(&Counters::splits);
+    counters.Add(&Counters::allocs);
+    Inner *right = inners.Alloc();
+    ++innerCount;
+    int mid = kInner / 2;
+    for (int j = mid + 1; j < kInner; ++j)
+    {
+      right->key[j - mid - 1] = std::move(inner->key[j]);
+    }
+    for (int j = mid + 1; j <= kInner; ++j)
+    {
+      right->child[j - mid - 1] = inner->child[j];
+    }
+    right->n = kInner - mid - 1;
+    inner->n = mid;
+    *sep = std::move(inner->key[mid]);
+    *split = right;
+
+    if (i <= mid)
+    {
+      InsertInner(inner, i, std::move(childSep), childSplit);
+    }
+    else
+    {
+      InsertInner(right, i - mid - 1, std::move(childSep), childSplit);
+    }
+
+    return true;
+  }
+
+  /**
+   * Inserts an item into a non-full leaf at a given position
+   */
+  template <typename K, typename... Args>
+  void InsertLeaf(Leaf *leaf, int i, K&& key, Args&&... args)
+  {
+    for (int j = leaf->n; j > i; --j)
+    {
+      leaf->key[j] = std::move(leaf->key[j - 1]);
+      leaf->value[j] = std::move(leaf->value[j - 1]);
+    }
+
+    leaf->key[i] = std::forward<K>(key);
+    this->Assign(leaf->value[i], std::forward<Args>(args)...);
+    ++leaf->n;
+    ++size;
+  }
+
+  /**
+   * Inserts a separator & the child to its right into a non-full node
+   */
+  void InsertInner(Inner *node, int i, Key&& key, Node *child)
+  {
+    for (int j = node->n; j > i; --j)
+    {
+      node->key[j] = std::move(node->key[j - 1]);
+      node->child[j + 1] = node->child[j];
+    }
+
+    node->key[i] = std::move(key);
+    node->child[i + 1] = child;
+    ++node->n;
+  }
+
+  /**
+   * Removes a key from a subtree, restoring the occupancy of the
+   * children which underflow on the way back up
+   */
+  bool Delete(Node *node, const Key& key)
+  {
+    if (node->leaf)
+    {
+      Leaf *leaf = static_cast<Leaf *>(node);
+      int i = LowerBound(leaf, key);
+      if (i >= leaf->n || !(leaf->key[i] == key))
+      {
+        return false;
+      }
+
+      for (int j = i + 1; j < leaf->n; ++j)
+      {
+        leaf->key[j - 1] = std::move(leaf->key[j]);
+        leaf->value[j - 1] = std::move(leaf->value[j]);
+      }
+
+      --leaf->n;
+      --size;
+      return true;
+    }
+
+    Inner *inner = static_cast<Inner *>(node);
+    int i = ChildIndex(inner, key);
+    if (!Delete(inner->child[i], key))
+    {
+      return false;
+    }
+
+    Node *child = inner->child[i];
+    if (child->n < (child->leaf ? kLeaf / 2 : kInner / 2))
+    {
+      Rebalance(inner, i);
+    }
+
+    return true;
+  }
+
+  /**
+   * Fixes an underflowing child by borrowing from or merging with a sibling
+   */
+  void Rebalance(Inner *node, int i)
+  {
+    Node *child = node->child[i];
+    Node *left = i > 0 ? node->child[i - 1] : NULL;
+    Node *right = i < node->n ? node->child[i + 1] : NULL;
+    int min = child->leaf ? kLeaf / 2 : kInner / 2;
+
+    if (left && left->n > min)
+    {
+      BorrowLeft(node, i);
+    }
+    else if (right && right->n > min)
+    {
+      BorrowRight(node, i);
+    }
+    else if (left)
+    {
+      Merge(node, i - 1);
+    }
+    else
+    {
+      Merge(node, i);
+    }
+  }
+
+  /**
+   * Moves the last item of the left sibling into child i
+   */
+  void BorrowLeft(Inner *node, int i)
+  {
+    counters.Add(&Counters::borrows);
+    if (node->child[i]->leaf)
+    {
+      Leaf *child = static_cast<Leaf *>(node->child[i]);
+      Leaf *left = static_cast<Leaf *>(node->child[i - 1]);
+
+      for (int j = child->n; j > 0; --j)
+      {
+        child->key[j] = std::move(child->key[j - 1]);
+        child->value[j] = std::move(child->value[j - 1]);
+      }
+
+      --left->n;
+      child->key[0] = std::move(left->key[left->n]);
+      child->value[0] = std::move(left->value[left->n]);
+      ++child->n;
+
+      node->key[i - 1] = child->key[0];
+    }
+    else
+    {
+      Inner *child = static_cast<Inner *>(node->child[i]);
+      Inner *left = static_cast<Inner *>(node->child[i - 1]);
+
+      for (int j = child->n; j > 0; --j)
+      {
+        child->key[j] = std::move(child->key[j - 1]);
+      }
+      for (int j = child->n + 1; j > 0; --j)
+      {
+        child->child[j] = child->child[j - 1];
+      }
+
+      child->key[0] = std::move(node->key[i - 1]);
+      child->child[0] = left->child[left->n];
+      ++child->n;
+
+      node->key[i - 1] = std::move(left->key[left->n - 1]);
+      --left->n;
+    }
+  }
+
+  /**
+   * Moves the first item of the right sibling into child i
+   */
+  void BorrowRight(Inner *node, int i)
+  {
+    counters.Add(&Counters::borrows);
+    if (node->child[i]->leaf)
+    {
+      Leaf *child = static_cast<Leaf *>(node->child[i]);
+      Leaf *right = static_cast<Leaf *>(node->child[i + 1]);
+
+      child->key[child->n] = std::move(right->key[0]);
+      child->value[child->n] = std::move(right->value[0]);
+      ++child->n;
+
+      for (int j = 1; j < right->n; ++j)
+      {
+        right->key[j - 1] = std::move(right->key[j]);
+        right->value[j - 1] = std::move(right->value[j]);
+      }
+      --right->n;
+
+      node->key[i] = right->key[0];
+    }
+    else
+    {
+      Inner *child = static_cast<Inner *>(node->child[i]);
+      Inner *right = static_cast<Inner *>(node->child[i + 1]);
+
+      child->key[child->n] = std::move(node->key[i]);
+      child->child[child->n + 1] = right->child[0];
+      ++child->n;
+
+      node->key[i] = std::move(right->key[0]);
+      for (int j = 1; j < right->n; ++j)
+      {
+        right->key[j - 1] = std::move(right->key[j]);
+      }
+      for (int j = 1; j <= right->n; ++j)
+      {
+        right->child[j - 1] = right->child[j];
+      }
+      --right->n;
+    }
+  }
+
+  /**
+   * Merges child j + 1 into child j & removes separator j
+   */
+  void Merge(Inner *node, int j)
+  {
+    counters.Add(&Counters::joins);
+    if (node->child[j]->leaf)
+    {
+      Leaf *left = static_cast<Leaf *>(node->child[j]);
+      Leaf *right = static_cast<Leaf *>(node->child[j + 1]);
+
+      for (int k = 0; k < right->n; ++k)
+      {
+        left->key[left->n + k] = std::move(right->key[k]);
+        left->value[left->n + k] = std::move(right->value[k]);
+      }
+      left->n += right->n;
+
+      left->next = right->next;
+      if (right->next)
+      {
+        right->next->prev = left;
+      }
+      counters.Add(&Counters::frees);
+      leaves.Free(right);
+      --leafCount;
+    }
+    else
+    {
+      Inner *left = static_cast<Inner *>(node->child[j]);
+      Inner *right = static_cast<Inner *>(node->child[j + 1]);
+
+      left->key[left->n] = std::move(node->key[j]);
+      for (int k = 0; k < right->n; ++k)
+      {
+        left->key[left->n + 1 + k] = std::move(right->key[k]);
+      }
+      for (int k = 0; k <= right->n; ++k)
+      {
+        left->child[left->n + 1 + k] = right->child[k];
+      }
+      left->n += right->n + 1;
+      counters.Add(&Counters::frees);
+      inners.Free(right);
+      --innerCount;
+    }
+
+    for (int k = j + 1; k < node->n; ++k)
+    {
+      node->key[k - 1] = std::move(node->key[k]);
+      node->child[k] = node->child[k + 1];
+    }
+    --node->n;
+  }
+
+  /**
+   * Runs the destructors of all nodes in a subtree. The nodes left to visit
+   * are kept on an explicit stack instead of recursing
+   */
+  void Destroy(Node *node)
+  {
+    std::vector<Node *> stack(1, node);
+    while (!stack.empty())
+    {
+      node = stack.back();
+      stack.pop_back();
+      if (node->leaf)
+      {
+        static_cast<Leaf *>(node)->~Leaf();
+      }
+      else
+      {
+        Inner *inner = static_cast<Inner *>(node);
+        stack.insert(stack.end(), inner->child, inner->child + inner->n + 1);
+        inner->~Inner();
+      }
+    }
+  }
+
+  /**
+   * Allocators for internal nodes & leaves
+   */
+  Pool<Inner> inners;
+  Pool<Leaf>  leaves;
+
+  /**
+   * Root node
+   */
+  Node *root;
+
+  /**
+   * Number of items
+   */
+  size_t size;
+
+  /**
+   * Number of levels
+   */
+  size_t height;
+
+  /**
+   * Number of leaves & internal nodes
+   */
+  size_t leafCount;
+  size_t innerCount;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  CounterSet<> counters;
+};
+
+#endif /*__BPLUSTREE_H__*/
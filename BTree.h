@@ -6,35 +6,292 @@
  * and all internal nodes contain n + 1 children, where n is the number of
  * keys stored in a node
  *
- * @tparam Key   Key types, must support total ordering
- * @tparam Value Value types
- * @tparam T     Minimal degree of the tree
+ * Keys and values are stored in separate arrays, so intra-node searches
+ * only touch keys & can be vectorised for arithmetic key types. Internal
+ * nodes also record the number of items below each child, which answers
+ * order-statistic queries without visiting the siblings
+ *
+ * GetSnapshot hands out immutable views of the tree in O(1). While one is
+ * live, updates copy the nodes on their path before modifying them
+ *
+ * @tparam Key     Key types, must support total ordering
+ * @tparam Value   Value types
+ * @tparam T       Minimal degree of the tree
+ * @tparam Search  Intra-node search strategy, for keys in their natural order
+ * @tparam Compare Comparator ordering the keys
  */
-template <typename Key, typename Value, int T>
-class BTree : public Tree<Key, Value>
+template <typename Key, typename Value, int T, typename Search = NodeSearch<Key>,
+          typename Compare = std::less<Key>>
+class BTree : public TreeBase<BTree<Key, Value, T, Search, Compare>, Key, Value>
 {
+  struct Node;
+
 public:
+  /**
+   * Type the keys of type K are looked up as
+   */
+  template <typename K>
+  using Lookup = typename LookupKey<Compare, Key, K>::Type;
+
+  /**
+   * Bidirectional iterator over the items, in key order. The path from the
+   * root is kept on an explicit stack: every entry holds a node & the index
+   * of the child descended into, except for the top one, which holds the
+   * index of the current key. The past-the-end iterator has an empty path.
+   * Iterators are invalidated by modifications of the tree
+   *
+   * @tparam V Value type, const for read-only values
+   */
+  template <typename V>
+  class Cursor
+  {
+  public:
+    /**
+     * Returns an iterator to the smallest item of the tree with a root
+     */
+    static Cursor Begin(Node *const *root)
+    {
+      Cursor it(root);
+      Node *node = *root;
+      for (; !node->leaf; node = node->child[0])
+      {
+        it.path.Push(Entry(node, 0));
+      }
+      if (node->n > 0)
+      {
+        it.path.Push(Entry(node, 0));
+      }
+      return it;
+    }
+
+    /**
+     * Returns the past-the-end iterator of the tree with a root
+     */
+    static Cursor End(Node *const *root)
+    {
+      return Cursor(root);
+    }
+
+    const Key& GetKey() const
+    {
+      return path.Top().node->key[path.Top().i];
+    }
+
+    V& GetValue() const
+    {
+      return path.Top().node->value[path.Top().i];
+    }
+
+    Cursor& operator ++ ()
+    {
+      Entry& top = path.Top();
+      if (!top.node->leaf)
+      {
+        Node *node = top.node->child[++top.i];
+        for (; !node->leaf; node = node->child[0])
+        {
+          path.Push(Entry(node, 0));
+        }
+        path.Push(Entry(node, 0));
+      }
+      else if (++top.i >= top.node->n)
+      {
+        Ascend();
+      }
+      return *this;
+    }
+
+    Cursor& operator -- ()
+    {
+      if (path.Empty())
+      {
+        Node *node = *root;
+        for (; !node->leaf; node = node->child[node->n])
+        {
+          path.Push(Entry(node, node->n));
+        }
+        path.Push(Entry(node, node->n - 1));
+        if (node->n == 0)
+        {
+          path.Clear();
+        }
+        return *this;
+      }
+
+      Entry& top = path.Top();
+      if (!top.node->leaf)
+      {
+        Node *node = top.node->child[top.i];
+        for (; !node->leaf; node = node->child[node->n])
+        {
+          path.Push(Entry(node, node->n));
+        }
+        path.Push(Entry(node, node->n - 1));
+      }
+      else if (top.i > 0)
+      {
+        --top.i;
+      }
+      else
+      {
+        do
+        {
+          path.Pop();
+        }
+        while (!path.Empty() && path.Top().i == 0);
+
+        if (!path.Empty())
+        {
+          --path.Top().i;
+        }
+      }
+      return *this;
+    }
+
+    Cursor operator ++ (int)
+    {
+      Cursor it(*this);
+      ++*this;
+      return it;
+    }
+
+    Cursor operator -- (int)
+    {
+      Cursor it(*this);
+      --*this;
+      return it;
+    }
+
+    bool operator == (const Cursor& that) const
+    {
+      if (path.Empty() || that.path.Empty())
+      {
+        return path.Empty() && that.path.Empty();
+      }
+      return path.Top().node == that.path.Top().node &&
+             path.Top().i == that.path.Top().i;
+    }
+
+    bool operator != (const Cursor& that) const
+    {
+      return !(*this == that);
+    }
+
+  private:
+    friend class BTree;
+
+    /**
+     * Node on the path & index into it
+     */
+    struct Entry
+    {
+      Entry()
+      {
+      }
+
+      Entry(Node *node, int i)
+        : node(node)
+        , i(i)
+      {
+      }
+
+      Node *node;
+      int   i;
+    };
+
+    Cursor(Node *const *root)
+      : root(root)
+    {
+    }
+
+    /**
+     * Pops exhausted nodes off the path after the last key of a leaf
+     */
+    void Ascend()
+    {
+      do
+      {
+        path.Pop();
+      }
+      while (!path.Empty() && path.Top().i >= path.Top().node->n);
+    }
+
+    /**
+     * Root of the tree being iterated, used to step back from the end
+     */
+    Node *const *root;
+
+    /**
+     * Path from the root to the current key
+     */
+    Stack<Entry> path;
+  };
+
+  /**
+   * Iterator over the items, in key order. Values are read-only, as the
+   * nodes may be shared with snapshots
+   */
+  typedef Cursor<const Value> Iterator;
+
+  /**
+   * Immutable view of the tree, taken by GetSnapshot
+   */
+  typedef TreeSnapshot<Node, Iterator> Snapshot;
+
   /**
    * Creates a new BTree
    */
-  BTree()
-    : root(NULL)
+  explicit BTree(const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
     , size(0)
+    , height(1)
+    , nodeCount(1)
+    , depths(0)
   {
+    counters.Add(&Counters::allocs);
     root = new Node();
     root->n = 0;
     root->leaf = true;
   }
 
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  BTree(It begin, It end, double fill = 1.0, const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
+    , size(0)
+    , height(1)
+    , nodeCount(0)
+    , depths(0)
+  {
+    // The root is allocated last, so unsorted input leaks nothing
+    BulkLoad(begin, end, fill);
+    if (root == NULL)
+    {
+      counters.Add(&Counters::allocs);
+      ++nodeCount;
+      root = new Node();
+      root->n = 0;
+      root->leaf = true;
+    }
+  }
+
   /**
    * Destroys the tree
    */
   ~BTree()
   {
-    if (root)
+    if (versions.Live())
     {
-      delete root;
+      Abandon();
+      return;
     }
+    Destroy(root);
+    versions.Drain([] (Node *node) { delete node; });
   }
 
   /**
@@ -42,58 +299,454 @@ public:
    */
   void Insert(const Key& key, const Value &value)
   {
-    if (root->n < 2 * T - 1)
+    Emplace(key, value);
+  }
+
+  /**
+   * Inserts a value into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Emplace(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    bool added = InsertNonFull(Root(), true, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return added;
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    bool added = InsertNonFull(Root(), false, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return added;
+  }
+
+  /**
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. Nodes are packed bottom-up, level by level, in
+   * O(n). Each node receives about fill * (2 * T - 1) keys, clamped to the
+   * range allowed by the minimal degree
+   */
+  template <typename It>
+  void BulkLoad(It begin, It end, double fill = 1.0)
+  {
+    if (size != 0)
     {
-      InsertNonFull(root, Item(key, value));
+      throw std::runtime_error("Tree is not empty");
     }
-    else
+
+    size_t n = this->CountSorted(begin, end, compare);
+    if (n == 0)
     {
+      return;
+    }
+
+    int target = static_cast<int>(fill * (2 * T - 1));
+    target = std::max(T - 1, std::min(2 * T - 1, target));
+
+    // Build the leaves, setting aside the items which separate them. Items
+    // are counted per level to find their depths once the height is known
+    std::vector<Item> seps;
+    std::vector<Node *> nodes;
+    std::vector<size_t> items;
+    size_t count = Groups(n, target, T - 1);
+    size_t base = (n - count + 1) / count, extra = (n - count + 1) % count;
+    for (size_t g = 0; g < count; ++g)
+    {
+      counters.Add(&Counters::allocs);
       Node *node = new Node();
-      node->n = 0;
-      node->leaf = false;
-      node->child[0] = root;
-      root = node;
-      Split(node, 0);
-      InsertNonFull(node, Item(key, value));
+      versions.Stamp(node);
+      node->leaf = true;
+      node->n = static_cast<int>(base + (g < extra));
+      for (int i = 0; i < node->n; ++i, ++begin)
+      {
+        node->key[i] = begin->first;
+        node->value[i] = begin->second;
+      }
+      nodes.push_back(node);
+
+      if (g + 1 < count)
+      {
+        seps.push_back(Item(begin->first, begin->second));
+        ++begin;
+      }
+    }
+    items.push_back(n - seps.size());
+    nodeCount = nodes.size();
+
+    // Build the internal levels out of the separators
+    while (nodes.size() > 1)
+    {
+      std::vector<Item> upSeps;
+      std::vector<Node *> up;
+      size_t m = seps.size(), s = 0, c = 0;
+      count = Groups(m, target, T - 1);
+      base = (m - count + 1) / count;
+      extra = (m - count + 1) % count;
+      for (size_t g = 0; g < count; ++g)
+      {
+        counters.Add(&Counters::allocs);
+        Node *node = new Node();
+        versions.Stamp(node);
+        node->leaf = false;
+        node->n = static_cast<int>(base + (g < extra));
+        for (int i = 0; i < node->n; ++i, ++s)
+        {
+          node->key[i] = std::move(seps[s].key);
+          node->value[i] = std::move(seps[s].value);
+          node->count[i] = nodes[c]->GetCount();
+          node->child[i] = nodes[c++];
+        }
+        node->count[node->n] = nodes[c]->GetCount();
+        node->child[node->n] = nodes[c++];
+        up.push_back(node);
+
+        if (g + 1 < count)
+        {
+          upSeps.push_back(std::move(seps[s++]));
+        }
+      }
+
+      items.push_back(seps.size() - upSeps.size());
+      nodeCount += up.size();
+      nodes.swap(up);
+      seps.swap(upSeps);
+    }
+
+    if (root)
+    {
+      Drop(root);
+    }
+    root = nodes[0];
+    size = n;
+    height = items.size();
+    depths = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+      depths += items[i] * (height - i);
+    }
+  }
+
+  /**
+   * Deletes an entry from the tree
+   */
+  template <typename K>
+  void Delete(const K& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an entry from the tree if the key is present
+   * @return True if an entry was removed
+   */
+  template <typename K>
+  bool Erase(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    root = Mutable(root);
+    bool erased = Delete(root, key);
+    Collect();
+    return erased;
+  }
+
+  /**
+   * Finds a value in the tree. With a transparent comparator, key can be
+   * of any type comparable with Key
+   */
+  template <typename K>
+  Value& Find(const K& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Finds a value in the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *TryFind(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    Node *node = root;
+    counters.Add(&Counters::finds);
+    while (node)
+    {
+      counters.Add(&Counters::visits);
+      int i = Position<false>(node, key);
+      if (Found(node, i, key))
+      {
+        // Values shared with snapshots are copied before they are handed out
+        return versions.Frozen(node) ? Thaw(key) : &node->value[i];
+      }
+
+      if (node->leaf)
+      {
+        break;
+      }
+
+      node = node->child[i];
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Finds a value for reading only, without copying the nodes it shares
+   * with snapshots
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  const Value *TryFind(const K& arg) const
+  {
+    const Lookup<K>& key = arg;
+    const Node *node = root;
+    counters.Add(&Counters::finds);
+    while (node)
+    {
+      counters.Add(&Counters::visits);
+      int i = Position<false>(node, key);
+      if (Found(node, i, key))
+      {
+        return &node->value[i];
+      }
+
+      if (node->leaf)
+      {
+        break;
+      }
+
+      node = node->child[i];
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  template <typename K>
+  bool Contains(const K& key)
+  {
+    const BTree& tree = *this;
+    return tree.TryFind(key) != NULL;
+  }
+
+  /**
+   * Removes all items, leaving an empty root leaf
+   */
+  void Clear()
+  {
+    if (versions.Live())
+    {
+      counters.Add(&Counters::frees, nodeCount + versions.GetRetired());
+      Abandon();
+    }
+    else
+    {
+      versions.Drain([this] (Node *node) { Free(node); });
+      Destroy(root);
+      counters.Add(&Counters::frees, nodeCount);
+    }
+    counters.Add(&Counters::allocs);
+    root = new Node();
+    root->n = 0;
+    root->leaf = true;
+    size = 0;
+    height = 1;
+    nodeCount = 1;
+    depths = 0;
+  }
+
+  /**
+   * Returns an immutable view of the items in O(1), which can be read from
+   * any thread without locks while this tree goes on changing: from then
+   * on, updates copy the nodes on their path instead of modifying them,
+   * until the snapshot is released. Must be taken by the thread updating
+   * the tree; it stays readable if the tree is cleared or destroyed first
+   */
+  Snapshot GetSnapshot()
+  {
+    static_assert(std::is_copy_constructible<Node>::value, "Snapshots need copyable items");
+    Collect();
+    uint32_t version = versions.Freeze();
+    return Snapshot(root, size, version, versions.GetRegistry());
+  }
+
+  /**
+   * Returns an iterator to the smallest item
+   */
+  Iterator Begin()
+  {
+    return Iterator::Begin(&root);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator::End(&root);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   */
+  template <typename K>
+  Iterator LowerBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Bound<false, Iterator>(key);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key
+   */
+  template <typename K>
+  Iterator UpperBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Bound<true, Iterator>(key);
+  }
+
+  /**
+   * Returns an iterator to the k-th smallest item, counting from zero, or
+   * the past-the-end iterator if k is out of range, in O(T log n)
+   */
+  Iterator Select(size_t k)
+  {
+    Iterator it(&root);
+    if (k >= size)
+    {
+      return it;
+    }
+
+    for (Node *node = root; ; )
+    {
+      if (node->leaf)
+      {
+        it.path.Push(typename Iterator::Entry(node, static_cast<int>(k)));
+        return it;
+      }
+
+      int i = 0;
+      while (k > node->count[i])
+      {
+        k -= node->count[i] + 1;
+        ++i;
+      }
+
+      it.path.Push(typename Iterator::Entry(node, i));
+      if (k == node->count[i])
+      {
+        return it;
+      }
+      node = node->child[i];
+    }
+  }
+
+  /**
+   * Returns the number of keys less than key, in O(T log n)
+   */
+  template <typename K>
+  size_t Rank(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    size_t rank = 0;
+    for (Node *node = root; ; )
+    {
+      int i = Position<false>(node, key);
+      rank += i;
+      if (node->leaf)
+      {
+        return rank;
+      }
+
+      for (int j = 0; j < i; ++j)
+      {
+        rank += node->count[j];
+      }
+
+      if (Found(node, i, key))
+      {
+        return rank + node->count[i];
+      }
+      node = node->child[i];
     }
   }
 
   /**
-   * Deletes an entry from the tree
+   * Returns the number of keys in [lo, hi), in O(T log n)
    */
-  void Delete(const Key& key)
+  template <typename L, typename H>
+  size_t CountRange(const L& lo, const H& hi)
   {
-    Delete(root, key);
+    // Lookup keys are only ever compared with keys of the tree
+    size_t l = Rank(lo), h = Rank(hi);
+    return l < h ? h - l : 0;
   }
 
   /**
-   * Finds a value in the tree
+   * Invokes a callback on all items with keys in [lo, hi), in order.
+   * Callbacks taking the value by const reference read it in place
    */
-  Value& Find(const Key& key)
+  template <typename L, typename H, typename Fn>
+  void Range(const L& lo, const H& hi, Fn fn)
   {
-    Node *node = root;
-    while (node)
+    typedef typename std::conditional<
+        Reads<Fn, Key, Value>::value, const Value, Value>::type V;
+    const Lookup<L>& l = lo;
+    const Lookup<H>& h = hi;
+    if (!std::is_const<V>::value && versions.Live())
     {
-      int i = 0;
-      while (i < node->n && node->key[i].key < key)
-      {
-        ++i;
-      }
-
-      if (i < node->n && node->key[i].key == key)
+      // Handing a value out copies the path to it, which iterators do not
+      // follow, so every item is found again from the root
+      for (Iterator it = LowerBound(l); it != End() && compare(it.GetKey(), h); it = UpperBound(it.GetKey()))
       {
-        return node->key[i].value;
+        fn(it.GetKey(), *Thaw(it.GetKey()));
       }
+      return;
+    }
 
-      if (node->leaf)
+    for (Cursor<V> it = Bound<false, Cursor<V>>(l), end = Cursor<V>::End(&root); it != end; ++it)
+    {
+      if (!compare(it.GetKey(), h))
       {
         break;
       }
-
-      node = node->child[i];
+      fn(it.GetKey(), it.GetValue());
     }
+  }
 
-    throw std::runtime_error("Key not found");
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<Key, Key, const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
   }
 
   /**
@@ -105,11 +758,41 @@ public:
   }
 
   /**
-   * Returns the height of the tree
+   * Returns the height of the tree, in O(1)
    */
   size_t GetHeight()
   {
-    return root ? root->GetHeight() : 0;
+    return height;
+  }
+
+  /**
+   * Returns the structural statistics of the tree, in O(1). The bytes
+   * include the nodes retired while snapshots still reach them
+   */
+  Stats GetStats()
+  {
+    Stats stats;
+    stats.nodes = nodeCount;
+    stats.fill = static_cast<double>(size) / (nodeCount * (2 * T - 1));
+    stats.depth = size ? static_cast<double>(depths) / size : 0.0;
+    stats.bytes = (nodeCount + versions.GetRetired()) * sizeof(Node);
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return counters.Get(compare);
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset(compare);
   }
 
 private:
@@ -122,9 +805,10 @@ private:
     {
     }
 
-    Item(const Key& key, const Value& value)
-      : key(key)
-      , value(value)
+    template <typename K, typename V>
+    Item(K&& key, V&& value)
+      : key(std::forward<K>(key))
+      , value(std::forward<V>(value))
     {
     }
 
@@ -135,40 +819,149 @@ private:
   /**
    * Internal BTree node
    */
-  struct Node
+  struct Node : public Stamped<true>
   {
     Node()
     {
       memset(child, 0, sizeof(child));
     }
 
-    ~Node()
+    size_t GetCount()
     {
-      if (n > 0)
+      size_t total = n;
+      if (!leaf)
       {
         for (int i = 0; i <= n; ++i)
         {
-          delete child[i];
+          total += count[i];
         }
       }
+      return total;
+    }
+
+    int     n;
+    bool    leaf;
+    Key     key[T * 2];
+    Value   value[T * 2];
+    Node   *child[T * 2 + 1];
+    size_t  count[T * 2 + 1];
+  };
+
+  /**
+   * Moves the item at index j in src to index i in dst
+   */
+  static void Move(Node *dst, int i, Node *src, int j)
+  {
+    dst->key[i] = std::move(src->key[j]);
+    dst->value[i] = std::move(src->value[j]);
+  }
+
+  /**
+   * Returns the root, which can be modified, splitting it first if it is
+   * full so that an item can be inserted below it
+   */
+  Node *Root()
+  {
+    root = Mutable(root);
+    if (root->n == 2 * T - 1)
+    {
+      counters.Add(&Counters::allocs);
+      Node *node = new Node();
+      versions.Stamp(node);
+      node->n = 0;
+      node->leaf = false;
+      node->child[0] = root;
+      root = node;
+      ++nodeCount;
+      ++height;
+      depths += size;
+      Split(node, 0);
     }
+    return root;
+  }
+
+  /**
+   * Returns the number of nodes a level of m items is split into, when
+   * adjacent nodes are separated by an item moved up to the next level.
+   * Nodes get close to target items each, but never fewer than lo
+   */
+  static size_t Groups(size_t m, size_t target, size_t lo)
+  {
+    size_t count = (m + target + 1) / (target + 1);
+    count = std::min(count, (m + 1) / (lo + 1));
+    return std::max(count, static_cast<size_t>(1));
+  }
+
+  /**
+   * Returns the index of the first key of a node not less than (Upper =
+   * false) or greater than (Upper = true) a given key. Lookups in the
+   * natural order of Key go through Search, which may be vectorised, the
+   * others through a binary search with the comparator
+   */
+  template <bool Upper, typename K>
+  int Position(const Node *node, const K& key) const
+  {
+    counters.Add(&Counters::searches);
+    return Position<Upper>(node, key, NaturalOrder<Compare, Key, K>());
+  }
+
+  template <bool Upper, typename K>
+  int Position(const Node *node, const K& key, std::true_type) const
+  {
+    return Upper
+        ? Search::UpperBound(node->key, node->n, key)
+        : Search::LowerBound(node->key, node->n, key);
+  }
+
+  template <bool Upper, typename K>
+  int Position(const Node *node, const K& key, std::false_type) const
+  {
+    const Key *keys = node->key;
+    return static_cast<int>(Upper
+        ? std::upper_bound(keys, keys + node->n, key, compare) - keys
+        : std::lower_bound(keys, keys + node->n, key, compare) - keys);
+  }
+
+  /**
+   * Checks whether the key at the index returned by Position<false> is the
+   * one looked up
+   */
+  template <typename K>
+  bool Found(const Node *node, int i, const K& key) const
+  {
+    return i < node->n && !compare(key, node->key[i]);
+  }
 
-    int GetHeight()
+  /**
+   * Descends to the first key not less than (Upper = false) or greater
+   * than (Upper = true) a given key, recording the path
+   */
+  template <bool Upper, typename It, typename K>
+  It Bound(const K& key)
+  {
+    It it(&root);
+    for (Node *node = root; ; node = node->child[it.path.Top().i])
     {
-      int height = 0;
-      for (int i = 0; i <= n; ++i)
+      int i = Position<Upper>(node, key);
+      it.path.Push(typename It::Entry(node, i));
+
+      if (!Upper && Found(node, i, key))
       {
-        height = std::max(height, child[i]->GetHeight());
+        return it;
       }
 
-      return height + 1;
+      if (node->leaf)
+      {
+        break;
+      }
     }
 
-    int  n;
-    bool    leaf;
-    Item    key[T * 2];
-    Node   *child[T * 2 + 1];
-  };
+    if (it.path.Top().i >= it.path.Top().node->n)
+    {
+      it.Ascend();
+    }
+    return it;
+  }
 
   /**
    * Takes as input a node containing 2 * t - 1 keys and its parent,
@@ -179,10 +972,16 @@ private:
    */
   void Split(Node *x, int c)
   {
+    counters.Add(&Counters::splits);
     Node *z, *y;
 
+    // The median moves up a level
+    counters.Add(&Counters::allocs);
     z = new Node();
-    y = x->child[c];
+    versions.Stamp(z);
+    ++nodeCount;
+    --depths;
+    y = Child(x, c);
     z->leaf = y->leaf;
 
     z->n = T - 1;
@@ -190,7 +989,7 @@ private:
 
     for (int i = 0; i < T - 1; ++i)
     {
-      z->key[i] = y->key[i + T];
+      Move(z, i, y, i + T);
     }
 
     if (!z->leaf)
@@ -198,21 +997,25 @@ private:
       for (int i = 0; i < T; ++i)
       {
         z->child[i] = y->child[i + T];
+        z->count[i] = y->count[i + T];
       }
     }
 
     for (int i = x->n; i > c; --i)
     {
-      x->child[i] = x->child[i - 1];
+      x->child[i + 1] = x->child[i];
+      x->count[i + 1] = x->count[i];
     }
 
     x->child[c + 1] = z;
-    for (int i = x->n - 1; i > c; --i)
+    x->count[c + 1] = z->GetCount();
+    x->count[c] = y->GetCount();
+    for (int i = x->n - 1; i >= c; --i)
     {
-      x->key[i + 1] = x->key[i];
+      Move(x, i + 1, x, i);
     }
 
-    x->key[c] = y->key[T - 1];
+    Move(x, c, y, T - 1);
     ++x->n;
   }
 
@@ -222,17 +1025,21 @@ private:
    */
   Node* Join(Node *node, int j)
   {
-    Node *left = node->child[j];
-    Node *right = node->child[j + 1];
+    counters.Add(&Counters::joins);
+    Node *left = Child(node, j);
+    Node *right = Child(node, j + 1);
+
+    // The separator moves down a level
+    ++depths;
 
     // Add key to left child
     left->n = 2 * T - 1;
-    left->key[T - 1] = node->key[j];
+    Move(left, T - 1, node, j);
 
     // Add keys from right
     for (int i = 0; i < T; ++i)
     {
-      left->key[T + i] = right->key[i];
+      Move(left, T + i, right, i);
     }
 
     // Add children
@@ -241,157 +1048,188 @@ private:
       for (int i = 0; i <= T; ++i)
       {
         left->child[T + i] = right->child[i];
+        left->count[T + i] = right->count[i];
       }
     }
 
     // Remove key
-    for (int i = j; i < node->n; ++i)
+    node->count[j] += node->count[j + 1] + 1;
+    for (int i = j; i < node->n - 1; ++i)
     {
-      node->key[i] = node->key[i + 1];
+      Move(node, i, node, i + 1);
       node->child[i + 1] = node->child[i + 2];
+      node->count[i + 1] = node->count[i + 2];
     }
     node->n--;
 
     // If root became empty, reduce the height of the tree
     if (node->n == 0)
     {
-      root->n = 0;
-      delete root;
+      Drop(root);
       root = left;
+      --nodeCount;
+      --height;
+      depths -= size;
     }
 
-    right->n = 0;
-    delete right;
+    Drop(right);
+    --nodeCount;
 
     return left;
   }
 
   /**
    * Inserts a key into a node that's node full
-   * If a duplicate key is found, its value is overwritten
+   * If a duplicate key is found, its value is overwritten if replace is set
+   * @return True if a new item was added
    */
-  void InsertNonFull(Node *node, const Item& item)
+  template <typename K, typename... Args>
+  bool InsertNonFull(Node *node, bool replace, K&& key, Args&&... args)
   {
-    if (node->leaf)
+    int i = Position<false>(node, key);
+    if (Found(node, i, key))
     {
-      int i, j = node->n - 1;
-      for (i = 0; item.key >= node->key[i].key && i < node->n; ++i)
+      if (replace)
       {
-        if (item.key == node->key[i].key)
-        {
-          node->key[i].value = item.value;
-          return;
-        }
+        this->Assign(node->value[i], std::forward<Args>(args)...);
       }
+      return false;
+    }
 
-      while (j >= i)
+    if (node->leaf)
+    {
+      for (int j = node->n - 1; j >= i; --j)
       {
-        node->key[j + 1] = node->key[j];
-        --j;
+        Move(node, j + 1, node, j);
       }
 
-      node->key[j + 1] = item;
+      node->key[i] = std::forward<K>(key);
+      this->Assign(node->value[i], std::forward<Args>(args)...);
       ++node->n;
       ++size;
+      depths += height;
+      return true;
     }
-    else
-    {
-      int i = node->n - 1;
-      while (i >= 0 && item.key < node->key[i].key)
-      {
-        --i;
-      }
 
-      if (i >= 0 && node->key[i].key == item.key)
+    if (node->child[i]->n == 2 * T - 1)
+    {
+      Split(node, i);
+      if (compare(node->key[i], key))
       {
-        node->key[i].value = item.value;
-        return;
+        ++i;
       }
-
-      ++i;
-
-      if (node->child[i]->n == 2 * T - 1)
+      else if (!compare(key, node->key[i]))
       {
-        Split(node, i);
-        if (item.key > node->key[i].key)
+        if (replace)
         {
-          ++i;
+          this->Assign(node->value[i], std::forward<Args>(args)...);
         }
+        return false;
       }
+    }
 
-      InsertNonFull(node->child[i], item);
+    if (!InsertNonFull(Child(node, i), replace, std::forward<K>(key), std::forward<Args>(args)...))
+    {
+      return false;
     }
+
+    ++node->count[i];
+    return true;
   }
 
   /**
    * Deletes a node from the tree, maintaining balance
+   * @return False if the key is not in the subtree
    */
-  void Delete(Node *node, const Key& key)
+  template <typename K>
+  bool Delete(Node *node, const K& key)
   {
     if (node->leaf)
     {
       // Rule 1: If key is in a leaf, it is removed
-      DeleteFromLeaf(node, key);
-      return;
-    }
-
-    int i = node->n - 1;
-    while (i >= 0 && key < node->key[i].key)
-    {
-      --i;
+      return DeleteFromLeaf(node, key);
     }
 
-    if (i >= 0 && node->key[i].key == key)
+    int i = Position<false>(node, key);
+    if (Found(node, i, key))
     {
       // Rule 2: Key is in an internal node
       if (node->child[i]->n >= T)
       {
         // Rule 2a
-        node->key[i] = DeleteMax(node->child[i]);
+        Item item = DeleteMax(Child(node, i));
+        node->key[i] = std::move(item.key);
+        node->value[i] = std::move(item.value);
+        --node->count[i];
         --size;
+        depths -= height;
+        return true;
       }
-      else if (node->child[i + 1]->n >= T)
+
+      if (node->child[i + 1]->n >= T)
       {
         // Rule 2b
-        node->key[i] = DeleteMin(node->child[i + 1]);
+        Item item = DeleteMin(Child(node, i + 1));
+        node->key[i] = std::move(item.key);
+        node->value[i] = std::move(item.value);
+        --node->count[i + 1];
         --size;
+        depths -= height;
+        return true;
       }
-      else
-      {
-        // Rule 2c
-        Delete(Join(node, i), key);
-      }
+
+      // Rule 2c
+      return DeleteJoined(node, i, key);
     }
-    else
+
+    // Key is in one of the children. Counts are only decremented once the
+    // recursive call returns, if the key was found
+    if (node->child[i]->n < T)
     {
-      // Key is in one of the children
-      ++i;
-      if (node->child[i]->n >= T)
+      if (i >= 1 && node->child[i - 1]->n >= T)
       {
-        // Rule 3
-        Delete(node->child[i], key);
+        // Rule 3a
+        BorrowLeft(node, i);
+      }
+      else if (i < node->n && node->child[i + 1]->n >= T)
+      {
+        // Rule 3a
+        BorrowRight(node, i);
       }
       else
       {
-        if (i >= 1 && node->child[i - 1]->n >= T)
-        {
-          // Rule 3a
-          BorrowLeft(node, i);
-          Delete(node->child[i], key);
-        }
-        else if (i < node->n && node->child[i + 1]->n >= T)
-        {
-          // Rule 3a
-          BorrowRight(node, i);
-          Delete(node->child[i], key);
-        }
-        else
-        {
-          // Rule 3b
-          Delete(Join(node, i >= 1 ? i - 1 : i), key);
-        }
+        // Rule 3b
+        return DeleteJoined(node, i >= 1 ? i - 1 : i, key);
       }
     }
+
+    // Rule 3
+    if (!Delete(Child(node, i), key))
+    {
+      return false;
+    }
+    --node->count[i];
+    return true;
+  }
+
+  /**
+   * Joins two children around key j & deletes a key from the result. If
+   * the join emptied the root, the joined node is the new root
+   * @return False if the key is not in the joined node
+   */
+  template <typename K>
+  bool DeleteJoined(Node *node, int j, const K& key)
+  {
+    Node *child = Join(node, j);
+    if (!Delete(child, key))
+    {
+      return false;
+    }
+    if (child != root)
+    {
+      --node->count[j];
+    }
+    return true;
   }
 
   /**
@@ -405,23 +1243,31 @@ private:
     if (node->leaf)
     {
       // Rule 2: Max is the last key
-      return node->key[--node->n];
-    }
-
-    if (node->child[node->n]->n >= T)
-    {
-      // Rule 3
-      return DeleteMax(node->child[node->n]);
+      --node->n;
+      return Item(std::move(node->key[node->n]), std::move(node->value[node->n]));
     }
 
-    if (node->child[node->n - 1]->n >= T)
+    int i = node->n;
+    if (node->child[i]->n < T)
     {
-      // Rule 3a
-      BorrowLeft(node, node->n);
-      return DeleteMax(node->child[node->n]);
+      if (node->child[i - 1]->n >= T)
+      {
+        // Rule 3a
+        BorrowLeft(node, i);
+      }
+      else
+      {
+        Node *child = Join(node, --i);
+        if (child == root)
+        {
+          return DeleteMax(child);
+        }
+      }
     }
 
-    return DeleteMax(Join(node, node->n - 1));
+    // Rule 3
+    --node->count[i];
+    return DeleteMax(Child(node, i));
   }
 
   /**
@@ -432,53 +1278,60 @@ private:
     if (node->leaf)
     {
       // Rule 2
-      Item key = node->key[0];
+      Item item(std::move(node->key[0]), std::move(node->value[0]));
       for (int i = 0; i < node->n - 1; ++i)
       {
-        node->key[i] = node->key[i + 1];
+        Move(node, i, node, i + 1);
       }
 
       --node->n;
-      return key;
-    }
-
-    if (node->child[0]->n >= T)
-    {
-      // Rule 3
-      return DeleteMin(node->child[0]);
+      return item;
     }
 
-    if (node->child[1]->n >= T)
+    if (node->child[0]->n < T)
     {
-      BorrowRight(node, 0);
-      return DeleteMin(node->child[0]);
+      if (node->child[1]->n >= T)
+      {
+        // Rule 3a
+        BorrowRight(node, 0);
+      }
+      else
+      {
+        Node *child = Join(node, 0);
+        if (child == root)
+        {
+          return DeleteMin(child);
+        }
+      }
     }
 
-    return DeleteMin(Join(node, 0));
+    // Rule 3
+    --node->count[0];
+    return DeleteMin(Child(node, 0));
   }
 
   /**
-   * Deletes a key from a leaf node or throws
-   * and exception if the key is not in the leaf
+   * Deletes a key from a leaf node
+   * @return False if the key is not in the leaf
    */
-  void DeleteFromLeaf(Node *node, const Key& key)
+  template <typename K>
+  bool DeleteFromLeaf(Node *node, const K& key)
   {
-    for (int i = 0; i < node->n; ++i)
+    int i = Position<false>(node, key);
+    if (Found(node, i, key))
     {
-      if (node->key[i].key == key)
+      for (int j = i + 1; j < node->n; ++j)
       {
-        for (int j = i + 1; j < node->n; ++j)
-        {
-          node->key[j - 1] = node->key[j];
-        }
-
-        --size;
-        --node->n;
-        return;
+        Move(node, j - 1, node, j);
       }
+
+      --size;
+      --node->n;
+      depths -= height;
+      return true;
     }
 
-    throw std::runtime_error("Key not found!");
+    return false;
   }
 
   /**
@@ -486,32 +1339,39 @@ private:
    */
   void BorrowLeft(Node *node, int i)
   {
-    Node *child = node->child[i];
-    Node *sibling = node->child[i - 1];
+    counters.Add(&Counters::borrows);
+    Node *child = Child(node, i);
+    Node *sibling = Child(node, i - 1);
 
     // Move keys of the child to the right
-    for (int i = T; i >= 1; --i)
+    for (int j = T - 1; j >= 1; --j)
     {
-      child->key[i] = child->key[i - 1];
+      Move(child, j, child, j - 1);
     }
 
     // Add a key from x
-    child->key[0] = node->key[i - 1];
+    Move(child, 0, node, i - 1);
     child->n = T;
 
     // Move key from sibling to node
-    node->key[i - 1] = sibling->key[sibling->n - 1];
+    Move(node, i - 1, sibling, sibling->n - 1);
 
     // Move & add children
+    size_t moved = 1;
     if (!child->leaf)
     {
-      for (int i = T + 1; i >= 1; --i);
+      for (int j = T; j >= 1; --j)
       {
-        child->child[i] = child->child[i - 1];
+        child->child[j] = child->child[j - 1];
+        child->count[j] = child->count[j - 1];
       }
       child->child[0] = sibling->child[sibling->n];
+      child->count[0] = sibling->count[sibling->n];
+      moved += child->count[0];
     }
 
+    node->count[i - 1] -= moved;
+    node->count[i] += moved;
     --sibling->n;
   }
 
@@ -520,35 +1380,171 @@ private:
    */
   void BorrowRight(Node *node, int i)
   {
-    Node *child = node->child[i];
-    Node *sibling = node->child[i + 1];
+    counters.Add(&Counters::borrows);
+    Node *child = Child(node, i);
+    Node *sibling = Child(node, i + 1);
 
     // Move a key from node to child
-    child->key[T - 1] = node->key[i];
+    Move(child, T - 1, node, i);
     child->n = T;
 
     // Move a key from sibling to node
-    node->key[i] = sibling->key[0];
+    Move(node, i, sibling, 0);
 
     // Remove key from sibling
-    for (int i = 1; i < sibling->n; ++i)
+    for (int j = 1; j < sibling->n; ++j)
     {
-      sibling->key[i - 1] = sibling->key[i];
+      Move(sibling, j - 1, sibling, j);
     }
 
+    size_t moved = 1;
     if (!child->leaf)
     {
       child->child[T] = sibling->child[0];
-      for (int i = 1; i <= sibling->n; ++i)
+      child->count[T] = sibling->count[0];
+      moved += child->count[T];
+      for (int j = 1; j <= sibling->n; ++j)
       {
-        sibling->child[i - 1] = sibling->child[i];
+        sibling->child[j - 1] = sibling->child[j];
+        sibling->count[j - 1] = sibling->count[j];
       }
     }
 
+    node->count[i] += moved;
+    node->count[i + 1] -= moved;
     --sibling->n;
   }
 
+  /**
+   * Returns a node which can be modified: the node itself, or a copy of
+   * it if a snapshot may reach it, in which case the original is retired
+   */
+  Node *Mutable(Node *node)
+  {
+    return versions.Frozen(node) ? Copy(node, std::is_copy_constructible<Node>()) : node;
+  }
+
+  Node *Copy(Node *node, std::true_type)
+  {
+    counters.Add(&Counters::allocs);
+    Node *copy = new Node(*node);
+    versions.Stamp(copy);
+    versions.Retire(node);
+    return copy;
+  }
+
+  Node *Copy(Node *node, std::false_type)
+  {
+    return node;
+  }
+
+  /**
+   * Returns child i of a node which can be modified, making the child
+   * modifiable as well
+   */
+  Node *Child(Node *node, int i)
+  {
+    return node->child[i] = Mutable(node->child[i]);
+  }
+
+  /**
+   * Makes the value of a key modifiable, copying the nodes on the path to
+   * it which snapshots hold
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *Thaw(const K& key)
+  {
+    Node *node = root = Mutable(root);
+    for (;;)
+    {
+      int i = Position<false>(node, key);
+      if (Found(node, i, key))
+      {
+        return &node->value[i];
+      }
+
+      if (node->leaf)
+      {
+        return NULL;
+      }
+
+      node = Child(node, i);
+    }
+  }
+
+  /**
+   * Frees a node removed from the tree, or retires it if a snapshot may
+   * still reach it
+   */
+  void Drop(Node *node)
+  {
+    if (versions.Frozen(node))
+    {
+      versions.Retire(node);
+    }
+    else
+    {
+      Free(node);
+    }
+  }
+
+  /**
+   * Deletes a node
+   */
+  void Free(Node *node)
+  {
+    counters.Add(&Counters::frees);
+    delete node;
+  }
+
+  /**
+   * Frees the retired nodes which no snapshot can reach anymore
+   */
+  void Collect()
+  {
+    versions.Collect([this] (Node *node) { Free(node); });
+  }
+
+  /**
+   * Leaves the nodes to the live snapshots, which delete them along with
+   * the retired ones once the last of them is released
+   */
+  void Abandon()
+  {
+    Node *node = root;
+    versions.Orphan([] (Node *node) { delete node; }, [node] { Destroy(node); });
+  }
+
+  /**
+   * Deletes all nodes of a subtree. The nodes left to visit are kept on an
+   * explicit stack, so large trees are torn down without recursion
+   */
+  static void Destroy(Node *node)
+  {
+    std::vector<Node *> stack;
+    if (node)
+    {
+      stack.push_back(node);
+    }
+    while (!stack.empty())
+    {
+      node = stack.back();
+      stack.pop_back();
+      if (!node->leaf)
+      {
+        stack.insert(stack.end(), node->child, node->child + node->n + 1);
+      }
+      delete node;
+    }
+  }
+
 private:
+  /**
+   * Comparator ordering the keys
+   */
+  Comparator<Compare> compare;
+
   /**
    * Root node
    */
@@ -558,6 +1554,33 @@ private:
    * Number of items
    */
   size_t size;
+
+  /**
+   * Number of levels
+   */
+  size_t height;
+
+  /**
+   * Number of nodes
+   */
+  size_t nodeCount;
+
+  /**
+   * Sum of the depths of all items, the root being at depth 1. Deletions
+   * always free a slot in a leaf, as items removed from internal nodes
+   * are replaced by their predecessor or successor
+   */
+  size_t depths;
+
+  /**
+   * Snapshot versions & the nodes retired while snapshots are live
+   */
+  Versions<Node> versions;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  mutable CounterSet<> counters;
 };
 
 #endif /*__BTREE_H__*/
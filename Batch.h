@@ -0,0 +1,117 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <cstddef>
+
+/**
+ * Batched operations on binary search trees, using group prefetching. The
+ * keys of a batch are processed in groups which descend the tree in
+ * lockstep: every round moves each lookup of the group one level down and
+ * prefetches the child it moves to, so the cache misses of the whole group
+ * overlap instead of stalling one lookup after the other. Lookups which
+ * are done leave the group, so later rounds only visit the deeper paths
+ *
+ * @tparam Node    Node type, with key, value, left & right fields
+ * @tparam Key     Key type
+ * @tparam Value   Value type
+ * @tparam Compare Comparator ordering the keys
+ */
+template <typename Node, typename Key, typename Value, typename Compare>
+class Batch
+{
+public:
+  /**
+   * Number of lookups in flight, enough to cover memory latency without
+   * running out of fill buffers
+   */
+  static const size_t kGroup = 16;
+
+  /**
+   * Looks up n keys, storing a pointer to the value of each key in out, or
+   * NULL if the key is missing. Returns the number of keys found
+   */
+  static size_t Find(Node *root, const Key *keys, size_t n, Value **out,
+                     const Compare& less)
+  {
+    size_t found = 0;
+    for (size_t base = 0; base < n; base += kGroup)
+    {
+      size_t live = n - base < kGroup ? n - base : kGroup;
+      size_t lane[kGroup];
+      Node *node[kGroup];
+      for (size_t i = 0; i < live; ++i)
+      {
+        lane[i] = base + i;
+        node[i] = root;
+        out[base + i] = NULL;
+      }
+
+      while (live > 0)
+      {
+        for (size_t i = 0; i < live; )
+        {
+          const Key& key = keys[lane[i]];
+          Node *next = node[i];
+          if (next && less(key, next->key))
+          {
+            next = next->left;
+          }
+          else if (next && less(next->key, key))
+          {
+            next = next->right;
+          }
+          else
+          {
+            if (next)
+            {
+              out[lane[i]] = &next->value;
+              ++found;
+            }
+
+            // Done, the last lookup of the group takes its place
+            --live;
+            lane[i] = lane[live];
+            node[i] = node[live];
+            continue;
+          }
+
+          __builtin_prefetch(next);
+          node[i++] = next;
+        }
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Inserts n items into a tree, overwriting the values of duplicates. The
+   * keys of each group are looked up together first: existing keys are
+   * updated in place, which leaves the structure of the tree unchanged,
+   * while missing ones are inserted one at a time, on paths which are now
+   * cached. Nodes never move, so the pointers found stay valid
+   */
+  template <typename T>
+  static void Insert(T *tree, Node *const *root, const Key *keys, const Value *values,
+                     size_t n, const Compare& less)
+  {
+    Value *slot[kGroup];
+    for (size_t base = 0; base < n; base += kGroup)
+    {
+      size_t m = n - base < kGroup ? n - base : kGroup;
+      Find(*root, keys + base, m, slot, less);
+      for (size_t i = 0; i < m; ++i)
+      {
+        if (slot[i])
+        {
+          *slot[i] = values[base + i];
+        }
+        else
+        {
+          tree->Insert(keys[base + i], values[base + i]);
+        }
+      }
+    }
+  }
+};
+
+#endif /*__BATCH_H__*/
@@ -0,0 +1,987 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "Pool.h"
+#include "Iterator.h"
+#include "Search.h"
+#include "Batch.h"
+#include "Tasks.h"
+#include "Join.h"
+#include "Snapshot.h"
+#include "Treap.h"
+#include "BTree.h"
+#include "BPlusTree.h"
+#include "RBTree.h"
+#include "AVLTree.h"
+#include "BufferedBTree.h"
+using namespace std;
+
+typedef uint32_t Key;
+typedef uint32_t Value;
+
+/**
+ * Maps an index to a key. Multiplication by an odd constant is a bijection
+ * on 32 bit integers, so distinct indices yield distinct, well spread keys
+ */
+static inline Key Scramble(uint64_t i)
+{
+  return static_cast<Key>(i * 2654435761u);
+}
+
+/**
+ * Log-linear latency histogram with constant memory. Every power of two
+ * is split into 2^kSubBits buckets, giving ~3% relative precision
+ */
+class Histogram
+{
+public:
+  Histogram()
+    : bucket(kBuckets, 0)
+    , count(0)
+    , max(0)
+  {
+  }
+
+  /**
+   * Records a single sample, in nanoseconds
+   */
+  void Add(uint64_t ns)
+  {
+    ++bucket[Index(ns)];
+    ++count;
+    max = std::max(max, ns);
+  }
+
+  /**
+   * Returns the lower bound of the bucket containing the quantile q
+   */
+  uint64_t Quantile(double q) const
+  {
+    if (count == 0)
+    {
+      return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket.size(); ++i)
+    {
+      seen += bucket[i];
+      if (seen >= rank && bucket[i] != 0)
+      {
+        return std::min(Lower(i), max);
+      }
+    }
+
+    return max;
+  }
+
+  uint64_t GetMax() const
+  {
+    return max;
+  }
+
+private:
+  static const int kSubBits = 5;
+  static const int kSub = 1 << kSubBits;
+  static const size_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+  static size_t Index(uint64_t v)
+  {
+    if (v < static_cast<uint64_t>(kSub))
+    {
+      return static_cast<size_t>(v);
+    }
+
+    int exp = 63 - __builtin_clzll(v);
+    int shift = exp - kSubBits;
+    return (shift + 1) * kSub + ((v >> shift) & (kSub - 1));
+  }
+
+  static uint64_t Lower(size_t i)
+  {
+    if (i < static_cast<size_t>(kSub))
+    {
+      return i;
+    }
+
+    int shift = static_cast<int>(i / kSub) - 1;
+    return (static_cast<uint64_t>(kSub) | (i % kSub)) << shift;
+  }
+
+  std::vector<uint64_t> bucket;
+  uint64_t count;
+  uint64_t max;
+};
+
+/**
+ * Zipfian generator over [0, n), after Gray et al. "Quickly Generating
+ * Billion-Record Synthetic Databases" (as used by YCSB)
+ */
+class Zipfian
+{
+public:
+  Zipfian(uint64_t n, double theta)
+    : n(n)
+    , theta(theta)
+  {
+    double zeta2 = 0.0;
+    zetan = 0.0;
+    for (uint64_t i = 1; i <= n; ++i)
+    {
+      zetan += 1.0 / pow(static_cast<double>(i), theta);
+      if (i == 2)
+      {
+        zeta2 = zetan;
+      }
+    }
+
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+  }
+
+  /**
+   * Returns the rank of the next item, 0 being the most popular
+   */
+  template <typename Rng>
+  uint64_t Next(Rng& rng)
+  {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    double uz = u * zetan;
+
+    if (uz < 1.0)
+    {
+      return 0;
+    }
+
+    if (uz < 1.0 + pow(0.5, theta))
+    {
+      return n > 1 ? 1 : 0;
+    }
+
+    uint64_t r = static_cast<uint64_t>(n * pow(eta * u - eta + 1.0, alpha));
+    return std::min(r, n - 1);
+  }
+
+private:
+  uint64_t n;
+  double theta;
+  double zetan;
+  double alpha;
+  double eta;
+};
+
+/**
+ * Order in which keys are requested
+ */
+enum Distribution
+{
+  SEQUENTIAL,
+  UNIFORM,
+  ZIPFIAN
+};
+
+/**
+ * Order in which the keys are loaded. Scrambled keys are spread over the
+ * whole key space; the others are the integers in [0, n), inserted in
+ * ascending or descending order, or as a sawtooth: kTeeth ascending runs
+ * over the whole range, each filling the gaps left by the previous ones
+ */
+enum Order
+{
+  SCRAMBLED,
+  ASCENDING,
+  DESCENDING,
+  SAWTOOTH
+};
+
+static const uint64_t kTeeth = 16;
+
+/**
+ * Description of a workload. The tree is loaded with n keys, then the run
+ * phase executes a mix of lookups, updates, inserts, deletes and range
+ * scans. Inserts and deletes slide a window over the key space so the tree
+ * size stays constant and every lookup hits. Batched workloads load &
+ * look keys up through InsertBatch & FindBatch, batch keys per call
+ */
+struct Workload
+{
+  const char   *name;
+  Order         load;
+  Distribution  dist;
+  int           read;
+  int           update;
+  int           insert;
+  int           remove;
+  int           scan;
+  int           batch;
+  int           miss;
+};
+
+static const Workload kWorkloads[] =
+{
+  { "sequential",    ASCENDING,  SEQUENTIAL, 100,  0,  0,  0,   0,   0,  0 },
+  { "reverse",       DESCENDING, SEQUENTIAL, 100,  0,  0,  0,   0,   0,  0 },
+  { "sawtooth",      SAWTOOTH,   SEQUENTIAL, 100,  0,  0,  0,   0,   0,  0 },
+  { "uniform",       SCRAMBLED,  UNIFORM,    100,  0,  0,  0,   0,   0,  0 },
+  { "zipfian",       SCRAMBLED,  ZIPFIAN,    100,  0,  0,  0,   0,   0,  0 },
+  { "read-heavy",    SCRAMBLED,  ZIPFIAN,     95,  5,  0,  0,   0,   0,  0 },
+  { "write-heavy",   SCRAMBLED,  UNIFORM,     50,  0, 25, 25,   0,   0,  0 },
+  { "scan",          ASCENDING,  UNIFORM,      0,  0,  0,  0, 100,   0,  0 },
+  { "uniform-batch", SCRAMBLED,  UNIFORM,    100,  0,  0,  0,   0, 256,  0 },
+  { "uniform-miss",  SCRAMBLED,  UNIFORM,    100,  0,  0,  0,   0,   0, 50 },
+};
+
+static const char *kTrees[] =
+{
+  "treap", "avl", "rb", "btree", "btree64", "bplus", "bplus4k",
+  "btree-scalar", "btree64-scalar", "bplus4k-scalar", "betree",
+  "treap-compact", "avl-compact", "rb-compact", "avl-weight"
+};
+
+/**
+ * Measurements of a single phase, passed from the worker process
+ */
+struct Result
+{
+  uint64_t ops;
+  double   seconds;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+  uint64_t height;
+  long     rss;
+};
+
+/**
+ * Benchmark settings
+ */
+struct Options
+{
+  vector<string>   trees;
+  vector<string>   workloads;
+  vector<uint64_t> sizes;
+  uint64_t         ops;
+  uint64_t         scan;
+  double           theta;
+  uint64_t         sample;
+  unsigned         seed;
+  bool             json;
+  string           output;
+  string           label;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static inline uint64_t Elapsed(Clock::time_point start, Clock::time_point end)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static long PeakRSS()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static Result Summarize(const Histogram& hist, uint64_t ops, uint64_t ns)
+{
+  Result r;
+  r.ops = ops;
+  r.seconds = ns / 1e9;
+  r.p50 = hist.Quantile(0.50);
+  r.p99 = hist.Quantile(0.99);
+  r.p999 = hist.Quantile(0.999);
+  r.max = hist.GetMax();
+  r.height = 0;
+  r.rss = PeakRSS();
+  return r;
+}
+
+/**
+ * Returns the key of the item with index i in the key space of a workload
+ */
+static inline Key KeyOf(const Workload& w, uint64_t i)
+{
+  return w.load == SCRAMBLED ? Scramble(i) : static_cast<Key>(i);
+}
+
+/**
+ * Returns the i-th of n keys loaded by a workload
+ */
+static Key LoadKey(const Workload& w, uint64_t i, uint64_t n)
+{
+  switch (w.load)
+  {
+    case DESCENDING:
+    {
+      return static_cast<Key>(n - 1 - i);
+    }
+    case SAWTOOTH:
+    {
+      // The first n % kTeeth teeth hold one key more than the others
+      uint64_t q = n / kTeeth, r = n % kTeeth, tooth, pos;
+      if (i < r * (q + 1))
+      {
+        tooth = i / (q + 1);
+        pos = i % (q + 1);
+      }
+      else
+      {
+        tooth = r + (i - r * (q + 1)) / q;
+        pos = (i - r * (q + 1)) % q;
+      }
+      return static_cast<Key>(pos * kTeeth + tooth);
+    }
+    default:
+    {
+      return KeyOf(w, i);
+    }
+  }
+}
+
+/**
+ * Runs the load & run phases of a workload against a tree
+ */
+template <typename T>
+static void Run(
+    T *tree,
+    const Workload& w,
+    uint64_t n,
+    const Options& opt,
+    Result *load,
+    Result *run)
+{
+  std::mt19937_64 rng(opt.seed);
+  volatile Value sink = 0;
+
+  // Load phase: n inserts, in the load order of the workload
+  {
+    Histogram hist;
+    Clock::time_point begin = Clock::now();
+    if (w.batch > 0)
+    {
+      vector<Key> keys(w.batch);
+      vector<Value> values(w.batch);
+      for (uint64_t i = 0; i < n; i += w.batch)
+      {
+        size_t m = std::min<uint64_t>(w.batch, n - i);
+        for (size_t j = 0; j < m; ++j)
+        {
+          keys[j] = LoadKey(w, i + j, n);
+          values[j] = static_cast<Value>(i + j);
+        }
+
+        // Every item of a batch is charged the average latency
+        Clock::time_point start = Clock::now();
+        tree->InsertBatch(&keys[0], &values[0], m);
+        uint64_t ns = Elapsed(start, Clock::now()) / m;
+        for (size_t j = 0; j < m; ++j)
+        {
+          hist.Add(ns);
+        }
+      }
+    }
+    else
+    {
+      for (uint64_t i = 0; i < n; ++i)
+      {
+        Key key = LoadKey(w, i, n);
+        bool timed = i % opt.sample == 0;
+        Clock::time_point start = timed ? Clock::now() : Clock::time_point();
+        tree->Insert(key, static_cast<Value>(i));
+        if (timed)
+        {
+          hist.Add(Elapsed(start, Clock::now()));
+        }
+      }
+    }
+    *load = Summarize(hist, n, Elapsed(begin, Clock::now()));
+    load->height = tree->GetHeight();
+  }
+
+  // Run phase: the live keys are the indices in [lo, hi)
+  {
+    Histogram hist;
+    uint64_t lo = 0, hi = n, cursor = 0;
+    Zipfian *zipf = w.dist == ZIPFIAN ? new Zipfian(n, opt.theta) : NULL;
+    std::uniform_int_distribution<int> mix(0, 99);
+
+    // Lookups of batched workloads are queued & run together
+    vector<Key> pending;
+    vector<Value *> found(w.batch);
+    auto flush = [tree, &pending, &found, &hist, &sink] ()
+    {
+      if (pending.empty())
+      {
+        return;
+      }
+
+      Clock::time_point start = Clock::now();
+      tree->FindBatch(&pending[0], pending.size(), &found[0]);
+      uint64_t ns = Elapsed(start, Clock::now()) / pending.size();
+      for (size_t j = 0; j < pending.size(); ++j)
+      {
+        sink = sink + *found[j];
+        hist.Add(ns);
+      }
+      pending.clear();
+    };
+
+    Clock::time_point begin = Clock::now();
+    for (uint64_t i = 0; i < opt.ops; ++i)
+    {
+      uint64_t idx;
+      switch (w.dist)
+      {
+        case SEQUENTIAL:
+        {
+          idx = lo + cursor;
+          cursor = cursor + 1 == hi - lo ? 0 : cursor + 1;
+          break;
+        }
+        case UNIFORM:
+        {
+          idx = lo + rng() % (hi - lo);
+          break;
+        }
+        case ZIPFIAN:
+        default:
+        {
+          idx = lo + Scramble(zipf->Next(rng)) % (hi - lo);
+          break;
+        }
+      }
+
+      if (w.miss > 0 && static_cast<int>(rng() % 100) < w.miss)
+      {
+        // Keys past the loaded range are missing
+        idx += hi - lo;
+      }
+
+      Key key = KeyOf(w, idx);
+      int op = mix(rng);
+
+      if (op < w.read && w.batch > 0)
+      {
+        pending.push_back(key);
+        if (pending.size() == static_cast<size_t>(w.batch))
+        {
+          flush();
+        }
+        continue;
+      }
+
+      bool timed = i % opt.sample == 0;
+      Clock::time_point start = timed ? Clock::now() : Clock::time_point();
+      if (op < w.read)
+      {
+        Value *value = tree->TryFind(key);
+        if (value)
+        {
+          sink = sink + *value;
+        }
+      }
+      else if ((op -= w.read) < w.update)
+      {
+        tree->Insert(key, static_cast<Value>(i));
+      }
+      else if ((op -= w.update) < w.scan)
+      {
+        Key end = static_cast<Key>(key + opt.scan);
+        tree->Range(key, end, [&sink] (const Key&, Value& value)
+        {
+          sink = sink + value;
+        });
+      }
+      else if ((op -= w.scan) < w.insert)
+      {
+        Key fresh = KeyOf(w, hi);
+        tree->Insert(fresh, static_cast<Value>(i));
+        ++hi;
+      }
+      else
+      {
+        Key old = KeyOf(w, lo);
+        if (hi - lo > 1)
+        {
+          tree->Delete(old);
+          ++lo;
+          cursor = 0;
+        }
+      }
+      if (timed)
+      {
+        hist.Add(Elapsed(start, Clock::now()));
+      }
+    }
+    flush();
+    *run = Summarize(hist, opt.ops, Elapsed(begin, Clock::now()));
+    delete zipf;
+  }
+
+  run->height = tree->GetHeight();
+}
+
+/**
+ * Loads a tree & runs a workload on it. Runner<T> calls the tree directly,
+ * so the compiler can inline its methods, while VirtualRunner<T> goes
+ * through the virtual Tree interface
+ */
+typedef void (*RunFn)(const Workload&, uint64_t, const Options&, Result *, Result *);
+
+template <typename T>
+static void Runner(const Workload& w, uint64_t n, const Options& opt, Result *load, Result *run)
+{
+  Run(new T(), w, n, opt, load, run);
+}
+
+template <typename T>
+static void VirtualRunner(const Workload& w, uint64_t n, const Options& opt, Result *load, Result *run)
+{
+  Tree<Key, Value> *tree = new VirtualTree<T>();
+  Run(tree, w, n, opt, load, run);
+}
+
+template <typename T>
+static RunFn Pick(bool virt)
+{
+  return virt ? VirtualRunner<T> : Runner<T>;
+}
+
+/**
+ * Returns the runner of a tree by name. A "-virtual" suffix selects the
+ * virtual interface
+ */
+static RunFn MakeRunner(const string& name)
+{
+  static const string kSuffix = "-virtual";
+  bool virt = name.size() > kSuffix.size() &&
+      name.compare(name.size() - kSuffix.size(), kSuffix.size(), kSuffix) == 0;
+  string base = virt ? name.substr(0, name.size() - kSuffix.size()) : name;
+
+  if (base == "treap")
+  {
+    return Pick<Treap<Key, Value>>(virt);
+  }
+
+  if (base == "avl")
+  {
+    return Pick<AVLTree<Key, Value>>(virt);
+  }
+
+  if (base == "rb")
+  {
+    return Pick<RBTree<Key, Value>>(virt);
+  }
+
+  if (base == "treap-compact")
+  {
+    return Pick<Treap<Key, Value, std::less<Key>, CompactNodes>>(virt);
+  }
+
+  if (base == "avl-compact")
+  {
+    return Pick<AVLTree<Key, Value, std::less<Key>, CompactNodes>>(virt);
+  }
+
+  if (base == "rb-compact")
+  {
+    return Pick<RBTree<Key, Value, std::less<Key>, CompactNodes>>(virt);
+  }
+
+  if (base == "avl-weight")
+  {
+    return Pick<AVLTree<Key, Value, std::less<Key>, WideNodes, WeightBalance>>(virt);
+  }
+
+  if (base == "btree")
+  {
+    return Pick<BTree<Key, Value, 16>>(virt);
+  }
+
+  if (base == "btree64")
+  {
+    return Pick<BTree<Key, Value, 64>>(virt);
+  }
+
+  if (base == "btree-scalar")
+  {
+    return Pick<BTree<Key, Value, 16, ScalarSearch<Key>>>(virt);
+  }
+
+  if (base == "btree64-scalar")
+  {
+    return Pick<BTree<Key, Value, 64, ScalarSearch<Key>>>(virt);
+  }
+
+  if (base == "bplus")
+  {
+    return Pick<BPlusTree<Key, Value, 256>>(virt);
+  }
+
+  if (base == "bplus4k")
+  {
+    return Pick<BPlusTree<Key, Value, 4096>>(virt);
+  }
+
+  if (base == "bplus4k-scalar")
+  {
+    return Pick<BPlusTree<Key, Value, 4096, ScalarSearch<Key>>>(virt);
+  }
+
+  if (base == "betree")
+  {
+    return Pick<BufferedBTree<Key, Value>>(virt);
+  }
+
+  return NULL;
+}
+
+/**
+ * Runs a single configuration in a child process, so peak RSS is
+ * attributed to one tree only
+ */
+static bool Fork(
+    const string& name,
+    const Workload& w,
+    uint64_t n,
+    const Options& opt,
+    Result *results)
+{
+  int fd[2];
+  if (pipe(fd) < 0)
+  {
+    throw std::runtime_error("Cannot create pipe");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    throw std::runtime_error("Cannot fork");
+  }
+
+  if (pid == 0)
+  {
+    close(fd[0]);
+    int status = 0;
+    try
+    {
+      MakeRunner(name)(w, n, opt, &results[0], &results[1]);
+      if (write(fd[1], results, 2 * sizeof(Result)) != 2 * sizeof(Result))
+      {
+        status = 1;
+      }
+    }
+    catch (std::exception& e)
+    {
+      cerr << name << "/" << w.name << "/" << n << ": " << e.what() << endl;
+      status = 1;
+    }
+    close(fd[1]);
+    _exit(status);
+  }
+
+  close(fd[1]);
+  ssize_t total = 0, count;
+  char *buffer = reinterpret_cast<char *>(results);
+  while ((count = read(fd[0], buffer + total, 2 * sizeof(Result) - total)) > 0)
+  {
+    total += count;
+  }
+  close(fd[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return total == 2 * sizeof(Result) && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+/**
+ * Writes a row of results
+ */
+static void Emit(
+    FILE *out,
+    const Options& opt,
+    const string& tree,
+    const Workload& w,
+    uint64_t n,
+    const char *phase,
+    const Result& r,
+    bool first)
+{
+  double rate = r.seconds > 0 ? r.ops / r.seconds : 0.0;
+  if (opt.json)
+  {
+    fprintf(out,
+        "%s  {\"label\": \"%s\", \"tree\": \"%s\", \"workload\": \"%s\", "
+        "\"size\": %llu, \"phase\": \"%s\", \"ops\": %llu, "
+        "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_ns\": %llu, "
+        "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, "
+        "\"height\": %llu, \"peak_rss_kb\": %ld}",
+        first ? "" : ",\n",
+        opt.label.c_str(), tree.c_str(), w.name,
+        (unsigned long long)n, phase, (unsigned long long)r.ops,
+        r.seconds, rate, (unsigned long long)r.p50,
+        (unsigned long long)r.p99, (unsigned long long)r.p999,
+        (unsigned long long)r.max, (unsigned long long)r.height, r.rss);
+  }
+  else
+  {
+    fprintf(out, "%s,%s,%s,%llu,%s,%llu,%.6f,%.1f,%llu,%llu,%llu,%llu,%llu,%ld\n",
+        opt.label.c_str(), tree.c_str(), w.name,
+        (unsigned long long)n, phase, (unsigned long long)r.ops,
+        r.seconds, rate, (unsigned long long)r.p50,
+        (unsigned long long)r.p99, (unsigned long long)r.p999,
+        (unsigned long long)r.max, (unsigned long long)r.height, r.rss);
+  }
+  fflush(out);
+}
+
+/**
+ * Splits a comma-separated list
+ */
+static vector<string> Split(const string& str)
+{
+  vector<string> items;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ','))
+  {
+    if (!item.empty())
+    {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+static void Usage(const char *argv0)
+{
+  cerr
+    << "Usage: " << argv0 << " [options]\n"
+    << "  --trees LIST      treap,avl,rb,btree,btree64,bplus,bplus4k,\n"
+    << "                    btree-scalar,btree64-scalar,bplus4k-scalar,betree,\n"
+    << "                    treap-compact,avl-compact,rb-compact,avl-weight\n"
+    << "                    (default: all); a -virtual suffix, e.g. avl-virtual,\n"
+    << "                    calls the tree through the virtual interface\n"
+    << "  --workloads LIST  sequential,reverse,sawtooth,uniform,zipfian,\n"
+    << "                    read-heavy,write-heavy,scan,uniform-batch,\n"
+    << "                    uniform-miss (default: all)\n"
+    << "  --sizes LIST      tree sizes, e.g. 1e3,1e5,1e8 (default: 1e3,1e4,1e5,1e6)\n"
+    << "  --ops N           operations in the run phase (default: 1e6)\n"
+    << "  --scan N          keys covered by each range scan (default: 100)\n"
+    << "  --theta X         zipfian skew (default: 0.99)\n"
+    << "  --sample N        time one operation in N, leaving the others free of\n"
+    << "                    clock reads (default: 1)\n"
+    << "  --seed N          random seed (default: 1)\n"
+    << "  --format FMT      csv or json (default: csv)\n"
+    << "  --output PATH     output file (default: stdout)\n"
+    << "  --label STR       label attached to every row, e.g. a commit hash\n";
+}
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  opt.trees.assign(kTrees, kTrees + sizeof(kTrees) / sizeof(kTrees[0]));
+  for (size_t i = 0; i < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++i)
+  {
+    opt.workloads.push_back(kWorkloads[i].name);
+  }
+  opt.sizes.push_back(1000);
+  opt.sizes.push_back(10000);
+  opt.sizes.push_back(100000);
+  opt.sizes.push_back(1000000);
+  opt.ops = 1000000;
+  opt.scan = 100;
+  opt.theta = 0.99;
+  opt.sample = 1;
+  opt.seed = 1;
+  opt.json = false;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "-h" || arg == "--help")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+
+    if (i + 1 >= argc)
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    string val = argv[++i];
+    if (arg == "--trees")
+    {
+      opt.trees = Split(val);
+    }
+    else if (arg == "--workloads")
+    {
+      opt.workloads = Split(val);
+    }
+    else if (arg == "--sizes")
+    {
+      vector<string> sizes = Split(val);
+      opt.sizes.clear();
+      for (size_t j = 0; j < sizes.size(); ++j)
+      {
+        opt.sizes.push_back(static_cast<uint64_t>(atof(sizes[j].c_str())));
+      }
+    }
+    else if (arg == "--ops")
+    {
+      opt.ops = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--scan")
+    {
+      opt.scan = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--theta")
+    {
+      opt.theta = atof(val.c_str());
+    }
+    else if (arg == "--sample")
+    {
+      opt.sample = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--seed")
+    {
+      opt.seed = static_cast<unsigned>(atoi(val.c_str()));
+    }
+    else if (arg == "--format")
+    {
+      opt.json = val == "json";
+    }
+    else if (arg == "--output")
+    {
+      opt.output = val;
+    }
+    else if (arg == "--label")
+    {
+      opt.label = val;
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (size_t i = 0; i < opt.trees.size(); ++i)
+  {
+    if (!MakeRunner(opt.trees[i]))
+    {
+      cerr << "Unknown tree: " << opt.trees[i] << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  vector<const Workload *> workloads;
+  for (size_t i = 0; i < opt.workloads.size(); ++i)
+  {
+    const Workload *w = NULL;
+    for (size_t j = 0; j < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++j)
+    {
+      if (opt.workloads[i] == kWorkloads[j].name)
+      {
+        w = &kWorkloads[j];
+      }
+    }
+
+    if (!w)
+    {
+      cerr << "Unknown workload: " << opt.workloads[i] << endl;
+      return EXIT_FAILURE;
+    }
+    workloads.push_back(w);
+  }
+
+  for (size_t i = 0; i < opt.sizes.size(); ++i)
+  {
+    if (opt.sizes[i] == 0 || opt.sizes[i] > 0xFFFFFFFFull)
+    {
+      cerr << "Invalid size: " << opt.sizes[i] << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opt.sample == 0)
+  {
+    cerr << "Invalid sample rate: " << opt.sample << endl;
+    return EXIT_FAILURE;
+  }
+
+  FILE *out = stdout;
+  if (!opt.output.empty() && !(out = fopen(opt.output.c_str(), "w")))
+  {
+    cerr << "Cannot open " << opt.output << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (opt.json)
+  {
+    fprintf(out, "[\n");
+  }
+  else
+  {
+    fprintf(out, "label,tree,workload,size,phase,ops,seconds,ops_per_sec,"
+                 "p50_ns,p99_ns,p999_ns,max_ns,height,peak_rss_kb\n");
+  }
+
+  bool first = true, ok = true;
+  for (size_t s = 0; s < opt.sizes.size(); ++s)
+  {
+    for (size_t w = 0; w < workloads.size(); ++w)
+    {
+      for (size_t t = 0; t < opt.trees.size(); ++t)
+      {
+        Result results[2];
+        if (!Fork(opt.trees[t], *workloads[w], opt.sizes[s], opt, results))
+        {
+          cerr << "Failed: " << opt.trees[t] << "/" << workloads[w]->name
+               << "/" << opt.sizes[s] << endl;
+          ok = false;
+          continue;
+        }
+
+        Emit(out, opt, opt.trees[t], *workloads[w], opt.sizes[s], "load",
+             results[0], first);
+        first = false;
+        Emit(out, opt, opt.trees[t], *workloads[w], opt.sizes[s], "run",
+             results[1], first);
+      }
+    }
+  }
+
+  if (opt.json)
+  {
+    fprintf(out, "\n]\n");
+  }
+
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
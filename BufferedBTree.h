@@ -0,0 +1,1153 @@
+#ifndef __BUFFEREDBTREE_H__
+#define __BUFFEREDBTREE_H__
+
+/**
+ * Write-optimised BTree (B-epsilon tree). Internal nodes carry a buffer of
+ * pending messages, upserts & tombstones, sorted by key. Writes land in
+ * the buffer of the root; when a buffer overflows, the messages bound for
+ * the child which receives the most of them move down in a single batch,
+ * so the walk to the leaves is paid once per batch rather than once per
+ * key. Lookups check the buffers on their path before the leaf: a message
+ * higher up is newer than anything below it.
+ *
+ * Insert is blind, it never looks the key up. Delete, Erase, Emplace &
+ * TryEmplace do, since they report whether the key was present. The size,
+ * iterators & range queries need all items in the leaves, so they flush
+ * the buffers first; GetSize is only cheap while nothing is pending.
+ *
+ * @tparam Key    Key types, must support total ordering
+ * @tparam Value  Value types
+ * @tparam F      Maximal number of children of an internal node
+ * @tparam M      Maximal number of messages in a buffer & items in a leaf
+ */
+template <typename Key, typename Value, int F = 8, int M = 512>
+class BufferedBTree : public TreeBase<BufferedBTree<Key, Value, F, M>, Key, Value>
+{
+  static_assert(F >= 8, "Internal nodes need at least 8 children");
+  static_assert(M >= 8, "Buffers & leaves need at least 8 entries");
+
+  struct Node;
+
+public:
+  /**
+   * Bidirectional iterator over the items, in key order. Steps follow the
+   * leaf chain. Iterators are invalidated by modifications of the tree
+   */
+  class Iterator
+  {
+  public:
+    const Key& GetKey() const
+    {
+      return leaf->key[i];
+    }
+
+    Value& GetValue() const
+    {
+      return leaf->value[i];
+    }
+
+    Iterator& operator ++ ()
+    {
+      ++i;
+      Skip();
+      return *this;
+    }
+
+    Iterator& operator -- ()
+    {
+      Node *node = leaf ? leaf : tree->Last();
+      if (leaf && i > 0)
+      {
+        --i;
+        return *this;
+      }
+
+      if (leaf)
+      {
+        node = leaf->prev;
+      }
+      while (node && node->key.empty())
+      {
+        node = node->prev;
+      }
+      leaf = node;
+      i = node ? node->key.size() - 1 : 0;
+      return *this;
+    }
+
+    Iterator operator ++ (int)
+    {
+      Iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    Iterator operator -- (int)
+    {
+      Iterator it(*this);
+      --*this;
+      return it;
+    }
+
+    bool operator == (const Iterator& that) const
+    {
+      return leaf == that.leaf && (!leaf || i == that.i);
+    }
+
+    bool operator != (const Iterator& that) const
+    {
+      return !(*this == that);
+    }
+
+  private:
+    friend class BufferedBTree;
+
+    Iterator(Node *leaf, size_t i, BufferedBTree *tree)
+      : leaf(leaf)
+      , i(i)
+      , tree(tree)
+    {
+      Skip();
+    }
+
+    /**
+     * Moves past the end of the current leaf, & past empty leaves
+     */
+    void Skip()
+    {
+      while (leaf && i >= leaf->key.size())
+      {
+        leaf = leaf->next;
+        i = 0;
+      }
+    }
+
+    /**
+     * Current leaf, NULL past the end
+     */
+    Node *leaf;
+
+    /**
+     * Index of the current item in the leaf
+     */
+    size_t i;
+
+    /**
+     * Tree being iterated, used to step back from the end
+     */
+    BufferedBTree *tree;
+  };
+
+  /**
+   * Creates a new tree
+   */
+  BufferedBTree()
+    : root(new Node(true))
+    , size(0)
+    , pending(0)
+    , height(1)
+    , nodeCount(1)
+    , leafCount(1)
+  {
+    counters.Add(&Counters::allocs);
+  }
+
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  BufferedBTree(It begin, It end)
+    : root(new Node(true))
+    , size(0)
+    , pending(0)
+    , height(1)
+    , nodeCount(1)
+    , leafCount(1)
+  {
+    counters.Add(&Counters::allocs);
+    try
+    {
+      BulkLoad(begin, end);
+    }
+    catch (...)
+    {
+      Destroy(root);
+      throw;
+    }
+  }
+
+  /**
+   * Destroys the tree
+   */
+  ~BufferedBTree()
+  {
+    Destroy(root);
+  }
+
+  /**
+   * Inserts a value into the tree, without looking the key up
+   */
+  void Insert(const Key& key, const Value& value)
+  {
+    Put(key, value, false);
+  }
+
+  /**
+   * Inserts a value into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Put(std::move(key), std::move(value), false);
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    if (Value *value = TryFind(key))
+    {
+      this->Assign(*value, std::forward<Args>(args)...);
+      return false;
+    }
+
+    Put(std::forward<K>(key), Value(std::forward<Args>(args)...), false);
+    return true;
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    if (TryFind(key))
+    {
+      return false;
+    }
+
+    Put(std::forward<K>(key), Value(std::forward<Args>(args)...), false);
+    return true;
+  }
+
+  /**
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. Leaves & internal nodes are packed bottom-up,
+   * with empty buffers, in O(n)
+   */
+  template <typename It>
+  void BulkLoad(It begin, It end)
+  {
+    if (GetSize() != 0)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+
+    size_t n = this->CountSorted(begin, end);
+    if (n == 0)
+    {
+      return;
+    }
+
+    // Build the leaves, reusing the empty root as the first one
+    std::vector<Key> seps;
+    std::vector<Node *> nodes;
+    size_t count = (n + M - 1) / M, base = n / count, extra = n % count;
+    for (size_t g = 0; g < count; ++g)
+    {
+      Node *leaf = g == 0 ? root : new Node(true);
+      counters.Add(&Counters::allocs, g > 0);
+      for (size_t i = 0; i < base + (g < extra); ++i, ++begin)
+      {
+        leaf->key.push_back(begin->first);
+        leaf->value.push_back(begin->second);
+      }
+
+      if (g > 0)
+      {
+        nodes.back()->next = leaf;
+        leaf->prev = nodes.back();
+        seps.push_back(leaf->key[0]);
+      }
+      nodes.push_back(leaf);
+    }
+    nodeCount = leafCount = count;
+
+    // Build the internal levels out of the separators
+    while (nodes.size() > 1)
+    {
+      std::vector<Key> upSeps;
+      std::vector<Node *> up;
+      size_t s = 0, c = 0;
+      count = (nodes.size() + F - 1) / F;
+      base = nodes.size() / count;
+      extra = nodes.size() % count;
+      for (size_t g = 0; g < count; ++g)
+      {
+        counters.Add(&Counters::allocs);
+        Node *node = new Node(false);
+        for (size_t i = 0; i < base + (g < extra); ++i)
+        {
+          if (i > 0)
+          {
+            node->key.push_back(std::move(seps[s++]));
+          }
+          node->child.push_back(nodes[c++]);
+        }
+        up.push_back(node);
+
+        if (g + 1 < count)
+        {
+          upSeps.push_back(std::move(seps[s++]));
+        }
+      }
+
+      nodeCount += up.size();
+      nodes.swap(up);
+      seps.swap(upSeps);
+      ++height;
+    }
+
+    root = nodes[0];
+    size = n;
+  }
+
+  /**
+   * Deletes an entry from the tree
+   */
+  void Delete(const Key& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an entry from the tree if the key is present. The key is
+   * looked up, then a tombstone is buffered
+   * @return True if an entry was removed
+   */
+  bool Erase(const Key& key)
+  {
+    if (!TryFind(key))
+    {
+      return false;
+    }
+
+    Put(key, Value(), true);
+    return true;
+  }
+
+  /**
+   * Finds a value in the tree
+   */
+  Value& Find(const Key& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Finds a value in the tree without throwing if the key is missing. The
+   * value may live in a buffer, until the message holding it moves down
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  Value *TryFind(const Key& key)
+  {
+    // Internal nodes take two searches: the buffer, then the separators
+    Node *node = root;
+    counters.Add(&Counters::finds);
+    for (; !node->leaf; node = node->child[ChildIndex(node, key)])
+    {
+      counters.Add(&Counters::visits);
+      counters.Add(&Counters::searches, 2);
+      Buffer& buffer = node->buffer;
+      size_t i = LowerBound(buffer.key, key);
+      if (i < buffer.key.size() && !(key < buffer.key[i]))
+      {
+        return buffer.erase[i] ? NULL : &buffer.value[i];
+      }
+    }
+
+    counters.Add(&Counters::visits);
+    counters.Add(&Counters::searches);
+    size_t i = LowerBound(node->key, key);
+    if (i < node->key.size() && !(key < node->key[i]))
+    {
+      return &node->value[i];
+    }
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  bool Contains(const Key& key)
+  {
+    return TryFind(key) != NULL;
+  }
+
+  /**
+   * Moves all pending messages down to the leaves
+   */
+  void Flush()
+  {
+    if (pending > 0)
+    {
+      FlushAll(root);
+      FixRoot();
+    }
+  }
+
+  /**
+   * Removes all items & pending messages, without flushing them
+   */
+  void Clear()
+  {
+    Destroy(root);
+    counters.Add(&Counters::allocs);
+    root = new Node(true);
+    size = pending = 0;
+    height = nodeCount = leafCount = 1;
+  }
+
+  /**
+   * Returns an iterator to the smallest item, after a flush
+   */
+  Iterator Begin()
+  {
+    Flush();
+    Node *node = root;
+    while (!node->leaf)
+    {
+      node = node->child[0];
+    }
+    return Iterator(node, 0, this);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator(NULL, 0, this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key,
+   * after a flush
+   */
+  Iterator LowerBound(const Key& key)
+  {
+    Node *leaf = FindLeaf(key);
+    return Iterator(leaf, LowerBound(leaf->key, key), this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key,
+   * after a flush
+   */
+  Iterator UpperBound(const Key& key)
+  {
+    Node *leaf = FindLeaf(key);
+    return Iterator(leaf, UpperBound(leaf->key, key), this);
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order,
+   * after a flush
+   */
+  template <typename Fn>
+  void Range(const Key& lo, const Key& hi, Fn fn)
+  {
+    Node *leaf = FindLeaf(lo);
+    for (size_t i = LowerBound(leaf->key, lo); leaf; leaf = leaf->next, i = 0)
+    {
+      for (; i < leaf->key.size(); ++i)
+      {
+        if (!(leaf->key[i] < hi))
+        {
+          return;
+        }
+
+        fn(leaf->key[i], leaf->value[i]);
+      }
+    }
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
+  }
+
+  /**
+   * Returns the number of items in the tree, after a flush
+   */
+  size_t GetSize()
+  {
+    Flush();
+    return size;
+  }
+
+  /**
+   * Returns the height of the tree. All leaves are on the same level,
+   * so it only changes when the root is split or collapsed
+   */
+  size_t GetHeight()
+  {
+    return height;
+  }
+
+  /**
+   * Returns the structural statistics of the tree, in O(1), without
+   * flushing. Items in leaves all lie at the depth of the leaves. Bytes
+   * are estimated from the entries, leaving out the spare capacity of the
+   * vectors in the nodes
+   */
+  Stats GetStats()
+  {
+    size_t inner = nodeCount - leafCount;
+    Stats stats;
+    stats.nodes = nodeCount;
+    stats.fill = static_cast<double>(size) / (leafCount * M);
+    stats.depth = size ? static_cast<double>(height) : 0.0;
+    stats.bytes = nodeCount * sizeof(Node) +
+        (size + pending) * (sizeof(Key) + sizeof(Value)) + pending +
+        (nodeCount - 1) * sizeof(Node *) + (nodeCount - 1 - inner) * sizeof(Key);
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return counters.Get();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset();
+  }
+
+private:
+  /**
+   * Pending messages, sorted by key, at most one per key. A tombstone
+   * deletes its key, any other message inserts or replaces it
+   */
+  struct Buffer
+  {
+    std::vector<Key>   key;
+    std::vector<Value> value;
+    std::vector<char>  erase;
+  };
+
+  /**
+   * Leaves hold the items & are linked to their siblings. Internal nodes
+   * hold n children, n - 1 separators & a buffer; all keys in child[i + 1]
+   * are greater than or equal to key[i]
+   */
+  struct Node
+  {
+    explicit Node(bool leaf)
+      : leaf(leaf)
+      , prev(NULL)
+      , next(NULL)
+    {
+    }
+
+    bool                leaf;
+    std::vector<Key>    key;
+    std::vector<Value>  value;
+    std::vector<Node *> child;
+    Buffer              buffer;
+    Node               *prev;
+    Node               *next;
+  };
+
+  /**
+   * Returns the index of the first key in keys not less than key
+   */
+  static size_t LowerBound(const std::vector<Key>& keys, const Key& key)
+  {
+    return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+  }
+
+  /**
+   * Returns the index of the first key in keys greater than key
+   */
+  static size_t UpperBound(const std::vector<Key>& keys, const Key& key)
+  {
+    return std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+  }
+
+  /**
+   * Returns the index of the child of an internal node covering key
+   */
+  static size_t ChildIndex(Node *node, const Key& key)
+  {
+    return UpperBound(node->key, key);
+  }
+
+  /**
+   * Returns the number of entries of a node, items or children
+   */
+  static size_t Fill(Node *node)
+  {
+    return node->leaf ? node->key.size() : node->child.size();
+  }
+
+  /**
+   * Returns the maximal number of entries of a node
+   */
+  static size_t Capacity(Node *node)
+  {
+    return node->leaf ? M : F;
+  }
+
+  /**
+   * Adds a message to the tree: to the root buffer, which is flushed if it
+   * overflows, or straight to the root if it is a leaf
+   */
+  template <typename K, typename V>
+  void Put(K&& key, V&& value, bool erase)
+  {
+    Node *node = root;
+    if (node->leaf)
+    {
+      size_t i = LowerBound(node->key, key);
+      bool found = i < node->key.size() && !(key < node->key[i]);
+      if (erase && found)
+      {
+        node->key.erase(node->key.begin() + i);
+        node->value.erase(node->value.begin() + i);
+        --size;
+      }
+      else if (!erase && found)
+      {
+        node->value[i] = std::forward<V>(value);
+      }
+      else if (!erase)
+      {
+        node->key.insert(node->key.begin() + i, Key(std::forward<K>(key)));
+        node->value.insert(node->value.begin() + i, Value(std::forward<V>(value)));
+        ++size;
+      }
+    }
+    else
+    {
+      Buffer& buffer = node->buffer;
+      size_t i = LowerBound(buffer.key, key);
+      if (i < buffer.key.size() && !(key < buffer.key[i]))
+      {
+        buffer.value[i] = std::forward<V>(value);
+        buffer.erase[i] = erase;
+      }
+      else
+      {
+        buffer.key.insert(buffer.key.begin() + i, Key(std::forward<K>(key)));
+        buffer.value.insert(buffer.value.begin() + i, Value(std::forward<V>(value)));
+        buffer.erase.insert(buffer.erase.begin() + i, erase);
+        ++pending;
+      }
+      Drain(node);
+    }
+    FixRoot();
+  }
+
+  /**
+   * Splits the root while it overflows & collapses it while it is an
+   * internal node with a single child & nothing buffered. Once everything
+   * is deleted, the remaining empty nodes are dropped
+   */
+  void FixRoot()
+  {
+    if (size == 0 && pending == 0 && !root->leaf)
+    {
+      Destroy(root);
+      counters.Add(&Counters::allocs);
+      root = new Node(true);
+      height = nodeCount = leafCount = 1;
+    }
+
+    while (Fill(root) > Capacity(root))
+    {
+      counters.Add(&Counters::allocs);
+      Node *top = new Node(false);
+      ++nodeCount;
+      top->child.push_back(root);
+      root = top;
+      Split(root, 0);
+      ++height;
+    }
+
+    while (!root->leaf && root->child.size() == 1 && root->buffer.key.empty())
+    {
+      Node *node = root;
+      root = node->child[0];
+      counters.Add(&Counters::frees);
+      delete node;
+      --nodeCount;
+      --height;
+    }
+  }
+
+  /**
+   * Flushes the buffer of an internal node until it fits
+   */
+  void Drain(Node *node)
+  {
+    while (node->buffer.key.size() > static_cast<size_t>(M))
+    {
+      FlushChild(node, Busiest(node));
+    }
+  }
+
+  /**
+   * Flushes everything buffered in a subtree. Joins may pull unflushed
+   * buffers into a child already visited, even when a split follows and
+   * the number of children stays the same, so the scan restarts after them
+   */
+  void FlushAll(Node *node)
+  {
+    if (node->leaf)
+    {
+      return;
+    }
+
+    while (!node->buffer.key.empty())
+    {
+      FlushChild(node, Busiest(node));
+    }
+
+    for (size_t c = 0; c < node->child.size(); ++c)
+    {
+      if (node->child[c]->leaf)
+      {
+        continue;
+      }
+
+      FlushAll(node->child[c]);
+      if (Rebalance(node, c))
+      {
+        c = static_cast<size_t>(-1);
+      }
+    }
+  }
+
+  /**
+   * Returns the child of an internal node with the most messages bound
+   * for it. The messages for each child form a run of the sorted buffer
+   */
+  static size_t Busiest(Node *node)
+  {
+    const std::vector<Key>& keys = node->buffer.key;
+    size_t best = 0, most = 0, lo = 0;
+    for (size_t c = 0; c < node->child.size(); ++c)
+    {
+      size_t hi = c < node->key.size() ? LowerBound(keys, node->key[c]) : keys.size();
+      if (hi - lo > most)
+      {
+        best = c;
+        most = hi - lo;
+      }
+      lo = hi;
+    }
+    return best;
+  }
+
+  /**
+   * Moves the messages bound for child c of an internal node down into it,
+   * then rebalances the child
+   */
+  void FlushChild(Node *node, size_t c)
+  {
+    Buffer& buffer = node->buffer;
+    size_t lo = c > 0 ? LowerBound(buffer.key, node->key[c - 1]) : 0;
+    size_t hi = c < node->key.size() ? LowerBound(buffer.key, node->key[c]) : buffer.key.size();
+
+    Node *child = node->child[c];
+    if (child->leaf)
+    {
+      Apply(child, buffer, lo, hi);
+    }
+    else
+    {
+      Merge(child->buffer, buffer, lo, hi);
+      Drain(child);
+    }
+
+    buffer.key.erase(buffer.key.begin() + lo, buffer.key.begin() + hi);
+    buffer.value.erase(buffer.value.begin() + lo, buffer.value.begin() + hi);
+    buffer.erase.erase(buffer.erase.begin() + lo, buffer.erase.begin() + hi);
+    Rebalance(node, c);
+  }
+
+  /**
+   * Merges the messages in [lo, hi) of src into dst. They are newer, so
+   * they replace the messages of dst for the same keys. The merge runs
+   * backwards, in place, from the end of the grown buffer
+   */
+  void Merge(Buffer& dst, Buffer& src, size_t lo, size_t hi)
+  {
+    size_t i = dst.key.size(), j = hi, w = i + hi - lo;
+    dst.key.resize(w);
+    dst.value.resize(w);
+    dst.erase.resize(w);
+
+    while (j > lo)
+    {
+      --w;
+      if (i > 0 && src.key[j - 1] < dst.key[i - 1])
+      {
+        --i;
+        Shift(dst, i, w);
+        continue;
+      }
+
+      if (i > 0 && !(dst.key[i - 1] < src.key[j - 1]))
+      {
+        --i;
+        --pending;
+      }
+      --j;
+      dst.key[w] = std::move(src.key[j]);
+      dst.value[w] = std::move(src.value[j]);
+      dst.erase[w] = src.erase[j];
+    }
+
+    // Messages in [i, w) were replaced
+    dst.key.erase(dst.key.begin() + i, dst.key.begin() + w);
+    dst.value.erase(dst.value.begin() + i, dst.value.begin() + w);
+    dst.erase.erase(dst.erase.begin() + i, dst.erase.begin() + w);
+  }
+
+  /**
+   * Moves message i of a buffer to position w
+   */
+  static void Shift(Buffer& buffer, size_t i, size_t w)
+  {
+    if (i != w)
+    {
+      buffer.key[w] = std::move(buffer.key[i]);
+      buffer.value[w] = std::move(buffer.value[i]);
+      buffer.erase[w] = buffer.erase[i];
+    }
+  }
+
+  /**
+   * Applies the messages in [lo, hi) of src to the items of a leaf. As in
+   * Merge, the leaf grows by the number of upserts & is filled backwards
+   */
+  void Apply(Node *leaf, Buffer& src, size_t lo, size_t hi)
+  {
+    size_t i = leaf->key.size(), j = hi;
+    size_t w = i + std::count(src.erase.begin() + lo, src.erase.begin() + hi, 0);
+    leaf->key.resize(w);
+    leaf->value.resize(w);
+
+    while (j > lo)
+    {
+      if (i > 0 && src.key[j - 1] < leaf->key[i - 1])
+      {
+        --i;
+        --w;
+        if (i != w)
+        {
+          leaf->key[w] = std::move(leaf->key[i]);
+          leaf->value[w] = std::move(leaf->value[i]);
+        }
+        continue;
+      }
+
+      bool found = i > 0 && !(leaf->key[i - 1] < src.key[j - 1]);
+      i -= found;
+      --j;
+      if (src.erase[j])
+      {
+        size -= found;
+      }
+      else
+      {
+        --w;
+        leaf->key[w] = std::move(src.key[j]);
+        leaf->value[w] = std::move(src.value[j]);
+        size += !found;
+      }
+    }
+
+    // Items in [i, w) were replaced or deleted
+    leaf->key.erase(leaf->key.begin() + i, leaf->key.begin() + w);
+    leaf->value.erase(leaf->value.begin() + i, leaf->value.begin() + w);
+    pending -= hi - lo;
+  }
+
+  /**
+   * Restores the bounds of child c of an internal node: joins it with a
+   * sibling once it falls under a quarter of its capacity & splits it
+   * once it exceeds its capacity
+   * @return True if the child was joined with a sibling
+   */
+  bool Rebalance(Node *node, size_t c)
+  {
+    Node *child = node->child[c];
+    bool joined = Fill(child) < Capacity(child) / 4 && node->child.size() > 1;
+    if (joined)
+    {
+      if (c + 1 == node->child.size())
+      {
+        --c;
+      }
+
+      Join(node, c);
+      child = node->child[c];
+      if (!child->leaf)
+      {
+        Drain(child);
+      }
+    }
+
+    if (Fill(child) > Capacity(child))
+    {
+      Split(node, c);
+    }
+    return joined;
+  }
+
+  /**
+   * Joins children c & c + 1 of an internal node. Buffers of siblings cover
+   * disjoint key ranges, so they are simply concatenated
+   */
+  void Join(Node *node, size_t c)
+  {
+    counters.Add(&Counters::joins);
+    Node *left = node->child[c], *right = node->child[c + 1];
+    if (left->leaf)
+    {
+      Append(left->key, right->key);
+      Append(left->value, right->value);
+      left->next = right->next;
+      if (right->next)
+      {
+        right->next->prev = left;
+      }
+    }
+    else
+    {
+      left->key.push_back(std::move(node->key[c]));
+      Append(left->key, right->key);
+      Append(left->child, right->child);
+      Append(left->buffer.key, right->buffer.key);
+      Append(left->buffer.value, right->buffer.value);
+      Append(left->buffer.erase, right->buffer.erase);
+    }
+
+    node->key.erase(node->key.begin() + c);
+    node->child.erase(node->child.begin() + c + 1);
+    --nodeCount;
+    leafCount -= right->leaf;
+    counters.Add(&Counters::frees);
+    delete right;
+  }
+
+  /**
+   * Splits child c of an internal node into as many nodes as needed to fit
+   * its entries, evenly
+   */
+  void Split(Node *node, size_t c)
+  {
+    counters.Add(&Counters::splits);
+    Node *x = node->child[c];
+    size_t n = Fill(x), parts = (n + Capacity(x) - 1) / Capacity(x);
+    size_t base = n / parts, extra = n % parts;
+
+    // Entries of part p start at bound[p]
+    std::vector<size_t> bound(1, 0);
+    for (size_t p = 0; p < parts; ++p)
+    {
+      bound.push_back(bound.back() + base + (p < extra));
+    }
+
+    // Messages of part p start at cut[p], before anything is moved
+    std::vector<size_t> cut(1, 0);
+    for (size_t p = 1; p < parts && !x->leaf; ++p)
+    {
+      cut.push_back(LowerBound(x->buffer.key, x->key[bound[p] - 1]));
+    }
+    cut.push_back(x->buffer.key.size());
+
+    std::vector<Key> seps;
+    std::vector<Node *> made;
+    for (size_t p = 1; p < parts; ++p)
+    {
+      counters.Add(&Counters::allocs);
+      Node *y = new Node(x->leaf);
+      ++nodeCount;
+      leafCount += x->leaf;
+      size_t lo = bound[p], hi = bound[p + 1];
+      if (x->leaf)
+      {
+        Move(y->key, x->key, lo, hi);
+        Move(y->value, x->value, lo, hi);
+        seps.push_back(y->key[0]);
+      }
+      else
+      {
+        // Separator key[lo - 1] moves up, between the two parts
+        Move(y->key, x->key, lo, hi - 1);
+        Move(y->child, x->child, lo, hi);
+        Move(y->buffer.key, x->buffer.key, cut[p], cut[p + 1]);
+        Move(y->buffer.value, x->buffer.value, cut[p], cut[p + 1]);
+        Move(y->buffer.erase, x->buffer.erase, cut[p], cut[p + 1]);
+        seps.push_back(std::move(x->key[lo - 1]));
+      }
+      made.push_back(y);
+    }
+
+    // Truncate the first part
+    size_t keep = bound[1];
+    if (x->leaf)
+    {
+      x->key.erase(x->key.begin() + keep, x->key.end());
+      x->value.erase(x->value.begin() + keep, x->value.end());
+
+      Node *next = x->next;
+      for (size_t p = 0; p < made.size(); ++p)
+      {
+        Node *prev = p > 0 ? made[p - 1] : x;
+        prev->next = made[p];
+        made[p]->prev = prev;
+      }
+      made.back()->next = next;
+      if (next)
+      {
+        next->prev = made.back();
+      }
+    }
+    else
+    {
+      x->key.erase(x->key.begin() + keep - 1, x->key.end());
+      x->child.erase(x->child.begin() + keep, x->child.end());
+      x->buffer.key.erase(x->buffer.key.begin() + cut[1], x->buffer.key.end());
+      x->buffer.value.erase(x->buffer.value.begin() + cut[1], x->buffer.value.end());
+      x->buffer.erase.erase(x->buffer.erase.begin() + cut[1], x->buffer.erase.end());
+    }
+
+    node->key.insert(node->key.begin() + c, seps.begin(), seps.end());
+    node->child.insert(node->child.begin() + c + 1, made.begin(), made.end());
+  }
+
+  /**
+   * Moves the elements of src to the end of dst
+   */
+  template <typename T>
+  static void Append(std::vector<T>& dst, std::vector<T>& src)
+  {
+    Move(dst, src, 0, src.size());
+  }
+
+  /**
+   * Moves the elements in [lo, hi) of src to the end of dst, leaving them
+   * moved-from in src
+   */
+  template <typename T>
+  static void Move(std::vector<T>& dst, std::vector<T>& src, size_t lo, size_t hi)
+  {
+    dst.insert(dst.end(),
+        std::make_move_iterator(src.begin() + lo),
+        std::make_move_iterator(src.begin() + hi));
+  }
+
+  /**
+   * Flushes the tree & returns the leaf covering key
+   */
+  Node *FindLeaf(const Key& key)
+  {
+    Flush();
+    Node *node = root;
+    while (!node->leaf)
+    {
+      node = node->child[ChildIndex(node, key)];
+    }
+    return node;
+  }
+
+  /**
+   * Returns the rightmost leaf
+   */
+  Node *Last()
+  {
+    Node *node = root;
+    while (!node->leaf)
+    {
+      node = node->child.back();
+    }
+    return node;
+  }
+
+  /**
+   * Deletes a subtree, keeping the nodes left to visit on an explicit stack
+   */
+  void Destroy(Node *node)
+  {
+    std::vector<Node *> stack(1, node);
+    while (!stack.empty())
+    {
+      node = stack.back();
+      stack.pop_back();
+      stack.insert(stack.end(), node->child.begin(), node->child.end());
+      counters.Add(&Counters::frees);
+      delete node;
+    }
+  }
+
+  /**
+   * Root of the tree
+   */
+  Node *root;
+
+  /**
+   * Number of items in the leaves
+   */
+  size_t size;
+
+  /**
+   * Number of messages in the buffers
+   */
+  size_t pending;
+
+  /**
+   * Number of levels
+   */
+  size_t height;
+
+  /**
+   * Number of nodes & of leaves among them
+   */
+  size_t nodeCount;
+  size_t leafCount;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  CounterSet<> counters;
+};
+
+#endif /*__BUFFEREDBTREE_H__*/
@@ -0,0 +1,829 @@
+#ifndef __CONCURRENTBTREE_H__
+#define __CONCURRENTBTREE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+/**
+ * Thread-safe BTree using optimistic lock coupling. Every node carries a
+ * version counter whose lowest bit is a write lock. Readers never write
+ * shared memory: they record the version of a node, read it & check that
+ * the version did not change, restarting from the root otherwise. Writers
+ * descend in the same way and only lock the nodes they modify, by turning
+ * the version they read into a lock with a single compare-and-swap
+ *
+ * As in BTree, full nodes are split on the way down, so a split locks just
+ * the node & its parent. Deletions likewise refill the nodes with fewer
+ * than T keys on their way down, from a sibling with keys to spare or by
+ * merging the two, which locks the node, its parent & the sibling. Keys are removed
+ * from leaves in place, while keys in internal nodes are marked as deleted
+ * and revived by later inserts, until a merge or a borrow moves them down
+ * into a leaf, where they are dropped. Operations run inside Epoch critical
+ * sections & unlinked nodes are retired through Epoch, so optimistic
+ * readers never follow a dangling pointer
+ *
+ * Readers copy keys & values which might be modified concurrently and
+ * discard them if validation fails, so both must be trivially copyable.
+ * Fields read optimistically are accessed with relaxed atomic loads &
+ * stores, so such reads are not data races
+ *
+ * @tparam Key    Key type, must support total ordering
+ * @tparam Value  Value type
+ * @tparam T      Minimal degree of the tree
+ * @tparam Search Intra-node search strategy, for nodes locked by a writer
+ */
+template <typename Key, typename Value, int T, typename Search = NodeSearch<Key>>
+class ConcurrentBTree
+{
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "Keys must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Value>::value,
+                "Values must be trivially copyable");
+
+public:
+  /**
+   * Creates an empty tree
+   */
+  ConcurrentBTree()
+    : root(new Node(true))
+    , size(0)
+  {
+    counters.Add(&Counters::allocs);
+  }
+
+  /**
+   * Destroys the tree. No other thread may access it anymore
+   */
+  ~ConcurrentBTree()
+  {
+    Destroy(root.load());
+  }
+
+  /**
+   * Inserts an item into the tree, overwriting the value of a duplicate
+   */
+  void Insert(const Key& key, const Value& value)
+  {
+    Epoch::Guard guard;
+    while (!TryInsert(key, value))
+    {
+    }
+  }
+
+  /**
+   * Deletes an item from the tree
+   */
+  void Delete(const Key& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an item from the tree if the key is present
+   * @return True if this call removed the item
+   */
+  bool Erase(const Key& key)
+  {
+    Epoch::Guard guard;
+    Outcome result;
+    while ((result = TryDelete(key)) == RESTART)
+    {
+    }
+    return result == HIT;
+  }
+
+  /**
+   * Copies the value of an item out of the tree
+   * @return False if the key is not in the tree
+   */
+  bool Find(const Key& key, Value& value) const
+  {
+    Epoch::Guard guard;
+    counters.AddShared(&Counters::finds);
+    Outcome result;
+    while ((result = TryFind(key, value)) == RESTART)
+    {
+    }
+    return result == HIT;
+  }
+
+  /**
+   * Retrieves a copy of the value of an item
+   */
+  Value Find(const Key& key) const
+  {
+    Value value;
+    if (!Find(key, value))
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return value;
+  }
+
+  /**
+   * Returns the number of items in the tree
+   */
+  size_t GetSize() const
+  {
+    return size.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the height of the tree. All leaves are at the same depth, so
+   * only the leftmost path is followed, validated as in a lookup
+   */
+  size_t GetHeight() const
+  {
+    Epoch::Guard guard;
+    for (;;)
+    {
+      uint64_t v;
+      size_t height = 1;
+      Node *node = ReadRoot(v);
+      while (node && !node->leaf)
+      {
+        node = Descend(node, 0, v);
+        ++height;
+      }
+
+      if (node)
+      {
+        return height;
+      }
+    }
+  }
+
+  /**
+   * Returns a snapshot of the operation counters. Counters are read one by
+   * one, so they may be slightly out of sync under concurrent updates
+   */
+  Counters GetCounters() const
+  {
+    return counters.Get();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset();
+  }
+
+private:
+  ConcurrentBTree(const ConcurrentBTree&);
+  ConcurrentBTree& operator = (const ConcurrentBTree&);
+
+  /**
+   * Result of an attempt to run an operation
+   */
+  enum Outcome
+  {
+    RESTART,
+    MISS,
+    HIT
+  };
+
+  /**
+   * Internal node, guarded by a version lock
+   */
+  struct Node
+  {
+    Node(bool leaf)
+      : version(0)
+      , n(0)
+      , leaf(leaf)
+    {
+      memset(dead, 0, sizeof(dead));
+      memset(child, 0, sizeof(child));
+    }
+
+    /**
+     * Waits for the node to be unlocked & returns its version
+     */
+    uint64_t ReadLock() const
+    {
+      uint64_t v = version.load(std::memory_order_acquire);
+      while (v & kLocked)
+      {
+        std::this_thread::yield();
+        v = version.load(std::memory_order_acquire);
+      }
+      return v;
+    }
+
+    /**
+     * Checks that the node was not modified since version v was read.
+     * The fence keeps the preceding reads of the node before the check
+     */
+    bool Validate(uint64_t v) const
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return version.load(std::memory_order_relaxed) == v;
+    }
+
+    /**
+     * Turns an optimistic read at version v into a write lock, failing
+     * if the node was modified in the meantime. The fence keeps the
+     * following writes to the node after the lock
+     */
+    bool Upgrade(uint64_t v)
+    {
+      if (!version.compare_exchange_strong(v, v + kLocked))
+      {
+        return false;
+      }
+
+      std::atomic_thread_fence(std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * Releases the write lock, bumping the version
+     */
+    void Unlock()
+    {
+      version.fetch_add(kLocked, std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> version;
+    int     n;
+    bool    leaf;
+    Key     key[T * 2];
+    Value   value[T * 2];
+    bool    dead[T * 2];
+    Node   *child[T * 2 + 1];
+  };
+
+  /**
+   * Lock bit of the version
+   */
+  static const uint64_t kLocked = 1;
+
+  /**
+   * Reads a field of a node which a writer may be storing to, as optimistic
+   * readers do before they validate the version. Writers holding the lock
+   * of a node read its fields directly
+   */
+  template <typename U>
+  static U Load(const U& field)
+  {
+    return Load(field, Word<U>());
+  }
+
+  /**
+   * Writes a field of a locked node which optimistic readers may be loading
+   */
+  template <typename U>
+  static void Store(U& field, const typename std::remove_cv<U>::type& value)
+  {
+    Store(field, value, Word<U>());
+  }
+
+  /**
+   * Whether a field is accessed with a single relaxed atomic operation.
+   * Other fields are accessed byte by byte, so readers may see them torn,
+   * but torn copies are discarded when validation fails
+   */
+  template <typename U>
+  struct Word : std::integral_constant<bool, sizeof(U) <= 8 && sizeof(U) == alignof(U)>
+  {
+  };
+
+  template <typename U>
+  static U Load(const U& field, std::true_type)
+  {
+    U value;
+    __atomic_load(&field, &value, __ATOMIC_RELAXED);
+    return value;
+  }
+
+  template <typename U>
+  static U Load(const U& field, std::false_type)
+  {
+    U value;
+    unsigned char *to = reinterpret_cast<unsigned char *>(&value);
+    const unsigned char *from = reinterpret_cast<const unsigned char *>(&field);
+    for (size_t i = 0; i < sizeof(U); ++i)
+    {
+      to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+    }
+    return value;
+  }
+
+  template <typename U>
+  static void Store(U& field, const U& value, std::true_type)
+  {
+    __atomic_store(&field, &value, __ATOMIC_RELAXED);
+  }
+
+  template <typename U>
+  static void Store(U& field, const U& value, std::false_type)
+  {
+    unsigned char *to = reinterpret_cast<unsigned char *>(&field);
+    const unsigned char *from = reinterpret_cast<const unsigned char *>(&value);
+    for (size_t i = 0; i < sizeof(U); ++i)
+    {
+      __atomic_store_n(to + i, from[i], __ATOMIC_RELAXED);
+    }
+  }
+
+  /**
+   * Returns the index of the first of the n keys of a node not less than
+   * key. A writer may be moving the keys, so they are scanned one by one
+   * with relaxed loads instead of going through Search, which reads them
+   * with plain or vector loads; copying them out first costs more than the
+   * scan saves
+   */
+  static int LowerBound(const Node *node, int n, const Key& key)
+  {
+    int i = 0;
+    while (i < n && Load(node->key[i]) < key)
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  /**
+   * Copies the item at index j in src to index i in dst
+   */
+  static void Copy(Node *dst, int i, Node *src, int j)
+  {
+    Store(dst->key[i], src->key[j]);
+    Store(dst->value[i], src->value[j]);
+    Store(dst->dead[i], src->dead[j]);
+  }
+
+  /**
+   * Reads the root & its version, failing if the root changed meanwhile
+   */
+  Node *ReadRoot(uint64_t& v) const
+  {
+    Node *node = root.load(std::memory_order_acquire);
+    v = node->ReadLock();
+    return node == root.load(std::memory_order_acquire) ? node : NULL;
+  }
+
+  /**
+   * Moves from a node read at version v to its i-th child, validating the
+   * node both before the child is dereferenced & after its version is read
+   */
+  static Node *Descend(Node *node, int i, uint64_t& v)
+  {
+    Node *child = Load(node->child[i]);
+    if (!node->Validate(v))
+    {
+      return NULL;
+    }
+
+    uint64_t cv = child->ReadLock();
+    if (!node->Validate(v))
+    {
+      return NULL;
+    }
+
+    v = cv;
+    return child;
+  }
+
+  /**
+   * Single optimistic lookup attempt
+   */
+  Outcome TryFind(const Key& key, Value& value) const
+  {
+    uint64_t v;
+    Node *node = ReadRoot(v);
+    while (node)
+    {
+      counters.AddShared(&Counters::visits);
+      counters.AddShared(&Counters::searches);
+      int n = Load(node->n);
+      int i = LowerBound(node, n, key);
+      if (i < n && Load(node->key[i]) == key)
+      {
+        Value found = Load(node->value[i]);
+        bool dead = Load(node->dead[i]);
+        if (!node->Validate(v))
+        {
+          return RESTART;
+        }
+
+        if (dead)
+        {
+          return MISS;
+        }
+
+        value = found;
+        return HIT;
+      }
+
+      if (node->leaf)
+      {
+        return node->Validate(v) ? MISS : RESTART;
+      }
+
+      node = Descend(node, i, v);
+    }
+
+    return RESTART;
+  }
+
+  /**
+   * Single insertion attempt. Returns false if the operation must be
+   * restarted, which is also the case after splitting a node
+   */
+  bool TryInsert(const Key& key, const Value& value)
+  {
+    uint64_t v, pv = 0;
+    Node *parent = NULL, *node = ReadRoot(v);
+    while (node)
+    {
+      int n = Load(node->n);
+      if (n == 2 * T - 1)
+      {
+        // The parent was not full at version pv, so it can take the median
+        if (parent && !parent->Upgrade(pv))
+        {
+          return false;
+        }
+
+        if (!node->Upgrade(v))
+        {
+          if (parent)
+          {
+            parent->Unlock();
+          }
+          return false;
+        }
+
+        if (parent || node == root.load(std::memory_order_acquire))
+        {
+          Split(parent, node);
+        }
+
+        node->Unlock();
+        if (parent)
+        {
+          parent->Unlock();
+        }
+        return false;
+      }
+
+      int i = LowerBound(node, n, key);
+      bool found = i < n && Load(node->key[i]) == key;
+      if (found || node->leaf)
+      {
+        // The range of keys covered by the node only shrinks if it is split,
+        // which changes its version, so the parent need not be locked
+        if (!node->Upgrade(v))
+        {
+          return false;
+        }
+
+        if (found)
+        {
+          Store(node->value[i], value);
+          if (node->dead[i])
+          {
+            Store(node->dead[i], false);
+            size.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+        else
+        {
+          for (int j = node->n - 1; j >= i; --j)
+          {
+            Copy(node, j + 1, node, j);
+          }
+
+          Store(node->key[i], key);
+          Store(node->value[i], value);
+          Store(node->dead[i], false);
+          Store(node->n, node->n + 1);
+          size.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        node->Unlock();
+        return true;
+      }
+
+      parent = node;
+      pv = v;
+      node = Descend(node, i, v);
+    }
+
+    return false;
+  }
+
+  /**
+   * Single deletion attempt. A node with fewer than T keys on the path is
+   * refilled before it is entered, after which the deletion restarts
+   */
+  Outcome TryDelete(const Key& key)
+  {
+    uint64_t v, pv = 0;
+    int c = 0;
+    Node *parent = NULL, *node = ReadRoot(v);
+    while (node)
+    {
+      int n = Load(node->n);
+      if (parent && n < T)
+      {
+        Refill(parent, pv, c, node, v);
+        return RESTART;
+      }
+
+      int i = LowerBound(node, n, key);
+      if (i < n && Load(node->key[i]) == key)
+      {
+        if (!node->Upgrade(v))
+        {
+          return RESTART;
+        }
+
+        Outcome result = HIT;
+        if (node->leaf)
+        {
+          for (int j = i + 1; j < node->n; ++j)
+          {
+            Copy(node, j - 1, node, j);
+          }
+          Store(node->n, node->n - 1);
+        }
+        else if (node->dead[i])
+        {
+          result = MISS;
+        }
+        else
+        {
+          Store(node->dead[i], true);
+        }
+
+        if (result == HIT)
+        {
+          size.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        node->Unlock();
+        return result;
+      }
+
+      if (node->leaf)
+      {
+        return node->Validate(v) ? MISS : RESTART;
+      }
+
+      parent = node;
+      pv = v;
+      c = i;
+      node = Descend(node, i, v);
+    }
+
+    return RESTART;
+  }
+
+  /**
+   * Refills a node with fewer than T keys, read at version v, which is
+   * child c of a parent read at version pv. The node & a sibling are merged
+   * if the result is not full, otherwise the node borrows a key from the
+   * sibling. Gives up if the parent, the node or the sibling changed since
+   * they were read or is locked, so that no lock is ever waited for
+   */
+  void Refill(Node *parent, uint64_t pv, int c, Node *node, uint64_t v)
+  {
+    if (!parent->Upgrade(pv))
+    {
+      return;
+    }
+
+    if (!node->Upgrade(v))
+    {
+      parent->Unlock();
+      return;
+    }
+
+    int s = c > 0 ? c - 1 : c + 1;
+    Node *sibling = parent->child[s];
+    uint64_t sv = sibling->version.load(std::memory_order_acquire);
+    if ((sv & kLocked) || !sibling->Upgrade(sv))
+    {
+      node->Unlock();
+      parent->Unlock();
+      return;
+    }
+
+    Node *left = s < c ? sibling : node;
+    Node *right = s < c ? node : sibling;
+    int k = std::min(c, s);
+    if (left->n + right->n + 1 < 2 * T - 1)
+    {
+      Merge(parent, k, left, right);
+      right->Unlock();
+      Epoch::Retire(right);
+
+      // A root left without keys makes way for its only child
+      if (parent->n == 0 && parent == root.load(std::memory_order_relaxed))
+      {
+        counters.AddShared(&Counters::frees);
+        root.store(left, std::memory_order_release);
+        left->Unlock();
+        parent->Unlock();
+        Epoch::Retire(parent);
+        return;
+      }
+    }
+    else
+    {
+      Borrow(parent, k, left, right, left == node);
+      right->Unlock();
+    }
+
+    left->Unlock();
+    parent->Unlock();
+  }
+
+  /**
+   * Appends separator k of the parent & the right node to the left one,
+   * then unlinks the right node, which is left to the caller to retire.
+   * A deleted separator is dropped if the nodes are leaves. All three
+   * nodes must be locked
+   */
+  void Merge(Node *parent, int k, Node *left, Node *right)
+  {
+    counters.AddShared(&Counters::joins);
+    counters.AddShared(&Counters::frees);
+    int n = left->n;
+    if (!left->leaf || !parent->dead[k])
+    {
+      Copy(left, n++, parent, k);
+    }
+    for (int i = 0; i < right->n; ++i)
+    {
+      Copy(left, n + i, right, i);
+    }
+    if (!left->leaf)
+    {
+      for (int i = 0; i <= right->n; ++i)
+      {
+        Store(left->child[n + i], right->child[i]);
+      }
+    }
+    Store(left->n, n + right->n);
+
+    for (int i = k + 1; i < parent->n; ++i)
+    {
+      Copy(parent, i - 1, parent, i);
+    }
+    for (int i = k + 2; i <= parent->n; ++i)
+    {
+      Store(parent->child[i - 1], parent->child[i]);
+    }
+    Store(parent->n, parent->n - 1);
+  }
+
+  /**
+   * Rotates a key through separator k of the parent into the left node
+   * from the right one (toLeft), or the other way around. A deleted
+   * separator is dropped if the nodes are leaves, so the receiving node
+   * only gains a key on the next attempt. All three nodes must be locked
+   */
+  void Borrow(Node *parent, int k, Node *left, Node *right, bool toLeft)
+  {
+    counters.AddShared(&Counters::borrows);
+    bool keep = !left->leaf || !parent->dead[k];
+    if (toLeft)
+    {
+      if (keep)
+      {
+        Copy(left, left->n, parent, k);
+        Store(left->child[left->n + 1], right->child[0]);
+        Store(left->n, left->n + 1);
+      }
+      Copy(parent, k, right, 0);
+      for (int i = 1; i < right->n; ++i)
+      {
+        Copy(right, i - 1, right, i);
+      }
+      for (int i = 1; i <= right->n; ++i)
+      {
+        Store(right->child[i - 1], right->child[i]);
+      }
+      Store(right->n, right->n - 1);
+    }
+    else
+    {
+      if (keep)
+      {
+        for (int i = right->n - 1; i >= 0; --i)
+        {
+          Copy(right, i + 1, right, i);
+        }
+        for (int i = right->n; i >= 0; --i)
+        {
+          Store(right->child[i + 1], right->child[i]);
+        }
+        Copy(right, 0, parent, k);
+        Store(right->child[0], left->child[left->n]);
+        Store(right->n, right->n + 1);
+      }
+      Copy(parent, k, left, left->n - 1);
+      Store(left->n, left->n - 1);
+    }
+  }
+
+  /**
+   * Splits a full node around its median key, which moves up to the
+   * parent. Both nodes must be locked. Without a parent, a new root is
+   * built & published once it is complete
+   */
+  void Split(Node *parent, Node *node)
+  {
+    counters.AddShared(&Counters::splits);
+    counters.AddShared(&Counters::allocs);
+    Node *right = new Node(node->leaf);
+    right->n = T - 1;
+    for (int i = 0; i < T - 1; ++i)
+    {
+      Copy(right, i, node, i + T);
+    }
+
+    if (!node->leaf)
+    {
+      for (int i = 0; i < T; ++i)
+      {
+        right->child[i] = node->child[i + T];
+      }
+    }
+
+    bool grow = parent == NULL;
+    if (grow)
+    {
+      counters.AddShared(&Counters::allocs);
+      parent = new Node(false);
+      parent->child[0] = node;
+    }
+
+    int c = Search::LowerBound(parent->key, parent->n, node->key[T - 1]);
+    for (int i = parent->n; i > c; --i)
+    {
+      Store(parent->child[i + 1], parent->child[i]);
+    }
+    for (int i = parent->n - 1; i >= c; --i)
+    {
+      Copy(parent, i + 1, parent, i);
+    }
+
+    Store(parent->child[c + 1], right);
+    Copy(parent, c, node, T - 1);
+    Store(parent->n, parent->n + 1);
+    Store(node->n, T - 1);
+
+    if (grow)
+    {
+      root.store(parent, std::memory_order_release);
+    }
+  }
+
+  /**
+   * Frees a subtree, keeping the nodes left to visit on an explicit stack
+   */
+  static void Destroy(Node *node)
+  {
+    std::vector<Node *> stack(1, node);
+    while (!stack.empty())
+    {
+      node = stack.back();
+      stack.pop_back();
+      if (!node->leaf)
+      {
+        stack.insert(stack.end(), node->child, node->child + node->n + 1);
+      }
+      delete node;
+    }
+  }
+
+  /**
+   * Root node
+   */
+  std::atomic<Node *> root;
+
+  /**
+   * Number of live items
+   */
+  std::atomic<size_t> size;
+  /**
+   * Operation counters, updated concurrently by readers as well, empty
+   * unless TREES_COUNTERS is set
+   */
+  mutable CounterSet<> counters;
+};
+
+#endif /*__CONCURRENTBTREE_H__*/
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Tree.h"
+#include "Pool.h"
+#include "Iterator.h"
+#include "Search.h"
+#include "Batch.h"
+#include "Snapshot.h"
+#include "BTree.h"
+#include "RBTree.h"
+#include "Epoch.h"
+#include "ConcurrentBTree.h"
+#include "SkipList.h"
+using namespace std;
+
+typedef uint32_t Key;
+typedef uint32_t Value;
+
+/**
+ * Maps an index to a key, as in the single threaded benchmark
+ */
+static inline Key Scramble(uint64_t i)
+{
+  return static_cast<Key>(i * 2654435761u);
+}
+
+/**
+ * Ordered map shared by all threads
+ */
+class Map
+{
+public:
+  virtual ~Map() {}
+  virtual bool Find(const Key& key, Value& value) = 0;
+  virtual void Insert(const Key& key, const Value& value) = 0;
+};
+
+/**
+ * Single threaded tree behind a global mutex
+ */
+template <typename T>
+class Locked : public Map
+{
+public:
+  bool Find(const Key& key, Value& value)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Value *found = tree.TryFind(key);
+    if (found)
+    {
+      value = *found;
+    }
+    return found != NULL;
+  }
+
+  void Insert(const Key& key, const Value& value)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    tree.Insert(key, value);
+  }
+
+private:
+  std::mutex lock;
+  T tree;
+};
+
+/**
+ * Tree which synchronises internally
+ */
+template <typename T>
+class Shared : public Map
+{
+public:
+  bool Find(const Key& key, Value& value)
+  {
+    return tree.Find(key, value);
+  }
+
+  void Insert(const Key& key, const Value& value)
+  {
+    tree.Insert(key, value);
+  }
+
+private:
+  T tree;
+};
+
+/**
+ * Creates a map by name
+ */
+static Map *MakeMap(const string& name)
+{
+  if (name == "olc-btree")
+  {
+    return new Shared<ConcurrentBTree<Key, Value, 16>>();
+  }
+
+  if (name == "lockfree-skiplist")
+  {
+    return new Shared<SkipList<Key, Value>>();
+  }
+
+  if (name == "mutex-btree")
+  {
+    return new Locked<BTree<Key, Value, 16>>();
+  }
+
+  if (name == "mutex-rb")
+  {
+    return new Locked<RBTree<Key, Value>>();
+  }
+
+  return NULL;
+}
+
+static const char *kMaps[] = { "olc-btree", "lockfree-skiplist", "mutex-btree", "mutex-rb" };
+
+/**
+ * Percentage of lookups in a workload. The remaining operations insert
+ * keys drawn from twice the loaded range, so half of them add new keys
+ */
+struct Workload
+{
+  const char *name;
+  int         read;
+};
+
+static const Workload kWorkloads[] =
+{
+  { "read",        100 },
+  { "read-heavy",   95 },
+  { "write-heavy",  50 },
+};
+
+/**
+ * Benchmark settings
+ */
+struct Options
+{
+  vector<string>   maps;
+  vector<string>   workloads;
+  vector<unsigned> threads;
+  uint64_t         size;
+  uint64_t         ops;
+  unsigned         seed;
+  string           label;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Runs ops operations split across a number of threads, all of which
+ * start together. Returns the wall clock time in seconds
+ */
+static double Run(Map *map, const Workload& w, unsigned threads, const Options& opt)
+{
+  std::atomic<unsigned> ready(0);
+  std::atomic<bool> go(false);
+  std::atomic<uint64_t> sink(0);
+
+  vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+  {
+    workers.push_back(std::thread([map, &w, &opt, &ready, &go, &sink, threads, t] ()
+    {
+      std::mt19937_64 rng(opt.seed + t);
+      std::uniform_int_distribution<int> mix(0, 99);
+      uint64_t ops = opt.ops / threads, local = 0;
+
+      ++ready;
+      while (!go.load())
+      {
+        std::this_thread::yield();
+      }
+
+      for (uint64_t i = 0; i < ops; ++i)
+      {
+        if (mix(rng) < w.read)
+        {
+          Value value;
+          if (map->Find(Scramble(rng() % opt.size), value))
+          {
+            local += value;
+          }
+        }
+        else
+        {
+          map->Insert(Scramble(rng() % (2 * opt.size)), static_cast<Value>(i));
+        }
+      }
+      sink += local;
+    }));
+  }
+
+  while (ready.load() < threads)
+  {
+    std::this_thread::yield();
+  }
+
+  Clock::time_point begin = Clock::now();
+  go = true;
+  for (size_t i = 0; i < workers.size(); ++i)
+  {
+    workers[i].join();
+  }
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+/**
+ * Splits a comma-separated list
+ */
+static vector<string> Split(const string& str)
+{
+  vector<string> items;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ','))
+  {
+    if (!item.empty())
+    {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+static void Usage(const char *argv0)
+{
+  cerr
+    << "Usage: " << argv0 << " [options]\n"
+    << "  --trees LIST      olc-btree,lockfree-skiplist,mutex-btree,mutex-rb\n"
+    << "                    (default: all)\n"
+    << "  --workloads LIST  read,read-heavy,write-heavy (default: all)\n"
+    << "  --threads LIST    thread counts (default: 1,2,4,8,16,32,64)\n"
+    << "  --size N          keys loaded before each run (default: 1e6)\n"
+    << "  --ops N           operations per run, over all threads (default: 1e7)\n"
+    << "  --seed N          random seed (default: 1)\n"
+    << "  --label STR       label attached to every row, e.g. a commit hash\n";
+}
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  opt.maps.assign(kMaps, kMaps + sizeof(kMaps) / sizeof(kMaps[0]));
+  for (size_t i = 0; i < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++i)
+  {
+    opt.workloads.push_back(kWorkloads[i].name);
+  }
+  for (unsigned t = 1; t <= 64; t *= 2)
+  {
+    opt.threads.push_back(t);
+  }
+  opt.size = 1000000;
+  opt.ops = 10000000;
+  opt.seed = 1;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "-h" || arg == "--help")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+
+    if (i + 1 >= argc)
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    string val = argv[++i];
+    if (arg == "--trees")
+    {
+      opt.maps = Split(val);
+    }
+    else if (arg == "--workloads")
+    {
+      opt.workloads = Split(val);
+    }
+    else if (arg == "--threads")
+    {
+      vector<string> threads = Split(val);
+      opt.threads.clear();
+      for (size_t j = 0; j < threads.size(); ++j)
+      {
+        opt.threads.push_back(static_cast<unsigned>(atoi(threads[j].c_str())));
+      }
+    }
+    else if (arg == "--size")
+    {
+      opt.size = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--ops")
+    {
+      opt.ops = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--seed")
+    {
+      opt.seed = static_cast<unsigned>(atoi(val.c_str()));
+    }
+    else if (arg == "--label")
+    {
+      opt.label = val;
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opt.size == 0 || opt.size > 0x7FFFFFFFull)
+  {
+    cerr << "Invalid size: " << opt.size << endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<const Workload *> workloads;
+  for (size_t i = 0; i < opt.workloads.size(); ++i)
+  {
+    const Workload *w = NULL;
+    for (size_t j = 0; j < sizeof(kWorkloads) / sizeof(kWorkloads[0]); ++j)
+    {
+      if (opt.workloads[i] == kWorkloads[j].name)
+      {
+        w = &kWorkloads[j];
+      }
+    }
+
+    if (!w)
+    {
+      cerr << "Unknown workload: " << opt.workloads[i] << endl;
+      return EXIT_FAILURE;
+    }
+    workloads.push_back(w);
+  }
+
+  printf("label,tree,workload,size,threads,ops,seconds,ops_per_sec\n");
+  for (size_t w = 0; w < workloads.size(); ++w)
+  {
+    for (size_t m = 0; m < opt.maps.size(); ++m)
+    {
+      for (size_t t = 0; t < opt.threads.size(); ++t)
+      {
+        Map *map = MakeMap(opt.maps[m]);
+        if (!map || opt.threads[t] == 0)
+        {
+          cerr << "Invalid configuration: " << opt.maps[m] << "/"
+               << opt.threads[t] << endl;
+          return EXIT_FAILURE;
+        }
+
+        for (uint64_t i = 0; i < opt.size; ++i)
+        {
+          map->Insert(Scramble(i), static_cast<Value>(i));
+        }
+
+        uint64_t ops = opt.ops / opt.threads[t] * opt.threads[t];
+        double seconds = Run(map, *workloads[w], opt.threads[t], opt);
+        printf("%s,%s,%s,%llu,%u,%llu,%.6f,%.1f\n",
+            opt.label.c_str(), opt.maps[m].c_str(), workloads[w]->name,
+            (unsigned long long)opt.size, opt.threads[t],
+            (unsigned long long)ops, seconds, seconds > 0 ? ops / seconds : 0.0);
+        fflush(stdout);
+        delete map;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
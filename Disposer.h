@@ -0,0 +1,165 @@
+#ifndef __DISPOSER_H__
+#define __DISPOSER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * Deletes objects on a background thread. Freeing a tree of hundreds of
+ * millions of nodes takes seconds; handing the old tree over to a Disposer
+ * when swapping in a new index keeps that work off the serving thread.
+ * Objects are deleted in the order they are handed over. Destroying the
+ * Disposer deletes everything still queued before joining its thread
+ */
+class Disposer
+{
+public:
+  Disposer()
+    : pending(0)
+    , stop(false)
+    , worker(&Disposer::Run, this)
+  {
+  }
+
+  ~Disposer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    ready.notify_one();
+    worker.join();
+  }
+
+  /**
+   * Schedules an object allocated with new to be deleted
+   */
+  template <typename T>
+  void Dispose(T *ptr)
+  {
+    Dispose(ptr, [] (void *p) { delete static_cast<T *>(p); });
+  }
+
+  /**
+   * Takes an object over & schedules it to be deleted
+   */
+  template <typename T>
+  void Dispose(std::unique_ptr<T> ptr)
+  {
+    Dispose(ptr.release());
+  }
+
+  /**
+   * Schedules an object to be freed by a function
+   */
+  void Dispose(void *ptr, void (*free)(void *))
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(Garbage(ptr, free));
+      ++pending;
+    }
+    ready.notify_one();
+  }
+
+  /**
+   * Blocks until all objects handed over so far are deleted
+   */
+  void Wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+  }
+
+private:
+  Disposer(const Disposer&);
+  Disposer& operator = (const Disposer&);
+
+  /**
+   * An object waiting to be freed
+   */
+  struct Garbage
+  {
+    Garbage(void *ptr, void (*free)(void *))
+      : ptr(ptr)
+      , free(free)
+    {
+    }
+
+    void *ptr;
+    void (*free)(void *);
+  };
+
+  /**
+   * Body of the worker thread. Objects are freed outside the lock, so
+   * handing over more of them never waits for a deletion in progress
+   */
+  void Run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      ready.wait(lock, [this] { return stop || !queue.empty(); });
+      if (queue.empty())
+      {
+        return;
+      }
+
+      Garbage garbage = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      garbage.free(garbage.ptr);
+      lock.lock();
+
+      if (--pending == 0)
+      {
+        done.notify_all();
+      }
+    }
+  }
+
+  /**
+   * Guards the queue & the flags
+   */
+  std::mutex mutex;
+
+  /**
+   * Signalled when objects are queued or the worker must stop
+   */
+  std::condition_variable ready;
+
+  /**
+   * Signalled when the queue drains
+   */
+  std::condition_variable done;
+
+  /**
+   * Objects waiting to be freed
+   */
+  std::deque<Garbage> queue;
+
+  /**
+   * Number of objects queued or being freed
+   */
+  size_t pending;
+
+  /**
+   * Set by the destructor once nothing else will be queued
+   */
+  bool stop;
+
+  /**
+   * Thread freeing the objects, started last
+   */
+  std::thread worker;
+};
+
+#endif /*__DISPOSER_H__*/
@@ -0,0 +1,306 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Epoch-based memory reclamation, shared by all lock-free structures in
+ * the process. Threads access shared objects inside critical sections,
+ * delimited by Epoch::Guard. Objects unlinked from a structure are retired
+ * instead of being freed, tagged with the global epoch. The global epoch
+ * only advances once every thread inside a critical section has observed
+ * it, so objects retired in epoch e are freed once the global epoch
+ * reaches e + 2: all critical sections which could have seen them are over
+ */
+class Epoch
+{
+  struct Record;
+
+public:
+  /**
+   * Scoped critical section. Sections may nest
+   */
+  class Guard
+  {
+  public:
+    Guard()
+      : record(Epoch::Enter())
+    {
+    }
+
+    ~Guard()
+    {
+      Epoch::Exit(record);
+    }
+
+  private:
+    Guard(const Guard&);
+    Guard& operator = (const Guard&);
+
+    Record *record;
+  };
+
+  /**
+   * Schedules an object allocated with new to be deleted once no thread
+   * can reference it anymore. Must be called inside a critical section
+   */
+  template <typename T>
+  static void Retire(T *ptr)
+  {
+    Retire(ptr, [] (void *p) { delete static_cast<T *>(p); });
+  }
+
+  /**
+   * Schedules an object to be freed by a function once no thread can
+   * reference it anymore. Must be called inside a critical section
+   */
+  static void Retire(void *ptr, void (*free)(void *))
+  {
+    Domain& domain = GetDomain();
+    Record *record = Local();
+
+    uint64_t e = domain.global.load();
+    int b = static_cast<int>(e % 3);
+    if (record->stamp[b] != e)
+    {
+      // The bag holds objects from epoch e - 3 or before, which are safe
+      Collect(record, b);
+      record->stamp[b] = e;
+    }
+    record->bag[b].push_back(Garbage(ptr, free));
+
+    if (++record->retired % kAdvance == 0)
+    {
+      TryAdvance();
+    }
+  }
+
+private:
+  /**
+   * Retired object & the function releasing it
+   */
+  struct Garbage
+  {
+    Garbage(void *ptr, void (*free)(void *))
+      : ptr(ptr)
+      , free(free)
+    {
+    }
+
+    void   *ptr;
+    void  (*free)(void *);
+  };
+
+  /**
+   * Per-thread state. Records are never freed while the process runs, but
+   * are recycled when their thread exits
+   */
+  struct Record
+  {
+    Record()
+      : epoch(0)
+      , used(true)
+      , next(NULL)
+      , depth(0)
+      , retired(0)
+    {
+      stamp[0] = stamp[1] = stamp[2] = 0;
+    }
+
+    /**
+     * Epoch observed on entry, shifted left, with the lowest bit set while
+     * the thread is inside a critical section
+     */
+    std::atomic<uint64_t> epoch;
+
+    /**
+     * True while the record is owned by a thread
+     */
+    std::atomic<bool> used;
+
+    /**
+     * Next record in the global list
+     */
+    Record *next;
+
+    /**
+     * Nesting depth of critical sections
+     */
+    int depth;
+
+    /**
+     * Number of objects retired, used to pace epoch advances
+     */
+    size_t retired;
+
+    /**
+     * Objects retired in the last three epochs & their epochs
+     */
+    std::vector<Garbage> bag[3];
+    uint64_t             stamp[3];
+  };
+
+  /**
+   * Global epoch & the list of all records
+   */
+  struct Domain
+  {
+    Domain()
+      : global(2)
+      , records(NULL)
+    {
+    }
+
+    /**
+     * Frees all remaining garbage at exit
+     */
+    ~Domain()
+    {
+      for (Record *record = records.load(); record; )
+      {
+        Record *next = record->next;
+        for (int b = 0; b < 3; ++b)
+        {
+          Collect(record, b);
+        }
+        delete record;
+        record = next;
+      }
+    }
+
+    std::atomic<uint64_t> global;
+    std::atomic<Record *> records;
+  };
+
+  /**
+   * Releases the record of a thread when it exits
+   */
+  struct Owner
+  {
+    Owner()
+      : record(NULL)
+    {
+    }
+
+    ~Owner()
+    {
+      if (record)
+      {
+        record->used.store(false, std::memory_order_release);
+      }
+    }
+
+    Record *record;
+  };
+
+  /**
+   * Number of retired objects between attempts to advance the epoch
+   */
+  static const size_t kAdvance = 64;
+
+  static Domain& GetDomain()
+  {
+    static Domain domain;
+    return domain;
+  }
+
+  /**
+   * Returns the record of the calling thread, claiming one if needed
+   */
+  static Record *Local()
+  {
+    static thread_local Owner owner;
+    if (owner.record)
+    {
+      return owner.record;
+    }
+
+    Domain& domain = GetDomain();
+    for (Record *record = domain.records.load(std::memory_order_acquire); record; record = record->next)
+    {
+      bool used = false;
+      if (!record->used.load() && record->used.compare_exchange_strong(used, true))
+      {
+        return owner.record = record;
+      }
+    }
+
+    Record *record = new Record();
+    record->next = domain.records.load();
+    while (!domain.records.compare_exchange_weak(record->next, record))
+    {
+    }
+    return owner.record = record;
+  }
+
+  /**
+   * Enters a critical section, publishing the observed epoch. The fence
+   * orders the publication before any read of shared objects
+   */
+  static Record *Enter()
+  {
+    Record *record = Local();
+    if (record->depth++ == 0)
+    {
+      uint64_t e = GetDomain().global.load(std::memory_order_acquire);
+      record->epoch.store(e << 1 | 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      for (int b = 0; b < 3; ++b)
+      {
+        if (record->stamp[b] + 2 <= e)
+        {
+          Collect(record, b);
+        }
+      }
+    }
+    return record;
+  }
+
+  /**
+   * Leaves a critical section
+   */
+  static void Exit(Record *record)
+  {
+    if (--record->depth == 0)
+    {
+      record->epoch.store(record->epoch.load(std::memory_order_relaxed) & ~1ull,
+                          std::memory_order_release);
+    }
+  }
+
+  /**
+   * Advances the global epoch if every active thread has observed it
+   */
+  static void TryAdvance()
+  {
+    Domain& domain = GetDomain();
+    uint64_t e = domain.global.load();
+    for (Record *record = domain.records.load(std::memory_order_acquire); record; record = record->next)
+    {
+      uint64_t local = record->epoch.load();
+      if ((local & 1) && (local >> 1) != e)
+      {
+        return;
+      }
+    }
+    domain.global.compare_exchange_strong(e, e + 1);
+  }
+
+  /**
+   * Frees the objects in a bag
+   */
+  static void Collect(Record *record, int b)
+  {
+    std::vector<Garbage>& bag = record->bag[b];
+    for (size_t i = 0; i < bag.size(); ++i)
+    {
+      bag[i].free(bag[i].ptr);
+    }
+    bag.clear();
+  }
+};
+
+#endif /*__EPOCH_H__*/
@@ -0,0 +1,284 @@
+#ifndef __ITERATOR_H__
+#define __ITERATOR_H__
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Stack used to record root-to-node paths. The first N entries are stored
+ * inline, so walking trees of reasonable height never allocates
+ *
+ * @tparam T Type of the entries
+ * @tparam N Number of entries stored inline
+ */
+template <typename T, size_t N = 64>
+class Stack
+{
+public:
+  Stack()
+    : size(0)
+  {
+  }
+
+  void Push(const T& item)
+  {
+    if (size < N)
+    {
+      items[size] = item;
+    }
+    else
+    {
+      spill.push_back(item);
+    }
+    ++size;
+  }
+
+  void Pop()
+  {
+    if (size > N)
+    {
+      spill.pop_back();
+    }
+    --size;
+  }
+
+  T& Top()
+  {
+    return size <= N ? items[size - 1] : spill[size - N - 1];
+  }
+
+  const T& Top() const
+  {
+    return size <= N ? items[size - 1] : spill[size - N - 1];
+  }
+
+  bool Empty() const
+  {
+    return size == 0;
+  }
+
+  size_t Size() const
+  {
+    return size;
+  }
+
+  void Clear()
+  {
+    spill.clear();
+    size = 0;
+  }
+
+private:
+  T              items[N];
+  std::vector<T> spill;
+  size_t         size;
+};
+
+/**
+ * Bidirectional in-order iterator over binary search trees whose nodes have
+ * no parent links. The path from the root to the current node is kept on an
+ * explicit stack, so steps cost O(1) amortized. The past-the-end iterator
+ * has an empty path. Iterators are invalidated by modifications of the tree
+ *
+ * @tparam Node  Node type, with key, value, left & right fields
+ * @tparam Key   Key type
+ * @tparam Value Value type
+ */
+template <typename Node, typename Key, typename Value>
+class TreeIterator
+{
+public:
+  /**
+   * Returns an iterator to the smallest item
+   */
+  static TreeIterator Begin(Node *const *root)
+  {
+    TreeIterator it(root);
+    for (Node *node = *root; node; node = node->left)
+    {
+      it.path.Push(node);
+    }
+    return it;
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  static TreeIterator End(Node *const *root)
+  {
+    return TreeIterator(root);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   * (Upper = false) or greater than key (Upper = true), under less
+   */
+  template <bool Upper, typename K, typename Compare>
+  static TreeIterator Bound(Node *const *root, const K& key, const Compare& less)
+  {
+    TreeIterator it(root);
+    size_t found = 0;
+    for (Node *node = *root; node; )
+    {
+      it.path.Push(node);
+      if (Upper ? less(key, node->key) : !less(node->key, key))
+      {
+        found = it.path.Size();
+        node = node->left;
+      }
+      else
+      {
+        node = node->right;
+      }
+    }
+
+    while (it.path.Size() > found)
+    {
+      it.path.Pop();
+    }
+    return it;
+  }
+
+  /**
+   * Returns an iterator to the k-th smallest item, counting from zero, or
+   * the past-the-end iterator if there are fewer items. Nodes must provide
+   * the sizes of their subtrees through Node::Count
+   */
+  static TreeIterator Select(Node *const *root, size_t k)
+  {
+    TreeIterator it(root);
+    for (Node *node = *root; node; )
+    {
+      it.path.Push(node);
+
+      size_t left = Node::Count(node->left);
+      if (k < left)
+      {
+        node = node->left;
+      }
+      else if (k == left)
+      {
+        return it;
+      }
+      else
+      {
+        k -= left + 1;
+        node = node->right;
+      }
+    }
+
+    it.path.Clear();
+    return it;
+  }
+
+  const Key& GetKey() const
+  {
+    return path.Top()->key;
+  }
+
+  Value& GetValue() const
+  {
+    return path.Top()->value;
+  }
+
+  TreeIterator& operator ++ ()
+  {
+    Node *node = path.Top();
+    if (node->right)
+    {
+      for (node = node->right; node; node = node->left)
+      {
+        path.Push(node);
+      }
+    }
+    else
+    {
+      Node *child;
+      do
+      {
+        child = path.Top();
+        path.Pop();
+      }
+      while (!path.Empty() && path.Top()->right == child);
+    }
+    return *this;
+  }
+
+  TreeIterator& operator -- ()
+  {
+    if (path.Empty())
+    {
+      for (Node *node = *root; node; node = node->right)
+      {
+        path.Push(node);
+      }
+      return *this;
+    }
+
+    Node *node = path.Top();
+    if (node->left)
+    {
+      for (node = node->left; node; node = node->right)
+      {
+        path.Push(node);
+      }
+    }
+    else
+    {
+      Node *child;
+      do
+      {
+        child = path.Top();
+        path.Pop();
+      }
+      while (!path.Empty() && path.Top()->left == child);
+    }
+    return *this;
+  }
+
+  TreeIterator operator ++ (int)
+  {
+    TreeIterator it(*this);
+    ++*this;
+    return it;
+  }
+
+  TreeIterator operator -- (int)
+  {
+    TreeIterator it(*this);
+    --*this;
+    return it;
+  }
+
+  bool operator == (const TreeIterator& that) const
+  {
+    if (path.Empty() || that.path.Empty())
+    {
+      return path.Empty() && that.path.Empty();
+    }
+    return path.Top() == that.path.Top();
+  }
+
+  bool operator != (const TreeIterator& that) const
+  {
+    return !(*this == that);
+  }
+
+private:
+  TreeIterator(Node *const *root)
+    : root(root)
+  {
+  }
+
+  /**
+   * Pointer to the root of the tree, used to step back from the end
+   */
+  Node *const *root;
+
+  /**
+   * Path from the root to the current node
+   */
+  Stack<Node *> path;
+};
+
+#endif /*__ITERATOR_H__*/
@@ -0,0 +1,406 @@
+#ifndef __JOIN_H__
+#define __JOIN_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+/**
+ * Join-based algorithms on balanced binary search trees, after Blelloch,
+ * Ferizovic & Sun, "Just Join for Parallel Ordered Sets". Everything is
+ * built on one primitive provided by each tree, Join(left, node, right),
+ * which links two trees & a node whose key lies between theirs, restoring
+ * balance. Splits take O(log n) & the union, intersection & difference of
+ * trees of sizes m <= n take O(m log(n / m + 1)). Both trees of a set
+ * operation are consumed: nodes either move into the result or are freed
+ * through Remove(node). The two recursive calls of every set operation
+ * work on disjoint subtrees, which the parallel versions below exploit:
+ * they split the trees into pieces, update those on the threads of a
+ * TaskPool & join the pieces back
+ *
+ * @tparam Tree  Tree type, providing Join, Create, Remove & compare
+ * @tparam Node  Node type, with key, value, left & right fields
+ * @tparam Key   Key types
+ * @tparam Value Value types
+ */
+template <typename Tree, typename Node, typename Key, typename Value>
+class Joins
+{
+public:
+  /**
+   * Inserts n items with strictly increasing keys into a subtree in
+   * O(m log(n / m + 1)), overwriting the values of keys already present
+   * @return The new root of the subtree
+   */
+  static Node *Insert(Tree *tree, Node *node, const Key *keys, const Value *values, size_t n)
+  {
+    if (n == 0)
+    {
+      return node;
+    }
+    if (!node)
+    {
+      return Build(tree, keys, values, n);
+    }
+
+    size_t i = std::lower_bound(keys, keys + n, node->key, tree->compare) - keys;
+    size_t found = i < n && !tree->compare(node->key, keys[i]);
+    if (found)
+    {
+      tree->Assign(node->value, values[i]);
+    }
+
+    Node *left = Insert(tree, node->left, keys, values, i);
+    Node *right = Insert(tree, node->right, keys + i + found, values + i + found, n - i - found);
+    return tree->Join(left, node, right);
+  }
+
+  /**
+   * Removes the items with any of n strictly increasing keys from a subtree
+   * in O(m log(n / m + 1)). Missing keys are ignored
+   * @return The new root of the subtree
+   */
+  static Node *Erase(Tree *tree, Node *node, const Key *keys, size_t n)
+  {
+    if (n == 0 || !node)
+    {
+      return node;
+    }
+
+    size_t i = std::lower_bound(keys, keys + n, node->key, tree->compare) - keys;
+    size_t found = i < n && !tree->compare(node->key, keys[i]);
+
+    Node *left = Erase(tree, node->left, keys, i);
+    Node *right = Erase(tree, node->right, keys + i + found, n - i - found);
+    if (found)
+    {
+      tree->Remove(node);
+      return Join(tree, left, right);
+    }
+    return tree->Join(left, node, right);
+  }
+
+  /**
+   * Inserts n items with strictly increasing keys, as Insert does, with
+   * the key range split across the threads of a pool
+   */
+  static void ParallelInsert(Tree& tree, const Key *keys, const Value *values, size_t n,
+                             TaskPool& tasks)
+  {
+    CheckSorted(tree, keys, n);
+    bool stale = tree.stale;
+    ParallelInsert(tree, keys, values, n, tasks, Depth(tasks));
+    tree.stale = stale;
+  }
+
+  /**
+   * Removes the items with any of n strictly increasing keys, as Erase
+   * does, with the key range split across the threads of a pool
+   */
+  static void ParallelErase(Tree& tree, const Key *keys, size_t n, TaskPool& tasks)
+  {
+    CheckSorted(tree, keys, n);
+    bool stale = tree.stale;
+    ParallelErase(tree, keys, n, tasks, Depth(tasks));
+    tree.stale = stale;
+  }
+
+  /**
+   * Merges another tree into a tree as Union does, with the key range
+   * split across the threads of a pool. The other tree is left empty
+   */
+  static void ParallelUnion(Tree& tree, Tree& other, TaskPool& tasks)
+  {
+    bool stale = tree.stale || other.stale;
+    ParallelUnion(tree, other, tasks, Depth(tasks));
+    tree.stale = stale;
+  }
+
+  /**
+   * Splits a subtree into the nodes with keys less than key & those with
+   * greater keys
+   * @return The node with the key, detached from both trees, or NULL
+   */
+  template <typename K>
+  static Node *Split(Tree *tree, Node *node, const K& key, Node *&left, Node *&right)
+  {
+    if (!node)
+    {
+      left = right = NULL;
+      return NULL;
+    }
+
+    if (tree->compare(key, node->key))
+    {
+      Node *found = Split(tree, node->left, key, left, right);
+      right = tree->Join(right, node, node->right);
+      return found;
+    }
+
+    if (tree->compare(node->key, key))
+    {
+      Node *found = Split(tree, node->right, key, left, right);
+      left = tree->Join(node->left, node, left);
+      return found;
+    }
+
+    left = node->left;
+    right = node->right;
+    return node;
+  }
+
+  /**
+   * Links two trees, all keys of the left one being less than those of the
+   * right one
+   */
+  static Node *Join(Tree *tree, Node *left, Node *right)
+  {
+    if (!left)
+    {
+      return right;
+    }
+
+    Node *last;
+    left = SplitLast(tree, left, last);
+    return tree->Join(left, last, right);
+  }
+
+  /**
+   * Merges two trees. Where both hold a key, the item of the first is kept
+   */
+  static Node *Union(Tree *tree, Node *a, Node *b)
+  {
+    if (!a)
+    {
+      return b;
+    }
+    if (!b)
+    {
+      return a;
+    }
+
+    Node *left, *right;
+    if (Node *dup = Split(tree, b, a->key, left, right))
+    {
+      tree->Remove(dup);
+    }
+    left = Union(tree, a->left, left);
+    right = Union(tree, a->right, right);
+    return tree->Join(left, a, right);
+  }
+
+  /**
+   * Keeps the items of the first tree whose keys are in the second one
+   */
+  static Node *Intersect(Tree *tree, Node *a, Node *b)
+  {
+    if (!a || !b)
+    {
+      RemoveAll(tree, a);
+      RemoveAll(tree, b);
+      return NULL;
+    }
+
+    Node *left, *right;
+    Node *dup = Split(tree, b, a->key, left, right);
+    left = Intersect(tree, a->left, left);
+    right = Intersect(tree, a->right, right);
+    if (dup)
+    {
+      tree->Remove(dup);
+      return tree->Join(left, a, right);
+    }
+
+    tree->Remove(a);
+    return Join(tree, left, right);
+  }
+
+  /**
+   * Keeps the items of the first tree whose keys are not in the second one
+   */
+  static Node *Difference(Tree *tree, Node *a, Node *b)
+  {
+    if (!a || !b)
+    {
+      RemoveAll(tree, b);
+      return a;
+    }
+
+    Node *left, *right;
+    Node *dup = Split(tree, b, a->key, left, right);
+    left = Difference(tree, a->left, left);
+    right = Difference(tree, a->right, right);
+    if (dup)
+    {
+      tree->Remove(dup);
+      tree->Remove(a);
+      return Join(tree, left, right);
+    }
+
+    return tree->Join(left, a, right);
+  }
+
+private:
+  /**
+   * Batches & trees below this size are updated by a single thread
+   */
+  static const size_t kGrain = 4096;
+
+  /**
+   * Builds a subtree out of n items with strictly increasing keys
+   */
+  static Node *Build(Tree *tree, const Key *keys, const Value *values, size_t n)
+  {
+    if (n == 0)
+    {
+      return NULL;
+    }
+
+    size_t mid = n / 2;
+    Node *left = Build(tree, keys, values, mid);
+    Node *node = tree->Create(keys[mid], values[mid]);
+    Node *right = Build(tree, keys + mid + 1, values + mid + 1, n - mid - 1);
+    return tree->Join(left, node, right);
+  }
+
+  /**
+   * Throws unless n keys are strictly increasing
+   */
+  static void CheckSorted(Tree& tree, const Key *keys, size_t n)
+  {
+    for (size_t i = 1; i < n; ++i)
+    {
+      if (!tree.compare(keys[i - 1], keys[i]))
+      {
+        throw std::runtime_error("Keys are not sorted");
+      }
+    }
+  }
+
+  /**
+   * Returns how many times to halve the work: about 8 tasks per thread,
+   * so that threads finishing early find work to steal
+   */
+  static unsigned Depth(TaskPool& tasks)
+  {
+    unsigned depth = 0;
+    for (size_t n = tasks.GetThreads(); n; n >>= 1)
+    {
+      ++depth;
+    }
+    return depth ? depth + 3 : 0;
+  }
+
+  /**
+   * Joins back a tree split off to be updated in parallel, adding up the
+   * counters of both
+   */
+  static void Merge(Tree& tree, Tree& right)
+  {
+    tree.counters.Add(right.GetCounters());
+    tree.Join(right);
+  }
+
+  /**
+   * Inserts items, halving the batch & the tree depth times
+   */
+  static void ParallelInsert(Tree& tree, const Key *keys, const Value *values, size_t n,
+                             TaskPool& tasks, unsigned depth)
+  {
+    if (n <= kGrain || depth == 0)
+    {
+      tree.root = Insert(&tree, tree.root, keys, values, n);
+      return;
+    }
+
+    size_t mid = n / 2;
+    Tree right(Unwrap(tree.compare));
+    tree.Split(keys[mid], right);
+    tasks.Invoke([&] { ParallelInsert(tree, keys, values, mid, tasks, depth - 1); },
+                 [&] { ParallelInsert(right, keys + mid, values + mid, n - mid, tasks, depth - 1); });
+    Merge(tree, right);
+  }
+
+  /**
+   * Removes items, halving the batch & the tree depth times
+   */
+  static void ParallelErase(Tree& tree, const Key *keys, size_t n, TaskPool& tasks,
+                            unsigned depth)
+  {
+    if (n <= kGrain || depth == 0)
+    {
+      tree.root = Erase(&tree, tree.root, keys, n);
+      return;
+    }
+
+    size_t mid = n / 2;
+    Tree right(Unwrap(tree.compare));
+    tree.Split(keys[mid], right);
+    tasks.Invoke([&] { ParallelErase(tree, keys, mid, tasks, depth - 1); },
+                 [&] { ParallelErase(right, keys + mid, n - mid, tasks, depth - 1); });
+    Merge(tree, right);
+  }
+
+  /**
+   * Merges trees, halving both depth times
+   */
+  static void ParallelUnion(Tree& tree, Tree& other, TaskPool& tasks, unsigned depth)
+  {
+    if (std::min(tree.size, other.size) <= kGrain || depth == 0)
+    {
+      tree.Union(other);
+      return;
+    }
+
+    // Split both trees around the median of the larger one
+    Tree& larger = tree.size < other.size ? other : tree;
+    Key pivot = larger.Select(larger.size / 2).GetKey();
+    Tree right(Unwrap(tree.compare)), otherRight(Unwrap(tree.compare));
+    tree.Split(pivot, right);
+    other.Split(pivot, otherRight);
+    tasks.Invoke([&] { ParallelUnion(tree, other, tasks, depth - 1); },
+                 [&] { ParallelUnion(right, otherRight, tasks, depth - 1); });
+    Merge(tree, right);
+  }
+
+  /**
+   * Detaches the node with the largest key from a subtree
+   * @return The rest of the subtree
+   */
+  static Node *SplitLast(Tree *tree, Node *node, Node *&last)
+  {
+    if (!node->right)
+    {
+      last = node;
+      return node->left;
+    }
+
+    Node *rest = SplitLast(tree, node->right, last);
+    return tree->Join(node->left, node, rest);
+  }
+
+  /**
+   * Removes all nodes of a subtree in O(1) space, flattening it with
+   * rotations as Destroy does
+   */
+  static void RemoveAll(Tree *tree, Node *node)
+  {
+    while (node)
+    {
+      if (Node *left = node->left)
+      {
+        node->left = left->right;
+        left->right = node;
+        node = left;
+      }
+      else
+      {
+        Node *right = node->right;
+        tree->Remove(node);
+        node = right;
+      }
+    }
+  }
+};
+
+#endif /*__JOIN_H__*/
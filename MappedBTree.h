@@ -0,0 +1,617 @@
+#ifndef __MAPPEDBTREE_H__
+#define __MAPPEDBTREE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only BTree stored in a file & served directly from a memory mapping.
+ * Save writes the items of any tree into a file of fixed size pages: a
+ * header page followed by one node per page, where children are referenced
+ * by their offset in the file. Opening the file only maps it & checks the
+ * header, so startup costs do not depend on the size of the tree: pages are
+ * read by the kernel when lookups first touch them
+ *
+ * Nodes are packed bottom-up as by BTree::BulkLoad. Leaves come first, in
+ * key order, so range scans read the file sequentially. Keys & values are
+ * stored as raw bytes, in host byte order
+ *
+ * @tparam Key    Key type, trivially copyable, ordered by operator <
+ * @tparam Value  Value type, trivially copyable
+ * @tparam Search Intra-node search strategy
+ */
+template <typename Key, typename Value, typename Search = NodeSearch<Key>>
+class MappedBTree
+{
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys are stored as raw bytes");
+  static_assert(std::is_trivially_copyable<Value>::value, "Values are stored as raw bytes");
+
+public:
+  /**
+   * Size of the pages, a multiple of the virtual memory page size
+   */
+  static const size_t kPage = 4096;
+
+  /**
+   * Version of the file format, bumped on incompatible changes
+   */
+  static const uint32_t kVersion = 1;
+
+  /**
+   * Writes the items of a tree to a file, replacing it atomically: the
+   * pages go to a temporary file first, which is renamed once complete
+   */
+  template <typename T>
+  static void Save(T& tree, const std::string& path)
+  {
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wb");
+    if (!file)
+    {
+      throw std::runtime_error("Cannot create " + tmp);
+    }
+
+    try
+    {
+      Writer writer(file);
+      Header header = writer.Write(tree);
+      if (fseek(file, 0, SEEK_SET) != 0 ||
+          fwrite(&header, sizeof(header), 1, file) != 1 ||
+          fflush(file) != 0 || fsync(fileno(file)) != 0)
+      {
+        throw std::runtime_error("Cannot write " + tmp);
+      }
+    }
+    catch (...)
+    {
+      fclose(file);
+      unlink(tmp.c_str());
+      throw;
+    }
+
+    if (fclose(file) != 0 || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+      unlink(tmp.c_str());
+      throw std::runtime_error("Cannot write " + path);
+    }
+  }
+
+  /**
+   * Maps a file written by Save. Only the header is validated: Verify
+   * checks the pages themselves
+   */
+  explicit MappedBTree(const std::string& path)
+    : fd(-1)
+    , base(NULL)
+    , length(0)
+    , header(NULL)
+  {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Cannot open " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kPage)
+    {
+      Close();
+      throw std::runtime_error("Not a tree file: " + path);
+    }
+
+    length = static_cast<size_t>(st.st_size);
+    void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+      Close();
+      throw std::runtime_error("Cannot map " + path);
+    }
+    base = static_cast<const char *>(addr);
+    header = reinterpret_cast<const Header *>(base);
+
+    if (!Valid())
+    {
+      Close();
+      throw std::runtime_error("Not a tree file or unsupported format: " + path);
+    }
+  }
+
+  /**
+   * Unmaps the file
+   */
+  ~MappedBTree()
+  {
+    Close();
+  }
+
+  /**
+   * Retrieves an item from the tree
+   */
+  const Value& Find(const Key& key) const
+  {
+    const Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Retrieves an item from the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  const Value *TryFind(const Key& key) const
+  {
+    counters.AddShared(&Counters::finds);
+    if (header->size == 0)
+    {
+      return NULL;
+    }
+
+    for (const char *page = base + header->root; ; )
+    {
+      counters.AddShared(&Counters::visits);
+      counters.AddShared(&Counters::searches);
+      uint32_t n = Count(page);
+      const Key *keys = Keys(page);
+      int i = Search::LowerBound(keys, static_cast<int>(n), key);
+      if (static_cast<uint32_t>(i) < n && !(key < keys[i]))
+      {
+        return &Values(page)[i];
+      }
+
+      if (Leaf(page))
+      {
+        return NULL;
+      }
+      page = base + Children(page)[i];
+    }
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  bool Contains(const Key& key) const
+  {
+    return TryFind(key) != NULL;
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  template <typename Fn>
+  void Range(const Key& lo, const Key& hi, Fn fn) const
+  {
+    if (header->size > 0)
+    {
+      Scan(base + header->root, &lo, hi, fn);
+    }
+  }
+
+  /**
+   * Recomputes the checksum of the pages, reading the whole file
+   * @return True if it matches the one recorded in the header
+   */
+  bool Verify() const
+  {
+    return Checksum(base + kPage, header->pages * kPage) == header->checksum;
+  }
+
+  /**
+   * Returns the number of items in the tree
+   */
+  size_t GetSize() const
+  {
+    return header->size;
+  }
+
+  /**
+   * Returns the height of the tree
+   */
+  size_t GetHeight() const
+  {
+    return header->height;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters() const
+  {
+    return counters.Get();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset();
+  }
+
+private:
+  MappedBTree(const MappedBTree&);
+  MappedBTree& operator = (const MappedBTree&);
+
+  /**
+   * Contents of the first page of the file
+   */
+  struct Header
+  {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page;
+    uint32_t keySize;
+    uint32_t valueSize;
+    uint32_t leafCapacity;
+    uint32_t innerCapacity;
+    uint64_t pages;
+    uint64_t size;
+    uint64_t root;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t checksum;
+    uint64_t headerChecksum;
+  };
+
+  /**
+   * Identifies tree files. Read back in the wrong byte order, it does not
+   * match, so files are never used across architectures
+   */
+  static const uint64_t kMagic = 0x3145455254504D4Dull;
+
+  /**
+   * Number of items & leaf flag at the start of every page, then the keys
+   */
+  static const size_t kKeys = 8;
+
+  /**
+   * Leaves hold keys & values, internal nodes also the offsets of their
+   * children. The capacities leave room for alignment padding
+   */
+  static const size_t kLeafCapacity =
+      (kPage - kKeys - alignof(Value)) / (sizeof(Key) + sizeof(Value));
+  static const size_t kInnerCapacity =
+      (kPage - kKeys - alignof(Value) - 2 * sizeof(uint64_t)) /
+      (sizeof(Key) + sizeof(Value) + sizeof(uint64_t));
+
+  static const size_t kLeafValues =
+      (kKeys + kLeafCapacity * sizeof(Key) + alignof(Value) - 1) / alignof(Value) * alignof(Value);
+  static const size_t kInnerValues =
+      (kKeys + kInnerCapacity * sizeof(Key) + alignof(Value) - 1) / alignof(Value) * alignof(Value);
+  static const size_t kChildren =
+      (kInnerValues + kInnerCapacity * sizeof(Value) + 7) / 8 * 8;
+
+  static_assert(kInnerCapacity >= 2, "Keys & values do not fit in a page");
+  static_assert(kLeafValues + kLeafCapacity * sizeof(Value) <= kPage, "Leaf overflow");
+  static_assert(kChildren + (kInnerCapacity + 1) * sizeof(uint64_t) <= kPage, "Node overflow");
+
+  static uint32_t Count(const char *page)
+  {
+    return reinterpret_cast<const uint32_t *>(page)[0];
+  }
+
+  static bool Leaf(const char *page)
+  {
+    return reinterpret_cast<const uint32_t *>(page)[1] != 0;
+  }
+
+  static const Key *Keys(const char *page)
+  {
+    return reinterpret_cast<const Key *>(page + kKeys);
+  }
+
+  static const Value *Values(const char *page)
+  {
+    return reinterpret_cast<const Value *>(page + (Leaf(page) ? kLeafValues : kInnerValues));
+  }
+
+  static const uint64_t *Children(const char *page)
+  {
+    return reinterpret_cast<const uint64_t *>(page + kChildren);
+  }
+
+  /**
+   * FNV-1a over 64 bit words. Pages are whole numbers of words
+   */
+  static uint64_t Checksum(const char *data, size_t n, uint64_t hash = 14695981039346656037ull)
+  {
+    for (size_t i = 0; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+    {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof(word));
+      hash = (hash ^ word) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  /**
+   * Streams the pages of a file, tracking their checksum
+   */
+  class Writer
+  {
+  public:
+    explicit Writer(FILE *file)
+      : file(file)
+      , page(kPage)
+      , pages(0)
+      , checksum(14695981039346656037ull)
+      , prev()
+      , started(false)
+    {
+    }
+
+    /**
+     * Writes a blank header page, then the nodes of the tree
+     * @return Header describing the pages written
+     */
+    template <typename T>
+    Header Write(T& tree)
+    {
+      Flush(false);
+
+      // Leaves are filled straight from the iterator, setting aside the
+      // items which separate them
+      size_t n = tree.GetSize();
+      std::vector<std::pair<Key, Value>> seps;
+      uint64_t first = 1, count = 0;
+      uint32_t height = 0;
+      if (n > 0)
+      {
+        typename T::Iterator it = tree.Begin(), end = tree.End();
+        count = Groups(n, kLeafCapacity);
+        size_t items = n - (count - 1);
+        for (size_t g = 0; g < count; ++g)
+        {
+          uint32_t m = static_cast<uint32_t>(items / count + (g < items % count));
+          Start(m, true);
+          for (uint32_t i = 0; i < m; ++i)
+          {
+            std::pair<Key, Value> item = Next(it, end);
+            Item(kLeafValues, i, item.first, item.second);
+          }
+          Flush(true);
+
+          if (g + 1 < count)
+          {
+            seps.push_back(Next(it, end));
+          }
+        }
+        if (it != end)
+        {
+          throw std::runtime_error("Tree size does not match its items");
+        }
+        height = 1;
+      }
+
+      // Internal levels are built out of the separators, their children
+      // being the nodes of the previous level, in order
+      while (count > 1)
+      {
+        std::vector<std::pair<Key, Value>> up;
+        uint64_t below = first, c = 0;
+        size_t m = seps.size(), s = 0;
+        first = pages;
+        count = Groups(m, kInnerCapacity);
+        size_t items = m - (count - 1);
+        for (size_t g = 0; g < count; ++g)
+        {
+          uint32_t k = static_cast<uint32_t>(items / count + (g < items % count));
+          Start(k, false);
+          uint64_t *child = reinterpret_cast<uint64_t *>(&page[kChildren]);
+          for (uint32_t i = 0; i < k; ++i, ++s)
+          {
+            Item(kInnerValues, i, seps[s].first, seps[s].second);
+            child[i] = (below + c++) * kPage;
+          }
+          child[k] = (below + c++) * kPage;
+          Flush(true);
+
+          if (g + 1 < count)
+          {
+            up.push_back(seps[s++]);
+          }
+        }
+        seps.swap(up);
+        ++height;
+      }
+
+      Header header;
+      memset(&header, 0, sizeof(header));
+      header.magic = kMagic;
+      header.version = kVersion;
+      header.page = kPage;
+      header.keySize = sizeof(Key);
+      header.valueSize = sizeof(Value);
+      header.leafCapacity = kLeafCapacity;
+      header.innerCapacity = kInnerCapacity;
+      header.pages = pages - 1;
+      header.size = n;
+      header.root = n > 0 ? (pages - 1) * kPage : 0;
+      header.height = height;
+      header.checksum = checksum;
+      header.headerChecksum = HeaderChecksum(header);
+      return header;
+    }
+
+  private:
+    /**
+     * Takes the next item of a tree, checking that keys are increasing
+     */
+    template <typename It>
+    std::pair<Key, Value> Next(It& it, const It& end)
+    {
+      if (it == end)
+      {
+        throw std::runtime_error("Tree size does not match its items");
+      }
+      if (started && !(prev < it.GetKey()))
+      {
+        throw std::runtime_error("Keys are not sorted");
+      }
+      prev = it.GetKey();
+      started = true;
+
+      std::pair<Key, Value> item(it.GetKey(), it.GetValue());
+      ++it;
+      return item;
+    }
+
+    /**
+     * Number of nodes needed for m items, where all nodes but the last one
+     * are followed by a separator: g nodes hold up to g * capacity + g - 1
+     */
+    static size_t Groups(size_t m, size_t capacity)
+    {
+      return (m + capacity + 1) / (capacity + 1);
+    }
+
+    void Start(uint32_t n, bool leaf)
+    {
+      memset(&page[0], 0, kPage);
+      uint32_t *head = reinterpret_cast<uint32_t *>(&page[0]);
+      head[0] = n;
+      head[1] = leaf;
+    }
+
+    void Item(size_t values, uint32_t i, const Key& key, const Value& value)
+    {
+      memcpy(&page[kKeys + i * sizeof(Key)], &key, sizeof(Key));
+      memcpy(&page[values + i * sizeof(Value)], &value, sizeof(Value));
+    }
+
+    void Flush(bool node)
+    {
+      if (!node)
+      {
+        memset(&page[0], 0, kPage);
+      }
+      if (fwrite(&page[0], kPage, 1, file) != 1)
+      {
+        throw std::runtime_error("Cannot write tree file");
+      }
+      if (node)
+      {
+        checksum = Checksum(&page[0], kPage, checksum);
+      }
+      ++pages;
+    }
+
+    FILE              *file;
+    std::vector<char>  page;
+    uint64_t           pages;
+    uint64_t           checksum;
+    Key                prev;
+    bool               started;
+  };
+
+  static uint64_t HeaderChecksum(const Header& header)
+  {
+    return Checksum(reinterpret_cast<const char *>(&header), offsetof(Header, headerChecksum));
+  }
+
+  /**
+   * Checks that the header matches the layout of this build & the size of
+   * the file, so that lookups stay within the mapping
+   */
+  bool Valid() const
+  {
+    return header->magic == kMagic &&
+           header->version == kVersion &&
+           header->page == kPage &&
+           header->keySize == sizeof(Key) &&
+           header->valueSize == sizeof(Value) &&
+           header->leafCapacity == kLeafCapacity &&
+           header->innerCapacity == kInnerCapacity &&
+           header->headerChecksum == HeaderChecksum(*header) &&
+           (header->pages + 1) * kPage == length &&
+           header->root % kPage == 0 &&
+           header->root < length &&
+           (header->size == 0 || header->root > 0);
+  }
+
+  /**
+   * Visits the items of a subtree not less than *lo & less than hi, in
+   * order. Once the first item is found, lo is dropped, as all further
+   * items are larger
+   * @return False once an item not less than hi was reached
+   */
+  template <typename Fn>
+  bool Scan(const char *page, const Key *lo, const Key& hi, Fn& fn) const
+  {
+    uint32_t n = Count(page);
+    const Key *keys = Keys(page);
+    const Value *values = Values(page);
+    uint32_t i = lo ? static_cast<uint32_t>(Search::LowerBound(keys, static_cast<int>(n), *lo)) : 0;
+    for (; ; ++i)
+    {
+      if (!Leaf(page) && !Scan(base + Children(page)[i], lo, hi, fn))
+      {
+        return false;
+      }
+      lo = NULL;
+
+      if (i >= n)
+      {
+        return true;
+      }
+      if (!(keys[i] < hi))
+      {
+        return false;
+      }
+      fn(keys[i], values[i]);
+    }
+  }
+
+  void Close()
+  {
+    if (base)
+    {
+      munmap(const_cast<char *>(base), length);
+      base = NULL;
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  /**
+   * Descriptor of the mapped file
+   */
+  int fd;
+
+  /**
+   * Start of the mapping
+   */
+  const char *base;
+
+  /**
+   * Length of the mapping
+   */
+  size_t length;
+
+  /**
+   * Header of the file, in the first page
+   */
+  const Header *header;
+  /**
+   * Operation counters, updated by concurrent readers, empty unless
+   * TREES_COUNTERS is set
+   */
+  mutable CounterSet<> counters;
+};
+
+#endif /*__MAPPEDBTREE_H__*/
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "Pool.h"
+#include "Iterator.h"
+#include "Search.h"
+#include "Batch.h"
+#include "Snapshot.h"
+#include "BTree.h"
+#include "MappedBTree.h"
+using namespace std;
+
+typedef uint32_t Key;
+typedef uint32_t Value;
+
+/**
+ * Maps an index to a key, as in the other benchmarks
+ */
+static inline Key Scramble(uint64_t i)
+{
+  return static_cast<Key>(i * 2654435761u);
+}
+
+struct Options
+{
+  uint64_t size;
+  uint64_t lookups;
+  string   path;
+  unsigned seed;
+  string   label;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double Elapsed(Clock::time_point begin)
+{
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+static void Report(const Options& opt, const char *phase, uint64_t ops, double seconds)
+{
+  printf("%s,%s,%llu,%llu,%.6f,%.1f\n",
+      opt.label.c_str(), phase, (unsigned long long)opt.size,
+      (unsigned long long)ops, seconds, seconds > 0 ? ops / seconds : 0.0);
+  fflush(stdout);
+}
+
+/**
+ * Drops the pages of a file from the page cache, so that the next open
+ * reads them from the disk. Pages of files on tmpfs cannot be dropped
+ */
+static void Evict(const string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+  {
+    cerr << "Cannot evict " << path << " from the page cache" << endl;
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+/**
+ * Opens the file & looks up random keys, as a process serving requests
+ * right after its start would
+ */
+static void Open(const Options& opt, const char *open, const char *lookup)
+{
+  Clock::time_point begin = Clock::now();
+  MappedBTree<Key, Value> tree(opt.path);
+  Report(opt, open, 1, Elapsed(begin));
+
+  std::mt19937_64 rng(opt.seed);
+  uint64_t sink = 0;
+  begin = Clock::now();
+  for (uint64_t i = 0; i < opt.lookups; ++i)
+  {
+    const Value *value = tree.TryFind(Scramble(rng() % opt.size));
+    sink += value ? *value : 0;
+  }
+  Report(opt, lookup, opt.lookups, Elapsed(begin));
+
+  if (sink == 0)
+  {
+    cerr << "No key found" << endl;
+  }
+}
+
+static void Usage(const char *argv0)
+{
+  cerr
+    << "Usage: " << argv0 << " [options]\n"
+    << "  --size N          keys in the tree (default: 1e7)\n"
+    << "  --lookups N       lookups after each open (default: 1e5)\n"
+    << "  --path PATH       tree file, removed afterwards\n"
+    << "                    (default: bench-mapped.tree)\n"
+    << "  --seed N          random seed (default: 1)\n"
+    << "  --label STR       label attached to every row, e.g. a commit hash\n";
+}
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  opt.size = 10000000;
+  opt.lookups = 100000;
+  opt.path = "bench-mapped.tree";
+  opt.seed = 1;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "-h" || arg == "--help")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+
+    if (i + 1 >= argc)
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    string val = argv[++i];
+    if (arg == "--size")
+    {
+      opt.size = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--lookups")
+    {
+      opt.lookups = static_cast<uint64_t>(atof(val.c_str()));
+    }
+    else if (arg == "--path")
+    {
+      opt.path = val;
+    }
+    else if (arg == "--seed")
+    {
+      opt.seed = static_cast<unsigned>(atoi(val.c_str()));
+    }
+    else if (arg == "--label")
+    {
+      opt.label = val;
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opt.size == 0 || opt.size > 0xFFFFFFFFull)
+  {
+    cerr << "Invalid size: " << opt.size << endl;
+    return EXIT_FAILURE;
+  }
+
+  printf("label,phase,size,ops,seconds,ops_per_sec\n");
+  try
+  {
+    // Building the tree is what a process without the file does at startup
+    {
+      Clock::time_point begin = Clock::now();
+      BTree<Key, Value, 64> tree;
+      for (uint64_t i = 0; i < opt.size; ++i)
+      {
+        tree.Insert(Scramble(i), static_cast<Value>(i));
+      }
+      Report(opt, "rebuild", opt.size, Elapsed(begin));
+
+      begin = Clock::now();
+      MappedBTree<Key, Value>::Save(tree, opt.path);
+      Report(opt, "save", opt.size, Elapsed(begin));
+    }
+
+    Evict(opt.path);
+    Open(opt, "open-cold", "lookup-cold");
+
+    // Reading the whole file leaves it in the page cache
+    {
+      MappedBTree<Key, Value> tree(opt.path);
+      Clock::time_point begin = Clock::now();
+      if (!tree.Verify())
+      {
+        throw std::runtime_error("Checksum mismatch");
+      }
+      Report(opt, "verify", opt.size, Elapsed(begin));
+    }
+    Open(opt, "open-warm", "lookup-warm");
+  }
+  catch (const std::exception& e)
+  {
+    cerr << e.what() << endl;
+    remove(opt.path.c_str());
+    return EXIT_FAILURE;
+  }
+
+  remove(opt.path.c_str());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,673 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+
+/**
+ * Slab allocator for tree nodes. Objects are carved out of large contiguous
+ * chunks and freed objects are recycled through an intrusive free list.
+ * Releasing the pool frees every chunk at once, without visiting objects.
+ * Pools can share chunks, so that trees can hand nodes over to each other;
+ * a chunk is freed once the last pool holding it lets go
+ *
+ * @tparam T Type of the objects
+ */
+template <typename T>
+class Pool
+{
+public:
+  /**
+   * Creates an empty pool
+   */
+  Pool()
+    : free(NULL)
+    , tail(NULL)
+    , next(NULL)
+    , end(NULL)
+    , capacity(kMinChunk)
+    , reserved(0)
+  {
+  }
+
+  /**
+   * Releases all chunks. Destructors of live objects are not run
+   */
+  ~Pool()
+  {
+    Release();
+  }
+
+  /**
+   * Constructs a new object
+   */
+  template <typename... Args>
+  T *Alloc(Args&&... args)
+  {
+    Slot *slot;
+    if (free)
+    {
+      slot = free;
+      free = free->next;
+      if (!free)
+      {
+        tail = NULL;
+      }
+    }
+    else
+    {
+      if (next == end)
+      {
+        Grow();
+      }
+      slot = next++;
+    }
+
+    return new (&slot->data) T(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Destroys an object & returns its slot to the free list
+   */
+  void Free(T *ptr)
+  {
+    ptr->~T();
+
+    Slot *slot = reinterpret_cast<Slot *>(ptr);
+    slot->next = free;
+    if (!free)
+    {
+      tail = slot;
+    }
+    free = slot;
+  }
+
+  /**
+   * Lets go of all chunks in O(chunks). Destructors of live objects are not
+   * run
+   */
+  void Release()
+  {
+    chunks.clear();
+    free = tail = next = end = NULL;
+    capacity = kMinChunk;
+    reserved = 0;
+  }
+
+  /**
+   * Holds on to the chunks of another pool too, so that objects allocated
+   * by it can be freed through this one
+   */
+  void Share(const Pool& other)
+  {
+    chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+    Dedupe();
+  }
+
+  /**
+   * Takes over the chunks & free slots of another pool, which is left empty.
+   * The free lists are spliced in O(1)
+   */
+  void Absorb(Pool& other)
+  {
+    if (other.free)
+    {
+      other.tail->next = free;
+      if (!free)
+      {
+        tail = other.tail;
+      }
+      free = other.free;
+    }
+
+    if (other.end - other.next > end - next)
+    {
+      next = other.next;
+      end = other.end;
+    }
+
+    Share(other);
+    other.Release();
+  }
+
+  /**
+   * Returns the number of bytes held by the chunks, free slots included.
+   * Chunks shared with other pools count in each of them
+   */
+  size_t GetBytes() const
+  {
+    return reserved * sizeof(Slot);
+  }
+
+private:
+  Pool(const Pool&);
+  Pool& operator = (const Pool&);
+
+  /**
+   * Storage for a single object, or a link in the free list
+   */
+  union Slot
+  {
+    Slot *next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+  };
+
+  /**
+   * Contiguous block of slots
+   */
+  struct Chunk
+  {
+    explicit Chunk(size_t size)
+      : slots(new Slot[size])
+      , size(size)
+    {
+    }
+
+    ~Chunk()
+    {
+      delete[] slots;
+    }
+
+    Slot  *slots;
+    size_t size;
+  };
+
+  /**
+   * Allocates a new chunk, doubling the chunk size up to a limit
+   */
+  void Grow()
+  {
+    chunks.push_back(std::make_shared<Chunk>(capacity));
+    next = chunks.back()->slots;
+    end = next + capacity;
+    reserved += capacity;
+    capacity = capacity < kMaxChunk ? capacity * 2 : kMaxChunk;
+  }
+
+  /**
+   * Drops the chunks held twice & recounts the slots
+   */
+  void Dedupe()
+  {
+    std::sort(chunks.begin(), chunks.end());
+    chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+    reserved = 0;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+      reserved += chunks[i]->size;
+    }
+  }
+
+  /**
+   * Number of objects in the first & largest chunks
+   */
+  static const size_t kMinChunk = 64;
+  static const size_t kMaxChunk = 64 * 1024;
+
+  /**
+   * List of free slots
+   */
+  Slot *free;
+
+  /**
+   * Last slot of the free list, or NULL if it is empty
+   */
+  Slot *tail;
+
+  /**
+   * Next unused slot in the current chunk
+   */
+  Slot *next;
+
+  /**
+   * End of the current chunk
+   */
+  Slot *end;
+
+  /**
+   * Size of the next chunk
+   */
+  size_t capacity;
+
+  /**
+   * Number of slots in all chunks
+   */
+  size_t reserved;
+
+  /**
+   * All chunks held by the pool
+   */
+  std::vector<std::shared_ptr<Chunk>> chunks;
+};
+
+/**
+ * Process-wide address range for the objects of one type, addressed by
+ * 32-bit indices. 2^32 slots are reserved up front without memory behind
+ * them & handed out to pools in fixed-size chunks, which are only made
+ * accessible then. Index 0 is never handed out, so it can stand for NULL
+ *
+ * @tparam T Type of the objects
+ */
+template <typename T>
+class Arena
+{
+public:
+  /**
+   * Number of slots in a chunk
+   */
+  static const uint32_t kChunk = 16 * 1024;
+
+  /**
+   * Returns the object at an index, which must not be 0
+   */
+  static T *At(uint32_t index)
+  {
+    return base + index;
+  }
+
+  /**
+   * Returns the index of an object, or 0 for NULL
+   */
+  static uint32_t IndexOf(const T *ptr)
+  {
+    return ptr ? static_cast<uint32_t>(ptr - base) : 0;
+  }
+
+  /**
+   * Makes a chunk accessible & returns the index of its first slot
+   */
+  static uint32_t Acquire()
+  {
+    std::lock_guard<std::mutex> lock(GetMutex());
+    if (base == NULL)
+    {
+      void *range = mmap(NULL, kSlots * sizeof(T), PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (range == MAP_FAILED)
+      {
+        throw std::bad_alloc();
+      }
+      base = static_cast<T *>(range);
+      GetRefs().resize(kSlots / kChunk);
+    }
+
+    // The first chunk holds index 0, so it is never used
+    std::vector<uint32_t>& free = GetFree();
+    uint32_t first;
+    if (!free.empty())
+    {
+      first = free.back();
+      free.pop_back();
+    }
+    else if (top + 2 * kChunk < kSlots)
+    {
+      first = static_cast<uint32_t>(top += kChunk);
+    }
+    else
+    {
+      throw std::bad_alloc();
+    }
+
+    if (mprotect(base + first, kChunk * sizeof(T), PROT_READ | PROT_WRITE) != 0)
+    {
+      free.push_back(first);
+      throw std::bad_alloc();
+    }
+    GetRefs()[first / kChunk] = 1;
+    return first;
+  }
+
+  /**
+   * Adds a reference to a chunk, for a pool sharing it
+   */
+  static void Retain(uint32_t first)
+  {
+    std::lock_guard<std::mutex> lock(GetMutex());
+    ++GetRefs()[first / kChunk];
+  }
+
+  /**
+   * Drops a reference to a chunk. The last one returns the memory of the
+   * chunk to the system & recycles its indices
+   */
+  static void Return(uint32_t first)
+  {
+    std::lock_guard<std::mutex> lock(GetMutex());
+    if (--GetRefs()[first / kChunk] == 0)
+    {
+      mmap(base + first, kChunk * sizeof(T), PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      GetFree().push_back(first);
+    }
+  }
+
+private:
+  /**
+   * Number of slots in the range
+   */
+  static const uint64_t kSlots = 1ull << 32;
+
+  static std::mutex& GetMutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::vector<uint32_t>& GetFree()
+  {
+    static std::vector<uint32_t> free;
+    return free;
+  }
+
+  /**
+   * Number of pools holding each chunk
+   */
+  static std::vector<uint32_t>& GetRefs()
+  {
+    static std::vector<uint32_t> refs;
+    return refs;
+  }
+
+  /**
+   * Start of the range, set once by the first chunk
+   */
+  static T *base;
+
+  /**
+   * First slot of the last chunk handed out
+   */
+  static uint64_t top;
+};
+
+template <typename T>
+T *Arena<T>::base = NULL;
+
+template <typename T>
+uint64_t Arena<T>::top = 0;
+
+/**
+ * 32-bit reference to an object of an Arena, used in place of a pointer.
+ * Handles convert to & from raw pointers, so code written against pointer
+ * links works unchanged
+ *
+ * @tparam T Type of the objects
+ */
+template <typename T>
+class Handle
+{
+public:
+  Handle()
+    : index(0)
+  {
+  }
+
+  Handle(T *ptr)
+    : index(Arena<T>::IndexOf(ptr))
+  {
+  }
+
+  Handle& operator = (T *ptr)
+  {
+    index = Arena<T>::IndexOf(ptr);
+    return *this;
+  }
+
+  operator T *() const
+  {
+    return index ? Arena<T>::At(index) : NULL;
+  }
+
+  explicit operator bool () const
+  {
+    return index != 0;
+  }
+
+  T *operator -> () const
+  {
+    return Arena<T>::At(index);
+  }
+
+private:
+  uint32_t index;
+};
+
+/**
+ * Pool allocating objects out of an Arena, so that they can be referenced
+ * through 32-bit Handles. Free slots are linked by index, which keeps the
+ * slots as small & aligned as the objects themselves. Releasing the pool
+ * returns every chunk at once, without visiting objects. As with Pool,
+ * chunks can be shared with other pools
+ *
+ * @tparam T Type of the objects
+ */
+template <typename T>
+class CompactPool
+{
+  static_assert(sizeof(T) >= sizeof(uint32_t) && alignof(T) >= alignof(uint32_t),
+                "Free slots must hold an index");
+
+public:
+  /**
+   * Creates an empty pool
+   */
+  CompactPool()
+    : free(0)
+    , tail(0)
+    , next(0)
+    , end(0)
+  {
+  }
+
+  /**
+   * Releases all chunks. Destructors of live objects are not run
+   */
+  ~CompactPool()
+  {
+    Release();
+  }
+
+  /**
+   * Constructs a new object
+   */
+  template <typename... Args>
+  T *Alloc(Args&&... args)
+  {
+    uint32_t slot;
+    if (free)
+    {
+      slot = free;
+      free = Link(slot);
+      if (!free)
+      {
+        tail = 0;
+      }
+    }
+    else
+    {
+      if (next == end)
+      {
+        next = Arena<T>::Acquire();
+        end = next + Arena<T>::kChunk;
+        chunks.push_back(next);
+      }
+      slot = next++;
+    }
+
+    return new (Arena<T>::At(slot)) T(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Destroys an object & returns its slot to the free list
+   */
+  void Free(T *ptr)
+  {
+    ptr->~T();
+    uint32_t slot = Arena<T>::IndexOf(ptr);
+    Link(slot) = free;
+    if (!free)
+    {
+      tail = slot;
+    }
+    free = slot;
+  }
+
+  /**
+   * Returns all chunks to the arena. Destructors of live objects are not run
+   */
+  void Release()
+  {
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+      Arena<T>::Return(chunks[i]);
+    }
+
+    chunks.clear();
+    free = tail = next = end = 0;
+  }
+
+  /**
+   * Holds on to the chunks of another pool too, so that objects allocated
+   * by it can be freed through this one
+   */
+  void Share(const CompactPool& other)
+  {
+    std::vector<uint32_t> held(chunks);
+    std::sort(held.begin(), held.end());
+    for (size_t i = 0; i < other.chunks.size(); ++i)
+    {
+      if (!std::binary_search(held.begin(), held.end(), other.chunks[i]))
+      {
+        Arena<T>::Retain(other.chunks[i]);
+        chunks.push_back(other.chunks[i]);
+      }
+    }
+  }
+
+  /**
+   * Takes over the chunks & free slots of another pool, which is left empty.
+   * The free lists are spliced in O(1)
+   */
+  void Absorb(CompactPool& other)
+  {
+    if (other.free)
+    {
+      Link(other.tail) = free;
+      if (!free)
+      {
+        tail = other.tail;
+      }
+      free = other.free;
+    }
+
+    if (other.end - other.next > end - next)
+    {
+      next = other.next;
+      end = other.end;
+    }
+
+    Share(other);
+    other.Release();
+  }
+
+  /**
+   * Returns the number of bytes held by the chunks, free slots included.
+   * Chunks shared with other pools count in each of them
+   */
+  size_t GetBytes() const
+  {
+    return chunks.size() * Arena<T>::kChunk * sizeof(T);
+  }
+
+private:
+  CompactPool(const CompactPool&);
+  CompactPool& operator = (const CompactPool&);
+
+  /**
+   * Returns the link to the next free slot, stored in a free slot
+   */
+  static uint32_t& Link(uint32_t slot)
+  {
+    return *reinterpret_cast<uint32_t *>(Arena<T>::At(slot));
+  }
+
+  /**
+   * Head of the list of free slots, or 0
+   */
+  uint32_t free;
+
+  /**
+   * Last slot of the free list, or 0 if it is empty
+   */
+  uint32_t tail;
+
+  /**
+   * Next unused slot in the current chunk
+   */
+  uint32_t next;
+
+  /**
+   * End of the current chunk
+   */
+  uint32_t end;
+
+  /**
+   * First slots of all chunks held by the pool
+   */
+  std::vector<uint32_t> chunks;
+};
+
+/**
+ * Node layout of the binary trees: 64-bit pointers between nodes & subtree
+ * sizes as wide as size_t
+ */
+struct WideNodes
+{
+  template <typename T>
+  using Link = T *;
+
+  template <typename T>
+  using Allocator = Pool<T>;
+
+  typedef size_t Count;
+
+  static const bool kPersistent = false;
+};
+
+/**
+ * Compact node layout of the binary trees: nodes come from an Arena & link
+ * to each other through 32-bit Handles, while subtree sizes are narrowed to
+ * 32 bits. A process can hold up to 2^32 - 2^15 nodes of each node type
+ * this way; for small keys & values, nodes shrink by 40%
+ */
+struct CompactNodes
+{
+  template <typename T>
+  using Link = Handle<T>;
+
+  template <typename T>
+  using Allocator = CompactPool<T>;
+
+  typedef uint32_t Count;
+
+  static const bool kPersistent = false;
+};
+
+/**
+ * Wide node layout stamped with versions, for trees handing out snapshots:
+ * nodes a live snapshot may reach are copied before they are modified, so
+ * updates copy the path they change instead of writing to it
+ */
+struct PersistentNodes : public WideNodes
+{
+  static const bool kPersistent = true;
+};
+
+#endif /*__POOL_H__*/
@@ -1,123 +1,344 @@
 #ifndef __RBTREE_H__
 #define __RBTREE_H__
 
-template<typename Key, typename Value>
-class RBTree : public Tree<Key, Value>
+/**
+ * Red-Black tree with parent links & subtree sizes
+ *
+ * @tparam Key     Key types, must support total ordering
+ * @tparam Value   Value types
+ * @tparam Compare Comparator ordering the keys
+ * @tparam Layout  Node layout, WideNodes or CompactNodes
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Layout = WideNodes>
+class RBTree : public TreeBase<RBTree<Key, Value, Compare, Layout>, Key, Value>
 {
+  class Node;
+
 public:
   /**
-   * Creates an empty Red-Black tree
+   * Type the keys of type K are looked up as
    */
-  RBTree()
-    : root(NULL)
-    , size(0)
-  {
-  }
+  template <typename K>
+  using Lookup = typename LookupKey<Compare, Key, K>::Type;
 
   /**
-   * Destroys the Red-Black tree
+   * Bidirectional iterator over the items, in key order. Steps follow the
+   * parent links. Iterators are invalidated by modifications of the tree
    */
-  ~RBTree()
+  class Iterator
   {
-    if (root)
+  public:
+    const Key& GetKey() const
     {
-      delete root;
+      return node->key;
     }
-  }
 
-  /**
-   * Inserts a new item into the tree
-   */
-  void Insert(const Key& key, const Value& value)
-  {
-    Node *node = root, *parent = NULL;
-
-    if (!root)
+    Value& GetValue() const
     {
-      root = new Node();
-      root->red = false;
-      root->key = key;
-      root->value = value;
-      ++size;
+      return node->value;
     }
-    else
+
+    Iterator& operator ++ ()
     {
-      while (node)
+      if (node->right)
       {
-        parent = node;
-        if (key < node->key)
+        node = node->right;
+        while (node->left)
         {
           node = node->left;
         }
-        else if (key == node->key)
+      }
+      else
+      {
+        Node *child;
+        do
         {
-          node->value = value;
-          return;
+          child = node;
+          node = node->parent;
         }
-        else
+        while (node && node->right == child);
+      }
+      return *this;
+    }
+
+    Iterator& operator -- ()
+    {
+      if (!node)
+      {
+        node = tree->root;
+        while (node && node->right)
         {
           node = node->right;
         }
       }
-
-      node = new Node();
-      node->red = true;
-      node->key = key;
-      node->value = value;
-      node->parent = parent;
-      ++size;
-
-      if (node->key < parent->key)
+      else if (node->left)
       {
-        parent->left = node;
+        node = node->left;
+        while (node->right)
+        {
+          node = node->right;
+        }
       }
       else
       {
-        parent->right = node;
+        Node *child;
+        do
+        {
+          child = node;
+          node = node->parent;
+        }
+        while (node && node->left == child);
       }
+      return *this;
+    }
+
+    Iterator operator ++ (int)
+    {
+      Iterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    Iterator operator -- (int)
+    {
+      Iterator it(*this);
+      --*this;
+      return it;
+    }
 
-      InsertFixup(node);
+    bool operator == (const Iterator& that) const
+    {
+      return node == that.node;
+    }
+
+    bool operator != (const Iterator& that) const
+    {
+      return node != that.node;
+    }
+
+  private:
+    friend class RBTree;
+
+    Iterator(Node *node, RBTree *tree)
+      : node(node)
+      , tree(tree)
+    {
+    }
+
+    /**
+     * Current node, NULL past the end
+     */
+    Node *node;
+
+    /**
+     * Tree being iterated, used to step back from the end
+     */
+    RBTree *tree;
+  };
+
+  /**
+   * Creates an empty Red-Black tree
+   */
+  explicit RBTree(const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
+    , size(0)
+    , depths(0)
+  {
+  }
+
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  RBTree(It begin, It end, const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
+    , size(0)
+    , depths(0)
+  {
+    BulkLoad(begin, end);
+  }
+
+  /**
+   * Destroys the Red-Black tree
+   */
+  ~RBTree()
+  {
+    if (!std::is_trivially_destructible<Node>::value)
+    {
+      Destroy(root);
     }
   }
 
   /**
-   * Retrieves an item from the tree
+   * Inserts a new item into the tree
    */
-  Value& Find(const Key& key)
+  void Insert(const Key& key, const Value& value)
   {
+    Emplace(key, value);
+  }
+
+  /**
+   * Inserts a new item into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Emplace(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    return InsertItem(true, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    return InsertItem(false, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. The tree is built perfectly balanced in O(n):
+   * all levels are full except for the last one, whose nodes are red
+   */
+  template <typename It>
+  void BulkLoad(It begin, It end)
+  {
+    if (root)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+
+    size = this->CountSorted(begin, end, compare);
+
+    size_t red = 0;
+    while ((static_cast<size_t>(2) << red) <= size)
+    {
+      ++red;
+    }
+    if (((size + 1) & size) == 0)
+    {
+      red = static_cast<size_t>(-1);
+    }
+
+    root = Build(begin, size, 0, red);
+  }
+
+  /**
+   * Retrieves an item from the tree. With a transparent comparator, key can be
+   * of any type comparable with Key
+   */
+  template <typename K>
+  Value& Find(const K& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Retrieves an item from the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *TryFind(const K& arg)
+  {
+    const Lookup<K>& key = arg;
     Node *node = root;
+    counters.Add(&Counters::finds);
     while (node)
     {
-      if (node->key > key)
+      counters.Add(&Counters::visits);
+      if (compare(key, node->key))
       {
         node = node->left;
       }
-      else if (node->key < key)
+      else if (compare(node->key, key))
       {
         node = node->right;
       }
       else
       {
-        return node->value;
+        return &node->value;
       }
     }
 
-    throw std::runtime_error("Key not found");
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  template <typename K>
+  bool Contains(const K& key)
+  {
+    return TryFind(key) != NULL;
+  }
+
+  /**
+   * Looks up n keys with their cache misses overlapped. Stores a pointer
+   * to the value of each key in out, or NULL if the key is missing
+   */
+  size_t FindBatch(const Key *keys, size_t n, Value **out)
+  {
+    counters.Add(&Counters::finds, n);
+    return Batch<Node, Key, Value, Comparator<Compare>>::Find(root, keys, n, out, compare);
+  }
+
+  /**
+   * Inserts n items, updating the keys already present in groups
+   */
+  void InsertBatch(const Key *keys, const Value *values, size_t n)
+  {
+    Batch<Node, Key, Value, Comparator<Compare>>::Insert(this, &root, keys, values, n, compare);
   }
 
   /**
    * Deletes an item from the tree
    */
-  void Delete(const Key& key)
+  template <typename K>
+  void Delete(const K& key)
   {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an item from the tree if the key is present
+   * @return True if an item was removed
+   */
+  template <typename K>
+  bool Erase(const K& arg)
+  {
+    const Lookup<K>& key = arg;
     Node *node = root;
     while (node)
     {
-      if (node->key > key)
+      if (compare(key, node->key))
       {
         node = node->left;
       }
-      else if (node->key < key)
+      else if (compare(node->key, key))
       {
         node = node->right;
       }
@@ -127,13 +348,13 @@ public:
       }
     }
 
-    if (!node || node->key != key)
+    if (!node)
     {
-      throw std::runtime_error("Key not found");
+      return false;
     }
 
-    bool red = true;
-    Node *sub, *succ;
+    bool red = node->red;
+    Node *sub, *succ, *parent = node->parent;
     if (!node->left)
     {
       Transplant(node, sub = node->right);
@@ -150,10 +371,11 @@ public:
 
       if (succ->parent == node)
       {
-        sub->parent = node;
+        parent = succ;
       }
       else
       {
+        parent = succ->parent;
         Transplant(succ, succ->right);
         succ->right = node->right;
         succ->right->parent = succ;
@@ -165,16 +387,195 @@ public:
       succ->red = node->red;
     }
 
-    node->left = node->right = NULL;
-    delete node;
+    depths -= node->weight;
+    counters.Add(&Counters::frees);
+    pool.Free(node);
     --size;
 
     if (!red)
     {
-      DeleteFixup(sub);
+      DeleteFixup(sub, parent);
+    }
+
+    // Subtree sizes & heights change on the path from the spliced position
+    // upwards. Rotations keep that position below the nodes they move up
+    for (Node *p = parent; p; p = p->parent)
+    {
+      Update(p);
+    }
+    return true;
+  }
+
+  /**
+   * Removes all items. The nodes are not visited unless they need their
+   * destructors run; their memory goes back in whole chunks
+   */
+  void Clear()
+  {
+    if (!std::is_trivially_destructible<Node>::value)
+    {
+      Destroy(root);
+    }
+    counters.Add(&Counters::frees, size);
+    pool.Release();
+    root = NULL;
+    size = 0;
+    depths = 0;
+  }
+
+  /**
+   * Returns an iterator to the smallest item
+   */
+  Iterator Begin()
+  {
+    Node *node = root;
+    while (node && node->left)
+    {
+      node = node->left;
+    }
+    return Iterator(node, this);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator(NULL, this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   */
+  template <typename K>
+  Iterator LowerBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    Node *node = root, *found = NULL;
+    while (node)
+    {
+      if (compare(node->key, key))
+      {
+        node = node->right;
+      }
+      else
+      {
+        found = node;
+        node = node->left;
+      }
+    }
+    return Iterator(found, this);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key
+   */
+  template <typename K>
+  Iterator UpperBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    Node *node = root, *found = NULL;
+    while (node)
+    {
+      if (compare(key, node->key))
+      {
+        found = node;
+        node = node->left;
+      }
+      else
+      {
+        node = node->right;
+      }
+    }
+    return Iterator(found, this);
+  }
+
+  /**
+   * Returns an iterator to the k-th smallest item, counting from zero, or
+   * the past-the-end iterator if k is out of range, in O(log n)
+   */
+  Iterator Select(size_t k)
+  {
+    Node *node = root;
+    while (node)
+    {
+      size_t left = Node::Count(node->left);
+      if (k < left)
+      {
+        node = node->left;
+      }
+      else if (k == left)
+      {
+        break;
+      }
+      else
+      {
+        k -= left + 1;
+        node = node->right;
+      }
+    }
+    return Iterator(node, this);
+  }
+
+  /**
+   * Returns the number of keys less than key, in O(log n)
+   */
+  template <typename K>
+  size_t Rank(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    size_t rank = 0;
+    for (Node *node = root; node; )
+    {
+      if (compare(node->key, key))
+      {
+        rank += Node::Count(node->left) + 1;
+        node = node->right;
+      }
+      else
+      {
+        node = node->left;
+      }
+    }
+    return rank;
+  }
+
+  /**
+   * Returns the number of keys in [lo, hi), in O(log n)
+   */
+  template <typename L, typename H>
+  size_t CountRange(const L& lo, const H& hi)
+  {
+    // Lookup keys are only ever compared with keys of the tree
+    size_t l = Rank(lo), h = Rank(hi);
+    return l < h ? h - l : 0;
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  template <typename L, typename H, typename Fn>
+  void Range(const L& lo, const H& hi, Fn fn)
+  {
+    const Lookup<H>& h = hi;
+    for (Iterator it = LowerBound(lo), end = End(); it != end; ++it)
+    {
+      if (!compare(it.GetKey(), h))
+      {
+        break;
+      }
+      fn(it.GetKey(), it.GetValue());
     }
   }
 
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<Key, Key, const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
+  }
+
   /**
    * Returns the number of items in the tree
    */
@@ -184,11 +585,40 @@ public:
   }
 
   /**
-   * Returns the height of the tree
+   * Returns the height of the tree, in O(1)
    */
   size_t GetHeight()
   {
-    return root ? root->GetHeight() : 0;
+    return root ? root->height : 0;
+  }
+
+  /**
+   * Returns the structural statistics of the tree, in O(1)
+   */
+  Stats GetStats()
+  {
+    Stats stats;
+    stats.nodes = size;
+    stats.fill = size ? 1.0 : 0.0;
+    stats.depth = size ? static_cast<double>(depths) / size : 0.0;
+    stats.bytes = pool.GetBytes();
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return counters.Get(compare);
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset(compare);
   }
 
 private:
@@ -199,10 +629,21 @@ private:
   {
   public:
     /**
-     * Allocates an empty node
+     * Reference to another node, a pointer or an index
      */
-    Node()
+    typedef typename Layout::template Link<Node> Link;
+
+    /**
+     * Allocates a black leaf, constructing the key & value from the
+     * arguments
+     */
+    template <typename K, typename... Args>
+    Node(K&& key, Args&&... args)
       : red(false)
+      , height(1)
+      , weight(1)
+      , key(std::forward<K>(key))
+      , value(std::forward<Args>(args)...)
       , parent(NULL)
       , left(NULL)
       , right(NULL)
@@ -210,46 +651,45 @@ private:
     }
 
     /**
-     * Frees the node & its children
+     * Returns the number of nodes in a subtree
      */
-    ~Node()
+    static size_t Count(const Node *node)
     {
-      if (left)
-      {
-        delete left;
-      }
-
-      if (right)
-      {
-        delete right;
-      }
+      return node ? node->weight : 0;
     }
 
     /**
-     * Returns the height of a node
+     * Returns the height of a subtree
      */
-    size_t GetHeight()
+    static uint32_t Height(const Node *node)
     {
-      size_t h = 0;
-
-      if (left)
-      {
-        h = std::max(h, left->GetHeight());
-      }
-
-      if (right)
-      {
-        h = std::max(h, right->GetHeight());
-      }
+      return node ? node->height : 0;
+    }
 
-      return h + 1;
+    /**
+     * Computes the size & height of the subtree rooted at the node
+     */
+    void ComputeWeight()
+    {
+      weight = 1 + Count(left) + Count(right);
+      height = 1 + std::max(Height(left), Height(right));
     }
 
   public:
     /**
-     * True if the node is red
+     * True if the node is red, sharing a word with the height
+     */
+    uint32_t red : 1;
+
+    /**
+     * Height of the subtree
      */
-    bool red;
+    uint32_t height : 31;
+
+    /**
+     * Size of the subtree
+     */
+    typename Layout::Count weight;
 
     /**
      * Key of the node
@@ -264,24 +704,36 @@ private:
     /**
      * Parent link
      */
-    Node *parent;
+    Link parent;
 
     /**
      * Left child
      */
-    Node *left;
+    Link left;
 
     /**
      * Right child
      */
-    Node *right;
+    Link right;
   };
 
+  /**
+   * Recomputes the size & height of a node from its children, keeping the
+   * total depth of the items up to date
+   */
+  void Update(Node *node)
+  {
+    depths -= node->weight;
+    node->ComputeWeight();
+    depths += node->weight;
+  }
+
   /**
    * Rotates a node left
    */
   void RotateLeft(Node *x)
   {
+    counters.Add(&Counters::rotations);
     Node *y;
 
     y = x->right;
@@ -307,6 +759,9 @@ private:
       x->parent->right = y;
     }
     x->parent = y;
+
+    Update(x);
+    Update(y);
   }
 
   /**
@@ -314,6 +769,7 @@ private:
    */
   void RotateRight(Node *y)
   {
+    counters.Add(&Counters::rotations);
     Node *x;
 
     x = y->left;
@@ -339,6 +795,9 @@ private:
 
     x->right = y;
     y->parent = x;
+
+    Update(y);
+    Update(x);
   }
 
   /**
@@ -383,14 +842,130 @@ private:
     return node;
   }
 
+  /**
+   * Inserts an item, constructing the node from the forwarded arguments
+   * once its position is known
+   * @param replace Whether to overwrite the value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool InsertItem(bool replace, K&& key, Args&&... args)
+  {
+    Node *node = root, *parent = NULL;
+
+    if (!root)
+    {
+      counters.Add(&Counters::allocs);
+      root = pool.Alloc(std::forward<K>(key), std::forward<Args>(args)...);
+      root->red = false;
+      ++size;
+      ++depths;
+      return true;
+    }
+
+    while (node)
+    {
+      parent = node;
+      if (compare(key, node->key))
+      {
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        node = node->right;
+      }
+      else
+      {
+        if (replace)
+        {
+          this->Assign(node->value, std::forward<Args>(args)...);
+        }
+        return false;
+      }
+    }
+
+    counters.Add(&Counters::allocs);
+    node = pool.Alloc(std::forward<K>(key), std::forward<Args>(args)...);
+    node->red = true;
+    node->parent = parent;
+    ++size;
+
+    if (compare(node->key, parent->key))
+    {
+      parent->left = node;
+    }
+    else
+    {
+      parent->right = node;
+    }
+
+    size_t depth = 1;
+    for (Node *p = parent; p; p = p->parent, ++depth)
+    {
+      ++p->weight;
+    }
+    depths += depth;
+
+    // Heights are recomputed up to the last rotation of the fixup, if any.
+    // Above it, subtrees can only have grown, so heights follow from the
+    // child on the path, up to the first one which does not change
+    Node *top = InsertFixup(node), *c = node;
+    for (; top && c != top; c = c->parent)
+    {
+      Node *p = c->parent;
+      p->height = 1 + std::max(Node::Height(p->left), Node::Height(p->right));
+    }
+    for (Node *p = c->parent; p && p->height <= c->height; c = p, p = p->parent)
+    {
+      p->height = c->height + 1;
+    }
+    return true;
+  }
+
+  /**
+   * Builds a perfectly balanced tree out of the next n sorted items,
+   * colouring the nodes at depth red in red
+   */
+  template <typename It>
+  Node *Build(It& it, size_t n, size_t depth, size_t red)
+  {
+    if (n == 0)
+    {
+      return NULL;
+    }
+
+    Node *left = Build(it, (n - 1) / 2, depth + 1, red);
+
+    counters.Add(&Counters::allocs);
+    Node *node = pool.Alloc(it->first, it->second);
+    node->red = depth == red;
+    ++depths;
+    ++it;
+
+    node->left = left;
+    node->right = Build(it, n - 1 - (n - 1) / 2, depth + 1, red);
+    if (node->left)
+    {
+      node->left->parent = node;
+    }
+    if (node->right)
+    {
+      node->right->parent = node;
+    }
+    Update(node);
+    return node;
+  }
+
   /**
    * Restores invariant after inserting a node
+   * @return Node moved up by the last rotation, or NULL if none was needed
    */
-  void InsertFixup(Node *z)
+  Node *InsertFixup(Node *z)
   {
-    Node *uncle;
+    Node *uncle, *top = NULL;
     while (z->parent && z->parent->red)
     {
+      counters.Add(&Counters::fixups);
       if (z->parent == z->parent->parent->left)
       {
         uncle = z->parent->parent->right;
@@ -412,6 +987,7 @@ private:
           z->parent->red = false;
           z->parent->parent->red = true;
           RotateRight(z->parent->parent);
+          top = z->parent;
         }
       }
       else
@@ -435,94 +1011,138 @@ private:
           z->parent->red = false;
           z->parent->parent->red = true;
           RotateLeft(z->parent->parent);
+          top = z->parent;
         }
       }
     }
 
     root->red = false;
+    return top;
   }
 
   /**
-   * Restores the invariant after removing a node
+   * Restores the invariant after removing a node. The node which replaced
+   * the removed one might be NULL, so its parent is tracked separately
    */
-  void DeleteFixup(Node *node)
+  void DeleteFixup(Node *node, Node *parent)
   {
     Node *sibling;
-    while (node != root && !node->red)
+    while (node != root && (!node || !node->red))
     {
-      if (node == node->parent->left)
+      counters.Add(&Counters::fixups);
+      if (node == parent->left)
       {
-        sibling = node->parent->right;
+        sibling = parent->right;
         if (sibling->red)
         {
           sibling->red = false;
-          node->parent->red = true;
-          RotateLeft(node->parent);
-          sibling = node->parent->right;
+          parent->red = true;
+          RotateLeft(parent);
+          sibling = parent->right;
         }
 
         if ((!sibling->left || !sibling->left->red) &&
             (!sibling->right || !sibling->right->red))
         {
           sibling->red = true;
-          node = node->parent;
+          node = parent;
+          parent = node->parent;
         }
         else
         {
-          if (!sibling->right->red)
+          if (!sibling->right || !sibling->right->red)
           {
             sibling->red = true;
             sibling->left->red = false;
             RotateRight(sibling);
-            sibling = node->parent->right;
+            sibling = parent->right;
           }
 
-          sibling->red = node->parent->red;
-          node->parent->red = false;
-          sibling->left->red = false;
-          RotateLeft(node->parent);
+          sibling->red = parent->red;
+          parent->red = false;
+          sibling->right->red = false;
+          RotateLeft(parent);
           node = root;
         }
       }
       else
       {
-        sibling = node->parent->left;
+        sibling = parent->left;
         if (sibling->red)
         {
           sibling->red = false;
-          node->parent->red = true;
-          RotateRight(node->parent);
-          sibling = node->parent->left;
+          parent->red = true;
+          RotateRight(parent);
+          sibling = parent->left;
         }
 
         if ((!sibling->left || !sibling->left->red) &&
             (!sibling->right || !sibling->right->red))
         {
           sibling->red = true;
-          node = node->parent;
+          node = parent;
+          parent = node->parent;
         }
         else
         {
-          if (!sibling->left->red)
+          if (!sibling->left || !sibling->left->red)
           {
             sibling->red = true;
             sibling->right->red = false;
             RotateLeft(sibling);
-            sibling = node->parent->left;
+            sibling = parent->left;
           }
 
-          sibling->red = node->parent->red;
-          node->parent->red = false;
-          sibling->right->red = false;
-          RotateRight(node->parent);
+          sibling->red = parent->red;
+          parent->red = false;
+          sibling->left->red = false;
+          RotateRight(parent);
           node = root;
         }
       }
     }
 
-    node->red = false;
+    if (node)
+    {
+      node->red = false;
+    }
   }
 
+  /**
+   * Runs the destructors of all nodes in a subtree in O(1) space. Left
+   * children are rotated up until the top node has none, which is then
+   * destroyed & replaced by its right child, so the tree is flattened as
+   * it is torn down instead of being walked with a stack
+   */
+  void Destroy(Node *node)
+  {
+    while (node)
+    {
+      if (Node *left = node->left)
+      {
+        node->left = left->right;
+        left->right = node;
+        node = left;
+      }
+      else
+      {
+        Node *right = node->right;
+        node->~Node();
+        node = right;
+      }
+    }
+  }
+
+  /**
+   * Comparator ordering the keys
+   */
+  Comparator<Compare> compare;
+
+  /**
+   * Allocator for the nodes
+   */
+  typename Layout::template Allocator<Node> pool;
+
   /**
    * Root node of the tree
    */
@@ -532,6 +1152,17 @@ private:
    * Number of items stored in the tree
    */
   size_t size;
+
+  /**
+   * Sum of the depths of all items, the root being at depth 1, which is
+   * also the sum of the sizes of all subtrees
+   */
+  size_t depths;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  CounterSet<> counters;
 };
 
 #endif /*__RBTREE_H__*/
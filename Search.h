@@ -0,0 +1,345 @@
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <cstdint>
+#include <type_traits>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Intra-node search over a sorted array of keys. LowerBound returns the
+ * index of the first key not less than the needle, UpperBound the index of
+ * the first key greater than it. This version scans the keys one by one and
+ * works for any type supporting operator <
+ *
+ * @tparam Key Key type
+ */
+template <typename Key>
+struct ScalarSearch
+{
+  static int LowerBound(const Key *keys, int n, const Key& key)
+  {
+    int i = 0;
+    while (i < n && keys[i] < key)
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  static int UpperBound(const Key *keys, int n, const Key& key)
+  {
+    int i = 0;
+    while (i < n && !(key < keys[i]))
+    {
+      ++i;
+    }
+    return i;
+  }
+};
+
+/**
+ * Narrows a search down to a window of at most two cache lines using a
+ * binary search, returning the number of keys skipped on the left. The
+ * window is then small enough to be scanned in full with vector compares
+ */
+template <bool Upper, typename Key>
+inline int Narrow(const Key *&keys, int &n, const Key& key)
+{
+  const int window = static_cast<int>(128 / sizeof(Key));
+  const Key *base = keys;
+
+  while (n > window)
+  {
+    int half = n / 2;
+    if (Upper ? !(key < keys[half]) : keys[half] < key)
+    {
+      keys += half + 1;
+      n -= half + 1;
+    }
+    else
+    {
+      n = half;
+    }
+  }
+
+  return static_cast<int>(keys - base);
+}
+
+/**
+ * Default intra-node search: the scalar version, specialised below for
+ * arithmetic keys when the target supports AVX2. Since the keys are sorted,
+ * the index is the number of keys which compare less (or less or equal) than
+ * the needle, which is counted without branches. With SSE2 alone, the 4-wide
+ * compares do not beat the scalar loop on typical node sizes
+ */
+template <typename Key, typename Enable = void>
+struct NodeSearch : public ScalarSearch<Key>
+{
+};
+
+#if defined(__AVX2__)
+
+/**
+ * 16 bit integers: 16 keys per compare.
+ * Unsigned keys are biased into the signed range
+ */
+template <typename Key>
+struct NodeSearch<Key, typename std::enable_if<
+    std::is_integral<Key>::value && sizeof(Key) == 2>::type>
+{
+  static int LowerBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<false>(keys, n, key);
+  }
+
+  static int UpperBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<true>(keys, n, key);
+  }
+
+private:
+  template <bool Upper>
+  static int Search(const Key *keys, int n, const Key& key)
+  {
+    const short bias = std::is_signed<Key>::value ? 0 : INT16_MIN;
+    int i = 0, count = Narrow<Upper>(keys, n, key);
+
+    const __m256i b16 = _mm256_set1_epi16(bias);
+    const __m256i k16 = _mm256_xor_si256(_mm256_set1_epi16(key), b16);
+    for (; i + 16 <= n; i += 16)
+    {
+      __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), b16);
+      unsigned mask = Upper
+          ? ~_mm256_movemask_epi8(_mm256_cmpgt_epi16(v, k16))
+          : _mm256_movemask_epi8(_mm256_cmpgt_epi16(k16, v));
+      count += __builtin_popcount(mask) / 2;
+    }
+
+    const __m128i b8 = _mm_set1_epi16(bias);
+    const __m128i k8 = _mm_xor_si128(_mm_set1_epi16(key), b8);
+    for (; i + 8 <= n; i += 8)
+    {
+      __m128i v = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), b8);
+      unsigned mask = 0xFFFF & (Upper
+          ? ~_mm_movemask_epi8(_mm_cmpgt_epi16(v, k8))
+          : _mm_movemask_epi8(_mm_cmpgt_epi16(k8, v)));
+      count += __builtin_popcount(mask) / 2;
+    }
+
+    return count + (Upper
+        ? ScalarSearch<Key>::UpperBound(keys + i, n - i, key)
+        : ScalarSearch<Key>::LowerBound(keys + i, n - i, key));
+  }
+};
+
+/**
+ * 32 bit integers: 8 keys per compare
+ */
+template <typename Key>
+struct NodeSearch<Key, typename std::enable_if<
+    std::is_integral<Key>::value && sizeof(Key) == 4>::type>
+{
+  static int LowerBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<false>(keys, n, key);
+  }
+
+  static int UpperBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<true>(keys, n, key);
+  }
+
+private:
+  template <bool Upper>
+  static int Search(const Key *keys, int n, const Key& key)
+  {
+    const int bias = std::is_signed<Key>::value ? 0 : INT32_MIN;
+    int i = 0, count = Narrow<Upper>(keys, n, key);
+
+    const __m256i b8 = _mm256_set1_epi32(bias);
+    const __m256i k8 = _mm256_xor_si256(_mm256_set1_epi32(key), b8);
+    for (; i + 8 <= n; i += 8)
+    {
+      __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), b8);
+      __m256i c = Upper ? _mm256_cmpgt_epi32(v, k8) : _mm256_cmpgt_epi32(k8, v);
+      unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(c));
+      mask = Upper ? ~mask & 0xFF : mask;
+      count += __builtin_popcount(mask);
+    }
+
+    const __m128i b4 = _mm_set1_epi32(bias);
+    const __m128i k4 = _mm_xor_si128(_mm_set1_epi32(key), b4);
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128i v = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), b4);
+      __m128i c = Upper ? _mm_cmpgt_epi32(v, k4) : _mm_cmpgt_epi32(k4, v);
+      unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(c));
+      mask = Upper ? ~mask & 0xF : mask;
+      count += __builtin_popcount(mask);
+    }
+
+    return count + (Upper
+        ? ScalarSearch<Key>::UpperBound(keys + i, n - i, key)
+        : ScalarSearch<Key>::LowerBound(keys + i, n - i, key));
+  }
+};
+
+/**
+ * 64 bit integers: 4 keys per compare
+ */
+template <typename Key>
+struct NodeSearch<Key, typename std::enable_if<
+    std::is_integral<Key>::value && sizeof(Key) == 8>::type>
+{
+  static int LowerBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<false>(keys, n, key);
+  }
+
+  static int UpperBound(const Key *keys, int n, const Key& key)
+  {
+    return Search<true>(keys, n, key);
+  }
+
+private:
+  template <bool Upper>
+  static int Search(const Key *keys, int n, const Key& key)
+  {
+    const long long bias = std::is_signed<Key>::value ? 0 : INT64_MIN;
+    int i = 0, count = Narrow<Upper>(keys, n, key);
+
+    const __m256i b4 = _mm256_set1_epi64x(bias);
+    const __m256i k4 = _mm256_xor_si256(_mm256_set1_epi64x(key), b4);
+    for (; i + 4 <= n; i += 4)
+    {
+      __m256i v = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), b4);
+      __m256i c = Upper ? _mm256_cmpgt_epi64(v, k4) : _mm256_cmpgt_epi64(k4, v);
+      unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(c));
+      mask = Upper ? ~mask & 0xF : mask;
+      count += __builtin_popcount(mask);
+    }
+
+    const __m128i b2 = _mm_set1_epi64x(bias);
+    const __m128i k2 = _mm_xor_si128(_mm_set1_epi64x(key), b2);
+    for (; i + 2 <= n; i += 2)
+    {
+      __m128i v = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), b2);
+      __m128i c = Upper ? _mm_cmpgt_epi64(v, k2) : _mm_cmpgt_epi64(k2, v);
+      unsigned mask = _mm_movemask_pd(_mm_castsi128_pd(c));
+      mask = Upper ? ~mask & 0x3 : mask;
+      count += __builtin_popcount(mask);
+    }
+
+    return count + (Upper
+        ? ScalarSearch<Key>::UpperBound(keys + i, n - i, key)
+        : ScalarSearch<Key>::LowerBound(keys + i, n - i, key));
+  }
+};
+
+/**
+ * Single precision floats: 8 keys per compare
+ */
+template <>
+struct NodeSearch<float>
+{
+  static int LowerBound(const float *keys, int n, const float& key)
+  {
+    return Search<false>(keys, n, key);
+  }
+
+  static int UpperBound(const float *keys, int n, const float& key)
+  {
+    return Search<true>(keys, n, key);
+  }
+
+private:
+  template <bool Upper>
+  static int Search(const float *keys, int n, const float& key)
+  {
+    int i = 0, count = Narrow<Upper>(keys, n, key);
+
+    const __m256 k8 = _mm256_set1_ps(key);
+    for (; i + 8 <= n; i += 8)
+    {
+      __m256 v = _mm256_loadu_ps(keys + i);
+      __m256 c = Upper
+          ? _mm256_cmp_ps(v, k8, _CMP_LE_OQ)
+          : _mm256_cmp_ps(v, k8, _CMP_LT_OQ);
+      unsigned mask = _mm256_movemask_ps(c);
+      count += __builtin_popcount(mask);
+    }
+
+    const __m128 k4 = _mm_set1_ps(key);
+    for (; i + 4 <= n; i += 4)
+    {
+      __m128 v = _mm_loadu_ps(keys + i);
+      __m128 c = Upper ? _mm_cmple_ps(v, k4) : _mm_cmplt_ps(v, k4);
+      unsigned mask = _mm_movemask_ps(c);
+      count += __builtin_popcount(mask);
+    }
+
+    return count + (Upper
+        ? ScalarSearch<float>::UpperBound(keys + i, n - i, key)
+        : ScalarSearch<float>::LowerBound(keys + i, n - i, key));
+  }
+};
+
+/**
+ * Double precision floats: 4 keys per compare
+ */
+template <>
+struct NodeSearch<double>
+{
+  static int LowerBound(const double *keys, int n, const double& key)
+  {
+    return Search<false>(keys, n, key);
+  }
+
+  static int UpperBound(const double *keys, int n, const double& key)
+  {
+    return Search<true>(keys, n, key);
+  }
+
+private:
+  template <bool Upper>
+  static int Search(const double *keys, int n, const double& key)
+  {
+    int i = 0, count = Narrow<Upper>(keys, n, key);
+
+    const __m256d k4 = _mm256_set1_pd(key);
+    for (; i + 4 <= n; i += 4)
+    {
+      __m256d v = _mm256_loadu_pd(keys + i);
+      __m256d c = Upper
+          ? _mm256_cmp_pd(v, k4, _CMP_LE_OQ)
+          : _mm256_cmp_pd(v, k4, _CMP_LT_OQ);
+      unsigned mask = _mm256_movemask_pd(c);
+      count += __builtin_popcount(mask);
+    }
+
+    const __m128d k2 = _mm_set1_pd(key);
+    for (; i + 2 <= n; i += 2)
+    {
+      __m128d v = _mm_loadu_pd(keys + i);
+      __m128d c = Upper ? _mm_cmple_pd(v, k2) : _mm_cmplt_pd(v, k2);
+      unsigned mask = _mm_movemask_pd(c);
+      count += __builtin_popcount(mask);
+    }
+
+    return count + (Upper
+        ? ScalarSearch<double>::UpperBound(keys + i, n - i, key)
+        : ScalarSearch<double>::LowerBound(keys + i, n - i, key));
+  }
+};
+
+#endif
+
+#endif /*__SEARCH_H__*/
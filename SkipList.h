@@ -0,0 +1,617 @@
+#ifndef __SKIPLIST_H__
+#define __SKIPLIST_H__
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+/**
+ * Lock-free skip list, after Herlihy & Shavit's "The Art of Multiprocessor
+ * Programming". Like the Treap, it is balanced by coin flips: every node
+ * gets a random number of levels. Each level is a sorted linked list and
+ * nodes are deleted by marking the low bit of their next pointers, top
+ * level first. Searches unlink the marked nodes they come across, while
+ * lookups & range scans only skip them, so readers never write shared
+ * memory & never wait for writers
+ *
+ * A node is retired, through epoch-based reclamation, once both its
+ * inserter finished linking it & its deleter finished unlinking it, and
+ * is freed when no thread can still hold a reference to it. Values are
+ * kept in separately allocated boxes, so updates swap in a new box
+ * atomically and readers always see a complete value
+ *
+ * References returned by Find stay valid until the item is updated or
+ * deleted. Range scans are weakly consistent: they see all items present
+ * during the whole scan & possibly some which are inserted or deleted
+ * concurrently
+ *
+ * @tparam Key   Key type, must support total ordering
+ * @tparam Value Value type
+ */
+template <typename Key, typename Value>
+class SkipList : public TreeBase<SkipList<Key, Value>, Key, Value>
+{
+public:
+  /**
+   * Creates an empty skip list
+   */
+  SkipList()
+    : head(NewNode(kMaxLevel, Key(), NULL))
+    , size(0)
+    , links(0)
+  {
+  }
+
+  /**
+   * Destroys the skip list. No other thread may access it anymore
+   */
+  ~SkipList()
+  {
+    for (Node *node = head; node; )
+    {
+      Node *next = Ptr(node->next[0].load());
+      if (!Marked(node->next[0].load()))
+      {
+        FreeNode(node);
+      }
+      node = next;
+    }
+  }
+
+  /**
+   * Inserts a new item into the list, replacing the value of a duplicate
+   */
+  void Insert(const Key& key, const Value& value)
+  {
+    InsertItem(true, key, value);
+  }
+
+  /**
+   * Inserts a new item into the list, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    InsertItem(true, std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    return InsertItem(true, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    return InsertItem(false, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Deletes an item from the list
+   */
+  void Delete(const Key& key)
+  {
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an item from the list if the key is present
+   * @return True if this call removed the item
+   */
+  bool Erase(const Key& key)
+  {
+    Epoch::Guard guard;
+    Node *preds[kMaxLevel], *succs[kMaxLevel];
+
+    for (;;)
+    {
+      if (!Search(key, preds, succs))
+      {
+        return false;
+      }
+
+      Node *node = succs[0];
+      for (int i = node->height - 1; i >= 1; --i)
+      {
+        uintptr_t next = node->next[i].load();
+        while (!Marked(next) && !node->next[i].compare_exchange_weak(next, next | 1))
+        {
+        }
+      }
+
+      // Marking the bottom level removes the item: only one thread wins
+      uintptr_t next = node->next[0].load();
+      while (!Marked(next))
+      {
+        if (node->next[0].compare_exchange_weak(next, next | 1))
+        {
+          size.fetch_sub(1, std::memory_order_relaxed);
+          links.fetch_sub(node->height, std::memory_order_relaxed);
+          Search(key, preds, succs);
+          Release(node);
+          return true;
+        }
+      }
+    }
+  }
+
+  /**
+   * Retrieves an item from the list
+   */
+  Value& Find(const Key& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Retrieves an item from the list without throwing if the key is
+   * missing. Like Find, the pointer is only safe to use while no other
+   * thread replaces or deletes the item
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  Value *TryFind(const Key& key)
+  {
+    Epoch::Guard guard;
+    counters.AddShared(&Counters::finds);
+    Node *node = Seek(key);
+    if (!node || key < node->key)
+    {
+      return NULL;
+    }
+    return node->value.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Checks whether a key is in the list
+   */
+  bool Contains(const Key& key)
+  {
+    Epoch::Guard guard;
+    counters.AddShared(&Counters::finds);
+    Node *node = Seek(key);
+    return node && !(key < node->key);
+  }
+
+  /**
+   * Copies the value of an item out of the list
+   * @return False if the key is not in the list
+   */
+  bool Find(const Key& key, Value& value)
+  {
+    Epoch::Guard guard;
+    counters.AddShared(&Counters::finds);
+    Node *node = Seek(key);
+    if (!node || key < node->key)
+    {
+      return false;
+    }
+    value = *node->value.load(std::memory_order_acquire);
+    return true;
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  template <typename Fn>
+  void Range(const Key& lo, const Key& hi, Fn fn)
+  {
+    Epoch::Guard guard;
+    for (Node *node = Seek(lo); node && node->key < hi; node = Ptr(node->next[0].load()))
+    {
+      if (!Marked(node->next[0].load(std::memory_order_acquire)))
+      {
+        fn(node->key, *node->value.load(std::memory_order_acquire));
+      }
+    }
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
+  }
+
+  /**
+   * Removes all items. Unlike the other operations, this is not thread-safe:
+   * no other thread may access the list meanwhile
+   */
+  void Clear()
+  {
+    for (Node *node = Ptr(head->next[0].load()); node; )
+    {
+      Node *next = Ptr(node->next[0].load());
+      if (!Marked(node->next[0].load()))
+      {
+        counters.AddShared(&Counters::frees);
+        FreeNode(node);
+      }
+      node = next;
+    }
+
+    for (int i = 0; i < kMaxLevel; ++i)
+    {
+      head->next[i].store(0);
+    }
+    size.store(0);
+    links.store(0);
+  }
+
+  /**
+   * Returns the number of items in the list
+   */
+  size_t GetSize()
+  {
+    return size.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the number of levels in use
+   */
+  size_t GetHeight()
+  {
+    size_t height = kMaxLevel;
+    while (height > 0 && !head->next[height - 1].load(std::memory_order_relaxed))
+    {
+      --height;
+    }
+    return height;
+  }
+
+  /**
+   * Returns the structural statistics of the list. Every item has its own
+   * node, whose depth is taken as the number of levels a search descends
+   * through. Nodes unlinked but not yet reclaimed are left out
+   */
+  Stats GetStats()
+  {
+    size_t n = GetSize();
+    Stats stats;
+    stats.nodes = n;
+    stats.fill = n ? 1.0 : 0.0;
+    stats.depth = n ? static_cast<double>(GetHeight()) : 0.0;
+    stats.bytes = (n + 1) * sizeof(Node) + n * sizeof(Value) +
+        (links.load(std::memory_order_relaxed) + kMaxLevel) * sizeof(std::atomic<uintptr_t>);
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters. Counters are read one by
+   * one, so they may be slightly out of sync under concurrent updates
+   */
+  Counters GetCounters()
+  {
+    return counters.Get();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset();
+  }
+
+private:
+  SkipList(const SkipList&);
+  SkipList& operator = (const SkipList&);
+
+  /**
+   * Node with a tower of next pointers, allocated right after it. The low
+   * bit of a next pointer marks the node as deleted on that level
+   */
+  struct Node
+  {
+    template <typename K>
+    Node(int height, K&& key, Value *value)
+      : key(std::forward<K>(key))
+      , value(value)
+      , owners(2)
+      , height(height)
+      , next(reinterpret_cast<std::atomic<uintptr_t> *>(this + 1))
+    {
+      for (int i = 0; i < height; ++i)
+      {
+        new (&next[i]) std::atomic<uintptr_t>(0);
+      }
+    }
+
+    Key                      key;
+    std::atomic<Value *>     value;
+    std::atomic<int>         owners;
+    int                      height;
+    std::atomic<uintptr_t>  *next;
+  };
+
+  /**
+   * Maximum number of levels, enough for 2^32 items
+   */
+  static const int kMaxLevel = 32;
+
+  static Node *Ptr(uintptr_t link)
+  {
+    return reinterpret_cast<Node *>(link & ~static_cast<uintptr_t>(1));
+  }
+
+  static bool Marked(uintptr_t link)
+  {
+    return link & 1;
+  }
+
+  static uintptr_t Link(Node *node)
+  {
+    return reinterpret_cast<uintptr_t>(node);
+  }
+
+  template <typename K>
+  static Node *NewNode(int height, K&& key, Value *value)
+  {
+    void *mem = ::operator new(sizeof(Node) + height * sizeof(std::atomic<uintptr_t>));
+    return new (mem) Node(height, std::forward<K>(key), value);
+  }
+
+  static void FreeNode(void *ptr)
+  {
+    Node *node = static_cast<Node *>(ptr);
+    delete node->value.load();
+    node->~Node();
+    ::operator delete(ptr);
+  }
+
+  /**
+   * Draws a level count from a geometric distribution with p = 1/2,
+   * using a per-thread xorshift generator
+   */
+  static int RandomLevel()
+  {
+    static thread_local uint64_t state = 0;
+    if (state == 0)
+    {
+      state = reinterpret_cast<uintptr_t>(&state) * 0x9E3779B97F4A7C15ull | 1;
+    }
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    int height = 1;
+    for (uint64_t bits = state; (bits & 1) && height < kMaxLevel; bits >>= 1)
+    {
+      ++height;
+    }
+    return height;
+  }
+
+  /**
+   * Inserts an item, building the node & the value box from the forwarded
+   * arguments the first time they are needed. If a failed attempt already
+   * built a node, later attempts search for its key & reuse its box
+   * @param replace Whether to overwrite the value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool InsertItem(bool replace, K&& key, Args&&... args)
+  {
+    Epoch::Guard guard;
+    Node *preds[kMaxLevel], *succs[kMaxLevel], *node = NULL;
+
+    for (;;)
+    {
+      if (node ? Search(node->key, preds, succs) : Search(key, preds, succs))
+      {
+        Value *box = NULL;
+        if (node)
+        {
+          box = node->value.exchange(NULL);
+          counters.AddShared(&Counters::frees);
+          FreeNode(node);
+        }
+
+        if (replace)
+        {
+          Epoch::Retire(succs[0]->value.exchange(box ? box : new Value(std::forward<Args>(args)...)));
+        }
+        else
+        {
+          delete box;
+        }
+        return false;
+      }
+
+      if (!node)
+      {
+        counters.AddShared(&Counters::allocs);
+        node = NewNode(RandomLevel(), std::forward<K>(key), new Value(std::forward<Args>(args)...));
+      }
+
+      for (int i = 0; i < node->height; ++i)
+      {
+        node->next[i].store(Link(succs[i]), std::memory_order_relaxed);
+      }
+
+      uintptr_t expected = Link(succs[0]);
+      if (preds[0]->next[0].compare_exchange_strong(expected, Link(node)))
+      {
+        break;
+      }
+    }
+
+    size.fetch_add(1, std::memory_order_relaxed);
+    links.fetch_add(node->height, std::memory_order_relaxed);
+    Raise(node, preds, succs);
+    Release(node);
+    return true;
+  }
+
+  /**
+   * Links a node which is already in the list on its upper levels,
+   * bottom-up, stopping if a concurrent delete marks it first
+   */
+  void Raise(Node *node, Node **preds, Node **succs)
+  {
+    for (int i = 1; i < node->height; ++i)
+    {
+      for (;;)
+      {
+        // Neighbours may have been refreshed by a search on a lower level,
+        // so point the node to the current successor first
+        uintptr_t next = node->next[i].load();
+        if (Marked(next))
+        {
+          return;
+        }
+
+        if (next != Link(succs[i]) &&
+            !node->next[i].compare_exchange_strong(next, Link(succs[i])))
+        {
+          return;
+        }
+
+        uintptr_t expected = Link(succs[i]);
+        if (preds[i]->next[i].compare_exchange_strong(expected, Link(node)))
+        {
+          break;
+        }
+
+        Search(node->key, preds, succs);
+      }
+    }
+  }
+
+  /**
+   * Drops a reference held by the inserter or the deleter of a node. The
+   * last one unlinks any level the node might still be on & retires it
+   */
+  void Release(Node *node)
+  {
+    if (node->owners.fetch_sub(1) == 1)
+    {
+      Node *preds[kMaxLevel], *succs[kMaxLevel];
+      Search(node->key, preds, succs);
+      counters.AddShared(&Counters::frees);
+      Epoch::Retire(node, FreeNode);
+    }
+  }
+
+  /**
+   * Finds the predecessors & successors of a key on every level, unlinking
+   * marked nodes on the way. Returns true if an unmarked node holds the key
+   */
+  bool Search(const Key& key, Node **preds, Node **succs)
+  {
+    while (!TrySearch(key, preds, succs))
+    {
+    }
+    return succs[0] && !(key < succs[0]->key);
+  }
+
+  /**
+   * Single search attempt, failing if a marked node cannot be unlinked
+   * because its predecessor changed
+   */
+  bool TrySearch(const Key& key, Node **preds, Node **succs)
+  {
+    Node *pred = head;
+    for (int i = kMaxLevel - 1; i >= 0; --i)
+    {
+      Node *curr = Ptr(pred->next[i].load(std::memory_order_acquire));
+      while (curr)
+      {
+        uintptr_t next = curr->next[i].load(std::memory_order_acquire);
+        if (Marked(next))
+        {
+          uintptr_t expected = Link(curr);
+          if (!pred->next[i].compare_exchange_strong(expected, next & ~static_cast<uintptr_t>(1)))
+          {
+            return false;
+          }
+          curr = Ptr(next);
+        }
+        else if (curr->key < key)
+        {
+          pred = curr;
+          curr = Ptr(next);
+        }
+        else
+        {
+          break;
+        }
+      }
+
+      preds[i] = pred;
+      succs[i] = curr;
+    }
+    return true;
+  }
+
+  /**
+   * Returns the first unmarked node with a key not less than key on the
+   * bottom level, without modifying the list
+   */
+  Node *Seek(const Key& key)
+  {
+    Node *pred = head, *curr = NULL;
+    uint64_t visits = 0;
+    for (int i = kMaxLevel - 1; i >= 0; --i)
+    {
+      curr = Ptr(pred->next[i].load(std::memory_order_acquire));
+      while (curr && curr->key < key)
+      {
+        pred = curr;
+        curr = Ptr(curr->next[i].load(std::memory_order_acquire));
+        ++visits;
+      }
+    }
+
+    while (curr && Marked(curr->next[0].load(std::memory_order_acquire)))
+    {
+      curr = Ptr(curr->next[0].load(std::memory_order_acquire));
+      ++visits;
+    }
+    counters.AddShared(&Counters::visits, visits);
+    return curr;
+  }
+
+  /**
+   * Sentinel with the maximum number of levels
+   */
+  Node *head;
+
+  /**
+   * Number of items stored in the list
+   */
+  std::atomic<size_t> size;
+
+  /**
+   * Number of levels of the nodes in the list, the head's excepted
+   */
+  std::atomic<size_t> links;
+
+  /**
+   * Operation counters, updated concurrently, empty unless TREES_COUNTERS
+   * is set
+   */
+  CounterSet<> counters;
+};
+
+#endif /*__SKIPLIST_H__*/
@@ -0,0 +1,541 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Version of the tree a node was created in, for trees handing out
+ * snapshots. Empty for the others
+ */
+template <bool Enabled>
+struct Stamped
+{
+  Stamped()
+    : stamp(0)
+  {
+  }
+
+  uint32_t stamp;
+};
+
+template <>
+struct Stamped<false>
+{
+};
+
+/**
+ * Versions of a tree held by live snapshots. Shared by the tree & its
+ * snapshots, which may be released from any thread. Nodes a tree leaves
+ * behind while snapshots are live are freed with the last of them
+ */
+class Registry
+{
+public:
+  Registry()
+    : live(0)
+    , oldest(UINT32_MAX)
+  {
+  }
+
+  /**
+   * Registers a snapshot of a version
+   */
+  void Acquire(uint32_t version)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++versions[version];
+    live.fetch_add(1, std::memory_order_relaxed);
+    oldest.store(versions.begin()->first, std::memory_order_release);
+  }
+
+  /**
+   * Unregisters a snapshot of a version. Its reads happen before the
+   * writer sees the snapshot gone
+   */
+  void Release(uint32_t version)
+  {
+    std::vector<std::function<void()>> done;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::map<uint32_t, size_t>::iterator it = versions.find(version);
+      if (--it->second == 0)
+      {
+        versions.erase(it);
+      }
+      oldest.store(versions.empty() ? UINT32_MAX : versions.begin()->first,
+                   std::memory_order_release);
+      if (live.fetch_sub(1, std::memory_order_release) == 1)
+      {
+        done.swap(orphans);
+      }
+    }
+    Run(done);
+  }
+
+  /**
+   * Takes over a function freeing nodes which snapshots may still reach,
+   * run once none is live, or right away if none is live anymore
+   */
+  void Defer(const std::function<void()>& free)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (live.load(std::memory_order_relaxed) != 0)
+      {
+        orphans.push_back(free);
+        return;
+      }
+    }
+    free();
+  }
+
+  /**
+   * Returns the number of live snapshots
+   */
+  size_t GetLive() const
+  {
+    return live.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Returns the oldest version held by a snapshot, or UINT32_MAX
+   */
+  uint32_t GetOldest() const
+  {
+    return oldest.load(std::memory_order_acquire);
+  }
+
+private:
+  /**
+   * Guards the versions
+   */
+  std::mutex mutex;
+
+  /**
+   * Number of live snapshots of each version
+   */
+  std::map<uint32_t, size_t> versions;
+
+  /**
+   * Number of live snapshots
+   */
+  std::atomic<size_t> live;
+
+  /**
+   * Oldest version held, read by the writer without locking
+   */
+  std::atomic<uint32_t> oldest;
+
+  /**
+   * Functions freeing the nodes of trees destroyed or cleared while
+   * snapshots were live
+   */
+  std::vector<std::function<void()>> orphans;
+
+  /**
+   * Runs the functions freeing orphaned nodes
+   */
+  static void Run(std::vector<std::function<void()>>& free)
+  {
+    for (size_t i = 0; i < free.size(); ++i)
+    {
+      free[i]();
+    }
+    free.clear();
+  }
+};
+
+/**
+ * Writer side of the snapshots of a tree. Taking a snapshot freezes the
+ * current version: from then on, nodes stamped with an older version are
+ * copied before they are modified, as long as any snapshot is live, and
+ * the originals are retired. Retired nodes are freed by the writer once
+ * every snapshot older than their retirement is released, so the memory
+ * allocator is never used by readers
+ *
+ * @tparam Node    Node type, deriving from Stamped<Enabled>
+ * @tparam Enabled Whether the tree hands out snapshots
+ */
+template <typename Node, bool Enabled = true>
+class Versions
+{
+public:
+  Versions()
+    : version(1)
+  {
+  }
+
+  /**
+   * Stamps a new node with the current version
+   */
+  void Stamp(Node *node)
+  {
+    node->stamp = version;
+  }
+
+  /**
+   * Checks whether a live snapshot may reach a node, which must then be
+   * copied before it is modified
+   */
+  bool Frozen(const Node *node) const
+  {
+    return Live() && node->stamp != version;
+  }
+
+  /**
+   * Checks whether any snapshot is live
+   */
+  bool Live() const
+  {
+    return registry && registry->GetLive() != 0;
+  }
+
+  /**
+   * Throws if a snapshot is live, for operations modifying nodes in place
+   */
+  void Check() const
+  {
+    if (Live())
+    {
+      throw std::runtime_error("Tree has live snapshots");
+    }
+  }
+
+  /**
+   * Registers a snapshot of the current version & starts a new one
+   * @return The version of the snapshot
+   */
+  uint32_t Freeze()
+  {
+    if (!registry)
+    {
+      registry = std::make_shared<Registry>();
+    }
+    registry->Acquire(version);
+    return version++;
+  }
+
+  /**
+   * Returns the registry the snapshots release their version to
+   */
+  const std::shared_ptr<Registry>& GetRegistry() const
+  {
+    return registry;
+  }
+
+  /**
+   * Defers freeing a node replaced by a copy until no snapshot can reach it
+   */
+  void Retire(Node *node)
+  {
+    retired.push_back(std::make_pair(node, version));
+  }
+
+  /**
+   * Frees the retired nodes which no live snapshot can reach: those
+   * retired no later than the version of the oldest snapshot
+   */
+  template <typename Free>
+  void Collect(Free free)
+  {
+    if (retired.empty())
+    {
+      return;
+    }
+
+    uint32_t oldest = registry->GetOldest();
+    while (!retired.empty() && retired.front().second <= oldest)
+    {
+      free(retired.front().first);
+      retired.pop_front();
+    }
+  }
+
+  /**
+   * Frees all retired nodes, when no snapshot is left
+   */
+  template <typename Free>
+  void Drain(Free free)
+  {
+    for (; !retired.empty(); retired.pop_front())
+    {
+      free(retired.front().first);
+    }
+  }
+
+  /**
+   * Hands the retired nodes & the rest of a tree being destroyed or
+   * cleared over to its live snapshots. The retired nodes are freed, then
+   * release is run, once the last snapshot is released
+   */
+  template <typename Free>
+  void Orphan(Free free, const std::function<void()>& release)
+  {
+    std::shared_ptr<std::deque<std::pair<Node *, uint32_t>>> nodes =
+        std::make_shared<std::deque<std::pair<Node *, uint32_t>>>();
+    nodes->swap(retired);
+    registry->Defer([nodes, free, release] ()
+    {
+      for (size_t i = 0; i < nodes->size(); ++i)
+      {
+        free((*nodes)[i].first);
+      }
+      release();
+    });
+  }
+
+  /**
+   * Returns the number of retired nodes not freed yet
+   */
+  size_t GetRetired() const
+  {
+    return retired.size();
+  }
+
+private:
+  /**
+   * Version nodes are created in. Older nodes are frozen
+   */
+  uint32_t version;
+
+  /**
+   * Live snapshots, created with the first one
+   */
+  std::shared_ptr<Registry> registry;
+
+  /**
+   * Nodes replaced by copies & the version they were retired in
+   */
+  std::deque<std::pair<Node *, uint32_t>> retired;
+};
+
+/**
+ * Trees without snapshots: nothing is ever frozen
+ */
+template <typename Node>
+class Versions<Node, false>
+{
+public:
+  void Stamp(Node *)
+  {
+  }
+
+  bool Frozen(const Node *) const
+  {
+    return false;
+  }
+
+  bool Live() const
+  {
+    return false;
+  }
+
+  void Check() const
+  {
+  }
+
+  void Retire(Node *)
+  {
+  }
+
+  template <typename Free>
+  void Collect(Free)
+  {
+  }
+
+  template <typename Free>
+  void Drain(Free)
+  {
+  }
+
+  template <typename Free>
+  void Orphan(Free, const std::function<void()>& release)
+  {
+    release();
+  }
+
+  size_t GetRetired() const
+  {
+    return 0;
+  }
+};
+
+/**
+ * Checks whether a callback of Range can take values as const references.
+ * Such callbacks only read, so they are handed the values in place even
+ * while snapshots share them
+ */
+template <typename Fn, typename Key, typename Value>
+class Reads
+{
+  template <typename F>
+  static auto Test(int) -> decltype(
+      (void) std::declval<F&>()(std::declval<const Key&>(), std::declval<const Value&>()),
+      std::true_type());
+
+  template <typename F>
+  static std::false_type Test(...);
+
+public:
+  static const bool value = decltype(Test<Fn>(0))::value;
+};
+
+/**
+ * Immutable view of a tree as it was when the snapshot was taken. Later
+ * updates copy the nodes they change, so a snapshot can be read from any
+ * thread without locks while the writer goes on. Its iterators hand out
+ * read-only values; the tree copies shared nodes before handing out their
+ * values for writing. A snapshot keeps the nodes it reaches alive until
+ * it is released, even if its tree is cleared or destroyed first
+ *
+ * @tparam Node Node type of the tree
+ * @tparam It   Read-only iterator of the tree, with Begin & End taking a root
+ */
+template <typename Node, typename It>
+class TreeSnapshot
+{
+public:
+  /**
+   * Iterator over the items, in key order
+   */
+  typedef It Iterator;
+
+  /**
+   * Creates an empty snapshot, of no tree
+   */
+  TreeSnapshot()
+    : root(NULL)
+    , size(0)
+    , version(0)
+  {
+  }
+
+  /**
+   * Creates the snapshot of a version, registered by Versions::Freeze
+   */
+  TreeSnapshot(Node *root, size_t size, uint32_t version,
+               const std::shared_ptr<Registry>& registry)
+    : root(root)
+    , size(size)
+    , version(version)
+    , registry(registry)
+  {
+  }
+
+  TreeSnapshot(const TreeSnapshot& that)
+    : root(that.root)
+    , size(that.size)
+    , version(that.version)
+    , registry(that.registry)
+  {
+    if (registry)
+    {
+      registry->Acquire(version);
+    }
+  }
+
+  TreeSnapshot(TreeSnapshot&& that)
+    : root(that.root)
+    , size(that.size)
+    , version(that.version)
+    , registry(std::move(that.registry))
+  {
+    that.Reset();
+  }
+
+  TreeSnapshot& operator = (TreeSnapshot that)
+  {
+    std::swap(root, that.root);
+    std::swap(size, that.size);
+    std::swap(version, that.version);
+    registry.swap(that.registry);
+    return *this;
+  }
+
+  ~TreeSnapshot()
+  {
+    Release();
+  }
+
+  /**
+   * Lets go of the nodes of the tree, leaving the snapshot empty
+   */
+  void Release()
+  {
+    if (registry)
+    {
+      registry->Release(version);
+      registry.reset();
+    }
+    Reset();
+  }
+
+  /**
+   * Returns the number of items in the snapshot
+   */
+  size_t GetSize() const
+  {
+    return size;
+  }
+
+  /**
+   * Returns an iterator to the smallest item. Iterators are valid until
+   * the snapshot is released or moved
+   */
+  Iterator Begin() const
+  {
+    return Iterator::Begin(&root);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End() const
+  {
+    return Iterator::End(&root);
+  }
+
+private:
+  /**
+   * Empties the snapshot, without releasing its version
+   */
+  void Reset()
+  {
+    root = NULL;
+    size = 0;
+    version = 0;
+  }
+
+  /**
+   * Root of the tree in the version of the snapshot
+   */
+  Node *root;
+
+  /**
+   * Number of items
+   */
+  size_t size;
+
+  /**
+   * Version of the tree the snapshot holds
+   */
+  uint32_t version;
+
+  /**
+   * Live snapshots of the tree, NULL once released
+   */
+  std::shared_ptr<Registry> registry;
+};
+
+#endif /*__SNAPSHOT_H__*/
@@ -0,0 +1,318 @@
+#ifndef __TASKS_H__
+#define __TASKS_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing pool of threads for fork-join parallelism. Invoke(f, g)
+ * queues g on the deque of the calling thread & runs f; idle threads steal
+ * the oldest tasks from the front of other deques, which for divide &
+ * conquer algorithms are the largest ones, while owners take their newest
+ * tasks back from the end. A thread waiting for a stolen task runs other
+ * tasks meanwhile, so nested Invokes never block a thread idle. Threads
+ * outside the pool share one extra deque & help as well while they wait
+ */
+class TaskPool
+{
+public:
+  /**
+   * Starts a pool of threads, one per hardware thread by default. Callers
+   * help running tasks, so a pool of 0 threads runs everything inline
+   */
+  explicit TaskPool(size_t threads = std::thread::hardware_concurrency())
+    : queues(threads + 1)
+    , queued(0)
+    , stop(false)
+  {
+    for (size_t i = 0; i < queues.size(); ++i)
+    {
+      queues[i].reset(new Queue());
+    }
+    for (size_t i = 0; i < threads; ++i)
+    {
+      workers.push_back(std::thread(&TaskPool::Work, this, i));
+    }
+  }
+
+  ~TaskPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+    {
+      worker.join();
+    }
+  }
+
+  /**
+   * Returns the number of threads of the pool
+   */
+  size_t GetThreads() const
+  {
+    return workers.size();
+  }
+
+  /**
+   * Runs f & g, in parallel if a thread steals g, & returns once both are
+   * done. An exception thrown by either is rethrown after both finish
+   */
+  template <typename F, typename G>
+  void Invoke(F&& f, G&& g)
+  {
+    Task task;
+    task.run = [&g] { g(); };
+    task.done = false;
+
+    size_t index = Index();
+    Push(index, &task);
+
+    std::exception_ptr error;
+    try
+    {
+      f();
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+
+    if (Pop(index, &task))
+    {
+      Run(&task);
+    }
+    else
+    {
+      // Stolen: help with other tasks until the thief is done
+      while (!task.done.load(std::memory_order_acquire))
+      {
+        if (Task *other = Take(index))
+        {
+          Run(other);
+        }
+        else
+        {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+    if (task.error)
+    {
+      std::rethrow_exception(task.error);
+    }
+  }
+
+private:
+  TaskPool(const TaskPool&);
+  TaskPool& operator = (const TaskPool&);
+
+  /**
+   * Function queued by Invoke, living on the stack of its caller
+   */
+  struct Task
+  {
+    std::function<void()> run;
+    std::exception_ptr    error;
+    std::atomic<bool>     done;
+  };
+
+  /**
+   * Deque of tasks owned by a thread. Owners push & pop at the back,
+   * thieves take from the front
+   */
+  struct Queue
+  {
+    std::mutex          mutex;
+    std::deque<Task *>  tasks;
+  };
+
+  /**
+   * Pool & deque of a thread of a pool
+   */
+  struct Worker
+  {
+    const TaskPool *pool;
+    size_t          index;
+  };
+
+  /**
+   * Returns the pool & deque of the calling thread, if it belongs to one
+   */
+  static Worker& Self()
+  {
+    static thread_local Worker self = { NULL, 0 };
+    return self;
+  }
+
+  /**
+   * Returns the deque of the calling thread: its own for the threads of
+   * the pool, the shared one for others
+   */
+  size_t Index() const
+  {
+    const Worker& self = Self();
+    return self.pool == this ? self.index : queues.size() - 1;
+  }
+
+  /**
+   * Queues a task at the back of a deque & wakes a thread to steal it
+   */
+  void Push(size_t index, Task *task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queues[index]->mutex);
+      queues[index]->tasks.push_back(task);
+    }
+    queued.fetch_add(1, std::memory_order_release);
+
+    // Taking the lock orders the count with a thread about to sleep
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    wake.notify_one();
+  }
+
+  /**
+   * Takes a task back from the back of a deque, unless it was stolen
+   */
+  bool Pop(size_t index, Task *task)
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    std::deque<Task *>& tasks = queues[index]->tasks;
+    if (tasks.empty() || tasks.back() != task)
+    {
+      return false;
+    }
+    tasks.pop_back();
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * Takes the newest task of a deque or, if it is empty, steals the oldest
+   * task of another one
+   */
+  Task *Take(size_t index)
+  {
+    if (queued.load(std::memory_order_acquire) == 0)
+    {
+      return NULL;
+    }
+
+    for (size_t i = 0; i < queues.size(); ++i)
+    {
+      Queue& queue = *queues[(index + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty())
+      {
+        Task *task;
+        if (i == 0)
+        {
+          task = queue.tasks.back();
+          queue.tasks.pop_back();
+        }
+        else
+        {
+          task = queue.tasks.front();
+          queue.tasks.pop_front();
+        }
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * Runs a task, recording its exception
+   */
+  static void Run(Task *task)
+  {
+    try
+    {
+      task->run();
+    }
+    catch (...)
+    {
+      task->error = std::current_exception();
+    }
+    task->done.store(true, std::memory_order_release);
+  }
+
+  /**
+   * Body of the threads of the pool: run tasks, sleep when there are none
+   */
+  void Work(size_t index)
+  {
+    Self().pool = this;
+    Self().index = index;
+
+    for (;;)
+    {
+      if (Task *task = Take(index))
+      {
+        Run(task);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      if (stop)
+      {
+        return;
+      }
+      if (queued.load(std::memory_order_acquire) == 0)
+      {
+        wake.wait(lock);
+      }
+    }
+  }
+
+  /**
+   * Deques of the threads of the pool, followed by the one shared by other
+   * threads
+   */
+  std::vector<std::unique_ptr<Queue>> queues;
+
+  /**
+   * Number of tasks in all deques
+   */
+  std::atomic<size_t> queued;
+
+  /**
+   * Guards sleeping & stopping
+   */
+  std::mutex mutex;
+
+  /**
+   * Signalled when tasks are queued or the threads must stop
+   */
+  std::condition_variable wake;
+
+  /**
+   * Set by the destructor
+   */
+  bool stop;
+
+  /**
+   * Threads of the pool, started last
+   */
+  std::vector<std::thread> workers;
+};
+
+#endif /*__TASKS_H__*/
@@ -1,16 +1,38 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <chrono>
 #include <exception>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 #include "Tree.h"
+#include "Pool.h"
+#include "Iterator.h"
+#include "Search.h"
+#include "Batch.h"
+#include "Tasks.h"
+#include "Join.h"
+#include "Snapshot.h"
 #include "Treap.h"
 #include "BTree.h"
+#include "BPlusTree.h"
 #include "RBTree.h"
 #include "AVLTree.h"
+#include "Epoch.h"
+#include "ConcurrentBTree.h"
+#include "SkipList.h"
+#include "MappedBTree.h"
+#include "BufferedBTree.h"
+#include "Disposer.h"
 using namespace std;
 
 template <class T, int N = 20>
@@ -18,7 +40,7 @@ class TreeTest
 {
 public:
   TreeTest()
-    : tree(new T())
+    : tree(new VirtualTree<T>())
   {
   }
 
@@ -26,6 +48,11 @@ public:
   {
     TestInsertDelete();
     TestInsertDuplicate();
+    TestRandom();
+    TestErase();
+    TestIterators();
+    TestBulkLoad();
+    TestBatch();
   }
 
 private:
@@ -71,14 +98,1658 @@ private:
     }
   }
 
+  void TestRandom()
+  {
+    std::unique_ptr<Tree<int, int>> tree(new VirtualTree<T>());
+    std::map<int, int> ref;
+
+    srand(N);
+    for (int i = 0; i < 100 * N; ++i)
+    {
+      int key = rand() % (10 * N);
+      if (rand() % 3)
+      {
+        tree->Insert(key, i);
+        ref[key] = i;
+      }
+      else
+      {
+        bool found = true;
+        try
+        {
+          tree->Delete(key);
+        }
+        catch (std::runtime_error&)
+        {
+          found = false;
+        }
+
+        assert(found == (ref.erase(key) != 0));
+      }
+
+      assert(tree->GetSize() == ref.size());
+    }
+
+    for (std::map<int, int>::iterator it = ref.begin(); it != ref.end(); ++it)
+    {
+      assert(tree->Find(it->first) == it->second);
+    }
+  }
+
+  void TestErase()
+  {
+    std::unique_ptr<Tree<int, int>> tree(new VirtualTree<T>());
+    std::map<int, int> ref;
+
+    srand(N + 2);
+    for (int i = 0; i < 100 * N; ++i)
+    {
+      int key = rand() % (10 * N);
+      if (rand() % 2)
+      {
+        tree->Insert(key, i);
+        ref[key] = i;
+      }
+      else
+      {
+        assert(tree->Erase(key) == (ref.erase(key) != 0));
+      }
+
+      key = rand() % (10 * N);
+      int *value = tree->TryFind(key);
+      assert(tree->Contains(key) == (value != NULL));
+      assert(value ? ref.count(key) && *value == ref[key] : !ref.count(key));
+      assert(tree->GetSize() == ref.size());
+    }
+  }
+
+  void TestIterators()
+  {
+    T tree;
+    std::map<int, int> ref;
+
+    assert(tree.Begin() == tree.End());
+    assert(tree.LowerBound(0) == tree.End());
+
+    srand(N + 1);
+    for (int i = 0; i < 10 * N; ++i)
+    {
+      int key = 2 * (rand() % (10 * N));
+      tree.Insert(key, i);
+      ref[key] = i;
+    }
+
+    // Forward & backward traversals
+    typename T::Iterator it = tree.Begin();
+    for (std::map<int, int>::iterator r = ref.begin(); r != ref.end(); ++r, ++it)
+    {
+      assert(it != tree.End());
+      assert(it.GetKey() == r->first && it.GetValue() == r->second);
+    }
+    assert(it == tree.End());
+
+    for (std::map<int, int>::reverse_iterator r = ref.rbegin(); r != ref.rend(); ++r)
+    {
+      --it;
+      assert(it.GetKey() == r->first && it.GetValue() == r->second);
+    }
+    assert(it == tree.Begin());
+
+    // Bounds, for present & missing keys
+    for (int key = -1; key <= 20 * N + 1; ++key)
+    {
+      std::map<int, int>::iterator lo = ref.lower_bound(key);
+      typename T::Iterator tlo = tree.LowerBound(key);
+      assert((lo == ref.end()) == (tlo == tree.End()));
+      assert(lo == ref.end() || tlo.GetKey() == lo->first);
+
+      std::map<int, int>::iterator hi = ref.upper_bound(key);
+      typename T::Iterator thi = tree.UpperBound(key);
+      assert((hi == ref.end()) == (thi == tree.End()));
+      assert(hi == ref.end() || thi.GetKey() == hi->first);
+
+      if (tlo != tree.Begin())
+      {
+        --tlo;
+        --lo;
+        assert(tlo.GetKey() == lo->first);
+      }
+    }
+
+    // Range queries, through the tree & its static interface
+    std::vector<int> keys;
+    tree.Range(N, 3 * N, [&keys] (const int& key, int&)
+    {
+      keys.push_back(key);
+    });
+
+    std::vector<int> virtualKeys;
+    static_cast<TreeBase<T, int, int>&>(tree).Range(N, 3 * N, [&virtualKeys] (const int& key, int&)
+    {
+      virtualKeys.push_back(key);
+    });
+
+    std::vector<int> expected;
+    for (std::map<int, int>::iterator r = ref.lower_bound(N); r != ref.lower_bound(3 * N); ++r)
+    {
+      expected.push_back(r->first);
+    }
+    assert(keys == expected && virtualKeys == expected);
+  }
+
+  void TestBulkLoad()
+  {
+    for (int n = 0; n <= 10 * N; ++n)
+    {
+      std::vector<std::pair<int, int>> items;
+      for (int i = 0; i < n; ++i)
+      {
+        items.push_back(std::make_pair(2 * i, -i));
+      }
+
+      T tree(items.begin(), items.end());
+      assert(tree.GetSize() == static_cast<size_t>(n));
+      for (int i = 0; i < n; ++i)
+      {
+        assert(tree.Find(2 * i) == -i);
+      }
+
+      int i = 0;
+      for (typename T::Iterator it = tree.Begin(); it != tree.End(); ++it, ++i)
+      {
+        assert(it.GetKey() == 2 * i);
+      }
+      assert(i == n);
+
+      // The loaded tree must stay valid under updates
+      for (int i = 0; i < n; ++i)
+      {
+        tree.Insert(2 * i + 1, i);
+      }
+      for (int i = 0; i < n; ++i)
+      {
+        tree.Delete(2 * i);
+      }
+      assert(tree.GetSize() == static_cast<size_t>(n));
+      for (int i = 0; i < n; ++i)
+      {
+        assert(tree.Find(2 * i + 1) == i);
+      }
+    }
+
+    std::vector<std::pair<int, int>> unsorted;
+    unsorted.push_back(std::make_pair(2, 2));
+    unsorted.push_back(std::make_pair(1, 1));
+    bool thrown = false;
+    try
+    {
+      T tree(unsorted.begin(), unsorted.end());
+    }
+    catch (const std::runtime_error&)
+    {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  void TestBatch()
+  {
+    // Batches longer than a group, with duplicates inside each of them
+    const int n = 10 * N;
+    std::vector<int> keys, values;
+    std::map<int, int> ref;
+    for (int i = 0; i < 2 * n; ++i)
+    {
+      keys.push_back((i * 7) % n);
+      values.push_back(i);
+      ref[keys.back()] = i;
+    }
+
+    T tree;
+    tree.InsertBatch(&keys[0], &values[0], keys.size());
+    assert(tree.GetSize() == ref.size());
+
+    std::vector<int> probe;
+    for (int i = -n; i < 2 * n; ++i)
+    {
+      probe.push_back(i);
+    }
+
+    std::vector<int *> out(probe.size());
+    assert(tree.FindBatch(&probe[0], probe.size(), &out[0]) == ref.size());
+    for (size_t i = 0; i < probe.size(); ++i)
+    {
+      if (ref.count(probe[i]))
+      {
+        assert(*out[i] == ref[probe[i]] && out[i] == &tree.Find(probe[i]));
+      }
+      else
+      {
+        assert(out[i] == NULL);
+      }
+    }
+    assert(tree.FindBatch(NULL, 0, NULL) == 0);
+  }
+
   std::auto_ptr<Tree<int, int>> tree;
 };
 
+template <typename Key>
+void TestSearch()
+{
+  // Past 128 / sizeof(Key) keys, searches narrow the window with a binary
+  // search before they scan it, for every key type
+  Key keys[160];
+  srand(sizeof(Key));
+  for (int n = 0; n <= 160; ++n)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      uint64_t bits = (uint64_t)rand() << 40 ^ (uint64_t)rand() << 20 ^ rand();
+      keys[i] = static_cast<Key>(bits) / (std::is_floating_point<Key>::value ? 7 : 1);
+    }
+    std::sort(keys, keys + n);
+    int m = std::unique(keys, keys + n) - keys;
+
+    for (int i = 0; i < m; ++i)
+    {
+      Key needles[] = { keys[i], static_cast<Key>(keys[i] - 1), static_cast<Key>(keys[i] + 1) };
+      for (int j = 0; j < 3; ++j)
+      {
+        assert((NodeSearch<Key>::LowerBound(keys, m, needles[j]) ==
+                ScalarSearch<Key>::LowerBound(keys, m, needles[j])));
+        assert((NodeSearch<Key>::UpperBound(keys, m, needles[j]) ==
+                ScalarSearch<Key>::UpperBound(keys, m, needles[j])));
+      }
+    }
+  }
+}
+
+template <typename T>
+void TestOrderStatistics()
+{
+  std::vector<std::pair<int, int>> items;
+  for (int i = 0; i < 100; ++i)
+  {
+    items.push_back(std::make_pair(3 * i, i));
+  }
+
+  T tree(items.begin(), items.end());
+  std::map<int, int> ref(items.begin(), items.end());
+  srand(7);
+  for (int i = 0; i < 2000; ++i)
+  {
+    int key = rand() % 400;
+    if (rand() % 3 == 0 && ref.count(key))
+    {
+      tree.Delete(key);
+      ref.erase(key);
+    }
+    else
+    {
+      tree.Insert(key, i);
+      ref[key] = i;
+    }
+
+    if (i % 100 == 0)
+    {
+      std::vector<int> keys;
+      for (std::map<int, int>::iterator r = ref.begin(); r != ref.end(); ++r)
+      {
+        keys.push_back(r->first);
+      }
+
+      for (size_t k = 0; k < keys.size(); ++k)
+      {
+        assert(tree.Select(k).GetKey() == keys[k]);
+      }
+      assert(tree.Select(keys.size()) == tree.End());
+
+      for (int key = -1; key <= 400; ++key)
+      {
+        size_t rank = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        assert(tree.Rank(key) == rank);
+        assert(tree.CountRange(key, key + 50) == ref.size() - rank -
+               (keys.end() - std::lower_bound(keys.begin(), keys.end(), key + 50)));
+      }
+      assert(tree.CountRange(200, 100) == 0);
+    }
+  }
+}
+
+template <typename T>
+void TestMoves()
+{
+  // Values are move-only, so any copy inside the tree fails to compile
+  T tree;
+  std::map<std::string, int> ref;
+  for (int i = 0; i < 500; ++i)
+  {
+    std::string key = std::to_string(i * 7919 % 500);
+    ref[key] = i;
+    tree.Insert(std::move(key), std::unique_ptr<int>(new int(i)));
+  }
+  assert(tree.GetSize() == 500);
+
+  assert(tree.Emplace("x", new int(1)));
+  assert(!tree.Emplace("x", new int(2)) && *tree.Find("x") == 2);
+
+  std::unique_ptr<int> value(new int(3));
+  assert(!tree.TryEmplace(std::string("x"), std::move(value)));
+  assert(value && *tree.Find("x") == 2);
+  assert(tree.TryEmplace(std::string("y"), std::move(value)));
+  assert(!value && *tree.Find("y") == 3);
+
+  assert(tree.Emplace(std::string("z")) && !tree.Find("z"));
+
+  // Deletions shift & rotate the remaining items
+  for (int i = 0; i < 500; i += 2)
+  {
+    tree.Delete(std::to_string(i));
+  }
+  assert(tree.GetSize() == 253);
+  for (int i = 1; i < 500; i += 2)
+  {
+    std::string key = std::to_string(i);
+    assert(*tree.Find(key) == ref[key]);
+  }
+}
+
+/**
+ * Key which counts the conversions from C strings, to check that
+ * transparent lookups compare C strings directly instead
+ */
+struct Name
+{
+  static int converted;
+
+  Name()
+  {
+  }
+
+  explicit Name(const std::string& text)
+    : text(text)
+  {
+  }
+
+  Name(const char *text)
+    : text(text)
+  {
+    ++converted;
+  }
+
+  std::string text;
+};
+
+int Name::converted = 0;
+
+bool operator < (const Name& a, const Name& b)
+{
+  return a.text < b.text;
+}
+
+bool operator < (const Name& a, const char *b)
+{
+  return strcmp(a.text.c_str(), b) < 0;
+}
+
+bool operator < (const char *a, const Name& b)
+{
+  return strcmp(a, b.text.c_str()) < 0;
+}
+
+template <typename T>
+void TestTransparent()
+{
+  T tree;
+  for (int i = 100; i < 300; ++i)
+  {
+    tree.Insert(Name(std::to_string(i)), i);
+  }
+
+  Name::converted = 0;
+  assert(tree.Find("142") == 142);
+  assert(tree.LowerBound("1420").GetKey().text == "143");
+  assert(tree.UpperBound("143").GetKey().text == "144");
+  assert(tree.Rank("2") == 100);
+  assert(tree.CountRange("15", "2") == 50);
+
+  int sum = 0;
+  tree.Range("15", "16", [&sum] (const Name&, int& v) { sum += v; });
+  assert(sum == 1545);
+
+  tree.Delete("142");
+  try
+  {
+    tree.Find("142");
+    assert(false);
+  }
+  catch (const std::runtime_error&)
+  {
+  }
+  assert(Name::converted == 0);
+  assert(tree.GetSize() == 199);
+}
+
+template <typename T>
+void TestCompare()
+{
+  // Keys are ordered by decreasing value
+  T tree;
+  for (int i = 0; i < 1000; ++i)
+  {
+    tree.Insert(i * 7919 % 1000, i);
+  }
+
+  int prev = 1000;
+  for (typename T::Iterator it = tree.Begin(); it != tree.End(); ++it)
+  {
+    assert(it.GetKey() == prev - 1);
+    prev = it.GetKey();
+  }
+  assert(tree.LowerBound(500).GetKey() == 500);
+  assert(tree.UpperBound(500).GetKey() == 499);
+  assert(tree.Rank(500) == 499);
+  assert(tree.CountRange(500, 400) == 100);
+
+  for (int i = 0; i < 1000; i += 2)
+  {
+    tree.Delete(i);
+  }
+  for (int i = 1; i < 1000; i += 2)
+  {
+    assert(tree.Find(i) * 7919 % 1000 == i);
+  }
+  assert(tree.GetSize() == 500);
+}
+
+template <typename T>
+void TestMapped(size_t n)
+{
+  const char *path = "mapped-test.tree";
+  T tree;
+  std::map<int, int> ref;
+  for (size_t i = 0; i < n; ++i)
+  {
+    int key = static_cast<int>(i * 7919 % (2 * n + 1));
+    tree.Insert(key, static_cast<int>(i));
+    ref[key] = static_cast<int>(i);
+  }
+  MappedBTree<int, int>::Save(tree, path);
+
+  {
+    MappedBTree<int, int> mapped(path);
+    assert(mapped.Verify());
+    assert(mapped.GetSize() == ref.size());
+    for (int key = -1; key <= static_cast<int>(2 * n + 1); ++key)
+    {
+      const int *value = mapped.TryFind(key);
+      assert(ref.count(key) ? value && *value == ref[key] : !value);
+      assert(mapped.Contains(key) == (value != NULL));
+    }
+
+    std::vector<int> keys;
+    mapped.Range(static_cast<int>(n / 3), static_cast<int>(n), [&keys] (const int& key, const int&)
+    {
+      keys.push_back(key);
+    });
+    std::vector<int> expected;
+    std::map<int, int>::iterator it = ref.lower_bound(static_cast<int>(n / 3));
+    for (; it != ref.end() && it->first < static_cast<int>(n); ++it)
+    {
+      expected.push_back(it->first);
+    }
+    assert(keys == expected);
+  }
+
+  // Flipping a byte of the last page is caught by Verify, a byte of the
+  // header by the constructor
+  if (n > 0)
+  {
+    FILE *file = fopen(path, "r+b");
+    fseek(file, -1, SEEK_END);
+    int c = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(c ^ 1, file);
+    fclose(file);
+    MappedBTree<int, int> mapped(path);
+    assert(!mapped.Verify());
+  }
+
+  FILE *file = fopen(path, "r+b");
+  fseek(file, 16, SEEK_SET);
+  fputc(0xFF, file);
+  fclose(file);
+  try
+  {
+    MappedBTree<int, int> mapped(path);
+    assert(false);
+  }
+  catch (const std::runtime_error&)
+  {
+  }
+  remove(path);
+}
+
+/**
+ * Checks the operation counters, which all read 0 unless the tests are
+ * built with TREES_COUNTERS
+ * @param compares Whether lookups go through the comparator of the tree
+ */
+template <typename T>
+void TestCounters(bool compares)
+{
+  T tree;
+  Counters zero;
+  memset(&zero, 0, sizeof(zero));
+  for (int i = 0; i < 1000; ++i)
+  {
+    tree.Insert(i, i);
+  }
+  for (int i = 0; i < 1000; ++i)
+  {
+    assert(tree.Find(i) == i);
+  }
+
+  Counters counters = tree.GetCounters();
+#if TREES_COUNTERS
+  assert(counters.finds == 1000 && counters.visits >= 1000);
+  assert(counters.allocs > 0 && counters.frees < counters.allocs);
+#else
+  assert(memcmp(&counters, &zero, sizeof(zero)) == 0);
+#endif
+
+  assert(!TREES_COUNTERS || !compares || counters.comparisons >= 1000);
+
+  tree.ResetCounters();
+  counters = tree.GetCounters();
+  assert(memcmp(&counters, &zero, sizeof(zero)) == 0);
+
+  for (int i = 0; i < 1000; ++i)
+  {
+    tree.Erase(i);
+  }
+  counters = tree.GetCounters();
+  assert(TREES_COUNTERS || memcmp(&counters, &zero, sizeof(zero)) == 0);
+}
+
+/**
+ * Checks the structural events counted for each kind of tree
+ */
+void TestStructuralCounters()
+{
+#if TREES_COUNTERS
+  RBTree<int, int> rb;
+  BTree<int, int, 2> btree;
+  BufferedBTree<int, int, 8, 8> buffered;
+  for (int i = 0; i < 1000; ++i)
+  {
+    rb.Insert(i, i);
+    btree.Insert(i, i);
+    buffered.Insert(i, i);
+  }
+  assert(rb.GetCounters().rotations > 0 && rb.GetCounters().fixups > 0);
+  assert(btree.GetCounters().splits > 0);
+
+  for (int i = 0; i < 1000; ++i)
+  {
+    rb.Erase(i);
+    btree.Erase(i);
+    buffered.Erase(i);
+  }
+  Counters counters = rb.GetCounters();
+  assert(counters.allocs == 1000 && counters.frees == 1000);
+
+  counters = btree.GetCounters();
+  assert(counters.joins > 0 && counters.borrows > 0);
+  assert(counters.allocs == counters.frees + 1);
+
+  // Pending deletes keep their nodes alive until they are flushed
+  assert(buffered.GetSize() == 0);
+  counters = buffered.GetCounters();
+  assert(counters.splits > 0 && counters.joins > 0);
+  assert(counters.allocs == counters.frees + 1);
+
+  // Algorithms copy comparators, which still add to the count of the tree
+  BTree<int, int, 5, NodeSearch<int>, std::greater<int>> reversed;
+  reversed.Insert(1, 1);
+  reversed.ResetCounters();
+  reversed.Find(1);
+  assert(reversed.GetCounters().comparisons > 0);
+
+  VirtualTree<AVLTree<int, int>> avl;
+  avl.Insert(1, 1);
+  assert(avl.GetCounters().allocs == 1);
+#endif
+}
+
+/**
+ * Checks the structural statistics of a tree as it fills up & empties
+ * @param empty Height of an empty tree
+ */
+template <typename T>
+void TestStats(size_t empty)
+{
+  T tree;
+  for (int i = 0; i < 1023; ++i)
+  {
+    tree.Insert(i, i);
+  }
+
+  Stats stats = tree.GetStats();
+  assert(stats.nodes > 0 && stats.bytes > 0);
+  assert(stats.fill > 0 && stats.fill <= 1);
+  assert(stats.depth >= 1 && stats.depth <= tree.GetHeight());
+
+  for (int i = 0; i < 1023; ++i)
+  {
+    tree.Insert(i + 1023, i);
+    tree.Erase(i);
+    assert(tree.GetHeight() > empty);
+  }
+  for (int i = 1023; i < 2046; ++i)
+  {
+    tree.Erase(i);
+  }
+
+  // Buffered trees only count the items which reached the leaves
+  assert(tree.GetSize() == 0);
+  stats = tree.GetStats();
+  assert(tree.GetHeight() == empty);
+  assert(stats.fill == 0 && stats.depth == 0);
+}
+
+/**
+ * Checks the height & depth of perfectly balanced binary trees
+ */
+template <typename T>
+void TestPerfectStats()
+{
+  std::vector<std::pair<int, int>> items;
+  for (int i = 0; i < 1023; ++i)
+  {
+    items.push_back(std::make_pair(i, i));
+  }
+
+  // Level d holds 2^(d - 1) items, so the depths add up to 9 * 2^10 + 1
+  T tree(items.begin(), items.end());
+  assert(tree.GetHeight() == 10);
+  assert(tree.GetStats().depth == 9217.0 / 1023);
+  assert(tree.GetStats().nodes == 1023);
+}
+
+/**
+ * Checks that the height of a binary tree stays below factor * log2(n + 2)
+ * under sorted, reverse & sawtooth inserts, followed by deletes from one end
+ */
+template <typename T>
+void TestHeights(double factor)
+{
+  const int n = 50000, teeth = 16;
+  for (int order = 0; order < 3; ++order)
+  {
+    T tree;
+    for (int i = 0; i < n; ++i)
+    {
+      int key = order == 0 ? i : order == 1 ? n - 1 - i : i % (n / teeth) * teeth + i / (n / teeth);
+      tree.Insert(key, i);
+      assert(tree.GetHeight() <= factor * log2(i + 3.0));
+    }
+    assert(tree.GetSize() == static_cast<size_t>(n));
+
+    for (int i = 0; i < n / 2; ++i)
+    {
+      tree.Delete(i);
+      assert(tree.GetHeight() <= factor * log2(n - i + 1.0));
+    }
+    assert(tree.GetSize() == static_cast<size_t>(n / 2) && tree.Begin().GetKey() == n / 2);
+  }
+}
+
+/**
+ * Checks that clearing a tree destroys its values & leaves it usable
+ * @param empty Height of an empty tree
+ */
+template <typename T>
+void TestClear(size_t empty)
+{
+  std::shared_ptr<int> shared(new int(1));
+  T tree;
+  for (int i = 0; i < 5000; ++i)
+  {
+    tree.Insert(i * 7919 % 5000, shared);
+  }
+
+  tree.Clear();
+  assert(shared.use_count() == 1);
+  assert(tree.GetSize() == 0 && tree.GetHeight() == empty);
+  assert(tree.GetStats().depth == 0);
+  assert(!tree.Contains(1));
+
+  for (int i = 0; i < 100; ++i)
+  {
+    tree.Insert(i, shared);
+  }
+  assert(tree.GetSize() == 100 && *tree.Find(99) == 1);
+  tree.Clear();
+  tree.Clear();
+  assert(shared.use_count() == 1 && tree.GetSize() == 0);
+}
+
+/**
+ * Fills a tree & a reference map with the same pseudo-random items
+ */
+template <typename T>
+void Fill(T& tree, std::map<int, int>& ref, int n, unsigned seed)
+{
+  for (int i = 0; i < n; ++i)
+  {
+    int key = static_cast<int>((i * 2654435761u + seed) % 30000);
+    tree.Insert(key, i);
+    ref[key] = i;
+  }
+}
+
+/**
+ * Checks that a tree holds exactly the items of a reference map
+ */
+template <typename T>
+void Same(T& tree, const std::map<int, int>& ref)
+{
+  assert(tree.GetSize() == ref.size());
+  typename T::Iterator it = tree.Begin();
+  for (std::map<int, int>::const_iterator r = ref.begin(); r != ref.end(); ++r, ++it)
+  {
+    assert(it.GetKey() == r->first && it.GetValue() == r->second);
+  }
+  assert(it == tree.End());
+
+  Stats stats = tree.GetStats();
+  assert(ref.empty() || (stats.depth >= 1 && stats.depth <= tree.GetHeight()));
+}
+
+/**
+ * Checks splits, joins & set operations against std::map
+ */
+template <typename T>
+void TestJoins()
+{
+  std::map<int, int> a, b;
+  {
+    T x, y;
+    Fill(x, a, 20000, 0);
+    x.Split(15000, y);
+    Same(x, std::map<int, int>(a.begin(), a.lower_bound(15000)));
+    Same(y, std::map<int, int>(a.lower_bound(15000), a.end()));
+
+    T z;
+    z.Insert(0, 0);
+    bool thrown = false;
+    try
+    {
+      x.Join(z);
+    }
+    catch (const std::runtime_error&)
+    {
+      thrown = true;
+    }
+    assert(thrown && z.GetSize() == 1);
+
+    x.Join(y);
+    Same(x, a);
+    Same(y, std::map<int, int>());
+
+    // Splits outside the keys move all or nothing
+    x.Split(-1, y);
+    assert(x.GetSize() == 0 && y.GetSize() == a.size());
+    y.Split(30000, x);
+    assert(x.GetSize() == 0 && y.GetSize() == a.size());
+
+    // Both halves outlive the other
+    y.Split(10000, x);
+  }
+
+  for (int op = 0; op < 3; ++op)
+  {
+    T x, y;
+    a.clear();
+    b.clear();
+    Fill(x, a, 20000, 0);
+    Fill(y, b, 5000 << op, 12345);
+
+    std::map<int, int> expected;
+    for (std::map<int, int>::iterator it = a.begin(); it != a.end(); ++it)
+    {
+      bool both = b.count(it->first) > 0;
+      if (op == 0 || (op == 1 && both) || (op == 2 && !both))
+      {
+        expected.insert(*it);
+      }
+    }
+    if (op == 0)
+    {
+      expected.insert(b.begin(), b.end());
+    }
+
+    if (op == 0)
+    {
+      x.Union(y);
+    }
+    else if (op == 1)
+    {
+      x.Intersect(y);
+    }
+    else
+    {
+      x.Difference(y);
+    }
+    Same(x, expected);
+    Same(y, std::map<int, int>());
+
+    y.Insert(1, 1);
+    assert(y.GetSize() == 1 && y.Find(1) == 1);
+  }
+}
+
+/**
+ * Checks the parallel batch operations & union against std::map, with
+ * batches large enough to be split across the threads of a pool
+ */
+template <typename T>
+void TestParallel()
+{
+  TaskPool tasks(3);
+  std::map<int, int> a, b;
+  T x, y;
+  Fill(x, a, 20000, 0);
+
+  std::vector<int> keys, values;
+  for (int key = 1; key < 60000; key += 3)
+  {
+    keys.push_back(key);
+    values.push_back(-key);
+    a[key] = -key;
+  }
+  x.ParallelInsertBatch(&keys[0], &values[0], keys.size(), tasks);
+  Same(x, a);
+
+  keys.clear();
+  for (int key = 0; key < 50000; key += 2)
+  {
+    keys.push_back(key);
+    a.erase(key);
+  }
+  x.ParallelDeleteBatch(&keys[0], keys.size(), tasks);
+  Same(x, a);
+
+  Fill(y, b, 40000, 777);
+  for (std::map<int, int>::iterator it = b.begin(); it != b.end(); ++it)
+  {
+    a.insert(*it);
+  }
+  x.ParallelUnion(y, tasks);
+  Same(x, a);
+  Same(y, std::map<int, int>());
+
+  std::reverse(keys.begin(), keys.end());
+  bool thrown = false;
+  try
+  {
+    x.ParallelDeleteBatch(&keys[0], keys.size(), tasks);
+  }
+  catch (const std::runtime_error&)
+  {
+    thrown = true;
+  }
+  assert(thrown);
+  Same(x, a);
+
+  // A pool without threads runs everything on the caller
+  TaskPool serial(0);
+  x.ParallelDeleteBatch(&keys.back(), 1, serial);
+  a.erase(keys.back());
+  Same(x, a);
+}
+
+/**
+ * Checks that a snapshot holds exactly the items of a reference map
+ */
+template <typename S>
+void SameSnapshot(const S& snapshot, const std::map<int, int>& ref)
+{
+  assert(snapshot.GetSize() == ref.size());
+  typename S::Iterator it = snapshot.Begin();
+  for (std::map<int, int>::const_iterator r = ref.begin(); r != ref.end(); ++r, ++it)
+  {
+    assert(it.GetKey() == r->first && it.GetValue() == r->second);
+  }
+  assert(it == snapshot.End());
+}
+
+/**
+ * Checks that snapshots keep the items they were taken with while the
+ * tree changes, including while another thread reads them, & that the
+ * nodes they held are freed once they are released
+ */
+template <typename T>
+void TestSnapshots()
+{
+  std::map<int, int> a;
+  T tree;
+  Fill(tree, a, 20000, 0);
+
+  typename T::Snapshot first = tree.GetSnapshot();
+  std::map<int, int> before = a;
+
+  // Readers scan while the writer goes on
+  std::atomic<bool> done(false);
+  std::thread reader([&] {
+    while (!done)
+    {
+      SameSnapshot(first, before);
+    }
+  });
+
+  typename T::Snapshot second;
+  for (int i = 0; i < 30000; ++i)
+  {
+    int key = static_cast<int>((i * 40503u + 7) % 30000);
+    if (i % 3 == 0)
+    {
+      tree.Erase(key);
+      a.erase(key);
+    }
+    else
+    {
+      tree.Insert(key, -i);
+      a[key] = -i;
+    }
+    if (i == 15000)
+    {
+      second = tree.GetSnapshot();
+    }
+  }
+  done = true;
+  reader.join();
+
+  Same(tree, a);
+  SameSnapshot(first, before);
+  typename T::Snapshot copy = first;
+  first.Release();
+  SameSnapshot(copy, before);
+
+  copy.Release();
+  second = typename T::Snapshot();
+
+  // Erasing frees the nodes retired while the snapshots were live
+  tree.Erase(a.begin()->first);
+  a.erase(a.begin());
+  Counters counters = tree.GetCounters();
+  assert(!TREES_COUNTERS || counters.allocs - counters.frees == tree.GetStats().nodes);
+
+  tree.Insert(-1, -1);
+  a[-1] = -1;
+  Same(tree, a);
+
+  counters = tree.GetCounters();
+  assert(!TREES_COUNTERS || counters.allocs - counters.frees == tree.GetStats().nodes);
+
+  // Clearing the tree leaves its live snapshots readable
+  typename T::Snapshot kept = tree.GetSnapshot();
+  tree.Erase(a.begin()->first);
+  tree.Clear();
+  assert(tree.GetSize() == 0);
+  SameSnapshot(kept, a);
+  counters = tree.GetCounters();
+  assert(!TREES_COUNTERS || counters.allocs - counters.frees == tree.GetStats().nodes);
+
+  tree.Insert(1, 1);
+  Same(tree, std::map<int, int>{{1, 1}});
+
+  // So does destroying it, with the nodes freed by the last snapshot
+  std::map<int, int> b;
+  std::unique_ptr<T> doomed(new T());
+  Fill(*doomed, b, 2000, 5);
+  typename T::Snapshot last = doomed->GetSnapshot();
+  doomed->Erase(b.begin()->first);
+  doomed.reset();
+  SameSnapshot(kept, a);
+  SameSnapshot(last, b);
+  kept.Release();
+  SameSnapshot(last, b);
+
+  // Nodes kept alive for a snapshot count towards the bytes of the tree
+  T held;
+  b.clear();
+  Fill(held, b, 2000, 9);
+  uint64_t bytes = held.GetStats().bytes;
+  kept = held.GetSnapshot();
+  for (std::map<int, int>::iterator it = b.begin(); it != b.end(); ++it)
+  {
+    held.Erase(it->first);
+  }
+  assert(held.GetStats().bytes >= bytes);
+  kept.Release();
+}
+
+/**
+ * Checks that values written through Find, TryFind & Range after a
+ * snapshot is taken only change the tree, & that snapshots are read-only
+ */
+template <typename T>
+void TestSnapshotWrites()
+{
+  typedef typename T::Snapshot::Iterator It;
+  static_assert(std::is_const<typename std::remove_reference<
+      decltype(std::declval<It>().GetValue())>::type>::value,
+      "Snapshot values must be read-only");
+
+  T tree;
+  std::map<int, int> a;
+  Fill(tree, a, 2000, 11);
+  std::map<int, int> before = a;
+  typename T::Snapshot snapshot = tree.GetSnapshot();
+
+  // Reads go through the shared nodes without copying them
+  uint64_t allocs = tree.GetCounters().allocs;
+  size_t sum = 0;
+  tree.Range(0, 30000, [&sum] (const int&, const int& value) { sum += value; });
+  const T& view = tree;
+  for (std::map<int, int>::iterator it = a.begin(); it != a.end(); ++it)
+  {
+    sum -= it->second;
+    assert(*view.TryFind(it->first) == it->second && tree.Contains(it->first));
+  }
+  assert(sum == 0 && tree.GetCounters().allocs == allocs);
+
+  int key = a.begin()->first;
+  tree.Find(key) = -1;
+  a[key] = -1;
+  key = a.rbegin()->first;
+  *tree.TryFind(key) = -2;
+  a[key] = -2;
+  tree.Range(1000, 20000, [] (const int&, int& value) { value = -value - 3; });
+  for (std::map<int, int>::iterator it = a.lower_bound(1000); it != a.lower_bound(20000); ++it)
+  {
+    it->second = -it->second - 3;
+  }
+
+  Same(tree, a);
+  SameSnapshot(snapshot, before);
+  snapshot.Release();
+  Same(tree, a);
+}
+
+/**
+ * Checks that a tree with compact nodes holds the same items as one with
+ * wide nodes, in less memory
+ */
+template <typename Wide, typename Compact>
+void TestCompact()
+{
+  Wide wide;
+  Compact compact;
+  for (int i = 0; i < 300000; ++i)
+  {
+    int key = static_cast<int>(i * 2654435761u % 250000);
+    if (i % 3 == 2)
+    {
+      assert(wide.Erase(key) == compact.Erase(key));
+    }
+    else
+    {
+      wide.Insert(key, i);
+      compact.Insert(key, i);
+    }
+  }
+
+  assert(compact.GetSize() == wide.GetSize());
+  typename Compact::Iterator it = compact.Begin();
+  for (typename Wide::Iterator w = wide.Begin(); w != wide.End(); ++w, ++it)
+  {
+    assert(it.GetKey() == w.GetKey() && it.GetValue() == w.GetValue());
+  }
+  assert(it == compact.End());
+  assert(compact.GetStats().bytes * 10 < wide.GetStats().bytes * 7);
+}
+
+/**
+ * Checks that trees handed over to a Disposer are destroyed in the
+ * background, by Wait or at the latest by the destructor
+ */
+void TestDisposer()
+{
+  typedef Tree<int, std::shared_ptr<int>> Index;
+  std::shared_ptr<int> shared(new int(1));
+  {
+    Disposer disposer;
+    for (int i = 0; i < 3; ++i)
+    {
+      std::unique_ptr<Index> tree(new VirtualTree<AVLTree<int, std::shared_ptr<int>>>());
+      for (int j = 0; j < 10000; ++j)
+      {
+        tree->Insert(j, shared);
+      }
+      disposer.Dispose(std::move(tree));
+    }
+    disposer.Wait();
+    assert(shared.use_count() == 1);
+
+    BTree<int, std::shared_ptr<int>, 2> *tree = new BTree<int, std::shared_ptr<int>, 2>();
+    for (int j = 0; j < 100000; ++j)
+    {
+      tree->Insert(j, shared);
+    }
+    disposer.Dispose(tree);
+    disposer.Dispose(std::unique_ptr<Index>());
+  }
+  assert(shared.use_count() == 1);
+}
+
+void TestBPlusTreeRange()
+{
+  BPlusTree<int, int, 64> tree;
+  for (int i = 0; i < 1000; i += 2)
+  {
+    tree.Insert(i, -i);
+  }
+
+  std::vector<int> keys;
+  tree.Range(101, 201, [&keys] (const int& key, int& value)
+  {
+    assert(value == -key);
+    keys.push_back(key);
+  });
+
+  assert(keys.size() == 50);
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    assert(keys[i] == 102 + 2 * static_cast<int>(i));
+  }
+}
+
+void TestBufferedBTree()
+{
+  // Small buffers, so that messages are pending at every level
+  BufferedBTree<int, int, 8, 8> tree;
+  std::map<int, int> ref;
+  for (int i = 0; i < 5000; ++i)
+  {
+    int key = (i * 7919) % 2000;
+    if (i % 3 == 2)
+    {
+      assert(tree.Erase(key) == (ref.erase(key) != 0));
+    }
+    else
+    {
+      tree.Insert(key, i);
+      ref[key] = i;
+    }
+
+    // Lookups see the newest message for the key, wherever it is
+    int *value = tree.TryFind(key);
+    assert(value ? ref.count(key) && *value == ref[key] : !ref.count(key));
+  }
+  assert(tree.GetHeight() > 2);
+
+  for (int key = 0; key < 2000; ++key)
+  {
+    int *value = tree.TryFind(key);
+    assert(value ? ref.count(key) && *value == ref[key] : !ref.count(key));
+  }
+
+  // Flushing moves everything to the leaves, without changing the items
+  assert(tree.GetSize() == ref.size());
+  std::map<int, int>::iterator r = ref.begin();
+  for (BufferedBTree<int, int, 8, 8>::Iterator it = tree.Begin(); it != tree.End(); ++it, ++r)
+  {
+    assert(it.GetKey() == r->first && it.GetValue() == r->second);
+  }
+  assert(r == ref.end());
+
+  for (int key = 0; key < 2000; ++key)
+  {
+    tree.Erase(key);
+  }
+  assert(tree.GetSize() == 0 && tree.GetHeight() == 1);
+
+  // Random updates, checked after every flush, so that flushes hit joins
+  // & splits of nodes whose buffers have not been flushed yet
+  for (unsigned seed = 0; seed < 50; ++seed)
+  {
+    BufferedBTree<int, int, 8, 8> tree;
+    std::map<int, int> ref;
+    srand(seed);
+    for (int i = 0; i < 20000; ++i)
+    {
+      int key = rand() % 1000;
+      if (rand() % 2)
+      {
+        tree.Erase(key);
+        ref.erase(key);
+      }
+      else
+      {
+        tree.Insert(key, i);
+        ref[key] = i;
+      }
+
+      if (i % 97 == 96)
+      {
+        assert(tree.GetSize() == ref.size());
+        std::map<int, int>::iterator r = ref.begin();
+        for (BufferedBTree<int, int, 8, 8>::Iterator it = tree.Begin(); it != tree.End(); ++it, ++r)
+        {
+          assert(it.GetKey() == r->first && it.GetValue() == r->second);
+        }
+        assert(r == ref.end());
+      }
+    }
+  }
+}
+
+/**
+ * Adds an item unless the key is present, for trees with TryEmplace;
+ * other concurrent trees insert it
+ */
+template <typename T>
+void TryAdd(T& tree, int key, int value)
+{
+  tree.Insert(key, value);
+}
+
+template <typename Key, typename Value>
+void TryAdd(SkipList<Key, Value>& tree, int key, int value)
+{
+  tree.TryEmplace(key, value);
+}
+
+template <typename T>
+void TestConcurrent()
+{
+  // Single threaded, against a reference
+  {
+    T tree;
+    std::map<int, int> ref;
+    srand(11);
+    for (int i = 0; i < 20000; ++i)
+    {
+      int key = rand() % 500;
+      if (rand() % 3 == 0)
+      {
+        bool thrown = false;
+        try
+        {
+          tree.Delete(key);
+        }
+        catch (const std::runtime_error&)
+        {
+          thrown = true;
+        }
+        assert(thrown == (ref.erase(key) == 0));
+      }
+      else
+      {
+        tree.Insert(key, i);
+        ref[key] = i;
+      }
+      assert(tree.GetSize() == ref.size());
+    }
+
+    for (int key = 0; key < 500; ++key)
+    {
+      int value;
+      assert(tree.Find(key, value) == (ref.count(key) == 1));
+      assert(!ref.count(key) || value == ref[key]);
+    }
+  }
+
+  // Writers on disjoint keys, with readers checking every value they see
+  {
+    const int kWriters = 4, kKeys = 20000;
+    T tree;
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; ++t)
+    {
+      threads.push_back(std::thread([&tree, &done, &errors, t] ()
+      {
+        unsigned seed = t;
+        while (!done.load())
+        {
+          int key = rand_r(&seed) % (kWriters * kKeys), value;
+          if (tree.Find(key, value) && value != -key)
+          {
+            ++errors;
+          }
+        }
+      }));
+    }
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; ++t)
+    {
+      writers.push_back(std::thread([&tree, t] ()
+      {
+        for (int i = 0; i < kKeys; ++i)
+        {
+          tree.Insert(i * kWriters + t, -(i * kWriters + t));
+        }
+        for (int i = 0; i < kKeys; i += 2)
+        {
+          tree.Delete(i * kWriters + t);
+        }
+      }));
+    }
+
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+      writers[i].join();
+    }
+    done = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+      threads[i].join();
+    }
+
+    assert(errors.load() == 0);
+    assert(tree.GetSize() == static_cast<size_t>(kWriters * kKeys / 2));
+    for (int key = 0; key < kWriters * kKeys; ++key)
+    {
+      int value;
+      bool live = (key / kWriters) % 2 == 1;
+      assert(tree.Find(key, value) == live);
+      assert(!live || value == -key);
+    }
+  }
+
+  // Writers racing on the same few keys, so that inserts meet erases of
+  // the same items. A last pass by every writer inserts the even keys &
+  // erases the odd ones, which leaves a known set once all are done
+  {
+    const int kWriters = 4, kKeys = 64, kOps = 50000;
+    T tree;
+    std::atomic<int> errors(0);
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; ++t)
+    {
+      writers.push_back(std::thread([&tree, &errors, t] ()
+      {
+        unsigned seed = t + 100;
+        for (int i = 0; i < kOps; ++i)
+        {
+          int key = rand_r(&seed) % kKeys, op = rand_r(&seed) % 4, value;
+          if (op == 0)
+          {
+            tree.Insert(key, -key);
+          }
+          else if (op == 1)
+          {
+            TryAdd(tree, key, -key);
+          }
+          else if (op == 2)
+          {
+            tree.Erase(key);
+          }
+          else if (tree.Find(key, value) && value != -key)
+          {
+            ++errors;
+          }
+        }
+
+        for (int i = 0; i < kKeys; ++i)
+        {
+          int key = (i + t * kKeys / kWriters) % kKeys;
+          if (key % 2 == 0)
+          {
+            tree.Insert(key, -key);
+          }
+          else
+          {
+            tree.Erase(key);
+          }
+        }
+      }));
+    }
+
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+      writers[i].join();
+    }
+
+    assert(errors.load() == 0);
+    assert(tree.GetSize() == static_cast<size_t>(kKeys / 2));
+    for (int key = 0; key < kKeys; ++key)
+    {
+      int value;
+      assert(tree.Find(key, value) == (key % 2 == 0));
+      assert(key % 2 == 1 || value == -key);
+    }
+  }
+}
+
+/**
+ * Checks that a ConcurrentBTree merges the nodes a sliding window of keys
+ * leaves behind, so that its height & its nodes stay bounded by the number
+ * of live items, with one writer & with several sliding their own windows
+ */
+template <typename T>
+void TestConcurrentMerges()
+{
+  const int kWindow = 1000, kKeys = 200000;
+  {
+    T tree;
+    for (int key = 0; key < kKeys; ++key)
+    {
+      tree.Insert(key, -key);
+      if (key >= kWindow)
+      {
+        assert(tree.Erase(key - kWindow));
+      }
+    }
+
+    assert(tree.GetSize() == static_cast<size_t>(kWindow));
+    assert(tree.GetHeight() <= 12);
+    for (int key = 0; key < kKeys; ++key)
+    {
+      int value;
+      assert(tree.Find(key, value) == (key >= kKeys - kWindow));
+    }
+    Counters counters = tree.GetCounters();
+    assert(!TREES_COUNTERS || counters.allocs - counters.frees <= kWindow);
+  }
+
+  {
+    const int kWriters = 4;
+    T tree;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; ++t)
+    {
+      writers.push_back(std::thread([&tree, t] ()
+      {
+        for (int i = 0; i < kKeys / kWriters; ++i)
+        {
+          tree.Insert(i * kWriters + t, i);
+          if (i >= kWindow / kWriters)
+          {
+            tree.Erase((i - kWindow / kWriters) * kWriters + t);
+          }
+        }
+      }));
+    }
+
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+      writers[i].join();
+    }
+
+    assert(tree.GetSize() == static_cast<size_t>(kWindow));
+    assert(tree.GetHeight() <= 12);
+    for (int key = kKeys - 2 * kWindow; key < kKeys; ++key)
+    {
+      int value;
+      assert(tree.Find(key, value) == (key >= kKeys - kWindow));
+    }
+    Counters counters = tree.GetCounters();
+    assert(!TREES_COUNTERS || counters.allocs - counters.frees <= kWindow);
+  }
+}
+
+void TestSkipListRange()
+{
+  VirtualTree<SkipList<int, int>> adapter;
+  SkipList<int, int>& list = adapter.Get();
+  for (int i = 0; i < 1000; i += 2)
+  {
+    list.Insert(i, -i);
+  }
+  for (int i = 0; i < 1000; i += 4)
+  {
+    list.Delete(i);
+  }
+
+  std::vector<int> keys;
+  static_cast<Tree<int, int>&>(adapter).Range(101, 201, [&keys] (const int& key, int& value)
+  {
+    assert(value == -key);
+    keys.push_back(key);
+  });
+
+  assert(keys.size() == 25 && list.GetSize() == 250);
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    assert(keys[i] == 102 + 4 * static_cast<int>(i));
+  }
+}
+
 int main()
 {
   (TreeTest<Treap<int, int>>()).Run();
   (TreeTest<AVLTree<int, int>>()).Run();
   (TreeTest<RBTree<int, int>>()).Run();
+  (TreeTest<Treap<int, int, std::less<int>, CompactNodes>>()).Run();
+  (TreeTest<AVLTree<int, int, std::less<int>, CompactNodes>>()).Run();
+  (TreeTest<AVLTree<int, int, std::less<int>, WideNodes, WeightBalance>>()).Run();
+  (TreeTest<RBTree<int, int, std::less<int>, CompactNodes>>()).Run();
   (TreeTest<BTree<int, int, 2>>()).Run();
+  (TreeTest<BTree<int, int, 5>>()).Run();
+  (TreeTest<BPlusTree<int, int, 64>>()).Run();
+  (TreeTest<BPlusTree<int, int>>()).Run();
+  (TreeTest<BufferedBTree<int, int, 8, 8>>()).Run();
+  (TreeTest<BufferedBTree<int, int>>()).Run();
+  TestOrderStatistics<Treap<int, int>>();
+  TestOrderStatistics<AVLTree<int, int>>();
+  TestOrderStatistics<AVLTree<int, int, std::less<int>, WideNodes, WeightBalance>>();
+  TestOrderStatistics<RBTree<int, int>>();
+  TestOrderStatistics<RBTree<int, int, std::less<int>, CompactNodes>>();
+  TestOrderStatistics<BTree<int, int, 2>>();
+  TestOrderStatistics<BTree<int, int, 5>>();
+  TestMoves<Treap<std::string, std::unique_ptr<int>>>();
+  TestMoves<AVLTree<std::string, std::unique_ptr<int>>>();
+  TestMoves<RBTree<std::string, std::unique_ptr<int>>>();
+  TestMoves<AVLTree<std::string, std::unique_ptr<int>, std::less<std::string>, CompactNodes>>();
+  TestMoves<BTree<std::string, std::unique_ptr<int>, 2>>();
+  TestMoves<BTree<std::string, std::unique_ptr<int>, 5>>();
+  TestMoves<BPlusTree<std::string, std::unique_ptr<int>, 512>>();
+  TestMoves<BufferedBTree<std::string, std::unique_ptr<int>, 8, 8>>();
+  TestMoves<SkipList<std::string, std::unique_ptr<int>>>();
+  TestTransparent<Treap<Name, int, Less>>();
+  TestTransparent<AVLTree<Name, int, Less>>();
+  TestTransparent<RBTree<Name, int, Less>>();
+  TestTransparent<BTree<Name, int, 2, NodeSearch<Name>, Less>>();
+  TestTransparent<BTree<Name, int, 5, NodeSearch<Name>, Less>>();
+  TestCompare<Treap<int, int, std::greater<int>>>();
+  TestCompare<AVLTree<int, int, std::greater<int>>>();
+  TestCompare<RBTree<int, int, std::greater<int>>>();
+  TestCompare<BTree<int, int, 2, NodeSearch<int>, std::greater<int>>>();
+  TestCompare<BTree<int, int, 5, NodeSearch<int>, std::greater<int>>>();
+  TestMapped<BTree<int, int, 5>>(0);
+  TestMapped<BTree<int, int, 5>>(1);
+  TestMapped<BTree<int, int, 5>>(1000);
+  TestMapped<BTree<int, int, 5>>(300000);
+  // Leaves of int keys & values hold 510 items, internal nodes 254, so
+  // these fill every node of a level once separators are set aside
+  TestMapped<BTree<int, int, 5>>(511);
+  TestMapped<BTree<int, int, 5>>(1022);
+  TestMapped<BTree<int, int, 5>>(255 * 511);
+  TestMapped<BTree<int, int, 5>>(511 * 511);
+  TestMapped<RBTree<int, int>>(50000);
+  TestCounters<Treap<int, int>>(true);
+  TestCounters<AVLTree<int, int>>(true);
+  TestCounters<RBTree<int, int>>(true);
+  TestCounters<BTree<int, int, 2>>(false);
+  TestCounters<BTree<int, int, 5, NodeSearch<int>, std::greater<int>>>(true);
+  TestCounters<BPlusTree<int, int, 64>>(false);
+  TestCounters<BufferedBTree<int, int, 8, 8>>(false);
+  TestCounters<ConcurrentBTree<int, int, 4>>(false);
+  TestCounters<SkipList<int, int>>(false);
+  TestStructuralCounters();
+  TestStats<Treap<int, int>>(0);
+  TestStats<AVLTree<int, int>>(0);
+  TestStats<RBTree<int, int>>(0);
+  TestStats<Treap<int, int, std::less<int>, CompactNodes>>(0);
+  TestStats<AVLTree<int, int, std::less<int>, CompactNodes>>(0);
+  TestStats<RBTree<int, int, std::less<int>, CompactNodes>>(0);
+  TestStats<BTree<int, int, 2>>(1);
+  TestStats<BTree<int, int, 5>>(1);
+  TestStats<BPlusTree<int, int, 64>>(1);
+  TestStats<BufferedBTree<int, int, 8, 8>>(1);
+  TestStats<SkipList<int, int>>(0);
+  TestPerfectStats<AVLTree<int, int>>();
+  TestPerfectStats<AVLTree<int, int, std::less<int>, WideNodes, WeightBalance>>();
+  TestPerfectStats<RBTree<int, int>>();
+  TestHeights<AVLTree<int, int>>(1.4405);
+  TestHeights<AVLTree<int, int, std::less<int>, CompactNodes>>(1.4405);
+  TestHeights<AVLTree<int, int, std::less<int>, WideNodes, WeightBalance>>(2.07);
+  TestHeights<RBTree<int, int>>(2);
+  TestClear<Treap<int, std::shared_ptr<int>>>(0);
+  TestClear<AVLTree<int, std::shared_ptr<int>>>(0);
+  TestClear<RBTree<int, std::shared_ptr<int>>>(0);
+  TestClear<RBTree<int, std::shared_ptr<int>, std::less<int>, CompactNodes>>(0);
+  TestClear<BTree<int, std::shared_ptr<int>, 2>>(1);
+  TestClear<BTree<int, std::shared_ptr<int>, 5>>(1);
+  TestClear<BPlusTree<int, std::shared_ptr<int>, 64>>(1);
+  TestClear<BufferedBTree<int, std::shared_ptr<int>, 8, 8>>(1);
+  TestClear<SkipList<int, std::shared_ptr<int>>>(0);
+  TestDisposer();
+  TestJoins<Treap<int, int>>();
+  TestJoins<AVLTree<int, int>>();
+  TestJoins<Treap<int, int, std::less<int>, CompactNodes>>();
+  TestJoins<AVLTree<int, int, std::less<int>, CompactNodes>>();
+  TestJoins<AVLTree<int, int, std::less<int>, WideNodes, WeightBalance>>();
+  TestParallel<Treap<int, int>>();
+  TestParallel<AVLTree<int, int>>();
+  TestParallel<AVLTree<int, int, std::less<int>, CompactNodes>>();
+  TestParallel<AVLTree<int, int, std::less<int>, CompactNodes, WeightBalance>>();
+  TestSnapshots<Treap<int, int, std::less<int>, PersistentNodes>>();
+  TestSnapshots<AVLTree<int, int, std::less<int>, PersistentNodes>>();
+  TestSnapshots<AVLTree<int, int, std::less<int>, PersistentNodes, WeightBalance>>();
+  TestSnapshots<BTree<int, int, 2>>();
+  TestSnapshots<BTree<int, int, 5>>();
+  TestSnapshotWrites<Treap<int, int, std::less<int>, PersistentNodes>>();
+  TestSnapshotWrites<AVLTree<int, int, std::less<int>, PersistentNodes>>();
+  TestSnapshotWrites<BTree<int, int, 2>>();
+  TestCompact<Treap<int, int>, Treap<int, int, std::less<int>, CompactNodes>>();
+  TestCompact<AVLTree<int, int>, AVLTree<int, int, std::less<int>, CompactNodes>>();
+  TestCompact<RBTree<int, int>, RBTree<int, int, std::less<int>, CompactNodes>>();
+  TestBPlusTreeRange();
+  TestBufferedBTree();
+  TestConcurrent<ConcurrentBTree<int, int, 2>>();
+  TestConcurrent<ConcurrentBTree<int, int, 8>>();
+  TestConcurrent<SkipList<int, int>>();
+  TestConcurrentMerges<ConcurrentBTree<int, int, 2>>();
+  TestConcurrentMerges<ConcurrentBTree<int, int, 8>>();
+  TestSkipListRange();
+  TestSearch<int16_t>();
+  TestSearch<uint16_t>();
+  TestSearch<int32_t>();
+  TestSearch<uint32_t>();
+  TestSearch<int64_t>();
+  TestSearch<uint64_t>();
+  TestSearch<float>();
+  TestSearch<double>();
   return 0;
 }
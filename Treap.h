@@ -1,17 +1,71 @@
 #ifndef __TREAP_H__
 #define __TREAP_H__
 
-template<typename Key, typename Value>
-class Treap : public Tree<Key, Value>
+/**
+ * Treap: a binary search tree whose nodes also form a heap on random
+ * priorities, which keeps it balanced in expectation
+ *
+ * @tparam Key     Key types, must support total ordering
+ * @tparam Value   Value types
+ * @tparam Compare Comparator ordering the keys
+ * @tparam Layout  Node layout, WideNodes, CompactNodes or PersistentNodes
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Layout = WideNodes>
+class Treap : public TreeBase<Treap<Key, Value, Compare, Layout>, Key, Value>
 {
+  class Node;
+
+  /**
+   * Split, join & set operations, built on Join(left, node, right)
+   */
+  typedef Joins<Treap, Node, Key, Value> Ops;
+  friend class Joins<Treap, Node, Key, Value>;
+
 public:
+  /**
+   * Bidirectional iterator over the items, in key order. Values are
+   * read-only if the nodes may be shared with snapshots
+   */
+  typedef TreeIterator<Node, Key, typename std::conditional<
+      Layout::kPersistent, const Value, Value>::type> Iterator;
+
+  /**
+   * Immutable view of the tree, taken by GetSnapshot
+   */
+  typedef TreeSnapshot<Node, TreeIterator<Node, Key, const Value>> Snapshot;
+
+  /**
+   * Type the keys of type K are looked up as
+   */
+  template <typename K>
+  using Lookup = typename LookupKey<Compare, Key, K>::Type;
+
   /**
    * Creates an empty Red-Black tree
    */
-  Treap()
-    : root(NULL)
+  explicit Treap(const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
+    , size(0)
+    , depths(0)
+    , stale(false)
+  {
+  }
+
+  /**
+   * Creates a tree out of the (key, value) pairs in [begin, end), which
+   * must be sorted by key
+   */
+  template <typename It>
+  Treap(It begin, It end, const Compare& compare = Compare())
+    : compare(compare)
+    , root(NULL)
     , size(0)
+    , depths(0)
+    , stale(false)
   {
+    BulkLoad(begin, end);
   }
 
   /**
@@ -19,9 +73,14 @@ public:
    */
   ~Treap()
   {
-    if (root)
+    if (versions.Live())
     {
-      delete root;
+      Abandon();
+    }
+    else if (!std::is_trivially_destructible<Node>::value)
+    {
+      Destroy(root);
+      versions.Drain([] (Node *node) { node->~Node(); });
     }
   }
 
@@ -30,74 +89,552 @@ public:
    */
   void Insert(const Key& key, const Value& value)
   {
-    Node *node = new Node();
-    node->key = key;
-    node->value = value;
-    root = Insert(root, node);
+    Emplace(key, value);
+  }
+
+  /**
+   * Inserts a new item into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Emplace(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    size_t before = size;
+    root = Insert(root, true, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return size != before;
   }
 
   /**
-   * Retrieves an item from the tree
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
    */
-  Value& Find(const Key& key)
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
   {
+    size_t before = size;
+    root = Insert(root, false, std::forward<K>(key), std::forward<Args>(args)...);
+    Collect();
+    return size != before;
+  }
+
+  /**
+   * Fills an empty tree with the (key, value) pairs in [begin, end), which
+   * must be sorted by key. Nodes are appended to the right spine of the
+   * Cartesian tree, which is kept on a stack, in O(n). Subtrees are final
+   * once they leave the spine, so their sizes are computed then
+   */
+  template <typename It>
+  void BulkLoad(It begin, It end)
+  {
+    if (root)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+
+    size = this->CountSorted(begin, end, compare);
+
+    std::vector<Node *> spine;
+    for (; begin != end; ++begin)
+    {
+      counters.Add(&Counters::allocs);
+      Node *node = pool.Alloc(begin->first, begin->second);
+      versions.Stamp(node);
+      ++depths;
+
+      Node *last = NULL;
+      while (!spine.empty() && spine.back()->weight > node->weight)
+      {
+        last = spine.back();
+        Update(last);
+        spine.pop_back();
+      }
+
+      node->left = last;
+      if (!spine.empty())
+      {
+        spine.back()->right = node;
+      }
+      spine.push_back(node);
+    }
+
+    for (size_t i = spine.size(); i-- > 0; )
+    {
+      Update(spine[i]);
+    }
+
+    root = spine.empty() ? NULL : spine.front();
+  }
+
+  /**
+   * Retrieves an item from the tree. With a transparent comparator, key can be
+   * of any type comparable with Key
+   */
+  template <typename K>
+  Value& Find(const K& key)
+  {
+    Value *value = TryFind(key);
+    if (!value)
+    {
+      throw std::runtime_error("Key not found");
+    }
+    return *value;
+  }
+
+  /**
+   * Retrieves an item from the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *TryFind(const K& arg)
+  {
+    const Lookup<K>& key = arg;
     Node *node = root;
+    counters.Add(&Counters::finds);
     while (node)
     {
-      if (node->key > key)
+      counters.Add(&Counters::visits);
+      if (compare(key, node->key))
       {
         node = node->left;
       }
-      else if (node->key < key)
+      else if (compare(node->key, key))
       {
         node = node->right;
       }
       else
       {
-        return node->value;
+        // Values shared with snapshots are copied before they are handed out
+        return versions.Frozen(node) ? Thaw(key) : &node->value;
+      }
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Retrieves an item for reading only, without copying the nodes it shares
+   * with snapshots
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  const Value *TryFind(const K& arg) const
+  {
+    const Lookup<K>& key = arg;
+    const Node *node = root;
+    counters.Add(&Counters::finds);
+    while (node)
+    {
+      counters.Add(&Counters::visits);
+      if (compare(key, node->key))
+      {
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        node = node->right;
+      }
+      else
+      {
+        return &node->value;
+      }
+    }
+
+    return NULL;
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  template <typename K>
+  bool Contains(const K& key)
+  {
+    const Treap& tree = *this;
+    return tree.TryFind(key) != NULL;
+  }
+
+  /**
+   * Looks up n keys with their cache misses overlapped. Stores a pointer
+   * to the value of each key in out, or NULL if the key is missing
+   */
+  size_t FindBatch(const Key *keys, size_t n, Value **out)
+  {
+    counters.Add(&Counters::finds, n);
+    size_t found = Batch<Node, Key, Value, Comparator<Compare>>::Find(root, keys, n, out, compare);
+    if (versions.Live())
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        out[i] = out[i] ? TryFind(keys[i]) : NULL;
       }
     }
+    return found;
+  }
 
-    throw std::runtime_error("Key not found");
+  /**
+   * Inserts n items, updating the keys already present in groups. Values
+   * are updated in place, so while snapshots are live the items are
+   * inserted one at a time instead
+   */
+  void InsertBatch(const Key *keys, const Value *values, size_t n)
+  {
+    if (versions.Live())
+    {
+      for (size_t i = 0; i < n; ++i)
+      {
+        Insert(keys[i], values[i]);
+      }
+      return;
+    }
+    Batch<Node, Key, Value, Comparator<Compare>>::Insert(this, &root, keys, values, n, compare);
   }
 
   /**
    * Deletes an item from the tree
    */
-  void Delete(const Key& key)
+  template <typename K>
+  void Delete(const K& key)
   {
-    Node *node = root, *parent = NULL;
+    if (!Erase(key))
+    {
+      throw std::runtime_error("Key not found");
+    }
+  }
+
+  /**
+   * Deletes an item from the tree if the key is present
+   * @return True if an item was removed
+   */
+  template <typename K>
+  bool Erase(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    Stack<Node *> path;
+    Node *node = root;
     while (node)
     {
-      if (key < node->key)
+      if (compare(key, node->key))
       {
-        parent = node;
+        path.Push(node);
         node = node->left;
       }
-      else if (key > node->key)
+      else if (compare(node->key, key))
       {
-        parent = node;
+        path.Push(node);
         node = node->right;
       }
       else
       {
-        if (parent == NULL)
-        {
-          root = Delete(node);
-        }
-        else if (parent->left == node)
-        {
-          parent->left = Delete(node);
-        }
-        else
-        {
-          parent->right = Delete(node);
-        }
-        return;
+        // The children of the node are zipped together in its place, then
+        // the sizes & heights on the path down to it are updated bottom-up
+        bool left = !path.Empty() && path.Top()->left == node;
+        Node *child = Zip(node->left, node->right);
+        --size;
+        Drop(node);
+        root = Retrace(path, child, left, -1);
+        Collect();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Removes all items. The nodes are not visited unless they need their
+   * destructors run; their memory goes back in whole chunks
+   */
+  void Clear()
+  {
+    if (versions.Live())
+    {
+      counters.Add(&Counters::frees, size + versions.GetRetired());
+      Abandon();
+    }
+    else
+    {
+      versions.Drain([this] (Node *node) { Free(node); });
+      if (!std::is_trivially_destructible<Node>::value)
+      {
+        Destroy(root);
+      }
+      counters.Add(&Counters::frees, size);
+    }
+    pool.Release();
+    root = NULL;
+    size = 0;
+    depths = 0;
+    stale = false;
+  }
+
+  /**
+   * Moves the items with keys not less than key into another tree, which
+   * must be empty, in O(log n). The trees share their node memory from
+   * then on, which is freed once both let go of it
+   */
+  template <typename K>
+  void Split(const K& arg, Treap& right)
+  {
+    const Lookup<K>& key = arg;
+    if (&right == this || right.root)
+    {
+      throw std::runtime_error("Tree is not empty");
+    }
+    versions.Check();
+
+    right.pool.Share(pool);
+    Node *left, *rest;
+    Node *found = Ops::Split(this, root, key, left, rest);
+    root = left;
+    right.root = found ? Join(NULL, found, rest) : rest;
+    size = Node::Count(root);
+    right.size = Node::Count(right.root);
+
+    // The depths of the items are only known for both trees together
+    stale = right.stale = true;
+  }
+
+  /**
+   * Moves all items of another tree, whose keys must all be greater than
+   * those of this one, into this tree in O(log n)
+   */
+  void Join(Treap& right)
+  {
+    if (&right == this)
+    {
+      throw std::runtime_error("Cannot join a tree with itself");
+    }
+    versions.Check();
+    if (root && right.root && !compare(Last(root)->key, First(right.root)->key))
+    {
+      throw std::runtime_error("Trees overlap");
+    }
+    root = Ops::Join(this, root, Adopt(right));
+  }
+
+  /**
+   * Moves all items of another tree into this one, keeping the values of
+   * this tree for keys in both. Takes O(m log(n / m + 1)) for trees of
+   * sizes m <= n; the other tree is left empty
+   */
+  void Union(Treap& other)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      root = Ops::Union(this, root, Adopt(other));
+    }
+  }
+
+  /**
+   * Keeps the items whose keys are also in another tree, which is left
+   * empty, in O(m log(n / m + 1))
+   */
+  void Intersect(Treap& other)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      root = Ops::Intersect(this, root, Adopt(other));
+    }
+  }
+
+  /**
+   * Removes the items whose keys are in another tree, which is left empty,
+   * in O(m log(n / m + 1))
+   */
+  void Difference(Treap& other)
+  {
+    if (&other == this)
+    {
+      Clear();
+      return;
+    }
+    versions.Check();
+    root = Ops::Difference(this, root, Adopt(other));
+  }
+
+  /**
+   * Inserts n items with strictly increasing keys, overwriting the values
+   * of keys already present, in O(m log(n / m + 1)). Large batches are cut
+   * in disjoint key ranges, the tree is split along them & the pieces are
+   * updated by the threads of a pool, then joined back
+   */
+  void ParallelInsertBatch(const Key *keys, const Value *values, size_t n, TaskPool& tasks)
+  {
+    versions.Check();
+    Ops::ParallelInsert(*this, keys, values, n, tasks);
+  }
+
+  /**
+   * Removes the items with any of n strictly increasing keys, ignoring
+   * missing ones, in O(m log(n / m + 1)) on the threads of a pool
+   */
+  void ParallelDeleteBatch(const Key *keys, size_t n, TaskPool& tasks)
+  {
+    versions.Check();
+    Ops::ParallelErase(*this, keys, n, tasks);
+  }
+
+  /**
+   * Moves all items of another tree into this one as Union does, on the
+   * threads of a pool. Both trees are split around the median key of the
+   * larger one until the pieces are small
+   */
+  void ParallelUnion(Treap& other, TaskPool& tasks)
+  {
+    if (&other != this)
+    {
+      versions.Check();
+      Ops::ParallelUnion(*this, other, tasks);
+    }
+  }
+
+  /**
+   * Returns an immutable view of the items in O(1), which can be read from
+   * any thread without locks while this tree goes on changing: from then
+   * on, updates copy the nodes on their path instead of modifying them,
+   * until the snapshot is released. Needs PersistentNodes & must be taken
+   * by the thread updating the tree. Split, Join & the set operations
+   * throw while snapshots are live; clearing or destroying the tree leaves
+   * them readable
+   */
+  Snapshot GetSnapshot()
+  {
+    static_assert(Layout::kPersistent, "Snapshots need PersistentNodes");
+    Collect();
+    uint32_t version = versions.Freeze();
+    return Snapshot(root, size, version, versions.GetRegistry());
+  }
+
+  /**
+   * Returns an iterator to the smallest item
+   */
+  Iterator Begin()
+  {
+    return Iterator::Begin(&root);
+  }
+
+  /**
+   * Returns the past-the-end iterator
+   */
+  Iterator End()
+  {
+    return Iterator::End(&root);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key not less than key
+   */
+  template <typename K>
+  Iterator LowerBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Iterator::template Bound<false>(&root, key, compare);
+  }
+
+  /**
+   * Returns an iterator to the first item with a key greater than key
+   */
+  template <typename K>
+  Iterator UpperBound(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    return Iterator::template Bound<true>(&root, key, compare);
+  }
+
+  /**
+   * Returns an iterator to the k-th smallest item, counting from zero, or
+   * the past-the-end iterator if k is out of range, in O(log n)
+   */
+  Iterator Select(size_t k)
+  {
+    return Iterator::Select(&root, k);
+  }
+
+  /**
+   * Returns the number of keys less than key, in O(log n)
+   */
+  template <typename K>
+  size_t Rank(const K& arg)
+  {
+    const Lookup<K>& key = arg;
+    size_t rank = 0;
+    for (Node *node = root; node; )
+    {
+      if (compare(node->key, key))
+      {
+        rank += Node::Count(node->left) + 1;
+        node = node->right;
+      }
+      else
+      {
+        node = node->left;
+      }
+    }
+    return rank;
+  }
+
+  /**
+   * Returns the number of keys in [lo, hi), in O(log n)
+   */
+  template <typename L, typename H>
+  size_t CountRange(const L& lo, const H& hi)
+  {
+    // Lookup keys are only ever compared with keys of the tree
+    size_t l = Rank(lo), h = Rank(hi);
+    return l < h ? h - l : 0;
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order.
+   * Callbacks taking the value by const reference read it in place
+   */
+  template <typename L, typename H, typename Fn>
+  void Range(const L& lo, const H& hi, Fn fn)
+  {
+    typedef typename std::conditional<
+        Reads<Fn, Key, Value>::value, const Value, Value>::type V;
+    typedef TreeIterator<Node, Key, V> Cursor;
+    const Lookup<L>& l = lo;
+    const Lookup<H>& h = hi;
+    if (!std::is_const<V>::value && versions.Live())
+    {
+      // Handing a value out copies the path to it, which iterators do not
+      // follow, so every item is found again from the root
+      for (Iterator it = LowerBound(l); it != End() && compare(it.GetKey(), h); it = UpperBound(it.GetKey()))
+      {
+        fn(it.GetKey(), *Thaw(it.GetKey()));
+      }
+      return;
+    }
+
+    for (Cursor it = Cursor::template Bound<false>(&root, l, compare), end = Cursor::End(&root); it != end; ++it)
+    {
+      if (!compare(it.GetKey(), h))
+      {
+        break;
       }
+      fn(it.GetKey(), it.GetValue());
     }
+  }
 
-    throw std::runtime_error("Key not found");
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  void Range(const Key& lo, const Key& hi, const typename Tree<Key, Value>::Callback& fn)
+  {
+    Range<Key, Key, const typename Tree<Key, Value>::Callback&>(lo, hi, fn);
   }
 
   /**
@@ -109,71 +646,135 @@ public:
   }
 
   /**
-   * Returns the height of the tree
+   * Returns the height of the tree, in O(1)
    */
   size_t GetHeight()
   {
-    return root ? root->GetHeight() : 0;
+    return root ? root->height : 0;
+  }
+
+  /**
+   * Returns the structural statistics of the tree, in O(1) except for the
+   * first call after a Split, which sums the depths of the items again.
+   * The bytes of the pool include the nodes retired for live snapshots
+   */
+  Stats GetStats()
+  {
+    if (stale)
+    {
+      depths = Depths(root);
+      stale = false;
+    }
+
+    Stats stats;
+    stats.nodes = size;
+    stats.fill = size ? 1.0 : 0.0;
+    stats.depth = size ? static_cast<double>(depths) / size : 0.0;
+    stats.bytes = pool.GetBytes();
+    return stats;
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return counters.Get(compare);
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    counters.Reset(compare);
   }
 
 private:
   /**
    * Internal node in the tree
    */
-  class Node
+  class Node : public Stamped<Layout::kPersistent>
   {
   public:
     /**
-     * Allocates an empty node
+     * Reference to another node, a pointer or an index
+     */
+    typedef typename Layout::template Link<Node> Link;
+
+    /**
+     * Allocates a leaf, constructing the key & value from the arguments
      */
-    Node()
-      : weight(rand())
+    template <typename K, typename... Args>
+    Node(K&& key, Args&&... args)
+      : weight(Priority())
+      , height(1)
+      , count(1)
+      , key(std::forward<K>(key))
+      , value(std::forward<Args>(args)...)
       , left(NULL)
       , right(NULL)
     {
     }
 
     /**
-     * Frees the node & its children
+     * Returns the number of nodes in a subtree
      */
-    ~Node()
+    static size_t Count(const Node *node)
     {
-      if (left)
-      {
-        delete left;
-      }
-
-      if (right)
-      {
-        delete right;
-      }
+      return node ? node->count : 0;
     }
 
     /**
-     * Retrieves the height of the tree
+     * Returns the height of a subtree
      */
-    int GetHeight()
+    static uint32_t Height(const Node *node)
     {
-      int height = 0;
+      return node ? node->height : 0;
+    }
 
-      if (left)
-      {
-        height = std::max(height, left->GetHeight());
-      }
+    /**
+     * Computes the size & height of the subtree rooted at the node
+     */
+    void ComputeCount()
+    {
+      count = 1 + Count(left) + Count(right);
+      height = 1 + std::max(Height(left), Height(right));
+    }
 
-      if (right)
+    /**
+     * Draws a heap priority from a per-thread xorshift generator, so that
+     * nodes built by parallel operations do not contend on shared state
+     */
+    static uint32_t Priority()
+    {
+      static thread_local uint64_t state = 0;
+      if (state == 0)
       {
-        height = std::max(height, right->GetHeight());
+        state = reinterpret_cast<uintptr_t>(&state) * 0x9E3779B97F4A7C15ull | 1;
       }
 
-      return height + 1;
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return static_cast<uint32_t>(state >> 32);
     }
 
   public:
     /**
-     * Size of the tree
+     * Heap priority, from Priority()
+     */
+    uint32_t weight;
+
+    /**
+     * Height of the subtree
      */
-    size_t weight;
+    uint32_t height;
+
+    /**
+     * Size of the subtree
+     */
+    typename Layout::Count count;
 
     /**
      * Key of the node
@@ -188,22 +789,37 @@ private:
     /**
      * Left child
      */
-    Node *left;
+    Link left;
 
     /**
      * Right child
      */
-    Node *right;
+    Link right;
   };
 
+  /**
+   * Recomputes the size & height of a node from its children, keeping the
+   * total depth of the items up to date
+   */
+  void Update(Node *node)
+  {
+    depths -= node->count;
+    node->ComputeCount();
+    depths += node->count;
+  }
+
   /**
    * Rotates a node left
    */
   Node *RotateLeft(Node *x)
   {
-    Node *y = x->right;
+    counters.Add(&Counters::rotations);
+    x = Mutable(x);
+    Node *y = Mutable(x->right);
     x->right = y->left;
+    Update(x);
     y->left = x;
+    Update(y);
     return y;
   }
 
@@ -212,86 +828,473 @@ private:
    */
   Node *RotateRight(Node *y)
   {
-    Node *x = y->left;
+    counters.Add(&Counters::rotations);
+    y = Mutable(y);
+    Node *x = Mutable(y->left);
     y->left = x->right;
+    Update(y);
     x->right = y;
+    Update(x);
     return x;
   }
 
   /**
-   * Balances a node
+   * Inserts a new item into the tree rooted at root. The new leaf rotates
+   * up the path, kept on a stack, while its priority is lower than its
+   * parent's; above that point only sizes & heights change. The node is
+   * only constructed once its position is known, from the forwarded
+   * arguments
+   * @param replace Whether to overwrite the value of a duplicate
+   * @return The new root
    */
-  Node *Balance(Node *node)
+  template <typename K, typename... Args>
+  Node *Insert(Node *root, bool replace, K&& key, Args&&... args)
   {
-    if (node->left && node->left->weight < node->weight)
+    Stack<Node *> path;
+    bool left = false;
+    for (Node *node = root; node; )
     {
-      return RotateRight(node);
+      path.Push(node);
+      if (compare(key, node->key))
+      {
+        node = node->left;
+        left = true;
+      }
+      else if (compare(node->key, key))
+      {
+        node = node->right;
+        left = false;
+      }
+      else
+      {
+        if (!replace)
+        {
+          return root;
+        }
+        path.Pop();
+        Node *copy = Mutable(node);
+        this->Assign(copy->value, std::forward<Args>(args)...);
+        return Relink(path, node, copy, root);
+      }
     }
 
-    if (node->right && node->right->weight < node->weight)
+    ++size;
+    ++depths;
+    counters.Add(&Counters::allocs);
+    Node *node = pool.Alloc(std::forward<K>(key), std::forward<Args>(args)...);
+    versions.Stamp(node);
+
+    while (!path.Empty() && node->weight < path.Top()->weight)
     {
-      return RotateLeft(node);
+      Node *up = Mutable(path.Top());
+      if (left)
+      {
+        up->left = node;
+        node = RotateRight(up);
+      }
+      else
+      {
+        up->right = node;
+        node = RotateLeft(up);
+      }
+
+      Node *old = path.Top();
+      path.Pop();
+      left = !path.Empty() && path.Top()->left == old;
     }
+    return Retrace(path, node, left, 1);
+  }
 
-    return node;
+  /**
+   * Merges two subtrees, all keys of the left one being less than those of
+   * the right one, as the children of a removed node. The right spine of
+   * the left subtree & the left spine of the right one are interleaved by
+   * priority, as rotating the node down to a leaf would do, then the sizes
+   * on the merged spine are computed bottom-up
+   * @return The merged subtree
+   */
+  Node *Zip(Node *left, Node *right)
+  {
+    Node *top = NULL;
+    Stack<Node *> spine;
+    bool below = false;
+    while (left && right)
+    {
+      counters.Add(&Counters::rotations);
+      Node *node;
+      bool side = below;
+      if (left->weight < right->weight)
+      {
+        node = Mutable(left);
+        left = node->right;
+        below = false;
+      }
+      else
+      {
+        node = Mutable(right);
+        right = node->left;
+        below = true;
+      }
+      Attach(spine, top, side, node);
+      spine.Push(node);
+    }
+    Attach(spine, top, below, left ? left : right);
+
+    for (; !spine.Empty(); spine.Pop())
+    {
+      Update(spine.Top());
+    }
+    return top;
   }
 
   /**
-   * Inserts a new node into the tree, preserving balance
+   * Links a node below the last node of a spine, on the left or right, or
+   * as the top if the spine is empty
    */
-  Node *Insert(Node *node, Node *what)
+  static void Attach(Stack<Node *>& spine, Node *&top, bool left, Node *node)
   {
-    if (node == NULL)
+    if (spine.Empty())
+    {
+      top = node;
+    }
+    else if (left)
+    {
+      spine.Top()->left = node;
+    }
+    else
     {
-      ++size;
-      return what;
+      spine.Top()->right = node;
     }
+  }
 
-    if (what->key < node->key)
+  /**
+   * Walks the path of an insert or a delete back up from the new subtree
+   * below it, linking each node to the subtree rebuilt below & adding
+   * delta to its size. Heights are recomputed until one is unchanged
+   * @param left Whether the subtree goes left of the last node of the
+   *             path; higher up, the side of the node replaced tells
+   * @return The new root of the path
+   */
+  Node *Retrace(Stack<Node *>& path, Node *child, bool left, int delta)
+  {
+    bool settled = false;
+    while (!path.Empty())
     {
-      node->left = Insert(node->left, what);
-      return Balance(node);
+      Node *node = Mutable(path.Top());
+      if (left)
+      {
+        node->left = child;
+      }
+      else
+      {
+        node->right = child;
+      }
+
+      node->count += delta;
+      depths += delta;
+      if (!settled)
+      {
+        uint32_t height = node->height;
+        node->height = 1 + std::max(Node::Height(node->left), Node::Height(node->right));
+        settled = node->height == height;
+      }
+      child = node;
+
+      Node *old = path.Top();
+      path.Pop();
+      left = !path.Empty() && path.Top()->left == old;
     }
+    return child;
+  }
 
-    if (what->key > node->key)
+  /**
+   * Links the copy of a node taken for an update in place of the node,
+   * copying its ancestors in turn as long as snapshots hold them
+   * @return The new root
+   */
+  Node *Relink(Stack<Node *>& path, Node *node, Node *copy, Node *root)
+  {
+    for (; !path.Empty(); path.Pop())
     {
-      node->right = Insert(node->right, what);
-      return Balance(node);
+      if (copy == node)
+      {
+        return root;
+      }
+
+      Node *up = Mutable(path.Top());
+      if (up->left == node)
+      {
+        up->left = copy;
+      }
+      else
+      {
+        up->right = copy;
+      }
+      node = path.Top();
+      copy = up;
     }
+    return copy;
+  }
 
-    node->value = what->value;
-    return node;
+  /**
+   * Makes the value of a key modifiable, copying the node holding it & the
+   * ancestors of the node as long as snapshots hold them
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  template <typename K>
+  Value *Thaw(const K& key)
+  {
+    Stack<Node *> path;
+    for (Node *node = root; node; )
+    {
+      if (compare(key, node->key))
+      {
+        path.Push(node);
+        node = node->left;
+      }
+      else if (compare(node->key, key))
+      {
+        path.Push(node);
+        node = node->right;
+      }
+      else
+      {
+        Node *copy = Mutable(node);
+        root = Relink(path, node, copy, root);
+        return &copy->value;
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * Leaves the nodes & the chunks holding them to the live snapshots, which
+   * destroy them along with the retired ones once the last is released
+   */
+  void Abandon()
+  {
+    typedef typename Layout::template Allocator<Node> Allocator;
+    std::shared_ptr<Allocator> chunks = std::make_shared<Allocator>();
+    chunks->Share(pool);
+    Node *node = root;
+    versions.Orphan([] (Node *node) { node->~Node(); }, [chunks, node] ()
+    {
+      if (!std::is_trivially_destructible<Node>::value)
+      {
+        Destroy(node);
+      }
+    });
+  }
+
+  /**
+   * Runs the destructors of all nodes in a subtree in O(1) space. Left
+   * children are rotated up until the top node has none, which is then
+   * destroyed & replaced by its right child, so the tree is flattened as
+   * it is torn down instead of being walked with a stack
+   */
+  static void Destroy(Node *node)
+  {
+    while (node)
+    {
+      if (Node *left = node->left)
+      {
+        node->left = left->right;
+        left->right = node;
+        node = left;
+      }
+      else
+      {
+        Node *right = node->right;
+        node->~Node();
+        node = right;
+      }
+    }
   }
 
   /**
-   * Removes a node from the treap, preserving balance
+   * Links two subtrees & a node whose key lies between theirs. The node
+   * sinks down the spines of the subtrees until both roots below it have
+   * lower priorities, as if it was inserted last
    */
-  Node *Delete(Node *node)
+  Node *Join(Node *left, Node *node, Node *right)
   {
-    if (!node->left && !node->right)
+    if (left && left->weight < node->weight && (!right || left->weight <= right->weight))
     {
-      delete node;
-      --size;
-      return NULL;
+      left->right = Join(left->right, node, right);
+      Update(left);
+      return left;
     }
 
-    if (!node->right || (node->left && node->left->weight < node->right->weight))
+    if (right && right->weight < node->weight)
     {
-      node = RotateRight(node);
-      node->right = Delete(node->right);
-      return node;
+      right->left = Join(left, node, right->left);
+      Update(right);
+      return right;
     }
 
-    if (!node->left || (node->right && node->right->weight <= node->left->weight))
+    node->left = left;
+    node->right = right;
+    Update(node);
+    return node;
+  }
+
+  /**
+   * Returns a node which can be modified: the node itself, or a copy of
+   * it if a snapshot may reach it, in which case the original is retired
+   */
+  Node *Mutable(Node *node)
+  {
+    return versions.Frozen(node) ? Copy(node, std::integral_constant<bool, Layout::kPersistent>()) : node;
+  }
+
+  Node *Copy(Node *node, std::true_type)
+  {
+    counters.Add(&Counters::allocs);
+    Node *copy = pool.Alloc(static_cast<const Node&>(*node));
+    versions.Stamp(copy);
+    versions.Retire(node);
+    return copy;
+  }
+
+  Node *Copy(Node *node, std::false_type)
+  {
+    return node;
+  }
+
+  /**
+   * Frees a node removed from the tree, or retires it if a snapshot may
+   * still reach it
+   */
+  void Drop(Node *node)
+  {
+    depths -= Node::Count(node);
+    if (versions.Frozen(node))
+    {
+      versions.Retire(node);
+    }
+    else
+    {
+      Free(node);
+    }
+  }
+
+  /**
+   * Returns a node to the pool
+   */
+  void Free(Node *node)
+  {
+    counters.Add(&Counters::frees);
+    pool.Free(node);
+  }
+
+  /**
+   * Frees the retired nodes which no snapshot can reach anymore
+   */
+  void Collect()
+  {
+    versions.Collect([this] (Node *node) { Free(node); });
+  }
+
+  /**
+   * Takes the nodes of another tree over, leaving it empty
+   * @return The root of the other tree
+   */
+  Node *Adopt(Treap& other)
+  {
+    pool.Absorb(other.pool);
+    size += other.size;
+    depths += other.depths;
+    stale = stale || other.stale;
+
+    Node *node = other.root;
+    other.root = NULL;
+    other.size = 0;
+    other.depths = 0;
+    other.stale = false;
+    return node;
+  }
+
+  /**
+   * Allocates a node for a join-based operation
+   */
+  Node *Create(const Key& key, const Value& value)
+  {
+    ++size;
+    ++depths;
+    counters.Add(&Counters::allocs);
+    return pool.Alloc(key, value);
+  }
+
+  /**
+   * Frees a node dropped by a join-based operation
+   */
+  void Remove(Node *node)
+  {
+    depths -= Node::Count(node);
+    --size;
+    counters.Add(&Counters::frees);
+    pool.Free(node);
+  }
+
+  /**
+   * Returns the node with the smallest key in a subtree
+   */
+  static Node *First(Node *node)
+  {
+    while (node->left)
     {
-      node = RotateLeft(node);
-      node->left = Delete(node->left);
-      return node;
+      node = node->left;
     }
+    return node;
+  }
 
+  /**
+   * Returns the node with the largest key in a subtree
+   */
+  static Node *Last(Node *node)
+  {
+    while (node->right)
+    {
+      node = node->right;
+    }
     return node;
   }
 
+  /**
+   * Sums the sizes of all subtrees, which is the total depth of the items
+   */
+  static size_t Depths(Node *root)
+  {
+    size_t total = 0;
+    Stack<Node *> stack;
+    for (Node *node = root; node || !stack.Empty(); )
+    {
+      if (!node)
+      {
+        node = stack.Top();
+        stack.Pop();
+      }
+
+      total += Node::Count(node);
+      if (node->right)
+      {
+        stack.Push(node->right);
+      }
+      node = node->left;
+    }
+    return total;
+  }
+
+  /**
+   * Comparator ordering the keys
+   */
+  Comparator<Compare> compare;
+
+  /**
+   * Allocator for the nodes
+   */
+  typename Layout::template Allocator<Node> pool;
+
   /**
    * Root node of the tree
    */
@@ -301,6 +1304,27 @@ private:
    * Number of items stored in the tree
    */
   size_t size;
+
+  /**
+   * Sum of the depths of all items, the root being at depth 1, which is
+   * also the sum of the sizes of all subtrees
+   */
+  size_t depths;
+
+  /**
+   * Set once a Split leaves depths unknown, until GetStats sums them again
+   */
+  bool stale;
+
+  /**
+   * Snapshot versions & the nodes retired while snapshots are live
+   */
+  Versions<Node, Layout::kPersistent> versions;
+
+  /**
+   * Operation counters, empty unless TREES_COUNTERS is set
+   */
+  mutable CounterSet<> counters;
 };
 
 #endif /*__TREAP_H__*/
@@ -1,25 +1,436 @@
 #ifndef __TREE_H__
 #define __TREE_H__
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Transparent comparator, the C++11 counterpart of std::less<>. Trees
+ * ordered by it compare lookup keys of any type directly with their own
+ * keys, through operator <, instead of converting them to Key first
+ */
+struct Less
+{
+  typedef void is_transparent;
+
+  template <typename A, typename B>
+  bool operator () (const A& a, const B& b) const
+  {
+    return a < b;
+  }
+};
+
+/**
+ * Type a tree ordered by Compare looks up a key of type K as: K itself if
+ * the comparator is transparent, or Key otherwise. In the latter case, the
+ * argument is converted once, on entry, rather than in every comparison
+ */
+template <typename Compare, typename Key, typename K, typename Enable = void>
+struct LookupKey
+{
+  typedef Key Type;
+};
+
+template <typename Compare, typename Key, typename K>
+struct LookupKey<Compare, Key, K, typename std::conditional<
+    true, void, typename Compare::is_transparent>::type>
+{
+  typedef K Type;
+};
+
+/**
+ * Whether lookups of a K under Compare follow the natural order of Key, so
+ * they can use searches specialised for Key, such as NodeSearch
+ */
+template <typename Compare, typename Key, typename K>
+struct NaturalOrder : public std::integral_constant<bool,
+    std::is_same<typename LookupKey<Compare, Key, K>::Type, Key>::value &&
+    (std::is_same<Compare, std::less<Key>>::value ||
+     std::is_same<Compare, Less>::value)>
+{
+};
+
+#ifndef TREES_COUNTERS
+#define TREES_COUNTERS 0
+#endif
+
+/**
+ * Snapshot of the operation counters of a tree. Trees only count when
+ * built with TREES_COUNTERS defined to 1; otherwise every counter reads 0
+ * and counting compiles to nothing
+ */
+struct Counters
+{
+  /**
+   * Key comparisons made through the comparator of the tree
+   */
+  uint64_t comparisons;
+
+  /**
+   * Searches inside nodes of multiway trees, scalar or vectorised
+   */
+  uint64_t searches;
+
+  /**
+   * Point lookups: Find, TryFind, Contains & keys of FindBatch
+   */
+  uint64_t finds;
+
+  /**
+   * Nodes visited by point lookups
+   */
+  uint64_t visits;
+
+  /**
+   * Single rotations of binary trees
+   */
+  uint64_t rotations;
+
+  /**
+   * Iterations of the red-black fixup loops & AVL rebalancing steps
+   */
+  uint64_t fixups;
+
+  /**
+   * Nodes split in two, or more for buffered trees
+   */
+  uint64_t splits;
+
+  /**
+   * Nodes merged into a sibling
+   */
+  uint64_t joins;
+
+  /**
+   * Entries moved in from a sibling to fix an underflow
+   */
+  uint64_t borrows;
+
+  /**
+   * Nodes allocated
+   */
+  uint64_t allocs;
+
+  /**
+   * Nodes freed
+   */
+  uint64_t frees;
+};
+
+/**
+ * Comparator counting its invocations. Algorithms such as std::lower_bound
+ * take comparators by value, so copies add to the count of the original
+ */
+template <typename Compare>
+struct CountingCompare
+{
+  CountingCompare(const Compare& compare = Compare())
+    : compare(compare)
+    , count(0)
+    , total(&count)
+  {
+  }
+
+  CountingCompare(const CountingCompare& that)
+    : compare(that.compare)
+    , count(0)
+    , total(that.total)
+  {
+  }
+
+  template <typename A, typename B>
+  bool operator () (const A& a, const B& b) const
+  {
+    ++*total;
+    return compare(a, b);
+  }
+
+  Compare   compare;
+  uint64_t  count;
+  uint64_t *total;
+};
+
+/**
+ * Comparator stored by trees ordered by Compare: Compare itself, or a
+ * counting wrapper when counters are enabled
+ */
+template <typename Compare>
+using Comparator = typename std::conditional<
+    TREES_COUNTERS != 0, CountingCompare<Compare>, Compare>::type;
+
+/**
+ * Returns the comparator a Comparator was made from
+ */
+template <typename Compare>
+const Compare& Unwrap(const Compare& compare)
+{
+  return compare;
+}
+
+template <typename Compare>
+const Compare& Unwrap(const CountingCompare<Compare>& compare)
+{
+  return compare.compare;
+}
+
+/**
+ * Counters of a tree. Updates from several threads go through AddShared,
+ * as relaxed atomic increments
+ *
+ * @tparam Enabled Whether to count, TREES_COUNTERS by default
+ */
+template <bool Enabled = TREES_COUNTERS != 0>
+class CounterSet
+{
+public:
+  CounterSet()
+  {
+    memset(&values, 0, sizeof(values));
+  }
+
+  /**
+   * Adds n to a counter
+   */
+  void Add(uint64_t Counters::*counter, uint64_t n = 1)
+  {
+    values.*counter += n;
+  }
+
+  /**
+   * Adds n to a counter updated by other threads as well
+   */
+  void AddShared(uint64_t Counters::*counter, uint64_t n = 1)
+  {
+    __atomic_fetch_add(&(values.*counter), n, __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Adds all counters of a snapshot, e.g. of a tree joined into this one
+   */
+  void Add(const Counters& counters)
+  {
+    const uint64_t *src = reinterpret_cast<const uint64_t *>(&counters);
+    uint64_t *dst = reinterpret_cast<uint64_t *>(&values);
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); ++i)
+    {
+      dst[i] += src[i];
+    }
+  }
+
+  /**
+   * Returns the counters, with the comparisons made through compare
+   */
+  template <typename Compare>
+  Counters Get(const Compare& compare) const
+  {
+    Counters counters = Get();
+    counters.comparisons += Count(compare);
+    return counters;
+  }
+
+  /**
+   * Returns the counters. Each one is read atomically, but they are not
+   * read all at once
+   */
+  Counters Get() const
+  {
+    Counters counters;
+    const uint64_t *src = reinterpret_cast<const uint64_t *>(&values);
+    uint64_t *dst = reinterpret_cast<uint64_t *>(&counters);
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); ++i)
+    {
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return counters;
+  }
+
+  /**
+   * Zeroes the counters, including the comparisons made through compare
+   */
+  template <typename Compare>
+  void Reset(Compare& compare)
+  {
+    Reset();
+    Zero(compare);
+  }
+
+  /**
+   * Zeroes the counters
+   */
+  void Reset()
+  {
+    uint64_t *dst = reinterpret_cast<uint64_t *>(&values);
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(uint64_t); ++i)
+    {
+      __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+
+private:
+  template <typename Compare>
+  static uint64_t Count(const CountingCompare<Compare>& compare)
+  {
+    return compare.count;
+  }
+
+  template <typename Compare>
+  static void Zero(CountingCompare<Compare>& compare)
+  {
+    compare.count = 0;
+  }
+
+  Counters values;
+};
+
+/**
+ * Disabled counters: updates are no-ops & snapshots are all zeroes
+ */
+template <>
+class CounterSet<false>
+{
+public:
+  void Add(uint64_t Counters::*, uint64_t = 1)
+  {
+  }
+
+  void AddShared(uint64_t Counters::*, uint64_t = 1)
+  {
+  }
+
+  void Add(const Counters&)
+  {
+  }
+
+  template <typename Compare>
+  Counters Get(const Compare&) const
+  {
+    return Get();
+  }
+
+  Counters Get() const
+  {
+    Counters counters;
+    memset(&counters, 0, sizeof(counters));
+    return counters;
+  }
+
+  template <typename Compare>
+  void Reset(Compare&)
+  {
+  }
+
+  void Reset()
+  {
+  }
+};
+
+/**
+ * Structural statistics of a tree, maintained as it changes so that they
+ * can be read in O(1) even from large trees
+ */
+struct Stats
+{
+  /**
+   * Number of nodes
+   */
+  uint64_t nodes;
+
+  /**
+   * Fraction of the item slots of the nodes holding an item
+   */
+  double fill;
+
+  /**
+   * Average number of nodes on the path from the root to an item
+   */
+  double depth;
+
+  /**
+   * Bytes held for the nodes, including unused slots & the nodes kept
+   * alive for snapshots
+   */
+  uint64_t bytes;
+};
+
 template <typename Key, typename Value>
 class Tree
 {
 public:
+  /**
+   * Callback invoked on the items visited by a range query
+   */
+  typedef std::function<void(const Key&, Value&)> Callback;
+
+  /**
+   * Destroys the tree
+   */
+  virtual ~Tree()
+  {
+  }
+
   /**
    * Inserts a value into the tree
    */
   virtual void Insert(const Key& key, const Value &value) = 0;
 
+  /**
+   * Inserts a value into the tree, moving the key & value into it
+   */
+  virtual void Insert(Key&& key, Value&& value) = 0;
+
   /**
    * Deletes an entry from the tree
    */
   virtual void Delete(const Key& key) = 0;
 
+  /**
+   * Deletes an entry from the tree if the key is present
+   * @return True if an entry was removed
+   */
+  virtual bool Erase(const Key& key) = 0;
+
   /**
    * Finds a value in the tree
    */
   virtual Value& Find(const Key& key) = 0;
 
+  /**
+   * Finds a value in the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  virtual Value *TryFind(const Key& key) = 0;
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  virtual bool Contains(const Key& key) = 0;
+
+  /**
+   * Looks up n keys, storing a pointer to the value of each key in out, or
+   * NULL if the key is missing. Returns the number of keys found
+   */
+  virtual size_t FindBatch(const Key *keys, size_t n, Value **out) = 0;
+
+  /**
+   * Inserts n items, in order
+   */
+  virtual void InsertBatch(const Key *keys, const Value *values, size_t n) = 0;
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  virtual void Range(const Key& lo, const Key& hi, const Callback& fn) = 0;
+
+  /**
+   * Removes all items
+   */
+  virtual void Clear() = 0;
+
   /**
    * Returns the number of items in the tree
    */
@@ -29,6 +440,366 @@ public:
    * Returns the height of the tree
    */
   virtual size_t GetHeight() = 0;
+
+  /**
+   * Returns the structural statistics of the tree
+   */
+  virtual Stats GetStats() = 0;
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  virtual Counters GetCounters() = 0;
+
+  /**
+   * Zeroes the operation counters
+   */
+  virtual void ResetCounters() = 0;
+};
+
+/**
+ * Static interface of all trees, using the curiously recurring template
+ * pattern. Generic code written against TreeBase<Derived, Key, Value>, or
+ * directly against the tree type, calls the methods of Derived without a
+ * vtable, so they can be inlined. Tree provides the same operations behind
+ * virtual calls, through VirtualTree
+ *
+ * @tparam Derived Tree type deriving from TreeBase
+ * @tparam Key     Key type
+ * @tparam Value   Value type
+ */
+template <typename Derived, typename Key, typename Value>
+class TreeBase
+{
+public:
+  typedef Key   KeyType;
+  typedef Value ValueType;
+
+  /**
+   * Inserts a value into the tree
+   */
+  void Insert(const Key& key, const Value& value)
+  {
+    Self().Insert(key, value);
+  }
+
+  /**
+   * Inserts a value into the tree, moving the key & value into it
+   */
+  void Insert(Key&& key, Value&& value)
+  {
+    Self().Insert(std::move(key), std::move(value));
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, replacing the
+   * value of a duplicate
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool Emplace(K&& key, Args&&... args)
+  {
+    return Self().Emplace(std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Inserts an item whose value is constructed from args, unless the key
+   * is present. Nothing is moved from the arguments in that case
+   * @return True if a new item was added
+   */
+  template <typename K, typename... Args>
+  bool TryEmplace(K&& key, Args&&... args)
+  {
+    return Self().TryEmplace(std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Deletes an entry from the tree
+   */
+  void Delete(const Key& key)
+  {
+    Self().Delete(key);
+  }
+
+  /**
+   * Deletes an entry from the tree if the key is present
+   * @return True if an entry was removed
+   */
+  bool Erase(const Key& key)
+  {
+    return Self().Erase(key);
+  }
+
+  /**
+   * Finds a value in the tree
+   */
+  Value& Find(const Key& key)
+  {
+    return Self().Find(key);
+  }
+
+  /**
+   * Finds a value in the tree without throwing if the key is missing
+   * @return Pointer to the value, or NULL if the key is missing
+   */
+  Value *TryFind(const Key& key)
+  {
+    return Self().TryFind(key);
+  }
+
+  /**
+   * Checks whether a key is in the tree
+   */
+  bool Contains(const Key& key)
+  {
+    return Self().Contains(key);
+  }
+
+  /**
+   * Invokes a callback on all items with keys in [lo, hi), in order
+   */
+  template <typename Fn>
+  void Range(const Key& lo, const Key& hi, Fn fn)
+  {
+    Self().Range(lo, hi, fn);
+  }
+
+  /**
+   * Removes all items
+   */
+  void Clear()
+  {
+    Self().Clear();
+  }
+
+  /**
+   * Returns the number of items in the tree
+   */
+  size_t GetSize()
+  {
+    return Self().GetSize();
+  }
+
+  /**
+   * Returns the height of the tree
+   */
+  size_t GetHeight()
+  {
+    return Self().GetHeight();
+  }
+
+  /**
+   * Returns the structural statistics of the tree
+   */
+  Stats GetStats()
+  {
+    return Self().GetStats();
+  }
+
+  /**
+   * Returns a snapshot of the operation counters
+   */
+  Counters GetCounters()
+  {
+    return Self().GetCounters();
+  }
+
+  /**
+   * Zeroes the operation counters
+   */
+  void ResetCounters()
+  {
+    Self().ResetCounters();
+  }
+
+  /**
+   * Looks up n keys, storing a pointer to the value of each key in out, or
+   * NULL if the key is missing. Returns the number of keys found
+   */
+  size_t FindBatch(const Key *keys, size_t n, Value **out)
+  {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      out[i] = Self().TryFind(keys[i]);
+      found += out[i] != NULL;
+    }
+    return found;
+  }
+
+  /**
+   * Inserts n items, in order
+   */
+  void InsertBatch(const Key *keys, const Value *values, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      Self().Insert(keys[i], values[i]);
+    }
+  }
+
+protected:
+  /**
+   * Trees are not destroyed through their base
+   */
+  ~TreeBase()
+  {
+  }
+
+  /**
+   * Replaces a value with one constructed from args. A single value is
+   * copied or moved directly, without a temporary
+   */
+  template <typename... Args>
+  static void Assign(Value& dst, Args&&... args)
+  {
+    dst = Value(std::forward<Args>(args)...);
+  }
+
+  static void Assign(Value& dst, Value& src)
+  {
+    dst = src;
+  }
+
+  static void Assign(Value& dst, const Value& src)
+  {
+    dst = src;
+  }
+
+  static void Assign(Value& dst, Value&& src)
+  {
+    dst = std::move(src);
+  }
+
+  /**
+   * Checks that the keys of the (key, value) pairs in [begin, end) are
+   * strictly increasing under less & returns their number
+   */
+  template <typename It, typename Compare = std::less<Key>>
+  static size_t CountSorted(It begin, It end, const Compare& less = Compare())
+  {
+    size_t n = 0;
+    for (It prev = begin; begin != end; prev = begin++, ++n)
+    {
+      if (n > 0 && !less(prev->first, begin->first))
+      {
+        throw std::runtime_error("Keys are not sorted");
+      }
+    }
+    return n;
+  }
+
+private:
+  Derived& Self()
+  {
+    return static_cast<Derived&>(*this);
+  }
+};
+
+/**
+ * Adapts a tree to the virtual Tree interface, for code which picks trees
+ * at runtime
+ *
+ * @tparam T Tree type deriving from TreeBase
+ */
+template <typename T>
+class VirtualTree : public Tree<typename T::KeyType, typename T::ValueType>
+{
+public:
+  typedef typename T::KeyType   Key;
+  typedef typename T::ValueType Value;
+  typedef typename Tree<Key, Value>::Callback Callback;
+
+  void Insert(const Key& key, const Value& value)
+  {
+    tree.Insert(key, value);
+  }
+
+  void Insert(Key&& key, Value&& value)
+  {
+    tree.Insert(std::move(key), std::move(value));
+  }
+
+  void Delete(const Key& key)
+  {
+    tree.Delete(key);
+  }
+
+  bool Erase(const Key& key)
+  {
+    return tree.Erase(key);
+  }
+
+  Value& Find(const Key& key)
+  {
+    return tree.Find(key);
+  }
+
+  Value *TryFind(const Key& key)
+  {
+    return tree.TryFind(key);
+  }
+
+  bool Contains(const Key& key)
+  {
+    return tree.Contains(key);
+  }
+
+  size_t FindBatch(const Key *keys, size_t n, Value **out)
+  {
+    return tree.FindBatch(keys, n, out);
+  }
+
+  void InsertBatch(const Key *keys, const Value *values, size_t n)
+  {
+    tree.InsertBatch(keys, values, n);
+  }
+
+  void Range(const Key& lo, const Key& hi, const Callback& fn)
+  {
+    tree.Range(lo, hi, fn);
+  }
+
+  void Clear()
+  {
+    tree.Clear();
+  }
+
+  size_t GetSize()
+  {
+    return tree.GetSize();
+  }
+
+  size_t GetHeight()
+  {
+    return tree.GetHeight();
+  }
+
+  Stats GetStats()
+  {
+    return tree.GetStats();
+  }
+
+  Counters GetCounters()
+  {
+    return tree.GetCounters();
+  }
+
+  void ResetCounters()
+  {
+    tree.ResetCounters();
+  }
+
+  /**
+   * Returns the adapted tree
+   */
+  T& Get()
+  {
+    return tree;
+  }
+
+private:
+  T tree;
 };
 
 #endif /*__TREE_H__*/